@@ -1,12 +1,32 @@
 #!/bin/sh
+#usage: analyse.sh <telemetry file>
+#Reads the JSON lines written with --telemetry <file>. For MPI runs pass the
+#file of process 0 (<file>-0), it holds the aggregate over all processes
+#(rank -1), otherwise the records of rank 0 are used. Interactions and times
+#are summed from iteration 31 on.
 filename=$1
-ninter=`cat $filename|grep direct|awk '{if ($8 >= 31) {dir+= $10; apprx += $12; print dir/1e12," ", apprx/1e12}}'|tail -n 1`
-nflops=`cat $filename|grep direct|awk '{if ($8 >= 31) {dir+= $10*23; apprx += $12*65; print dir/1e12," ", apprx/1e12}}'|tail -n 1`
-time=`cat $filename|grep TOTAL|tail -n 1|awk '{print "TOTAL=", $4, " GRAV=", $6, " GPU=", $8}'`
-pflop=`echo $nflops $time | awk '{print "Performance [TFlop/s]: GPU= ", ($1+$2)/$8, " GPU+LET=", ($1+$2)/$6, " Effective=", ($1+$2)/$4}'`
-
-echo $ninter
-echo $nflops
-echo $time
-echo $pflop
-
+awk -v first=31 '
+function field(key)
+{
+  if(!match($0, "\"" key "\":[^,}]*")) return 0;
+  return substr($0, RSTART+length(key)+3, RLENGTH-length(key)-3) + 0;
+}
+{
+  rank = field("rank");
+  if(rank == -1) hasAll = 1;
+  if(field("iter") < first) next;
+  dir[rank]   += field("direct");
+  apprx[rank] += field("approx");
+  total[rank] += field("step");
+  grav[rank]  += field("grav");
+  gpu[rank]   += (field("gpuGravLocal") + field("gpuGravLET"))/1000;
+}
+END {
+  r = hasAll ? -1 : 0;
+  if(total[r] == 0 || gpu[r] == 0 || grav[r] == 0) { print "No telemetry records from iteration", first; exit 1; }
+  fdir = dir[r]*23/1e12; fappr = apprx[r]*65/1e12;
+  print dir[r]/1e12, " ", apprx[r]/1e12;
+  print fdir, " ", fappr;
+  print "TOTAL=", total[r], " GRAV=", grav[r], " GPU=", gpu[r];
+  print "Performance [TFlop/s]: GPU= ", (fdir+fappr)/gpu[r], " GPU+LET=", (fdir+fappr)/grav[r], " Effective=", (fdir+fappr)/total[r];
+}' $filename
@@ -0,0 +1,50 @@
+import sys
+import json
+
+# Merges the per process trace files written with --trace into one Chrome
+# trace file (load it in chrome://tracing or ui.perfetto.dev).
+# All processes take their time origin at the exit of a barrier at start up and
+# store the time of a second barrier at the end (syncEndUs). The clock of every
+# process is scaled so that its end barrier matches the one of rank 0, which
+# removes the drift between the clocks of different nodes.
+#
+# usage: python mergeTraces.py output.json trace-0 trace-1 ...
+
+
+def main():
+    if len(sys.argv) < 3:
+        print("usage: python mergeTraces.py output.json trace-0 [trace-1 ...]")
+        sys.exit(1)
+
+    traces = []
+    for name in sys.argv[2:]:
+        with open(name) as f:
+            traces.append(json.load(f))
+
+    refEnd = None
+    for t in traces:
+        if t["otherData"]["rank"] == 0:
+            refEnd = t["otherData"]["syncEndUs"]
+
+    events = []
+    for t in traces:
+        syncEnd = t["otherData"]["syncEndUs"]
+        scale   = 1.0
+        if refEnd is not None and syncEnd > 0:
+            scale = refEnd / syncEnd
+
+        for e in t["traceEvents"]:
+            if "ts" in e:
+                e["ts"] = e["ts"] * scale
+            if "dur" in e:
+                e["dur"] = e["dur"] * scale
+            events.append(e)
+
+    with open(sys.argv[1], "w") as f:
+        json.dump({"traceEvents": events, "displayTimeUnit": "ms"}, f)
+
+    print("Merged " + str(len(traces)) + " processes, " + str(len(events)) + " events into " + sys.argv[1])
+
+
+if __name__ == "__main__":
+    main()
@@ -205,9 +205,20 @@ KERNEL_DECLARE(cl_build_key_list)(uint4  *body_key,
     crd.y = (int)roundf(__fdividef((pos.y - corner.y) , domain_fac));
     crd.z = (int)roundf(__fdividef((pos.z - corner.z) , domain_fac));
   #else            
-    crd.x = (int)((pos.x - corner.x) / domain_fac);
-    crd.y = (int)((pos.y - corner.y) / domain_fac);
-    crd.z = (int)((pos.z - corner.z) / domain_fac);
+    //floorf so that images left of the corner get a negative cell, which
+    //the mask below wraps to the far side. The plain cast maps (-1,0) to 0
+    crd.x = (int)floorf((pos.x - corner.x) / domain_fac);
+    crd.y = (int)floorf((pos.y - corner.y) / domain_fac);
+    crd.z = (int)floorf((pos.z - corner.z) / domain_fac);
+  #endif
+
+  #ifdef PERIODIC
+    //With periodic boundaries corner spans exactly the box, particles that
+    //are outside it get the key of their image inside the box. No-op for
+    //open boundaries since the coordinates are in range there
+    crd.x &= (1 << MAXLEVELS) - 1;
+    crd.y &= (1 << MAXLEVELS) - 1;
+    crd.z &= (1 << MAXLEVELS) - 1;
   #endif
 
   uint4 key = get_key(crd);
@@ -805,14 +816,15 @@ KERNEL_DECLARE(store_dust_groups)(int    n_groups,
 //memory storage and memory reorders after sorting 
 //It is slightly less accurate and therefore not used 
 //for the real bodies. In the correct function we compute back
+//All dust is drifted every step, also the particles that are
+//inside their (block) time step. Drifting in parts with the 
+//same acceleration gives the same result as one drift
 KERNEL_DECLARE(predict_dust_particles)(const int n_bodies,
                                                   float tc,
                                                   float tp,
                                                   real4 *pos,
                                                   real4 *vel,
-                                                  real4 *acc,
-                                                  uint  *body2grouplist,
-                                                  uint  *valid_list){                                          
+                                                  real4 *acc){
   const uint bid = blockIdx.y * gridDim.x + blockIdx.x;
   const uint tid = threadIdx.x;
   const uint idx = bid * blockDim.x + tid;
@@ -835,15 +847,42 @@ KERNEL_DECLARE(predict_dust_particles)(const int n_bodies,
 
   pos[idx] = p;
   vel[idx] = v;
+}
 
-  //This is needed to retain compatability with the original 
-  //approximate gravity function
-  int grpID = body2grouplist[idx];
-  valid_list[grpID] = grpID; 
+//Marks the dust groups that have a particle at the end of its
+//time step. The end times are computed on the device and the
+//current time on the host, so compare with half a base step margin
+KERNEL_DECLARE(set_active_dust_groups)(const int n_bodies,
+                                                  float tc,
+                                                  float dt_base,
+                                                  float2 *time,
+                                                  uint  *body2grouplist,
+                                                  uint  *valid_list){
+  const uint bid = blockIdx.y * gridDim.x + blockIdx.x;
+  const uint tid = threadIdx.x;
+  const uint idx = bid * blockDim.x + tid;
+
+  if (idx >= n_bodies) return;
+
+  if(time[idx].y <= tc + 0.5f*dt_base)
+  {
+    int grpID = body2grouplist[idx];
+    valid_list[grpID] = grpID | (1 << 31);
+  }
 }
 
+//Every particle that got a new force ends its step now, also the ones
+//in a walked group that were not due yet. The new step is the base step
+//times 2^level, the largest level that is below the time step criterion
+//eta*sqrt(eps/|a|), at most one level above the previous one, not above
+//max_level and that starts at a multiple of its own length
 KERNEL_DECLARE(correct_dust_particles)(const int n_bodies,
-                                                  float dt_cb,
+                                                  float tc,
+                                                  float dt_base,
+                                                  float eta_eps,
+                                                  int   max_level,
+                                                  int   all_active,
+                                                  float2 *time,
                                                   uint   *active_list,
                                                   real4 *vel,
                                                   real4 *acc0,
@@ -856,23 +895,36 @@ KERNEL_DECLARE(correct_dust_particles)(const int n_bodies,
   if (idx >= n_bodies) return;
 
   //Check if particle is set to active during approx grav
-  #ifdef DO_BLOCK_TIMESTEP
-    if (active_list[idx] != 1) return;
-  #endif
+  if (!all_active && active_list[idx] != 1) return;
 
+  float2 t  = time[idx];
   float4 a0 = acc0[idx];
   float4 a1 = acc1[idx];
   float4  v = vel[idx];
 
   //Correct the velocity
-  dt_cb *= 0.5f;
+  float dt_cb = 0.5f*(tc - t.x);
   v.x += (a1.x - a0.x)*dt_cb;
   v.y += (a1.y - a0.y)*dt_cb;
   v.z += (a1.z - a0.z)*dt_cb;
 
+  //Select the next level
+  float a2     = a1.x*a1.x + a1.y*a1.y + a1.z*a1.z;
+  float dtCrit = (a2 > 0.0f) ? eta_eps*rsqrtf(sqrtf(a2)) : dt_base*(1 << max_level);
+  int   step   = __float2int_rn(tc / dt_base);
+  int   maxUp  = max_level;
+  if (t.y > t.x)
+    maxUp = min(max_level, __float2int_rn(log2f((t.y - t.x) / dt_base)) + 1);
+
+  int level = 0;
+  while (level < maxUp && (step & ((2 << level) - 1)) == 0 &&
+         dt_base*(2 << level) <= dtCrit)
+    level++;
+
   //Store the corrected velocity, acceleration and the new time step info
   vel     [idx] = v;
   acc0    [idx] = a1;
+  time    [idx] = make_float2(tc, tc + dt_base*(1 << level));
 }
 
 /// End Dust Functions /////
@@ -26,6 +26,61 @@ PROF_MODULE(dev_approximate_gravity);
 
 #if 1
 #define _QUADRUPOLE_
+
+//With DOUBLE_ACCUMULATION the interactions of one warp-batch are summed in
+//float and the partial sums are accumulated per particle in double. This
+//removes the round-off growth of summing thousands of float terms within a
+//walk at the cost of 4 double adds per 32 interactions. acc_out stays float4,
+//so the total of each walk (local and every LET) is rounded to float once
+#ifdef DOUBLE_ACCUMULATION
+  typedef double4 accum4;
+  #define make_accum4 make_double4
+#else
+  typedef float4  accum4;
+  #define make_accum4 make_float4
+#endif
+
+#endif
+
+//With PERIODIC all separations in the opening criterion and the force
+//evaluation use the nearest image. periodicBox holds the box size and its
+//inverse, both are 0 for open boundaries which makes periodic_dx a no-op
+#ifdef PERIODIC
+__constant__ float2 periodicBox = {0.0f, 0.0f};
+
+static __device__ __forceinline__ float periodic_dx(const float dx)
+{
+  return dx - periodicBox.x*rintf(dx*periodicBox.y);
+}
+
+extern "C" void gpu_setPeriodicBoxSize(const float boxSize)
+{
+  const float2 box = make_float2(boxSize, boxSize > 0.0f ? 1.0f/boxSize : 0.0f);
+  cudaMemcpyToSymbol(periodicBox, &box, sizeof(float2));
+}
+#else
+#define periodic_dx(dx) (dx)
+#endif
+
+//With TREEPM the tree only computes the short range part of the force, the
+//Newtonian force times erfc(r/2rs) + r/(rs sqrt(pi)) exp(-r^2/4rs^2), and
+//ignores cells further than rcut. treePM holds 1/(2 rs) and rcut, the
+//defaults give the unmodified force
+#ifdef TREEPM
+__constant__ float2 treePM = {0.0f, 1.0e30f};
+
+static __device__ __forceinline__ void treepm_factors(const float r2, float &facF, float &facP)
+{
+  const float u = sqrtf(r2)*treePM.x;
+  facP = erfcf(u);
+  facF = facP + 1.128379167f*u*__expf(-u*u);    //2/sqrt(pi)
+}
+
+extern "C" void gpu_setTreePMSplit(const float rs, const float rcut)
+{
+  const float2 split = make_float2(0.5f/rs, rcut);
+  cudaMemcpyToSymbol(treePM, &split, sizeof(float2));
+}
 #endif
 
 /************************************/
@@ -180,15 +235,24 @@ static __device__ __forceinline__ float4 add_acc(
     const float eps2)
 {
 #if 1  // to test performance of a tree-walk 
-  const float3 dr = make_float3(posj.x - pos.x, posj.y - pos.y, posj.z - pos.z);
+  const float3 dr = make_float3(periodic_dx(posj.x - pos.x), periodic_dx(posj.y - pos.y), periodic_dx(posj.z - pos.z));
 
   const float r2     = dr.x*dr.x + dr.y*dr.y + dr.z*dr.z + eps2;
   const float rinv   = rsqrtf(r2);
   const float rinv2  = rinv*rinv;
+#ifdef TREEPM
+  float facF, facP;
+  treepm_factors(r2, facF, facP);
+  const float mrinv  = massj * rinv;
+  const float mrinv3 = mrinv * rinv2 * facF;
+
+  acc.w -= mrinv * facP;
+#else
   const float mrinv  = massj * rinv;
   const float mrinv3 = mrinv * rinv2;
 
   acc.w -= mrinv;
+#endif
   acc.x += mrinv3 * dr.x;
   acc.y += mrinv3 * dr.y;
   acc.z += mrinv3 * dr.z;
@@ -196,15 +260,41 @@ static __device__ __forceinline__ float4 add_acc(
 
   return acc;
 }
+#ifdef DOUBLE_ACCUMULATION
+template<int NI>
+static __device__ __forceinline__ void accumulate(
+    accum4 acc_i[NI],
+    const float4 part_i[NI])
+{
+#pragma unroll
+  for (int k = 0; k < NI; k++)
+  {
+    acc_i[k].x += part_i[k].x;
+    acc_i[k].y += part_i[k].y;
+    acc_i[k].z += part_i[k].z;
+    acc_i[k].w += part_i[k].w;
+  }
+}
+#endif
+
 template<int NI, bool FULL>
 static __device__ __forceinline__ void directAcc(
-    float4 acc_i[NI], 
+    accum4 acc_i[NI], 
     const float4 pos_i[NI],
     const int ptclIdx,
     const float eps2)
 {
   const float4 M0 = (FULL || ptclIdx >= 0) ? tex1Dfetch(texBody, ptclIdx) : make_float4(0.0f, 0.0f, 0.0f, 0.0f);
 
+#ifdef DOUBLE_ACCUMULATION
+  float4 part_i[NI];
+#pragma unroll
+  for (int k = 0; k < NI; k++)
+    part_i[k] = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+#else
+  float4 *part_i = acc_i;
+#endif
+
 //#pragma unroll
   for (int j = 0; j < WARP_SIZE; j++)
   {
@@ -213,8 +303,12 @@ static __device__ __forceinline__ void directAcc(
     const float3 jpos  = make_float3(jM0.x, jM0.y, jM0.z);
 #pragma unroll
     for (int k = 0; k < NI; k++)
-      acc_i[k] = add_acc(acc_i[k], pos_i[k], jmass, jpos, eps2);
+      part_i[k] = add_acc(part_i[k], pos_i[k], jmass, jpos, eps2);
   }
+
+#ifdef DOUBLE_ACCUMULATION
+  accumulate<NI>(acc_i, part_i);
+#endif
 }
 
 
@@ -227,7 +321,7 @@ static __device__ __forceinline__ float4 add_acc(
     const float4 Q0,  const float4 Q1, float eps2) 
 {
 #if 1 
-  const float3 dr = make_float3(pos.x - com.x, pos.y - com.y, pos.z - com.z);
+  const float3 dr = make_float3(periodic_dx(pos.x - com.x), periodic_dx(pos.y - com.y), periodic_dx(pos.z - com.z));
   const float  r2 = dr.x*dr.x + dr.y*dr.y + dr.z*dr.z + eps2;
 
   const float rinv  = rsqrtf(r2);
@@ -256,11 +350,24 @@ static __device__ __forceinline__ float4 add_acc(
       q13*dr.x + q23*dr.y + q33*dr.z);
   const float qRR = qR.x*dr.x + qR.y*dr.y + qR.z*dr.z;  // 22
 
+#ifdef TREEPM
+  //The split factors of the monopole distance are applied to the whole
+  //expansion, the quadrupole is small compared to the monopole for the cells
+  //inside rcut
+  float facF, facP;
+  treepm_factors(r2, facF, facP);
+  acc.w  -= facP*(D0 + 0.5f*(D1*q + D2*qRR));
+  float C = D1 + 0.5f*(D2*q + D3*qRR);
+  acc.x  += facF*(C*dr.x + D2*qR.x);
+  acc.y  += facF*(C*dr.y + D2*qR.y);
+  acc.z  += facF*(C*dr.z + D2*qR.z);
+#else
   acc.w  -= D0 + 0.5f*(D1*q + D2*qRR);
   float C = D1 + 0.5f*(D2*q + D3*qRR);
   acc.x  += C*dr.x + D2*qR.x;
   acc.y  += C*dr.y + D2*qR.y;
   acc.z  += C*dr.z + D2*qR.z;               // 23
+#endif
 
 // total: 16 + 3 + 22 + 23 = 64 flops 
 
@@ -270,7 +377,7 @@ static __device__ __forceinline__ float4 add_acc(
 
 template<int NI, bool FULL>
 static __device__ __forceinline__ void approxAcc(
-    float4 acc_i[NI], 
+    accum4 acc_i[NI], 
     const float4 pos_i[NI],
     const int cellIdx,
     const float eps2)
@@ -286,6 +393,15 @@ static __device__ __forceinline__ void approxAcc(
   else
     M0 = Q0 = Q1 = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
 
+#ifdef DOUBLE_ACCUMULATION
+  float4 part_i[NI];
+#pragma unroll
+  for (int k = 0; k < NI; k++)
+    part_i[k] = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+#else
+  float4 *part_i = acc_i;
+#endif
+
   for (int j = 0; j < WARP_SIZE; j++)
   {
     const float4 jM0 = make_float4(__shfl(M0.x, j), __shfl(M0.y, j), __shfl(M0.z, j), __shfl(M0.w,j));
@@ -295,8 +411,12 @@ static __device__ __forceinline__ void approxAcc(
     const float3 jpos  = make_float3(jM0.x, jM0.y, jM0.z);
 #pragma unroll
       for (int k = 0; k < NI; k++)
-        acc_i[k] = add_acc(acc_i[k], pos_i[k], jmass, jpos, jQ0, jQ1, eps2);
+        part_i[k] = add_acc(part_i[k], pos_i[k], jmass, jpos, jQ0, jQ1, eps2);
   }
+
+#ifdef DOUBLE_ACCUMULATION
+  accumulate<NI>(acc_i, part_i);
+#endif
 }
 
 #endif
@@ -314,9 +434,9 @@ static __device__ bool split_node_grav_impbh(
 {
   //Compute the distance between the group and the cell
   float3 dr = make_float3(
-      fabsf(groupCenter.x - nodeCOM.x) - (groupSize.x),
-      fabsf(groupCenter.y - nodeCOM.y) - (groupSize.y),
-      fabsf(groupCenter.z - nodeCOM.z) - (groupSize.z)
+      fabsf(periodic_dx(groupCenter.x - nodeCOM.x)) - (groupSize.x),
+      fabsf(periodic_dx(groupCenter.y - nodeCOM.y)) - (groupSize.y),
+      fabsf(periodic_dx(groupCenter.z - nodeCOM.z)) - (groupSize.z)
       );
 
   dr.x += fabsf(dr.x); dr.x *= 0.5f;
@@ -329,6 +449,33 @@ static __device__ bool split_node_grav_impbh(
   return (ds2 <= fabsf(nodeCOM.w));
 }
 
+#ifdef TREEPM
+//True if no particle of the cell can be within rcut of the group. The opening
+//radius bounds the distance of the particles to the cell's center of mass, the
+//LET selection in parallel.cpp uses the same test
+static __device__ bool skip_node_treepm(
+    const float4 nodeCOM, 
+    const float4 groupCenter, 
+    const float4 groupSize)
+{
+  float3 dr = make_float3(
+      fabsf(periodic_dx(groupCenter.x - nodeCOM.x)) - (groupSize.x),
+      fabsf(periodic_dx(groupCenter.y - nodeCOM.y)) - (groupSize.y),
+      fabsf(periodic_dx(groupCenter.z - nodeCOM.z)) - (groupSize.z)
+      );
+
+  dr.x += fabsf(dr.x); dr.x *= 0.5f;
+  dr.y += fabsf(dr.y); dr.y *= 0.5f;
+  dr.z += fabsf(dr.z); dr.z *= 0.5f;
+
+  const float ds2  = dr.x*dr.x + dr.y*dr.y + dr.z*dr.z;
+  const float rmax = treePM.y + sqrtf(fabsf(nodeCOM.w));
+
+  return (ds2 > rmax*rmax);
+}
+#endif
+
+
 //Minimum distance
 __device__ bool split_node_grav_md(
     const float4 nodeCenter,
@@ -337,9 +484,9 @@ __device__ bool split_node_grav_md(
     const float4 groupSize)
 {
   //Compute the distance between the group and the cell
-  float3 dr = {fabs(groupCenter.x - nodeCenter.x) - (groupSize.x + nodeSize.x),
-    fabs(groupCenter.y - nodeCenter.y) - (groupSize.y + nodeSize.y),
-    fabs(groupCenter.z - nodeCenter.z) - (groupSize.z + nodeSize.z)};
+  float3 dr = {fabs(periodic_dx(groupCenter.x - nodeCenter.x)) - (groupSize.x + nodeSize.x),
+    fabs(periodic_dx(groupCenter.y - nodeCenter.y)) - (groupSize.y + nodeSize.y),
+    fabs(periodic_dx(groupCenter.z - nodeCenter.z)) - (groupSize.z + nodeSize.z)};
 
   dr.x += fabs(dr.x); dr.x *= 0.5f;
   dr.y += fabs(dr.y); dr.y *= 0.5f;
@@ -359,7 +506,7 @@ __device__ bool split_node_grav_md(
 template<int SHIFT, int BLOCKDIM2, int NI, bool INTCOUNT>
 static __device__ 
 uint2 approximate_gravity(
-    float4 acc_i[NI],
+    accum4 acc_i[NI],
     const float4 _pos_i[NI],
     const float4 groupPos,
     const float eps2,
@@ -402,7 +549,7 @@ uint2 approximate_gravity(
   {
     /* extract cell index from the current level cell list */
     const int cellListIdx = cellListBlock + laneIdx;
-    const bool useCell    = cellListIdx < nCells;
+    bool useCell          = cellListIdx < nCells;
     const int cellIdx     = cellList[ringAddr<SHIFT>(cellListOffset + cellListIdx)];
     cellListBlock += min(WARP_SIZE, nCells - cellListBlock);
 
@@ -416,6 +563,10 @@ uint2 approximate_gravity(
     /* check if cell opening condition is satisfied */
     const float4 cellCOM1 = make_float4(cellCOM.x, cellCOM.y, cellCOM.z, cellPos.w);
     bool splitCell = split_node_grav_impbh(cellCOM1, groupPos, groupSize);
+  #ifdef TREEPM
+    if (useCell && skip_node_treepm(cellCOM1, groupPos, groupSize))
+      useCell = false;
+  #endif
 #else /*added by egaburov, see compute_propertiesD.cu for matching code */
     bool splitCell = split_node_grav_impbh(cellPos, groupPos, groupSize);
 #endif
@@ -646,13 +797,13 @@ bool treewalk(
   body_i[1] = body_addr + WARP_SIZE + laneId%(nb_i - WARP_SIZE);
 
   float4 pos_i[2];
-  float4 acc_i[2];
+  accum4 acc_i[2];
 
   pos_i[0] = group_body_pos[body_i[0]];
   if(ni > 1) //Only read if we actually have ni == 2
     pos_i[1] = group_body_pos[body_i[1]];
 
-  acc_i[0] = acc_i[1] = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+  acc_i[0] = acc_i[1] = make_accum4(0.0f, 0.0f, 0.0f, 0.0f);
 
 
 #if 0
@@ -697,7 +848,7 @@ bool treewalk(
       acc_out     [addr].w += acc_i[0].w;
     }
     else
-      acc_out     [addr] = acc_i[0];
+      acc_out     [addr] = make_float4(acc_i[0].x, acc_i[0].y, acc_i[0].z, acc_i[0].w);
     //       ngb_out     [addr] = ngb_i;
     ngb_out     [addr] = addr; //JB Fixed this for demo 
     active_inout[addr] = 1;
@@ -723,7 +874,7 @@ bool treewalk(
       }
       else
       {
-        acc_out     [addr] = acc_i[1];
+        acc_out     [addr] = make_float4(acc_i[1].x, acc_i[1].y, acc_i[1].z, acc_i[1].w);
       }
 
       //         ngb_out     [addr] = ngb_i;
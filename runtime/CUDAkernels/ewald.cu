@@ -0,0 +1,101 @@
+#include "bonsai.h"
+#include "../profiling/bonsai_timing.h"
+PROF_MODULE(ewald);
+
+#include "node_specs.h"
+
+#ifdef PERIODIC
+
+#define EWALD_EN      64    //Must match EwaldTable::EN in include/ewald.h
+#define EWALD_THREADS 256
+
+//Trilinear interpolation in the Ewald table of a unit box. u is the
+//separation in units of the table spacing, all components in [0, EWALD_EN]
+static __device__ __forceinline__ float4 ewald_lookup(const float4 *table, const float3 u)
+{
+  const int i = min((int)u.x, EWALD_EN-1);
+  const int j = min((int)u.y, EWALD_EN-1);
+  const int k = min((int)u.z, EWALD_EN-1);
+  const float wx = u.x - i, wy = u.y - j, wz = u.z - k;
+
+  float4 r = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+#pragma unroll
+  for (int c = 0; c < 8; c++)
+  {
+    const int a = (c >> 2) & 1, b = (c >> 1) & 1, e = c & 1;
+    const float  w = (a ? wx : 1.0f-wx)*(b ? wy : 1.0f-wy)*(e ? wz : 1.0f-wz);
+    const float4 t = table[((i+a)*(EWALD_EN+1) + (j+b))*(EWALD_EN+1) + (k+e)];
+    r.x += w*t.x;
+    r.y += w*t.y;
+    r.z += w*t.z;
+    r.w += w*t.w;
+  }
+  return r;
+}
+
+//Adds the Ewald correction of the sources (mass in .w) to the accelerations
+//and potentials of the bodies. The tree already gave the nearest image force,
+//the table holds the difference to the full periodic sum. Source j is read
+//at sources[j*stride], which lets the kernel use the node multipoles in place
+KERNEL_DECLARE(ewald_correction)(const int n_bodies,
+                                 const int n_sources,
+                                 const int stride,
+                                 const float boxSize,
+                                 real4 *body_pos,
+                                 real4 *sources,
+                                 real4 *table,
+                                 real4 *acc)
+{
+  const uint bid = blockIdx.y * gridDim.x + blockIdx.x;
+  const uint tid = threadIdx.x;
+  const uint idx = bid * blockDim.x + tid;
+
+  __shared__ float4 shSources[EWALD_THREADS];
+
+  const float invL  = 1.0f/boxSize;
+  const float invL2 = invL*invL;
+  const float scale = 2.0f*EWALD_EN*invL;
+
+  const float4 pos = (idx < n_bodies) ? body_pos[idx] : make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+  float4 corr      = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+
+  for (int tile = 0; tile < n_sources; tile += EWALD_THREADS)
+  {
+    const int j = tile + tid;
+    shSources[tid] = (j < n_sources) ? sources[j*stride] : make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+    __syncthreads();
+
+    const int nj = min(EWALD_THREADS, n_sources - tile);
+    for (int k = 0; k < nj; k++)
+    {
+      const float4 src = shSources[k];
+      float3 dx = make_float3(pos.x - src.x, pos.y - src.y, pos.z - src.z);
+      dx.x -= boxSize*rintf(dx.x*invL);
+      dx.y -= boxSize*rintf(dx.y*invL);
+      dx.z -= boxSize*rintf(dx.z*invL);
+
+      const float3 u = make_float3(fminf(fabsf(dx.x)*scale, (float)EWALD_EN),
+                                   fminf(fabsf(dx.y)*scale, (float)EWALD_EN),
+                                   fminf(fabsf(dx.z)*scale, (float)EWALD_EN));
+      const float4 t = ewald_lookup(table, u);
+
+      //The force correction is odd in each coordinate
+      corr.x += src.w*(dx.x < 0.0f ? -t.x : t.x);
+      corr.y += src.w*(dx.y < 0.0f ? -t.y : t.y);
+      corr.z += src.w*(dx.z < 0.0f ? -t.z : t.z);
+      corr.w += src.w*t.w;
+    }
+    __syncthreads();
+  }
+
+  if (idx >= n_bodies) return;
+
+  float4 a = acc[idx];
+  a.x += corr.x*invL2;
+  a.y += corr.y*invL2;
+  a.z += corr.z*invL2;
+  a.w += corr.w*invL;
+  acc[idx] = a;
+}
+
+#endif
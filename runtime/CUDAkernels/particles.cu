@@ -657,7 +657,12 @@ KERNEL_DECLARE(gpu_internalMoveSFC2) (int       n_extract,
                                   real4     *acc1,
                                   float2    *time,
                                   int       *body_id,
-                                  uint4     *body_key)
+                                  uint4     *body_key
+#ifdef DOUBLE_ACCUMULATION
+                                  ,real4    *PposLo,
+                                  real4     *PvelLo
+#endif
+                                  )
 {
   CUXTIMER("internalMoveSFC2");
   uint bid = blockIdx.y * gridDim.x + blockIdx.x;
@@ -689,6 +694,10 @@ KERNEL_DECLARE(gpu_internalMoveSFC2) (int       n_extract,
     time[dstIdx] = time[srcIdx];
     body_key[dstIdx] = body_key[srcIdx];
     body_id[dstIdx]  = body_id[srcIdx];
+#ifdef DOUBLE_ACCUMULATION
+    PposLo[dstIdx]   = PposLo[srcIdx];
+    PvelLo[dstIdx]   = PvelLo[srcIdx];
+#endif
   }//if inside
 
 }
@@ -756,7 +765,12 @@ KERNEL_DECLARE(gpu_extractOutOfDomainParticlesAdvancedSFC2)(
                                                        float2 *time,
                                                        int   *body_id,
                                                        uint4 *body_key,
-                                                       bodyStruct *destination)
+                                                       bodyStruct *destination
+#ifdef DOUBLE_ACCUMULATION
+                                                       ,real4 *PposLo,
+                                                       real4 *PvelLo
+#endif
+                                                       )
 {
   CUXTIMER("extractOutOfDomainParticlesAdvancedSFC2");
   uint bid = blockIdx.y * gridDim.x + blockIdx.x;
@@ -794,6 +808,10 @@ KERNEL_DECLARE(gpu_extractOutOfDomainParticlesAdvancedSFC2)(
     shmem[threadIdx.x].time  = time[extractList[offset+id].y];
     shmem[threadIdx.x].id    = body_id[extractList[offset+id].y];
     shmem[threadIdx.x].key   = body_key[extractList[offset+id].y];
+#ifdef DOUBLE_ACCUMULATION
+    shmem[threadIdx.x].PposLo = PposLo[extractList[offset+id].y];
+    shmem[threadIdx.x].PvelLo = PvelLo[extractList[offset+id].y];
+#endif
   }
   __syncthreads();
 
@@ -802,28 +820,14 @@ KERNEL_DECLARE(gpu_extractOutOfDomainParticlesAdvancedSFC2)(
   float4 *output  = (float4*)&destination[startWrite];
 
 
-  //We have blockDim.x thread, each thread writes a float4. Compute number of items per thread-block
-  //and number of loops and remaining items
-  const float nThreadsPerItem = sizeof(bodyStruct) / sizeof(float4);
-  const int   nItemsPerLoop   = (int)(blockDim.x / nThreadsPerItem);
-
+  //We have blockDim.x thread, each thread writes a float4 per loop. The
+  //bodyStruct size does not have to divide blockDim.x float4s
   const int nExtractThisBlock = min(n_extract-startWrite, (int)blockDim.x);
+  const int nOut              = nExtractThisBlock * (sizeof(bodyStruct) / sizeof(float4));
 
-  const int   nLoops          = (nExtractThisBlock/nItemsPerLoop);
-  int         nExtra          = (nExtractThisBlock - nLoops*nItemsPerLoop)*nThreadsPerItem;
-
-
-  int startOut = 0;
-  for(int i=0; i < nLoops; i++)
-  {
-    output[startOut + threadIdx.x] = shdata4[threadIdx.x  + startOut]; //Write blockDim.x * float4 items
-    startOut += blockDim.x;
-  }
-
-  //Write the remaining items
-  if(threadIdx.x < nExtra)
+  for(int i = threadIdx.x; i < nOut; i += blockDim.x)
   {
-    output[startOut + threadIdx.x] = shdata4[threadIdx.x  + startOut]; //Write remaining float4 items
+    output[i] = shdata4[i];
   }
 
 
@@ -1093,7 +1097,12 @@ KERNEL_DECLARE(gpu_insertNewParticlesSFC)(int       n_extract,
                                               float2    *time,
                                               int       *body_id,
                                               uint4     *body_key,
-                                              bodyStruct *source)
+                                              bodyStruct *source
+#ifdef DOUBLE_ACCUMULATION
+                                              ,real4    *PposLo,
+                                              real4     *PvelLo
+#endif
+                                              )
 {
   CUXTIMER("insertNewParticlesSFC");
   uint bid = blockIdx.y * gridDim.x + blockIdx.x;
@@ -1115,6 +1124,10 @@ KERNEL_DECLARE(gpu_insertNewParticlesSFC)(int       n_extract,
   time[idx]     = source[id].time;
   body_id[idx]  = source[id].id;
   body_key[idx] = source[id].key;
+#ifdef DOUBLE_ACCUMULATION
+  PposLo[idx]   = source[id].PposLo;
+  PvelLo[idx]   = source[id].PvelLo;
+#endif
 }
 
 
@@ -129,7 +129,17 @@ KERNEL_DECLARE(predict_particles)(const int n_bodies,
                                              real4 *acc,
                                              float2 *time,
                                              real4 *pPos,
-                                             real4 *pVel){
+                                             real4 *pVel
+#ifdef PERIODIC
+                                             ,const float periodicBoxSize
+#endif
+#ifdef DOUBLE_ACCUMULATION
+                                             ,real4 *posLo,
+                                             real4 *velLo,
+                                             real4 *pPosLo,
+                                             real4 *pVelLo
+#endif
+                                             ){
   const uint bid = blockIdx.y * gridDim.x + blockIdx.x;
   const uint tid = threadIdx.x;
   const uint idx = bid * blockDim.x + tid;
@@ -151,6 +161,39 @@ KERNEL_DECLARE(predict_particles)(const int n_bodies,
 
 //   float dt_pb  = tp - tb;
 
+#ifdef DOUBLE_ACCUMULATION
+  //The state is the float pair hi + lo (about 48 bits). The update is done in
+  //double on the full value and split again, so the low bits survive from step
+  //to step. The gravity kernels only see the hi part
+  const float4 pl = posLo[idx];
+  const float4 vl = velLo[idx];
+  const double dt = dt_cb;
+
+  double px = ((double)p.x + pl.x) + dt*(((double)v.x + vl.x) + 0.5*a.x*dt);
+  double py = ((double)p.y + pl.y) + dt*(((double)v.y + vl.y) + 0.5*a.y*dt);
+  double pz = ((double)p.z + pl.z) + dt*(((double)v.z + vl.z) + 0.5*a.z*dt);
+
+  const double vx = ((double)v.x + vl.x) + (double)a.x*dt;
+  const double vy = ((double)v.y + vl.y) + (double)a.y*dt;
+  const double vz = ((double)v.z + vl.z) + (double)a.z*dt;
+
+#ifdef PERIODIC
+  //Keep the particles inside [-L/2, L/2), the corrector copies this back
+  if (periodicBoxSize > 0.0f)
+  {
+    const double L = periodicBoxSize;
+    px -= L*floor(px/L + 0.5);
+    py -= L*floor(py/L + 0.5);
+    pz -= L*floor(pz/L + 0.5);
+  }
+#endif
+
+  p.x = (float)px;  p.y = (float)py;  p.z = (float)pz;
+  v.x = (float)vx;  v.y = (float)vy;  v.z = (float)vz;
+
+  pPosLo[idx] = make_float4((float)(px - p.x), (float)(py - p.y), (float)(pz - p.z), 0.0f);
+  pVelLo[idx] = make_float4((float)(vx - v.x), (float)(vy - v.y), (float)(vz - v.z), 0.0f);
+#else
   p.x += v.x*dt_cb + a.x*dt_cb*dt_cb*0.5f;
   p.y += v.y*dt_cb + a.y*dt_cb*dt_cb*0.5f;
   p.z += v.z*dt_cb + a.z*dt_cb*dt_cb*0.5f;
@@ -159,6 +202,18 @@ KERNEL_DECLARE(predict_particles)(const int n_bodies,
   v.y += a.y*dt_cb;
   v.z += a.z*dt_cb;
 
+#ifdef PERIODIC
+  //Keep the particles inside [-L/2, L/2), the corrector copies this back
+  if (periodicBoxSize > 0.0f)
+  {
+    const float invL = 1.0f/periodicBoxSize;
+    p.x -= periodicBoxSize*floorf(p.x*invL + 0.5f);
+    p.y -= periodicBoxSize*floorf(p.y*invL + 0.5f);
+    p.z -= periodicBoxSize*floorf(p.z*invL + 0.5f);
+  }
+#endif
+#endif
+
   pPos[idx] = p;
   pVel[idx] = v;
 }
@@ -206,7 +261,14 @@ KERNEL_DECLARE(correct_particles)(const int n_bodies,
 #if 1
 					     float2 *time_new,
 					     int *pIDS,
-					     real4 *specialParticles){
+					     real4 *specialParticles
+#ifdef DOUBLE_ACCUMULATION
+					     ,real4 *posLo,
+					     real4 *velLo,
+					     real4 *pPosLo,
+					     real4 *pVelLo
+#endif
+					     ){
 
 #else
 					     float2 *time_new){
@@ -249,9 +311,22 @@ KERNEL_DECLARE(correct_particles)(const int n_bodies,
 
   //Correct the velocity
   dt_cb *= 0.5f;
+#ifdef DOUBLE_ACCUMULATION
+  //pPosLo and pVelLo are not reordered by the sort, like pVel they are read
+  //in the order of before the sort
+  posLo[idx] = pPosLo[unsortedIdx];
+
+  const float4 vl = pVelLo[unsortedIdx];
+  const double vx = ((double)v.x + vl.x) + ((double)a1.x - a0.x)*dt_cb;
+  const double vy = ((double)v.y + vl.y) + ((double)a1.y - a0.y)*dt_cb;
+  const double vz = ((double)v.z + vl.z) + ((double)a1.z - a0.z)*dt_cb;
+  v.x = (float)vx;  v.y = (float)vy;  v.z = (float)vz;
+  velLo[idx] = make_float4((float)(vx - v.x), (float)(vy - v.y), (float)(vz - v.z), 0.0f);
+#else
   v.x += (a1.x - a0.x)*dt_cb;
   v.y += (a1.y - a0.y)*dt_cb;
   v.z += (a1.z - a0.z)*dt_cb;
+#endif
 
 
   #if 1
@@ -0,0 +1,266 @@
+/*
+
+Energy conservation of the predictor/corrector of timestep.cu in its
+arithmetic variants, run on the host with the same update formulas:
+  - float     : the default build, float updates of a float state
+  - float-dbl : double updates rounded to a float state (what
+                DOUBLE_ACCUMULATION did before the low words were kept)
+  - hi/lo     : DOUBLE_ACCUMULATION, double updates of the hi + lo float pair
+  - double    : double state and forces, the reference
+The forces are direct sums in double from the positions the gravity kernels
+would see (the hi part) and are stored as float, like acc0/acc1. The model is
+a Plummer sphere placed at --offset from the origin, as a galaxy in a merger
+or a patch of a large box: there the ulp of a position is large compared to
+the step of a particle.
+
+usage: bonsai_accumulation_check [--n=#] [--steps=#] [--dt=#] [--offset=#]
+
+Checks that hi/lo has at least ten times less energy error than float-dbl
+and stays within three times of the double reference. The exit status is
+the number of failed checks.
+
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+#define EPS 0.1            //Plummer softening
+#define NREPORT 8          //Energy samples over the run
+
+enum Mode {FLOAT_STATE, FLOAT_DOUBLE_UPDATE, HI_LO, DOUBLE_STATE, NMODES};
+static const char *modeName[NMODES] = {"float", "float-dbl", "hi/lo", "double"};
+
+static int nFailed = 0;
+
+static void check(const bool ok, const char *what, const double value, const double limit)
+{
+  printf("  %-40s %10.3e  limit %10.3e  %s\n", what, value, limit, ok ? "ok" : "FAILED");
+  if(!ok) nFailed++;
+}
+
+//Plummer sphere in N-body units (G = M = 1, E = -1/4), centre of mass at rest
+static void plummer(const int n, std::vector<double> &pos, std::vector<double> &vel)
+{
+  std::mt19937_64 rng(12345);
+  std::uniform_real_distribution<double> U(0.0, 1.0);
+  const double a = 3*M_PI/16;
+
+  pos.resize(3*n);
+  vel.resize(3*n);
+  for(int i=0; i < n; i++)
+  {
+    double r;
+    do { r = a/sqrt(pow(U(rng), -2.0/3.0) - 1); } while(r > 10*a);
+    double c = 2*U(rng)-1, phi = 2*M_PI*U(rng), s = sqrt(1-c*c);
+    pos[3*i+0] = r*s*cos(phi);
+    pos[3*i+1] = r*s*sin(phi);
+    pos[3*i+2] = r*c;
+
+    //Rejection sampling of q = v/v_esc from q^2 (1-q^2)^3.5
+    double q, g;
+    do { q = U(rng); g = 0.1*U(rng); } while(g > q*q*pow(1-q*q, 3.5));
+    const double v = q*sqrt(2.0)*pow(r*r + a*a, -0.25);
+    c = 2*U(rng)-1; phi = 2*M_PI*U(rng); s = sqrt(1-c*c);
+    vel[3*i+0] = v*s*cos(phi);
+    vel[3*i+1] = v*s*sin(phi);
+    vel[3*i+2] = v*c;
+  }
+
+  for(int k=0; k < 3; k++)
+  {
+    double cp = 0, cv = 0;
+    for(int i=0; i < n; i++) { cp += pos[3*i+k]; cv += vel[3*i+k]; }
+    for(int i=0; i < n; i++) { pos[3*i+k] -= cp/n; vel[3*i+k] -= cv/n; }
+  }
+}
+
+static void gravity(const int n, const std::vector<double> &x, std::vector<double> &acc)
+{
+  const double m = 1.0/n;
+#pragma omp parallel for
+  for(int i=0; i < n; i++)
+  {
+    double ax = 0, ay = 0, az = 0;
+    for(int j=0; j < n; j++)
+    {
+      const double dx = x[3*j+0]-x[3*i+0], dy = x[3*j+1]-x[3*i+1], dz = x[3*j+2]-x[3*i+2];
+      const double ir = 1.0/sqrt(dx*dx + dy*dy + dz*dz + EPS*EPS);
+      ax += m*ir*ir*ir*dx;
+      ay += m*ir*ir*ir*dy;
+      az += m*ir*ir*ir*dz;
+    }
+    acc[3*i+0] = ax; acc[3*i+1] = ay; acc[3*i+2] = az;
+  }
+}
+
+static double energy(const int n, const std::vector<double> &x, const std::vector<double> &v)
+{
+  const double m = 1.0/n;
+  double K = 0, W = 0;
+  for(int i=0; i < n; i++)
+  {
+    K += 0.5*m*(v[3*i]*v[3*i] + v[3*i+1]*v[3*i+1] + v[3*i+2]*v[3*i+2]);
+    for(int j=i+1; j < n; j++)
+    {
+      const double dx = x[3*j+0]-x[3*i+0], dy = x[3*j+1]-x[3*i+1], dz = x[3*j+2]-x[3*i+2];
+      W -= m*m/sqrt(dx*dx + dy*dy + dz*dz + EPS*EPS);
+    }
+  }
+  return K + W;
+}
+
+//Integrates with predict_particles/correct_particles of one mode and returns
+//the largest |dE/E| of the NREPORT samples
+static double integrate(const Mode mode, const int n, const int nSteps, const double dt,
+                        const std::vector<double> &pos0, const std::vector<double> &vel0)
+{
+  const int n3 = 3*n;
+  std::vector<float>  ph(n3), pl(n3, 0.0f), vh(n3), vl(n3, 0.0f);   //State, hi and lo
+  std::vector<float>  pph(n3), ppl(n3), pvh(n3), pvl(n3);           //Predicted
+  std::vector<double> pd(pos0), vd(vel0), ppd(n3), pvd(n3);         //DOUBLE_STATE
+  std::vector<double> x(n3), v(n3), acc0(n3), acc1(n3);
+
+  for(int i=0; i < n3; i++)
+  {
+    ph[i] = (float)pos0[i];
+    vh[i] = (float)vel0[i];
+  }
+
+  //Position the gravity sees and the full state for the energy
+  #define GRAVITY_POS(p) for(int i=0; i < n3; i++) x[i] = (mode == DOUBLE_STATE) ? pd[i] : (double)(p)[i];
+  #define FULL_STATE()   for(int i=0; i < n3; i++) { \
+                           x[i] = (mode == DOUBLE_STATE) ? pd[i] : (double)ph[i] + pl[i]; \
+                           v[i] = (mode == DOUBLE_STATE) ? vd[i] : (double)vh[i] + vl[i]; }
+
+  GRAVITY_POS(ph);
+  gravity(n, x, acc0);
+  if(mode != DOUBLE_STATE) for(int i=0; i < n3; i++) acc0[i] = (float)acc0[i];
+
+  FULL_STATE();
+  const double E0 = energy(n, x, v);
+  double maxErr   = 0;
+
+  for(int step=1; step <= nSteps; step++)
+  {
+    //predict_particles
+    for(int i=0; i < n3; i++)
+    {
+      const float a = (float)acc0[i];
+      if(mode == FLOAT_STATE)
+      {
+        const float dtf = (float)dt;
+        pph[i] = ph[i] + vh[i]*dtf + a*dtf*dtf*0.5f;
+        pvh[i] = vh[i] + a*dtf;
+      }
+      else if(mode == FLOAT_DOUBLE_UPDATE)
+      {
+        pph[i] = (float)(ph[i] + dt*(vh[i] + 0.5*a*dt));
+        pvh[i] = (float)(vh[i] + (double)a*dt);
+      }
+      else if(mode == HI_LO)
+      {
+        const double p = ((double)ph[i] + pl[i]) + dt*(((double)vh[i] + vl[i]) + 0.5*a*dt);
+        const double w = ((double)vh[i] + vl[i]) + (double)a*dt;
+        pph[i] = (float)p;  ppl[i] = (float)(p - pph[i]);
+        pvh[i] = (float)w;  pvl[i] = (float)(w - pvh[i]);
+      }
+      else
+      {
+        ppd[i] = pd[i] + dt*(vd[i] + 0.5*acc0[i]*dt);
+        pvd[i] = vd[i] + acc0[i]*dt;
+      }
+    }
+    if(mode == DOUBLE_STATE) pd = ppd;
+
+    //Gravity on the predicted positions
+    GRAVITY_POS(pph);
+    gravity(n, x, acc1);
+
+    //correct_particles, pos = Ppos
+    const float hf = 0.5f*(float)dt;
+    for(int i=0; i < n3; i++)
+    {
+      if(mode != DOUBLE_STATE) acc1[i] = (float)acc1[i];
+      const float a0 = (float)acc0[i], a1 = (float)acc1[i];
+      if(mode == FLOAT_STATE)
+      {
+        vh[i] = pvh[i] + (a1 - a0)*hf;
+      }
+      else if(mode == FLOAT_DOUBLE_UPDATE)
+      {
+        vh[i] = (float)(pvh[i] + ((double)a1 - a0)*hf);
+      }
+      else if(mode == HI_LO)
+      {
+        const double w = ((double)pvh[i] + pvl[i]) + ((double)a1 - a0)*hf;
+        vh[i] = (float)w;  vl[i] = (float)(w - vh[i]);
+        pl[i] = ppl[i];
+      }
+      else
+      {
+        vd[i] = pvd[i] + 0.5*(acc1[i] - acc0[i])*dt;
+      }
+      if(mode != DOUBLE_STATE) ph[i] = pph[i];
+    }
+    acc0.swap(acc1);
+
+    if(step % std::max(nSteps/NREPORT, 1) == 0)
+    {
+      FULL_STATE();
+      maxErr = std::max(maxErr, fabs(energy(n, x, v)/E0 - 1));
+    }
+  }
+  #undef GRAVITY_POS
+  #undef FULL_STATE
+
+  return maxErr;
+}
+
+int main(int argc, char **argv)
+{
+  int    n      = 256;
+  int    nSteps = 8192;
+  double dt     = 1.0/512;
+  double offset = 100;
+
+  for(int i=1; i < argc; i++)
+  {
+    const std::string arg = argv[i];
+    const size_t eq = arg.find('=');
+    const std::string key = arg.substr(0, eq), value = (eq == std::string::npos) ? "" : arg.substr(eq+1);
+    if     (key == "--n")      n      = atoi(value.c_str());
+    else if(key == "--steps")  nSteps = atoi(value.c_str());
+    else if(key == "--dt")     dt     = atof(value.c_str());
+    else if(key == "--offset") offset = atof(value.c_str());
+    else
+    {
+      fprintf(stderr, "usage: %s [--n=#] [--steps=#] [--dt=#] [--offset=#]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<double> pos, vel;
+  plummer(n, pos, vel);
+  for(int i=0; i < n; i++) pos[3*i] += offset;
+
+  printf("Plummer N= %d at x= %g, %d steps of dt= %g, largest |dE/E| of %d samples\n",
+         n, offset, nSteps, dt, NREPORT);
+
+  double err[NMODES];
+  for(int mode=0; mode < NMODES; mode++)
+  {
+    err[mode] = integrate((Mode)mode, n, nSteps, dt, pos, vel);
+    printf("  %-10s %10.3e\n", modeName[mode], err[mode]);
+  }
+
+  check(err[HI_LO] <= 0.1*err[FLOAT_DOUBLE_UPDATE], "hi/lo against float-dbl / 10", err[HI_LO], 0.1*err[FLOAT_DOUBLE_UPDATE]);
+  check(err[HI_LO] <= 3.0*err[DOUBLE_STATE],        "hi/lo against 3x double",      err[HI_LO], 3.0*err[DOUBLE_STATE]);
+
+  printf("%d checks failed\n", nFailed);
+  return nFailed;
+}
@@ -0,0 +1,335 @@
+/*
+
+Checks of the AnalysisScheduler decisions on synthetic particle arrays: the
+output cadence of each module, that every staged particle is consumed once,
+skipping a due output while the previous run of the module is in flight,
+skipping when no staging buffer is free, and when the tree is requested. The
+modules used here record what the scheduler asked them to do, a module can be
+held inside consume() to keep its run in flight. Runs on the host only, with a
+single process.
+
+usage: bonsai_analysis_check
+
+The exit status is the number of failed checks.
+
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <vector_functions.h>
+#include "log.h"
+#include "analysisScheduler.h"
+
+#if ENABLE_LOG
+  bool ENABLE_RUNTIME_LOG;
+  bool PREPEND_RANK;
+  int  PREPEND_RANK_PROCID;
+  int  PREPEND_RANK_NPROCS;
+#endif
+
+static int nChecks, nFailed;
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+static void check(const bool ok, const char *what, const char *file, const int line)
+{
+  nChecks++;
+  if(ok) return;
+  nFailed++;
+  fprintf(stderr, "FAILED %s:%d: %s\n", file, line, what);
+}
+
+static void *checkAlloc(size_t bytes) { return malloc(bytes); }
+static void  checkFree (void *ptr)     { free(ptr); }
+
+//Counts the particles of each run and records the calls of the scheduler
+class RecordModule : public AnalysisModule
+{
+  public:
+    struct Output
+    {
+      double    time;
+      long long count, idSum;
+      bool      onMain;
+    };
+
+    RecordModule(const char *_name, const bool _tree = false) :
+      sawTree(false), sawNoTree(false), moduleName(_name), tree(_tree), hold(false),
+      merged(false), mainThread(std::this_thread::get_id()) {}
+
+    const char *name()      const { return moduleName; }
+    bool        needsTree() const { return tree; }
+
+    void begin(const int nSlots, const double time)
+    {
+      begins.push_back(time);
+      slotCount.assign(nSlots, 0);
+      slotIdSum.assign(nSlots, 0);
+      merged = false;
+    }
+
+    void consume(const ParticleBatch &batch, const int slot)
+    {
+      {
+        std::unique_lock<std::mutex> lock(holdMutex);
+        released.wait(lock, [this]{ return !hold; });
+      }
+      if(batch.tree) sawTree   = true;
+      else           sawNoTree = true;
+      for(int i=0; i < batch.n; i++)
+      {
+        slotCount[slot]++;
+        slotIdSum[slot] += batch.ids[i];
+        if(batch.ids[i] != batch.first + i) slotCount[slot] = -(1LL << 40);   //Batch offset is wrong
+      }
+    }
+
+    void merge()
+    {
+      runCount = runIdSum = 0;
+      for(size_t s=0; s < slotCount.size(); s++)
+      {
+        runCount += slotCount[s];
+        runIdSum += slotIdSum[s];
+      }
+      merged = true;
+    }
+
+    void reduceAndEmit(const int /*procId*/)
+    {
+      Output out = {begins.back(), runCount, runIdSum, std::this_thread::get_id() == mainThread};
+      outputs.push_back(out);
+    }
+
+    void setHold(const bool h)
+    {
+      {
+        std::lock_guard<std::mutex> lock(holdMutex);
+        hold = h;
+      }
+      released.notify_all();
+    }
+
+    //Spins until the run in flight has merged on its pool thread
+    void waitMerged() const
+    {
+      while(!merged) std::this_thread::yield();
+    }
+
+    std::vector<double>  begins;
+    std::vector<Output>  outputs;
+    std::atomic<bool>    sawTree, sawNoTree;
+
+  private:
+    const char *moduleName;
+    const bool  tree;
+
+    std::mutex              holdMutex;
+    std::condition_variable released;
+    bool                    hold;
+    std::atomic<bool>       merged;
+    std::thread::id         mainThread;
+
+    std::vector<long long>  slotCount, slotIdSum;
+    long long               runCount, runIdSum;
+};
+
+//Stages n particles with ids 0..n-1 and nNodes empty nodes
+static void stage(AnalysisScheduler &scheduler, const int n, const int nNodes = 0)
+{
+  AnalysisBuffer &buf = scheduler.buffer(n, scheduler.treeWanted() ? nNodes : 0);
+  for(int i=0; i < n; i++)
+  {
+    buf.pos[i] = make_float4(i, 0, 0, 1);
+    buf.vel[i] = make_float4(0, 0, 0, 0);
+    buf.ids[i] = i;
+  }
+  for(int i=0; i < buf.nNodes; i++)
+  {
+    buf.nodeCentre[i] = make_float4(0, 0, 0, 0);
+    buf.nodeSize[i]   = make_float4(1, 1, 1, 0);
+  }
+  if(buf.nNodes > 0) buf.levels.push_back(make_uint2(0, buf.nNodes));
+  scheduler.launch();
+}
+
+static bool sameTimes(const std::vector<double> &a, const std::vector<double> &b)
+{
+  if(a.size() != b.size()) return false;
+  for(size_t i=0; i < a.size(); i++)
+    if(std::fabs(a[i] - b[i]) > 1e-12) return false;
+  return true;
+}
+
+//Outputs at the first poll and then every interval, a step that jumps over
+//several due times gives a single output
+static void checkCadence()
+{
+  RecordModule *every  = new RecordModule("every");
+  RecordModule *offset = new RecordModule("offset");
+  RecordModule *fast   = new RecordModule("fast");
+  AnalysisScheduler scheduler(0, 1, 2, 2, checkAlloc, checkFree);
+  scheduler.addModule(every,  0.25);
+  scheduler.addModule(fast,   0.05);
+
+  //Steps of 1/16, exact in binary
+  int nDue = 0;
+  for(int step=0; step <= 16; step++)
+  {
+    const double t = step/16.0;
+    if(step == 5) scheduler.addModule(offset, 0.5);   //First output at t = 5/16
+    if(scheduler.poll(t))
+    {
+      nDue++;
+      stage(scheduler, 100);
+      scheduler.finish();
+    }
+  }
+
+  const double everyTimes[]  = {0, 0.25, 0.5, 0.75, 1.0};
+  const double offsetTimes[] = {5/16.0, 13/16.0};
+  CHECK(sameTimes(every->begins,  std::vector<double>(everyTimes,  everyTimes  + 5)));
+  CHECK(sameTimes(offset->begins, std::vector<double>(offsetTimes, offsetTimes + 2)));
+  CHECK(fast->begins.size() == 17);     //Due every step, no catching up
+  CHECK(nDue == 17);
+  CHECK(every->outputs.size() == every->begins.size());
+  CHECK(offset->outputs.size() == offset->begins.size());
+}
+
+//Every staged particle is consumed once, over several batches and slots, and
+//the reduction runs on the main thread after the merge
+static void checkCoverage()
+{
+  RecordModule *module = new RecordModule("coverage");
+  AnalysisScheduler scheduler(0, 1, 4, 1, checkAlloc, checkFree);
+  scheduler.addModule(module, 1.0);
+
+  const int sizes[] = {0, 1, 65536, 3*65536 + 17};
+  for(int i=0; i < 4; i++)
+  {
+    CHECK(scheduler.poll(i));
+    stage(scheduler, sizes[i]);
+    scheduler.finish();
+  }
+
+  CHECK(module->outputs.size() == 4);
+  for(size_t i=0; i < module->outputs.size() && i < 4; i++)
+  {
+    const long long n = sizes[i];
+    CHECK(module->outputs[i].count == n);
+    CHECK(module->outputs[i].idSum == n*(n-1)/2);
+    CHECK(module->outputs[i].onMain);
+  }
+}
+
+//A module that is due while its previous run is in flight skips that output,
+//the other modules run on a second buffer
+static void checkSkipInFlight()
+{
+  RecordModule *slow = new RecordModule("slow");
+  RecordModule *fast = new RecordModule("fast");
+  AnalysisScheduler scheduler(0, 1, 2, 2, checkAlloc, checkFree);
+  scheduler.addModule(slow, 0.25);
+  scheduler.addModule(fast, 0.25);
+
+  slow->setHold(true);
+  CHECK(scheduler.poll(0));
+  stage(scheduler, 1000);
+  fast->waitMerged();
+
+  CHECK(scheduler.poll(0.25));          //fast completes and is due again
+  CHECK(fast->outputs.size() == 1);
+  stage(scheduler, 1000);
+  fast->waitMerged();
+
+  slow->setHold(false);
+  slow->waitMerged();
+  CHECK(scheduler.poll(0.5));           //Both complete and are due again
+  stage(scheduler, 1000);
+  scheduler.finish();
+
+  const double slowTimes[] = {0, 0.5};
+  const double fastTimes[] = {0, 0.25, 0.5};
+  CHECK(sameTimes(slow->begins, std::vector<double>(slowTimes, slowTimes + 2)));
+  CHECK(sameTimes(fast->begins, std::vector<double>(fastTimes, fastTimes + 3)));
+  CHECK(slow->outputs.size() == 2);
+  CHECK(fast->outputs.size() == 3);
+  for(size_t i=0; i < slow->outputs.size(); i++) CHECK(slow->outputs[i].count == 1000);
+  for(size_t i=0; i < fast->outputs.size(); i++) CHECK(fast->outputs[i].count == 1000);
+}
+
+//With every staging buffer in use a due output is skipped, the simulation is
+//not held up
+static void checkNoFreeBuffer()
+{
+  RecordModule *slow  = new RecordModule("slow");
+  RecordModule *other = new RecordModule("other");
+  AnalysisScheduler scheduler(0, 1, 2, 1, checkAlloc, checkFree);
+  scheduler.addModule(slow,  0.25);
+  scheduler.addModule(other, 0.5);
+
+  slow->setHold(true);
+  CHECK(scheduler.poll(0));
+  stage(scheduler, 1000);
+  other->waitMerged();
+
+  CHECK(!scheduler.poll(0.25));         //slow in flight, other not due
+  CHECK(!scheduler.poll(0.5));          //other due, the buffer is held by slow
+  CHECK(other->outputs.size() == 1);
+
+  slow->setHold(false);
+  slow->waitMerged();
+  CHECK(scheduler.poll(0.75));          //slow completes and is due, other is not
+  stage(scheduler, 1000);
+  scheduler.finish();
+
+  const double slowTimes[]  = {0, 0.75};
+  const double otherTimes[] = {0};
+  CHECK(sameTimes(slow->begins,  std::vector<double>(slowTimes,  slowTimes  + 2)));
+  CHECK(sameTimes(other->begins, std::vector<double>(otherTimes, otherTimes + 1)));
+  CHECK(slow->outputs.size() == 2);
+}
+
+//The tree is only staged when a due module needs it
+static void checkTreeWanted()
+{
+  RecordModule *plain = new RecordModule("plain");
+  RecordModule *tree  = new RecordModule("tree", true);
+  AnalysisScheduler scheduler(0, 1, 2, 2, checkAlloc, checkFree);
+  scheduler.addModule(plain, 0.25);
+  scheduler.addModule(tree,  0.5);
+
+  CHECK(scheduler.poll(0));
+  CHECK(scheduler.treeWanted());
+  stage(scheduler, 1000, 64);
+  scheduler.finish();
+  CHECK(plain->sawTree && !plain->sawNoTree);
+  CHECK(tree->sawTree  && !tree->sawNoTree);
+
+  CHECK(scheduler.poll(0.25));
+  CHECK(!scheduler.treeWanted());
+  stage(scheduler, 1000, 64);
+  scheduler.finish();
+  CHECK(plain->sawNoTree);
+  CHECK(tree->begins.size() == 1);
+}
+
+int main()
+{
+  ENABLE_RUNTIME_LOG = false;
+
+  checkCadence();
+  checkCoverage();
+  checkSkipInFlight();
+  checkNoFreeBuffer();
+  checkTreeWanted();
+
+  fprintf(stderr, "analysis scheduler: %d of %d checks passed\n", nChecks - nFailed, nChecks);
+  return nFailed;
+}
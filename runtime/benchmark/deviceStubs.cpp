@@ -0,0 +1,114 @@
+//Stand-ins for the device entry points, so that the host tools in benchmark/
+//link the host sources of the main binary with the host compiler alone. These
+//are the kernels of devFunctionDefinitions.h (only their addresses are taken,
+//in load_kernels) and the host wrappers that live in CUDAkernels/*.cu. None of
+//them is reached by the host tools, calling one is an error.
+//The extern "C" names do not carry their signature, so the stubs are declared
+//without parameters and devFunctionDefinitions.h is not included here
+
+#include <cstdio>
+#include <cstdlib>
+#include "my_cuda_rt.h"
+#ifdef USE_B40C
+  #include "sort.h"
+#endif
+
+static void deviceStub(const char *name)
+{
+  fprintf(stderr, "%s runs on the device, it is not available in the host tools\n", name);
+  exit(1);
+}
+
+#define DEVICE_STUB(name) extern "C" void name() { deviceStub(#name); }
+
+//Kernels
+DEVICE_STUB(build_group_list2)
+DEVICE_STUB(cl_build_key_list)
+DEVICE_STUB(cl_build_nodes)
+DEVICE_STUB(cl_build_valid_list)
+DEVICE_STUB(cl_link_tree)
+DEVICE_STUB(compact_count)
+DEVICE_STUB(compact_move)
+DEVICE_STUB(compute_dt)
+DEVICE_STUB(compute_energy_double)
+DEVICE_STUB(compute_leaf)
+DEVICE_STUB(compute_non_leaf)
+DEVICE_STUB(compute_scaling)
+DEVICE_STUB(correct_dust_particles)
+DEVICE_STUB(correct_particles)
+DEVICE_STUB(dataReorderCombined)
+DEVICE_STUB(dataReorderCombined4)
+DEVICE_STUB(dataReorderF2)
+DEVICE_STUB(define_dust_groups)
+DEVICE_STUB(dev_approximate_gravity)
+DEVICE_STUB(dev_approximate_gravity_let)
+DEVICE_STUB(dev_determineLET)
+DEVICE_STUB(dev_direct_gravity)
+DEVICE_STUB(doDomainCheck)
+DEVICE_STUB(ewald_correction)
+DEVICE_STUB(exclusive_scan_block)
+DEVICE_STUB(extractInt_kernel)
+DEVICE_STUB(extractOutOfDomainParticlesAdvanced)
+DEVICE_STUB(extractOutOfDomainParticlesR4)
+DEVICE_STUB(get_Tnext)
+DEVICE_STUB(get_nactive)
+DEVICE_STUB(gpu_boundaryReduction)
+DEVICE_STUB(gpu_boundaryReductionGroups)
+DEVICE_STUB(gpu_build_level_list)
+DEVICE_STUB(gpu_build_parallel_grps)
+DEVICE_STUB(gpu_convertKey64to96)
+DEVICE_STUB(gpu_dataReorderCombined)
+DEVICE_STUB(gpu_dataReorderF2)
+DEVICE_STUB(gpu_dataReorderI1)
+DEVICE_STUB(gpu_domainCheckSFC)
+DEVICE_STUB(gpu_domainCheckSFCAndAssign)
+DEVICE_STUB(gpu_extractKeyAndPerm)
+DEVICE_STUB(gpu_extractOutOfDomainParticlesAdvancedSFC)
+DEVICE_STUB(gpu_extractOutOfDomainParticlesAdvancedSFC2)
+DEVICE_STUB(gpu_extractSampleParticles)
+DEVICE_STUB(gpu_extractSampleParticlesSFC)
+DEVICE_STUB(gpu_insertNewParticles)
+DEVICE_STUB(gpu_insertNewParticlesSFC)
+DEVICE_STUB(gpu_internalMove)
+DEVICE_STUB(gpu_internalMoveSFC)
+DEVICE_STUB(gpu_internalMoveSFC2)
+DEVICE_STUB(gpu_segmentedCoarseGroupBoundary)
+DEVICE_STUB(gpu_segmentedSummaryBasic)
+DEVICE_STUB(gpu_setPHGroupData)
+DEVICE_STUB(gpu_setPHGroupDataGetKey)
+DEVICE_STUB(gpu_setPHGroupDataGetKey2)
+DEVICE_STUB(predict_dust_particles)
+DEVICE_STUB(predict_particles)
+DEVICE_STUB(reOrderKeysValues_kernel)
+DEVICE_STUB(setActiveGroups)
+DEVICE_STUB(set_active_dust_groups)
+DEVICE_STUB(sort_count)
+DEVICE_STUB(sort_move_stage_key_value)
+DEVICE_STUB(split_move)
+DEVICE_STUB(store_dust_groups)
+DEVICE_STUB(store_group_list)
+
+//Host wrappers in the .cu files
+DEVICE_STUB(gpu_setPeriodicBoxSize)
+DEVICE_STUB(gpu_setTreePMSplit)
+DEVICE_STUB(thrust_sort_32b)
+DEVICE_STUB(thrust_sort_96b)
+DEVICE_STUB(thrust_gpuCompact)
+DEVICE_STUB(thrust_partitionDomains)
+DEVICE_STUB(remove_particles)
+
+const void* getTexturePointer(const char *name)
+{
+  deviceStub(name);
+  return NULL;
+}
+
+#ifdef USE_B40C
+Sort90::Sort90(uint N)                        { deviceStub("Sort90"); }
+Sort90::Sort90(uint N, void *generalBuffer)   { deviceStub("Sort90"); }
+Sort90::~Sort90()                             {}
+void Sort90::sort(my_dev::dev_mem<uint4> &srcKeys, my_dev::dev_mem<uint4> &sortedKeys, int N)
+{
+  deviceStub("Sort90::sort");
+}
+#endif
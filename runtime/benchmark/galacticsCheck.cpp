@@ -0,0 +1,309 @@
+/*
+
+Checks of the Milky Way models of Galactics on the galactics_mw_df tables.
+Each model is checked for equilibrium with quantities measured on the
+particles only:
+  - the virial ratio 2K/|W| of the whole model, W from a direct sum over a
+    random subsample of the particles
+  - the vertical balance of the disk, sigma_z in annuli against the
+    isothermal sheet sqrt(pi Sigma z_d), with z_d = <|z|>/ln 2 of the sech^2
+    profile
+  - the radial Jeans equation of the bulge and the halo, sigma_r in shells
+    against the integral of rho M(<r)/r^2 outside the shell, for isotropic
+    spheroids in the (nearly spherical) potential of all components
+With GALACTICS and --mwfork=# the reference Fortran generator runs as well
+and the disk v_phi, sigma_R, sigma_z and the spheroid sigma_r profiles of
+the sampler are compared with it. Runs on a single process.
+
+usage: bonsai_galactics_check [--mwdf=dir] [--ndisk=#] [--nbulge=#] [--nhalo=#]
+                              [--sample=#] [--threads=#] [--mwfork=#]
+
+The exit status is the number of failed checks.
+
+*/
+
+#ifdef USE_MPI
+  #include <mpi.h>
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "galactics.h"
+
+#define VIRIAL_TOL   0.05   //|2K/|W| - 1|
+#define PROFILE_TOL  0.10   //Relative difference of a dispersion or v_phi
+#define MIN_COUNT    500    //Particles in an annulus or shell to be checked
+
+static const double diskRadii[] = {2, 4, 6, 8, 10, 14};   //Annuli R +- 0.5
+static const int    nDiskRadii  = sizeof(diskRadii)/sizeof(diskRadii[0]);
+
+//Logarithmic shells of the spheroids, every SHELL_STEP-th one is checked
+#define NSHELLS     120
+#define SHELL_STEP  10
+static const double shellMin = 0.03, shellMax = 200;
+
+static int nFailed = 0;
+
+static void check(const bool ok, const char *what, const double value, const double expected)
+{
+  printf("  %-32s %10.5g  expected %10.5g  %s\n", what, value, expected, ok ? "ok" : "FAILED");
+  if(!ok) nFailed++;
+}
+
+static bool within(const double value, const double expected, const double tol)
+{
+  return fabs(value - expected) <= tol*fabs(expected);
+}
+
+struct Profiles
+{
+  double virial;
+  double diskVphi[nDiskRadii], diskSigR[nDiskRadii], diskSigZ[nDiskRadii], diskSigZSheet[nDiskRadii];
+  int    diskCount[nDiskRadii];
+  double shellR[NSHELLS];
+  double sigR[2][NSHELLS], sigRJeans[2][NSHELLS];   //Bulge, halo
+  int    shellCount[2][NSHELLS];
+};
+
+static double shellEdge(const int k)
+{
+  return shellMin*pow(shellMax/shellMin, (double)k/NSHELLS);
+}
+
+//2K/|W|. W is estimated from the pairs of nSample particles, scaled by the
+//fraction of all pairs they make up
+static double virialRatio(const Galactics &g, const int nSample)
+{
+  const int n = g.get_ntot();
+  double K = 0;
+  for(int i=0; i < n; i++)
+    K += 0.5*g[i].mass*((double)g[i].vx*g[i].vx + (double)g[i].vy*g[i].vy + (double)g[i].vz*g[i].vz);
+
+  std::vector<int> index(n);
+  for(int i=0; i < n; i++) index[i] = i;
+  srand48(19640417);
+  const int m = std::min(nSample, n);
+  for(int i=0; i < m; i++) std::swap(index[i], index[i + (int)(drand48()*(n-i))]);
+
+  double W = 0;
+#pragma omp parallel for schedule(dynamic, 16) reduction(+:W)
+  for(int i=0; i < m; i++)
+  {
+    const Galactics::Particle &p = g[index[i]];
+    for(int j=i+1; j < m; j++)
+    {
+      const Galactics::Particle &q = g[index[j]];
+      const double dx = p.x - q.x, dy = p.y - q.y, dz = p.z - q.z;
+      const double r  = sqrt(dx*dx + dy*dy + dz*dz);
+      if(r > 0) W -= p.mass*q.mass/r;
+    }
+  }
+  W *= ((double)n*(n-1))/((double)m*(m-1));
+  return 2*K/fabs(W);
+}
+
+static void diskProfiles(const Galactics &g, Profiles &prof)
+{
+  double sum[nDiskRadii][6] = {{0}};    //m, m*(vphi, vphi^2, vR^2, vz^2, |z|)
+  for(int r=0; r < nDiskRadii; r++) prof.diskCount[r] = 0;
+  for(int i=0; i < g.get_ndisk(); i++)
+  {
+    const Galactics::Particle &p = g[i];
+    const double R = sqrt((double)p.x*p.x + (double)p.y*p.y);
+    for(int r=0; r < nDiskRadii; r++)
+    {
+      if(fabs(R - diskRadii[r]) >= 0.5) continue;
+      const double vR   = (p.x*p.vx + p.y*p.vy)/R;
+      const double vphi = (p.x*p.vy - p.y*p.vx)/R;
+      sum[r][0] += p.mass;
+      sum[r][1] += p.mass*vphi;
+      sum[r][2] += p.mass*vphi*vphi;
+      sum[r][3] += p.mass*vR*vR;
+      sum[r][4] += p.mass*p.vz*p.vz;
+      sum[r][5] += p.mass*fabs(p.z);
+      prof.diskCount[r]++;
+    }
+  }
+  for(int r=0; r < nDiskRadii; r++)
+  {
+    const double m     = std::max(sum[r][0], 1e-30);
+    const double area  = 2*M_PI*diskRadii[r];      //Annulus of width 1
+    const double sigma = sum[r][0]/area;
+    const double zd    = sum[r][5]/m/log(2.0);
+    prof.diskVphi[r]      = sum[r][1]/m;
+    prof.diskSigR[r]      = sqrt(sum[r][3]/m);
+    prof.diskSigZ[r]      = sqrt(sum[r][4]/m);
+    prof.diskSigZSheet[r] = sqrt(M_PI*sigma*zd);
+  }
+}
+
+//sigma_r^2(r) rho(r) = int_r^inf rho(r') M(<r')/r'^2 dr', with M(<r) of all
+//components. The shell itself contributes half its width
+static void spheroidProfiles(const Galactics &g, Profiles &prof)
+{
+  const int n = g.get_ntot();
+  std::vector<std::pair<double, double> > rm(n);
+  for(int i=0; i < n; i++)
+    rm[i] = std::make_pair(sqrt((double)g[i].x*g[i].x + (double)g[i].y*g[i].y + (double)g[i].z*g[i].z),
+                           (double)g[i].mass);
+  std::sort(rm.begin(), rm.end());
+  std::vector<double> enclosed(n+1, 0.0);
+  for(int i=0; i < n; i++) enclosed[i+1] = enclosed[i] + rm[i].second;
+
+  for(int k=0; k < NSHELLS; k++) prof.shellR[k] = sqrt(shellEdge(k)*shellEdge(k+1));
+
+  const int first[2] = {g.get_ndisk(), g.get_ndisk() + g.get_nbulge()};
+  const int count[2] = {g.get_nbulge(), g.get_nhalo()};
+  for(int c=0; c < 2; c++)
+  {
+    std::vector<double> mass(NSHELLS, 0.0), vr2(NSHELLS, 0.0);
+    for(int k=0; k < NSHELLS; k++) prof.shellCount[c][k] = 0;
+    for(int i=first[c]; i < first[c] + count[c]; i++)
+    {
+      const Galactics::Particle &p = g[i];
+      const double r = sqrt((double)p.x*p.x + (double)p.y*p.y + (double)p.z*p.z);
+      const int    k = (int)floor(NSHELLS*log(r/shellMin)/log(shellMax/shellMin));
+      if(r <= 0 || k < 0 || k >= NSHELLS) continue;
+      const double vr = (p.x*p.vx + p.y*p.vy + p.z*p.vz)/r;
+      mass[k] += p.mass;
+      vr2[k]  += p.mass*vr*vr;
+      prof.shellCount[c][k]++;
+    }
+
+    double tail = 0;
+    for(int k=NSHELLS-1; k >= 0; k--)
+    {
+      const double r0 = shellEdge(k), r1 = shellEdge(k+1), rc = prof.shellR[k];
+      const double rho = mass[k]/(4.0/3.0*M_PI*(r1*r1*r1 - r0*r0*r0));
+      const int    j   = std::lower_bound(rm.begin(), rm.end(), std::make_pair(rc, 0.0)) - rm.begin();
+      const double dI  = rho*enclosed[j]/(rc*rc)*(r1 - r0);
+      prof.sigR[c][k]      = mass[k] > 0 ? sqrt(vr2[k]/mass[k]) : 0;
+      prof.sigRJeans[c][k] = rho > 0 ? sqrt((tail + 0.5*dI)/rho) : 0;
+      tail += dI;
+    }
+  }
+}
+
+static void measure(const Galactics &g, const int nSample, Profiles &prof)
+{
+  prof.virial = virialRatio(g, nSample);
+  diskProfiles(g, prof);
+  spheroidProfiles(g, prof);
+}
+
+static void checkEquilibrium(const char *name, const Profiles &prof)
+{
+  char what[64];
+  printf("%s: equilibrium\n", name);
+  check(within(prof.virial, 1.0, VIRIAL_TOL), "2K/|W|", prof.virial, 1.0);
+  for(int r=0; r < nDiskRadii; r++)
+  {
+    if(prof.diskCount[r] < MIN_COUNT) continue;
+    sprintf(what, "disk sigma_z R= %g", diskRadii[r]);
+    check(within(prof.diskSigZ[r], prof.diskSigZSheet[r], PROFILE_TOL), what,
+          prof.diskSigZ[r], prof.diskSigZSheet[r]);
+  }
+  const char *component[2] = {"bulge", "halo"};
+  for(int c=0; c < 2; c++)
+    for(int k=0; k < NSHELLS; k += SHELL_STEP)
+    {
+      if(prof.shellCount[c][k] < MIN_COUNT) continue;
+      sprintf(what, "%s sigma_r r= %.3g", component[c], prof.shellR[k]);
+      check(within(prof.sigR[c][k], prof.sigRJeans[c][k], PROFILE_TOL), what,
+            prof.sigR[c][k], prof.sigRJeans[c][k]);
+    }
+}
+
+#ifdef GALACTICS
+static void checkAgainstReference(const Profiles &prof, const Profiles &ref)
+{
+  char what[64];
+  printf("sampler against the reference generator\n");
+  check(fabs(prof.virial - ref.virial) <= VIRIAL_TOL, "2K/|W|", prof.virial, ref.virial);
+  for(int r=0; r < nDiskRadii; r++)
+  {
+    if(prof.diskCount[r] < MIN_COUNT || ref.diskCount[r] < MIN_COUNT) continue;
+    sprintf(what, "disk v_phi R= %g", diskRadii[r]);
+    check(within(prof.diskVphi[r], ref.diskVphi[r], PROFILE_TOL), what, prof.diskVphi[r], ref.diskVphi[r]);
+    sprintf(what, "disk sigma_R R= %g", diskRadii[r]);
+    check(within(prof.diskSigR[r], ref.diskSigR[r], PROFILE_TOL), what, prof.diskSigR[r], ref.diskSigR[r]);
+    sprintf(what, "disk sigma_z R= %g", diskRadii[r]);
+    check(within(prof.diskSigZ[r], ref.diskSigZ[r], PROFILE_TOL), what, prof.diskSigZ[r], ref.diskSigZ[r]);
+  }
+  const char *component[2] = {"bulge", "halo"};
+  for(int c=0; c < 2; c++)
+    for(int k=0; k < NSHELLS; k += SHELL_STEP)
+    {
+      if(prof.shellCount[c][k] < MIN_COUNT || ref.shellCount[c][k] < MIN_COUNT) continue;
+      sprintf(what, "%s sigma_r r= %.3g", component[c], prof.shellR[k]);
+      check(within(prof.sigR[c][k], ref.sigR[c][k], PROFILE_TOL), what, prof.sigR[c][k], ref.sigR[c][k]);
+    }
+}
+#endif
+
+int main(int argc, char **argv)
+{
+  std::string mwPath   = ".";
+  long long   ndisk    = 100000;
+  long long   nbulge   = 25000;
+  long long   nhalo    = 250000;
+  int         nSample  = 8000;
+  int         nThreads = 0;
+  int         nFork    = 0;
+  for(int i=1; i < argc; i++)
+  {
+    const std::string arg = argv[i];
+    if     (arg.compare(0, 7,  "--mwdf=")    == 0) mwPath   = arg.substr(7);
+    else if(arg.compare(0, 8,  "--ndisk=")   == 0) ndisk    = atoll(arg.substr(8).c_str());
+    else if(arg.compare(0, 9,  "--nbulge=")  == 0) nbulge   = atoll(arg.substr(9).c_str());
+    else if(arg.compare(0, 8,  "--nhalo=")   == 0) nhalo    = atoll(arg.substr(8).c_str());
+    else if(arg.compare(0, 9,  "--sample=")  == 0) nSample  = atoi(arg.substr(9).c_str());
+    else if(arg.compare(0, 10, "--threads=") == 0) nThreads = atoi(arg.substr(10).c_str());
+#ifdef GALACTICS
+    else if(arg.compare(0, 9,  "--mwfork=")  == 0) nFork    = atoi(arg.substr(9).c_str());
+#endif
+    else
+    {
+      fprintf(stderr, "usage: %s [--mwdf=dir] [--ndisk=#] [--nbulge=#] [--nhalo=#] [--sample=#] [--threads=#]"
+#ifdef GALACTICS
+                      " [--mwfork=#]"
+#endif
+                      "\n", argv[0]);
+      return 1;
+    }
+  }
+
+#ifdef USE_MPI
+  MPI_Init(&argc, &argv);
+#endif
+
+  const Galactics g(0, 1, ndisk, nbulge, nhalo, nThreads, mwPath);
+  g.summary(0, "sampler");
+  Profiles prof;
+  measure(g, nSample, prof);
+  checkEquilibrium("sampler", prof);
+
+#ifdef GALACTICS
+  if(nFork > 0)
+  {
+    const Galactics r = Galactics::reference(0, 1, ndisk, nbulge, nhalo, nFork);
+    r.summary(0, "reference");
+    Profiles ref;
+    measure(r, nSample, ref);
+    checkEquilibrium("reference", ref);
+    checkAgainstReference(prof, ref);
+  }
+#endif
+  (void)nFork;
+
+  printf("galactics: %d failed checks\n", nFailed);
+
+#ifdef USE_MPI
+  MPI_Finalize();
+#endif
+  return nFailed;
+}
@@ -0,0 +1,268 @@
+/*
+
+Brute force check of the HaloFinder: friends-of-friends labels and k-th
+neighbour distances of a clustered synthetic model (Plummer clumps in a
+uniform background) against an O(N^2) reference. With USE_MPI and several
+processes the particles are split into contiguous ranges of the key order,
+the SFC domains of a run. Each process builds its own host tree and the
+groups and neighbours are completed across the domains as in the FOF module.
+Process 0 gathers the result and compares:
+  - the partition into groups, per particle
+  - the label of every group, the smallest global index (process order) of
+    its members
+  - rk, the distance to the k-th neighbour over all processes
+
+usage: [mpirun -np P] bonsai_halo_check [--n=#] [--link=#] [--knn=#] [--threads=#]
+
+The exit status is non zero if a check failed.
+
+*/
+
+#ifdef USE_MPI
+  #include <mpi.h>
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cfloat>
+#include <string>
+#include "hostTree.h"
+#include "haloFinder.h"
+
+//w carries the global index + 1, buildHostTree only uses it as the mass of
+//the opening criterion
+static void makeClumps(std::vector<real4> &pos, const int n)
+{
+  const int nClumps     = 8;
+  const int perClump    = n/10;
+  const int nBackground = n - nClumps*perClump;
+
+  srand48(20160101);
+  pos.clear();
+  for(int c=0; c < nClumps; c++)
+  {
+    std::vector<real4> clump;
+    makePlummer(clump, perClump, 1000 + c);
+    const float cx = 2*drand48()-1, cy = 2*drand48()-1, cz = 2*drand48()-1;
+    const float r  = 0.02f + 0.08f*drand48();
+    for(int i=0; i < perClump; i++)
+      pos.push_back(make_float4(cx + r*clump[i].x, cy + r*clump[i].y, cz + r*clump[i].z, 0));
+  }
+  for(int i=0; i < nBackground; i++)
+    pos.push_back(make_float4(2*drand48()-1, 2*drand48()-1, 2*drand48()-1, 0));
+  for(int i=0; i < n; i++) pos[i].w = i + 1;
+}
+
+static int findRoot(std::vector<int> &root, int i)
+{
+  while(root[i] != i) i = root[i] = root[root[i]];
+  return i;
+}
+
+//Reference groups (root per particle) and k-th neighbour distances
+static void bruteForce(const std::vector<real4> &pos, const float b, const int k,
+                       std::vector<int> &group, std::vector<float> &rk)
+{
+  const int   n  = pos.size();
+  const float b2 = b*b;
+  group.resize(n);
+  for(int i=0; i < n; i++) group[i] = i;
+  for(int i=0; i < n; i++)
+    for(int j=i+1; j < n; j++)
+    {
+      const float dx = pos[j].x - pos[i].x;
+      const float dy = pos[j].y - pos[i].y;
+      const float dz = pos[j].z - pos[i].z;
+      if(dx*dx + dy*dy + dz*dz >= b2) continue;
+      const int ri = findRoot(group, i), rj = findRoot(group, j);
+      if(ri != rj) group[std::max(ri, rj)] = std::min(ri, rj);
+    }
+  for(int i=0; i < n; i++) group[i] = findRoot(group, i);
+
+  rk.assign(n, FLT_MAX);
+  if(k <= 0) return;
+#pragma omp parallel
+  {
+    std::vector<float> d2(n);
+#pragma omp for schedule(dynamic, 64)
+    for(int i=0; i < n; i++)
+    {
+      int m = 0;
+      for(int j=0; j < n; j++)
+      {
+        if(j == i) continue;
+        const float dx = pos[j].x - pos[i].x;
+        const float dy = pos[j].y - pos[i].y;
+        const float dz = pos[j].z - pos[i].z;
+        d2[m++] = dx*dx + dy*dy + dz*dz;
+      }
+      if(m < k) continue;
+      std::nth_element(d2.begin(), d2.begin() + k-1, d2.begin() + m);
+      rk[i] = std::sqrt(d2[k-1]);
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+#if ENABLE_LOG
+  ENABLE_RUNTIME_LOG = false;
+  PREPEND_RANK       = false;
+#endif
+
+  int   n        = 20000;
+  float b        = 0.01f;
+  int   k        = 16;
+  int   nThreads = 4;
+  for(int i=1; i < argc; i++)
+  {
+    const std::string arg = argv[i];
+    if     (arg.compare(0, 4,  "--n=")       == 0) n        = atoi(arg.substr(4).c_str());
+    else if(arg.compare(0, 7,  "--link=")    == 0) b        = atof(arg.substr(7).c_str());
+    else if(arg.compare(0, 6,  "--knn=")     == 0) k        = atoi(arg.substr(6).c_str());
+    else if(arg.compare(0, 10, "--threads=") == 0) nThreads = atoi(arg.substr(10).c_str());
+    else
+    {
+      fprintf(stderr, "usage: %s [--n=#] [--link=#] [--knn=#] [--threads=#]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  int procId = 0, nProcs = 1;
+#ifdef USE_MPI
+  MPI_Init(&argc, &argv);
+  MPI_Comm_rank(MPI_COMM_WORLD, &procId);
+  MPI_Comm_size(MPI_COMM_WORLD, &nProcs);
+#endif
+
+  //Every process makes the same model, the key order of the full tree gives
+  //the domains
+  std::vector<real4> all;
+  makeClumps(all, n);
+  HostTree global;
+  buildHostTree(global, all, 0.75f);
+  const int begin = (long long)n* procId   /nProcs;
+  const int end   = (long long)n*(procId+1)/nProcs;
+  std::vector<real4> domain(global.bodies.begin() + begin, global.bodies.begin() + end);
+
+  HostTree local;
+  std::vector<uint2> levels;
+  AnalysisTree tree = {0, 0, NULL, NULL, NULL};
+  if(!domain.empty())
+  {
+    buildHostTree(local, domain, 0.75f);
+    for(size_t l=0; l < local.levelList.size(); l++)
+      levels.push_back(make_uint2(local.levelList[l].x, local.levelList[l].y));
+    const AnalysisTree t = {local.nNodes(), (int)levels.size(), &local.nodeCentre[0],
+                            &local.nodeSize[0], &levels[0]};
+    tree = t;
+  }
+  const int nLocal = domain.size();
+
+  HaloFinder finder(nThreads);
+  std::vector<long long> label(nLocal);
+  std::vector<float>     rk(nLocal);
+  finder.setParticles(nLocal, nLocal > 0 ? &local.bodies[0] : NULL, tree);
+  if(nLocal > 0)
+  {
+    finder.link(b);
+    finder.labels(begin, &label[0]);
+    if(k > 0) finder.nearest(k, &rk[0]);
+  }
+#ifdef USE_MPI
+  finder.mergeAcrossProcesses(MPI_COMM_WORLD, b, nLocal > 0 ? &label[0] : NULL);
+  if(k > 0) finder.nearestAcrossProcesses(MPI_COMM_WORLD, k, nLocal > 0 ? &rk[0] : NULL);
+#endif
+
+  //Per particle of the model: its global index in process order, label and rk
+  std::vector<long long> order(n), labels(n);
+  std::vector<float>     rks(n);
+  std::vector<long long> myIds(nLocal);
+  for(int i=0; i < nLocal; i++) myIds[i] = (long long)local.bodies[i].w - 1;
+#ifdef USE_MPI
+  std::vector<int> counts(nProcs), offsets(nProcs+1, 0);
+  MPI_Gather(&nLocal, 1, MPI_INT, &counts[0], 1, MPI_INT, 0, MPI_COMM_WORLD);
+  for(int p=0; p < nProcs; p++) offsets[p+1] = offsets[p] + counts[p];
+  std::vector<long long> ids(n), gotLabel(n);
+  std::vector<float>     gotRk(n);
+  MPI_Gatherv(myIds.empty() ? NULL : &myIds[0], nLocal, MPI_LONG_LONG,
+              &ids[0], &counts[0], &offsets[0], MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+  MPI_Gatherv(label.empty() ? NULL : &label[0], nLocal, MPI_LONG_LONG,
+              &gotLabel[0], &counts[0], &offsets[0], MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+  MPI_Gatherv(rk.empty() ? NULL : &rk[0], nLocal, MPI_FLOAT,
+              &gotRk[0], &counts[0], &offsets[0], MPI_FLOAT, 0, MPI_COMM_WORLD);
+#else
+  std::vector<long long> &ids = myIds, &gotLabel = label;
+  std::vector<float>     &gotRk = rk;
+#endif
+
+  int nFailed = 0;
+  if(procId == 0)
+  {
+    for(int i=0; i < n; i++)
+    {
+      order [ids[i]] = i;
+      labels[ids[i]] = gotLabel[i];
+      rks   [ids[i]] = gotRk[i];
+    }
+
+    std::vector<int>   group;
+    std::vector<float> refRk;
+    bruteForce(all, b, k, group, refRk);
+
+    //Same partition and the smallest process order index as label
+    std::vector<long long> groupLabel(n, -1), groupMin(n, n);
+    std::vector<int>       groupSize(n, 0);
+    for(int i=0; i < n; i++)
+    {
+      groupMin[group[i]] = std::min(groupMin[group[i]], order[i]);
+      groupSize[group[i]]++;
+    }
+    int nGroups = 0, nLarge = 0, badLabel = 0, badPartition = 0, badRk = 0, nSplit = 0;
+    for(int i=0; i < n; i++)
+    {
+      const int g = group[i];
+      if(groupLabel[g] < 0)
+      {
+        groupLabel[g] = labels[i];
+        nGroups++;
+        if(groupSize[g] >= 20) nLarge++;
+      }
+      if(labels[i] != groupLabel[g])   badPartition++;
+      if(labels[i] != groupMin[g])     badLabel++;
+      if(k > 0 && std::fabs(rks[i] - refRk[i]) > 1e-6f*refRk[i]) badRk++;
+    }
+    //Distinct groups must have distinct labels
+    std::vector<long long> distinct;
+    for(int g=0; g < n; g++) if(groupLabel[g] >= 0) distinct.push_back(groupLabel[g]);
+    std::sort(distinct.begin(), distinct.end());
+    const int nMerged = distinct.size() - (std::unique(distinct.begin(), distinct.end()) - distinct.begin());
+
+    //Groups with members on more than one process
+    std::vector<int> firstProc(n, nProcs), lastProc(n, -1);
+    for(int i=0; i < n; i++)
+    {
+      int p = 0;
+#ifdef USE_MPI
+      p = std::upper_bound(offsets.begin(), offsets.end(), (int)order[i]) - offsets.begin() - 1;
+#endif
+      firstProc[group[i]] = std::min(firstProc[group[i]], p);
+      lastProc [group[i]] = std::max(lastProc [group[i]], p);
+    }
+    for(int g=0; g < n; g++)
+      if(groupSize[g] > 1 && firstProc[g] != lastProc[g]) nSplit++;
+
+    fprintf(stderr, "halo check: n= %d procs= %d link= %g k= %d : %d groups, %d with >= 20 members, "
+                    "%d on several processes\n", n, nProcs, b, k, nGroups, nLarge, nSplit);
+    fprintf(stderr, "  partition %d wrong, merged groups %d, label %d wrong, rk %d wrong\n",
+            badPartition, nMerged, badLabel, badRk);
+    nFailed = badPartition + nMerged + badLabel + badRk;
+    fprintf(stderr, "halo check %s\n", nFailed ? "FAILED" : "passed");
+  }
+
+#ifdef USE_MPI
+  MPI_Bcast(&nFailed, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  MPI_Finalize();
+#endif
+  return nFailed > 0;
+}
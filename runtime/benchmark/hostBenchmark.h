@@ -0,0 +1,156 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <ctime>
+#include <unistd.h>
+#include <sys/time.h>
+
+//Minimal benchmark runner for the host benchmarks. Every benchmark is
+//repeated until it ran for at least minTime seconds. The JSON output uses
+//the layout of Google Benchmark (--benchmark_out) so that its compare.py
+//and the usual CI tooling can diff two runs.
+
+struct BenchmarkResult
+{
+  std::string name;
+  long long   iterations;
+  double      realTime;       //ns per iteration
+  double      cpuTime;        //ns per iteration
+  double      itemsPerSecond;
+};
+
+//Passed to the benchmark body, setup work that should not be timed goes
+//between pause() and resume()
+class BenchmarkState
+{
+  public:
+    BenchmarkState() : running(false), real(0), cpu(0) {}
+
+    void resume()
+    {
+      if(running) return;
+      running   = true;
+      realStart = wallTime();
+      cpuStart  = cpuTime();
+    }
+
+    void pause()
+    {
+      if(!running) return;
+      running = false;
+      real   += wallTime() - realStart;
+      cpu    += cpuTime()  - cpuStart;
+    }
+
+    double getReal() const { return real; }
+    double getCPU()  const { return cpu;  }
+
+    static double wallTime()
+    {
+      struct timeval Tvalue;
+      gettimeofday(&Tvalue, NULL);
+      return ((double) Tvalue.tv_sec +1.e-6*((double) Tvalue.tv_usec));
+    }
+
+    static double cpuTime()
+    {
+      struct timespec ts;
+      clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+      return ts.tv_sec + 1.e-9*ts.tv_nsec;
+    }
+
+  private:
+    bool   running;
+    double realStart, cpuStart;
+    double real, cpu;
+};
+
+class BenchmarkRunner
+{
+  public:
+    BenchmarkRunner(const std::string &_filter, const double _minTime) :
+      filter(_filter), minTime(_minTime) {}
+
+    bool selected(const std::string &name) const
+    {
+      return filter.empty() || name.find(filter) != std::string::npos;
+    }
+
+    //Runs body(state) once as warm up and then until minTime has passed.
+    //items is the work per iteration, used for items_per_second
+    template<typename F>
+    void run(const std::string &name, const long long items, F body)
+    {
+      if(!selected(name)) return;
+
+      BenchmarkState warmUp;
+      warmUp.resume();
+      body(warmUp);
+      warmUp.pause();
+
+      //The total time limit bounds benchmarks with a lot of untimed setup
+      BenchmarkState state;
+      long long    iterations = 0;
+      const double tStart     = BenchmarkState::wallTime();
+      while(iterations < 1 || (state.getReal() < minTime &&
+                               BenchmarkState::wallTime() - tStart < 20*minTime))
+      {
+        state.resume();
+        body(state);
+        state.pause();
+        iterations++;
+      }
+
+      BenchmarkResult res;
+      res.name           = name;
+      res.iterations     = iterations;
+      res.realTime       = 1e9*state.getReal() / iterations;
+      res.cpuTime        = 1e9*state.getCPU()  / iterations;
+      res.itemsPerSecond = (state.getReal() > 0) ? items*iterations / state.getReal() : 0;
+      results.push_back(res);
+
+      fprintf(stdout, "%-52s %14.0f ns %14.0f ns %10lld %12.4gM items/s\n",
+                      res.name.c_str(), res.realTime, res.cpuTime, res.iterations,
+                      res.itemsPerSecond*1e-6);
+      fflush(stdout);
+    }
+
+    void writeJSON(FILE *out, const std::string &executable) const
+    {
+      char date[64], host[256];
+      const time_t now = time(NULL);
+      strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+      if(gethostname(host, sizeof(host)) != 0) sprintf(host, "unknown");
+
+      fprintf(out, "{\n  \"context\": {\n");
+      fprintf(out, "    \"date\": \"%s\",\n",            date);
+      fprintf(out, "    \"host_name\": \"%s\",\n",       host);
+      fprintf(out, "    \"executable\": \"%s\",\n",      executable.c_str());
+      fprintf(out, "    \"num_cpus\": %ld,\n",           sysconf(_SC_NPROCESSORS_ONLN));
+      fprintf(out, "    \"library_build_type\": \"%s\"\n",
+#ifdef NDEBUG
+              "release"
+#else
+              "debug"
+#endif
+             );
+      fprintf(out, "  },\n  \"benchmarks\": [");
+      for(size_t i=0; i < results.size(); i++)
+      {
+        const BenchmarkResult &r = results[i];
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"run_name\": \"%s\", \"run_type\": \"iteration\", "
+                     "\"iterations\": %lld, \"real_time\": %.3f, \"cpu_time\": %.3f, "
+                     "\"time_unit\": \"ns\", \"items_per_second\": %.6g}",
+                     i ? "," : "", r.name.c_str(), r.name.c_str(), r.iterations,
+                     r.realTime, r.cpuTime, r.itemsPerSecond);
+      }
+      fprintf(out, "\n  ]\n}\n");
+    }
+
+  private:
+    std::string                  filter;
+    double                       minTime;
+    std::vector<BenchmarkResult> results;
+};
@@ -0,0 +1,333 @@
+/*
+
+Micro benchmarks of the host side hot paths: key generation, the group tree,
+the LET selection and the tipsy reader. The inputs are synthetic Plummer
+spheres and exponential disks at several particle counts, the results are
+printed as a table and optionally written as Google Benchmark compatible JSON
+for regression tracking. Nothing in here touches the GPU, the binary runs on
+CPU only machines.
+
+usage: bonsai_benchmark [--benchmark_filter=substr] [--benchmark_min_time=s]
+                        [--benchmark_out=file.json] [--sizes=16384,131072,...]
+
+*/
+
+#ifdef USE_MPI
+  #include <mpi.h>
+#endif
+
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include "log.h"
+#include "FileIO.h"
+#include "hostTree.h"
+#include "hostBenchmark.h"
+
+//Gives access to the protected key function of the tree
+class BenchmarkTree : public octree
+{
+  public:
+    BenchmarkTree(char **argv) : octree(argv) {}
+    using octree::get_key;
+};
+
+//Groups of NCRIT consecutive particles of a key sorted tree, the boxes
+//that are sent to the other processes
+static void makeGroups(std::vector<real4> &groupCentre, std::vector<real4> &groupSize,
+                       const HostTree &tree)
+{
+  groupCentre.clear();
+  groupSize.clear();
+  for(size_t beg=0; beg < tree.bodies.size(); beg += NCRIT)
+  {
+    const size_t end = std::min(beg + NCRIT, tree.bodies.size());
+    float3 rMin = make_float3( 1e30f,  1e30f,  1e30f);
+    float3 rMax = make_float3(-1e30f, -1e30f, -1e30f);
+    for(size_t i=beg; i < end; i++)
+    {
+      const real4 b = tree.bodies[i];
+      rMin.x = std::min(rMin.x, b.x); rMax.x = std::max(rMax.x, b.x);
+      rMin.y = std::min(rMin.y, b.y); rMax.y = std::max(rMax.y, b.y);
+      rMin.z = std::min(rMin.z, b.z); rMax.z = std::max(rMax.z, b.z);
+    }
+    groupCentre.push_back(make_float4(0.5f*(rMin.x+rMax.x), 0.5f*(rMin.y+rMax.y), 0.5f*(rMin.z+rMax.z), 0));
+    groupSize  .push_back(make_float4(0.5f*(rMax.x-rMin.x), 0.5f*(rMax.y-rMin.y), 0.5f*(rMax.z-rMin.z), 0));
+  }
+}
+
+static void writeTipsy(const std::string &fileName, const std::vector<real4> &pos)
+{
+  dump h;
+  h.time    = 0;
+  h.nbodies = pos.size();
+  h.ndim    = 3;
+  h.nsph    = 0;
+  h.ndark   = pos.size();
+  h.nstar   = 0;
+
+  std::ofstream out(fileName.c_str(), std::ios::out | std::ios::binary);
+  out.write((char*)&h, sizeof(h));
+  for(size_t i=0; i < pos.size(); i++)
+  {
+    dark_particle d;
+    d.mass   = pos[i].w;
+    d.pos[0] = pos[i].x; d.pos[1] = pos[i].y; d.pos[2] = pos[i].z;
+    d.vel[0] = d.vel[1] = d.vel[2] = 0;
+    d.eps    = 0.05f;
+    d.phi    = i;
+    out.write((char*)&d, sizeof(d));
+  }
+}
+
+
+/*********************************/
+/*          Benchmarks           */
+/*********************************/
+
+static void benchmarkDistribution(BenchmarkRunner &runner, BenchmarkTree &octreeRef,
+                                  const std::string &model, const std::vector<real4> &pos)
+{
+  const int   n      = pos.size();
+  const float theta  = 0.75f;
+  char        buff[32];
+  sprintf(buff, "/%s/%d", model.c_str(), n);
+  const std::string suffix = buff;
+
+  //Key generation, Peano-Hilbert (host_get_key) and Morton (get_key)
+  {
+    std::vector<uint4> crd, keys(n);
+    float4             corner;
+    makeCoordinates(crd, corner, pos, 30);
+    runner.run("host_get_key" + suffix, n, [&](BenchmarkState &state)
+    {
+      for(int i=0; i < n; i++)
+        keys[i] = HostConstruction::host_get_key(crd[i]);
+    });
+
+    makeCoordinates(crd, corner, pos, 20);
+    std::vector<uint2> mortonKeys(n);
+    runner.run("get_key" + suffix, n, [&](BenchmarkState &state)
+    {
+      for(int i=0; i < n; i++)
+        mortonKeys[i] = octreeRef.get_key(make_int3(crd[i].x, crd[i].y, crd[i].z));
+    });
+  }
+
+  HostTree tree;
+  buildHostTree(tree, pos, theta);
+
+  //The group tree over the NCRIT groups
+  {
+    std::vector<real4> groupCentre, groupSize;
+    makeGroups(groupCentre, groupSize, tree);
+    const int nGroups = groupCentre.size();
+
+    std::vector<uint4> crd, grpKeys(nGroups);
+    float4             corner;
+    makeCoordinates(crd, corner, groupCentre, 30);
+    for(int i=0; i < nGroups; i++)
+    {
+      grpKeys[i]   = HostConstruction::host_get_key(crd[i]);
+      grpKeys[i].w = i;
+    }
+    std::sort(grpKeys.begin(), grpKeys.end(), cmp_ph_key());
+
+    //The construction marks the processed keys, so it works on a copy
+    std::vector<uint4> keysCopy(nGroups);
+    std::vector<uint2> nodes   (nGroups*MAXLEVELS+1);
+    std::vector<uint4> nodeKeys(nGroups*MAXLEVELS+1);
+    std::vector<uint>  nodeLevels(MAXLEVELS+1);
+    int nLevels = 0, nNodes = 0, startGrp = 0, endGrp = 0;
+
+    //The minimum level is only found in trees with more than 32 nodes
+    if(nGroups < 64)
+    {
+      fprintf(stderr, "Skipping the group tree of %s, only %d groups\n", suffix.c_str(), nGroups);
+    }
+    else
+    {
+      runner.run("build_GroupTree" + suffix, nGroups, [&](BenchmarkState &state)
+      {
+        state.pause();
+        keysCopy = grpKeys;
+        state.resume();
+        octreeRef.build_GroupTree(nGroups, &keysCopy[0], &nodes[0], &nodeKeys[0], &nodeLevels[0],
+                                  nLevels, nNodes, startGrp, endGrp);
+      });
+
+      std::vector<real4> sortedCentre(nGroups), sortedSize(nGroups);
+      for(int i=0; i < nGroups; i++)
+      {
+        sortedCentre[i] = groupCentre[grpKeys[i].w];
+        sortedSize  [i] = groupSize  [grpKeys[i].w];
+      }
+      std::vector<real4> treeCnt(nNodes), treeSize(nNodes);
+      runner.run("computeProps_GroupTree" + suffix, nNodes, [&](BenchmarkState &state)
+      {
+        octreeRef.computeProps_GroupTree(&sortedCentre[0], &sortedSize[0], &treeCnt[0], &treeSize[0],
+                                         &nodes[0], &nodeLevels[0], nLevels);
+      });
+    }
+  }
+
+#ifdef USE_MPI
+  //LET selection between two processes that own the x < 0 and x >= 0 halves
+  {
+    std::vector<real4> posLocal, posRemote;
+    for(int i=0; i < n; i++)
+      (pos[i].x < 0 ? posLocal : posRemote).push_back(pos[i]);
+
+    HostTree local, remote;
+    buildHostTree(local,  posLocal,  theta);
+    buildHostTree(remote, posRemote, theta);
+
+    //The boundary of the remote process, items are the exported cells
+    std::vector<real4> bndCentre, bndSize, bndMulti, bndBody;
+    const int2 bndLevel = remote.levelList[remote.startLevelMin];
+    extractGroupsTreeFull(bndCentre, bndSize, bndMulti, bndBody,
+                          &remote.nodeCentre[0], &remote.nodeSize[0], &remote.multipole[0],
+                          &remote.bodies[0], bndLevel.x, bndLevel.y, remote.nNodes());
+    const int nBnd = bndSize.size();
+
+    runner.run("extractGroupsTreeFull" + suffix, nBnd, [&](BenchmarkState &state)
+    {
+      extractGroupsTreeFull(bndCentre, bndSize, bndMulti, bndBody,
+                            &remote.nodeCentre[0], &remote.nodeSize[0], &remote.multipole[0],
+                            &remote.bodies[0], bndLevel.x, bndLevel.y, remote.nNodes());
+    });
+
+    static GETLETBUFFERS letBuffers;
+
+    //Is the boundary of the remote process enough for our local tree
+    runner.run("getLEToptQuickTreevsTree" + suffix, nBnd, [&](BenchmarkState &state)
+    {
+      double tFunc;
+      getLEToptQuickTreevsTree(letBuffers, &bndCentre[0], &bndSize[0], &bndMulti[0], 0, 1,
+                               &local.nodeSize[0], &local.nodeCentre[0], 0, 1,
+                               nBnd, 0, 1, tFunc);
+    });
+
+    //The LET we would send to the remote process. No cell limit so that
+    //the full selection is timed instead of the early exit of a run
+    std::vector<v4sf> letBuffer;
+    letBuffer.reserve(1 + local.bodies.size() + 5*local.nNodes());
+    runner.run("getLEToptQuickFullTree" + suffix, local.nNodes(), [&](BenchmarkState &state)
+    {
+      unsigned long long nflops;
+      double             tFunc;
+      letBuffer.clear();
+      getLEToptQuickFullTree(letBuffer, letBuffers, local.nNodes(), MAXLEVELS,
+                             &local.nodeCentre[0], &local.nodeSize[0], &local.multipole[0],
+                             0, 1, &local.bodies[0], local.bodies.size(),
+                             &bndSize[0], &bndCentre[0], 0, 1,
+                             local.nNodes(), 0, 1, nflops, tFunc);
+    });
+  }
+#endif
+
+  //Single process read of a tipsy file
+  {
+    char fileName[64];
+    sprintf(fileName, "bonsai_benchmark_%d.tipsy", (int)getpid());
+    writeTipsy(fileName, pos);
+
+    runner.run("read_tipsy_file_parallel" + suffix, n, [&](BenchmarkState &state)
+    {
+      std::vector<real4> bodyPositions, bodyVelocities, dustPositions, dustVelocities;
+      std::vector<int>   bodyIDs, dustIDs;
+      int NTotal, NFirst, NSecond, NThird;
+      read_tipsy_file_parallel(bodyPositions, bodyVelocities, bodyIDs, 0.05f*0.05f, fileName,
+                               0, 1, NTotal, NFirst, NSecond, NThird, NULL,
+                               dustPositions, dustVelocities, dustIDs, 1, 1, false);
+    });
+    remove(fileName);
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  my_dev::base_mem::currentMemUsage = 0;
+  my_dev::base_mem::maxMemUsage     = 0;
+
+#if ENABLE_LOG
+  ENABLE_RUNTIME_LOG = false;
+  PREPEND_RANK       = false;
+#endif
+
+  std::string      filter, outFile;
+  double           minTime = 0.5;
+  std::vector<int> sizes;
+
+  for(int i=1; i < argc; i++)
+  {
+    const std::string arg = argv[i];
+    if     (arg.compare(0, 19, "--benchmark_filter=")   == 0) filter  = arg.substr(19);
+    else if(arg.compare(0, 21, "--benchmark_min_time=") == 0) minTime = atof(arg.substr(21).c_str());
+    else if(arg.compare(0, 16, "--benchmark_out=")      == 0) outFile = arg.substr(16);
+    else if(arg.compare(0, 8,  "--sizes=")              == 0)
+    {
+      const std::string list = arg.substr(8);
+      for(size_t pos=0; pos < list.size(); )
+      {
+        sizes.push_back(atoi(list.c_str() + pos));
+        pos = list.find(',', pos);
+        if(pos == std::string::npos) break;
+        pos++;
+      }
+    }
+    else
+    {
+      fprintf(stderr, "usage: %s [--benchmark_filter=substr] [--benchmark_min_time=s] "
+                      "[--benchmark_out=file.json] [--sizes=n1,n2,...]\n", argv[0]);
+      return 1;
+    }
+  }
+  if(sizes.empty())
+  {
+    sizes.push_back(1 << 14);
+    sizes.push_back(1 << 17);
+    sizes.push_back(1 << 20);
+  }
+
+#ifdef USE_MPI
+  MPI_Init(&argc, &argv);
+#endif
+
+  //Only used for its host functions, no device is initialised
+  BenchmarkTree   octreeRef(argv);
+  BenchmarkRunner runner(filter, minTime);
+
+  fprintf(stdout, "%-52s %17s %17s %10s\n", "Benchmark", "Time", "CPU", "Iterations");
+  for(size_t i=0; i < sizes.size(); i++)
+  {
+    std::vector<real4> pos;
+    makePlummer(pos, sizes[i], 19810614);
+    benchmarkDistribution(runner, octreeRef, "plummer", pos);
+
+    makeDisk(pos, sizes[i], 19810614);
+    benchmarkDistribution(runner, octreeRef, "disk", pos);
+  }
+
+  if(!outFile.empty())
+  {
+    FILE *out = fopen(outFile.c_str(), "w");
+    if(!out)
+    {
+      fprintf(stderr, "Can not open benchmark output file: %s\n", outFile.c_str());
+      return 1;
+    }
+    runner.writeJSON(out, argv[0]);
+    fclose(out);
+  }
+
+#ifdef USE_MPI
+  MPI_Finalize();
+#endif
+  return 0;
+}
@@ -0,0 +1,19 @@
+//Host versions of the make_<type> constructors that go with hostCuda/vector_types.h
+
+#ifndef _HOST_VECTOR_FUNCTIONS_H_
+#define _HOST_VECTOR_FUNCTIONS_H_
+
+#include "vector_types.h"
+
+inline float2  make_float2(float x, float y)                   { float2  r = {x, y};       return r; }
+inline float3  make_float3(float x, float y, float z)          { float3  r = {x, y, z};    return r; }
+inline float4  make_float4(float x, float y, float z, float w) { float4  r = {x, y, z, w}; return r; }
+inline int2    make_int2(int x, int y)                         { int2    r = {x, y};       return r; }
+inline int4    make_int4(int x, int y, int z, int w)           { int4    r = {x, y, z, w}; return r; }
+inline uint2   make_uint2(unsigned int x, unsigned int y)      { uint2   r = {x, y};       return r; }
+inline uint4   make_uint4(unsigned int x, unsigned int y,
+                          unsigned int z, unsigned int w)      { uint4   r = {x, y, z, w}; return r; }
+inline double2 make_double2(double x, double y)                { double2 r = {x, y};       return r; }
+inline double3 make_double3(double x, double y, double z)      { double3 r = {x, y, z};    return r; }
+
+#endif
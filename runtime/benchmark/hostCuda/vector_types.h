@@ -0,0 +1,18 @@
+//Host definitions of the CUDA vector types, only used when the host tools in
+//benchmark/ are configured without the CUDA toolkit (see CMakeLists.txt).
+//The layout and alignment match the toolkit's vector_types.h
+
+#ifndef _HOST_VECTOR_TYPES_H_
+#define _HOST_VECTOR_TYPES_H_
+
+struct __attribute__((aligned(8)))  float2  { float x, y; };
+struct                              float3  { float x, y, z; };
+struct __attribute__((aligned(16))) float4  { float x, y, z, w; };
+struct __attribute__((aligned(8)))  int2    { int x, y; };
+struct __attribute__((aligned(16))) int4    { int x, y, z, w; };
+struct __attribute__((aligned(8)))  uint2   { unsigned int x, y; };
+struct __attribute__((aligned(16))) uint4   { unsigned int x, y, z, w; };
+struct __attribute__((aligned(16))) double2 { double x, y; };
+struct                              double3 { double x, y, z; };
+
+#endif
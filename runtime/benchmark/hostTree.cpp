@@ -0,0 +1,209 @@
+//Synthetic inputs and the host copy of the GPU tree of the host tools
+
+#include "hostTree.h"
+#include "plummer.h"
+
+/*********************************/
+/*      Synthetic inputs         */
+/*********************************/
+
+void makePlummer(std::vector<real4> &pos, const int n, const int seed)
+{
+  std::vector<real4> vel(n);
+  pos.resize(n);
+  const ICSums sums = makePlummer(&pos[0], &vel[0], 0, n, n, seed);
+  sums.centre(&pos[0], &vel[0], n, n);
+}
+
+//Exponential disk with a sech^2 vertical profile, scale length 1 and
+//scale height 0.1. The sum of two exponential deviates has the radial
+//distribution of an exponential surface density
+void makeDisk(std::vector<real4> &pos, const int n, const int seed)
+{
+  srand48(seed);
+  pos.resize(n);
+  for(int i=0; i < n; i++)
+  {
+    const double R   = -log((1.0-drand48())*(1.0-drand48()));
+    const double phi = 2*M_PI*drand48();
+    const double z   = 0.1*atanh(std::max(-0.999999, std::min(0.999999, 2*drand48()-1)));
+    pos[i] = make_float4(R*cos(phi), R*sin(phi), z, 1.0f/n);
+  }
+}
+
+//Integer coordinates on a 2^bits grid over the bounding box
+void makeCoordinates(std::vector<uint4> &crd, float4 &corner,
+                            const std::vector<real4> &pos, const int bits)
+{
+  float3 rMin = make_float3( 1e30f,  1e30f,  1e30f);
+  float3 rMax = make_float3(-1e30f, -1e30f, -1e30f);
+  for(size_t i=0; i < pos.size(); i++)
+  {
+    rMin.x = std::min(rMin.x, pos[i].x); rMax.x = std::max(rMax.x, pos[i].x);
+    rMin.y = std::min(rMin.y, pos[i].y); rMax.y = std::max(rMax.y, pos[i].y);
+    rMin.z = std::min(rMin.z, pos[i].z); rMax.z = std::max(rMax.z, pos[i].z);
+  }
+  const float size = 1.001f*std::max(rMax.x-rMin.x, std::max(rMax.y-rMin.y, rMax.z-rMin.z));
+
+  corner   = make_float4(rMin.x, rMin.y, rMin.z, size / (float)(1 << bits));
+  crd.resize(pos.size());
+  for(size_t i=0; i < pos.size(); i++)
+  {
+    crd[i].x = (uint)((pos[i].x - corner.x) / corner.w);
+    crd[i].y = (uint)((pos[i].y - corner.y) / corner.w);
+    crd[i].z = (uint)((pos[i].z - corner.z) / corner.w);
+    crd[i].w = i;
+  }
+}
+
+
+/*********************************/
+/*   Host copy of the GPU tree   */
+/*********************************/
+
+void buildHostTree(HostTree &tree, const std::vector<real4> &pos, const float theta)
+{
+  const int n = pos.size();
+
+  std::vector<uint4> keys;
+  float4             corner;
+  makeCoordinates(keys, corner, pos, 30);
+  for(int i=0; i < n; i++)
+  {
+    const uint idx = keys[i].w;
+    keys[i]        = HostConstruction::host_get_key(keys[i]);
+    keys[i].w      = idx;
+  }
+  std::sort(keys.begin(), keys.end(), keyLess);
+
+  tree.bodies.resize(n);
+  for(int i=0; i < n; i++) tree.bodies[i] = pos[keys[i].w];
+
+  //Split the key ranges level by level
+  std::vector<int2> ranges(1, make_int2(0, n));
+  std::vector<uint> info;
+  std::vector<bool> leaf;
+  tree.levelList.clear();
+
+  int levelBeg = 0;
+  for(int level=0; levelBeg < (int)ranges.size(); level++)
+  {
+    const int levelEnd = ranges.size();
+    tree.levelList.push_back(make_int2(levelBeg, levelEnd));
+
+    const uint4 mask = get_mask2(level+1);
+    for(int c=levelBeg; c < levelEnd; c++)
+    {
+      const int beg = ranges[c].x, end = ranges[c].y;
+      if(end - beg <= NLEAF || level+1 == MAXLEVELS)
+      {
+        assert(end - beg <= NLEAF);
+        info.push_back(beg | ((uint)(end-beg-1) << LEAFBIT));
+        leaf.push_back(true);
+        continue;
+      }
+
+      const int first = ranges.size();
+      int       start = beg;
+      for(int i=beg+1; i <= end; i++)
+      {
+        if(i == end || !keyEqual(keys[i], keys[start], mask))
+        {
+          ranges.push_back(make_int2(start, i));
+          start = i;
+        }
+      }
+      info.push_back(first | ((uint)(ranges.size()-first) << 28));
+      leaf.push_back(false);
+    }
+    levelBeg = levelEnd;
+  }
+
+  tree.startLevelMin = 0;
+  for(size_t i=0; i < tree.levelList.size(); i++)
+  {
+    if(tree.levelList[i].y - tree.levelList[i].x > START_LEVEL_MIN_NODES)
+    {
+      tree.startLevelMin = i;
+      break;
+    }
+  }
+
+  //Properties, bottom up. Second moments are accumulated around the origin
+  //and shifted to the centre of mass at the end
+  const int nNodes = ranges.size();
+  std::vector<double> props(13*nNodes);   //mass, m*x (3), m*xx (6), min (3)
+  std::vector<double> bmax (3*nNodes);
+
+  for(int c=nNodes-1; c >= 0; c--)
+  {
+    double *p  = &props[13*c];
+    double *mx = &bmax[3*c];
+    p[0] = 0;
+    for(int k=1; k < 10; k++) p[k] = 0;
+    for(int k=0; k < 3; k++) { p[10+k] = 1e30; mx[k] = -1e30; }
+
+    if(leaf[c])
+    {
+      for(int i=ranges[c].x; i < ranges[c].y; i++)
+      {
+        const real4  b   = tree.bodies[i];
+        const double x[3] = {b.x, b.y, b.z};
+        p[0] += b.w;
+        for(int k=0; k < 3; k++)
+        {
+          p[1+k]   += b.w*x[k];
+          p[10+k]   = std::min(p[10+k], x[k]);
+          mx[k]     = std::max(mx[k],   x[k]);
+        }
+        p[4] += b.w*x[0]*x[0]; p[5] += b.w*x[1]*x[1]; p[6] += b.w*x[2]*x[2];
+        p[7] += b.w*x[0]*x[1]; p[8] += b.w*x[0]*x[2]; p[9] += b.w*x[1]*x[2];
+      }
+    }
+    else
+    {
+      const int child  = info[c] & 0x0FFFFFFF;
+      const int nchild = (info[c] & 0xF0000000) >> 28;
+      for(int j=child; j < child+nchild; j++)
+      {
+        for(int k=0; k < 10; k++) p[k] += props[13*j+k];
+        for(int k=0; k < 3; k++)
+        {
+          p[10+k] = std::min(p[10+k], props[13*j+10+k]);
+          mx[k]   = std::max(mx[k],   bmax[3*j+k]);
+        }
+      }
+    }
+  }
+
+  tree.nodeCentre.resize(nNodes);
+  tree.nodeSize.resize(nNodes);
+  tree.multipole.resize(3*nNodes);
+  for(int c=0; c < nNodes; c++)
+  {
+    const double *p  = &props[13*c];
+    const double *mx = &bmax[3*c];
+    const double  m  = p[0];
+    const double com[3] = {p[1]/m, p[2]/m, p[3]/m};
+
+    float4 centre, size;
+    centre.x = 0.5*(p[10]+mx[0]); size.x = 0.5*(mx[0]-p[10]);
+    centre.y = 0.5*(p[11]+mx[1]); size.y = 0.5*(mx[1]-p[11]);
+    centre.z = 0.5*(p[12]+mx[2]); size.z = 0.5*(mx[2]-p[12]);
+
+    //Same opening criterion as the device properties
+    const double l  = 2*std::max(size.x, std::max(size.y, size.z));
+    const double dx = com[0]-centre.x, dy = com[1]-centre.y, dz = com[2]-centre.z;
+    const double s  = sqrt(dx*dx + dy*dy + dz*dz);
+    const double cellOp = (l/theta + s)*(l/theta + s);
+
+    centre.w = leaf[c] ? -cellOp : cellOp;
+    size.w   = intAsFloat(info[c]);
+    tree.nodeCentre[c] = centre;
+    tree.nodeSize  [c] = size;
+
+    tree.multipole[3*c+0] = make_float4(com[0], com[1], com[2], m);
+    tree.multipole[3*c+1] = make_float4(p[4]-m*com[0]*com[0], p[5]-m*com[1]*com[1], p[6]-m*com[2]*com[2], 0);
+    tree.multipole[3*c+2] = make_float4(p[7]-m*com[0]*com[1], p[8]-m*com[0]*com[2], p[9]-m*com[1]*com[2], 0);
+  }
+}
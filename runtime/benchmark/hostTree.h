@@ -0,0 +1,75 @@
+#pragma once
+
+//Synthetic inputs and a host copy of the GPU tree, shared by the host
+//benchmarks and the scaling simulator. Implemented in hostTree.cpp
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "parallelHost.h"
+#include "hostTreeBuild.h"
+
+inline float intAsFloat(const uint val)
+{
+  union{uint i; float f;} itof; //__int_as_float
+  itof.i = val;
+  return itof.f;
+}
+
+inline int floatAsInt(const float val)
+{
+  union{int i; float f;} itof; //__float_as_int
+  itof.f = val;
+  return itof.i;
+}
+
+//Strict ordering, the tree below assumes nothing about equal keys
+inline bool keyLess(const uint4 &a, const uint4 &b)
+{
+  if(a.x != b.x) return a.x < b.x;
+  if(a.y != b.y) return a.y < b.y;
+  return a.z < b.z;
+}
+
+inline bool keyEqual(const uint4 &a, const uint4 &b, const uint4 &mask)
+{
+  return ((a.x ^ b.x) & mask.x) == 0 && ((a.y ^ b.y) & mask.y) == 0 && ((a.z ^ b.z) & mask.z) == 0;
+}
+
+
+/*********************************/
+/*      Synthetic inputs         */
+/*********************************/
+
+void makePlummer(std::vector<real4> &pos, const int n, const int seed);
+
+//Exponential disk with a sech^2 vertical profile, scale length 1 and
+//scale height 0.1
+void makeDisk(std::vector<real4> &pos, const int n, const int seed);
+
+//Integer coordinates on a 2^bits grid over the bounding box
+void makeCoordinates(std::vector<uint4> &crd, float4 &corner,
+                     const std::vector<real4> &pos, const int bits);
+
+
+/*********************************/
+/*   Host copy of the GPU tree   */
+/*********************************/
+
+//Tree in the layout of the GPU tree: level ordered, the children of a node
+//are stored contiguously on the next level, nodeSize.w holds the child info
+//and nodeCentre.w the opening criterion (negative for leaves). This is the
+//data the LET functions get from the device in a run
+struct HostTree
+{
+  std::vector<real4> bodies;              //Sorted by key
+  std::vector<real4> nodeCentre;
+  std::vector<real4> nodeSize;
+  std::vector<real4> multipole;           //3 per node: com+mass, quadrupole
+  std::vector<int2>  levelList;
+  int                startLevelMin;
+
+  int nNodes() const { return (int)nodeSize.size(); }
+};
+
+void buildHostTree(HostTree &tree, const std::vector<real4> &pos, const float theta);
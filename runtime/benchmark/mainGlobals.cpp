@@ -0,0 +1,29 @@
+//Globals that are normally defined in main.cpp, for the host tools in
+//benchmark/ that link the other sources of the main binary
+
+#include <vector>
+#include "log.h"
+#include "octree.h"
+
+#if ENABLE_LOG
+  bool ENABLE_RUNTIME_LOG;
+  bool PREPEND_RANK;
+  int  PREPEND_RANK_PROCID;
+  int  PREPEND_RANK_NPROCS;
+#endif
+
+int devID;
+int renderDevID;
+
+long long my_dev::base_mem::currentMemUsage;
+long long my_dev::base_mem::maxMemUsage;
+
+int setupMergerModel(vector<real4> &bodyPositions1, vector<real4> &bodyVelocities1,
+                     vector<int>   &bodyIDs1,       vector<real4> &bodyPositions2,
+                     vector<real4> &bodyVelocities2, vector<int>  &bodyIDs2)
+{
+  fprintf(stderr, "setupMergerModel is not available in the host tools\n");
+  exit(1);
+  return 0;
+}
+
@@ -0,0 +1,271 @@
+import sys
+import os
+import json
+import socket
+import argparse
+import subprocess
+
+# End-to-end regression benchmark. Runs bonsai2 for a fixed number of steps on
+# fixed inputs and process counts, reads the per step telemetry and compares
+# steps per second, particle-steps per second and the relative energy error
+# against a baseline file. Exits with 1 if a case got slower or less accurate
+# than the tolerances allow, so it can be used as a gate.
+#
+# usage: python regression.py --bonsai ./bonsai2 --procs 1,2,4 --steps 32
+#        python regression.py ... --update       (store the results as the new baseline)
+#
+# The first --warmup steps are not timed, they include the allocations and the
+# first tree construction. Baselines are per machine: regressionBaseline.json
+# maps the machine key (host name and GPU, see machineKey) to its cases. Add a
+# machine with --update on it and commit the file. A case without a baseline
+# fails the gate, nothing passes silently.
+#
+# Without a GPU bonsai2 can not run. The gate then runs the host micro
+# benchmarks (bonsai_benchmark, --host-benchmark) and compares their
+# items/s with the baselines of the machine. Without that binary it exits with
+# SKIP_STATUS, which CTest and automake report as skipped.
+
+SKIP_STATUS = 77
+
+
+def parseArgs():
+    p = argparse.ArgumentParser(description="Bonsai end-to-end regression benchmark")
+    p.add_argument("--bonsai",       default="./bonsai2")
+    p.add_argument("--mpirun",       default="mpirun -np {procs}",
+                   help="launcher prefix, {procs} is replaced by the process count")
+    p.add_argument("--procs",        default="1")
+    p.add_argument("--cases",        default="tipsy,plummer,milkyway")
+    p.add_argument("--steps",        type=int,   default=32)
+    p.add_argument("--warmup",       type=int,   default=2)
+    p.add_argument("--nplummer",     type=int,   default=262144, help="total particles of the Plummer sphere")
+    p.add_argument("--nmilkyway",    type=int,   default=262144, help="total particles of the Milky Way model")
+    p.add_argument("--tipsy",        default="model3_child_compact.tipsy")
+    p.add_argument("--baseline",     default=os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                                          "regressionBaseline.json"))
+    p.add_argument("--workdir",      default="regression_runs")
+    p.add_argument("--perf-tol",     type=float, default=0.05, help="allowed relative drop of the step rate")
+    p.add_argument("--energy-tol",   type=float, default=0.5,  help="allowed relative increase of max |dE|")
+    p.add_argument("--energy-floor", type=float, default=1e-7, help="max |dE| below this always passes")
+    p.add_argument("--update",       action="store_true")
+    p.add_argument("--out",          default="", help="write the results of this run as JSON")
+    p.add_argument("--host-benchmark", default="", help="bonsai_benchmark, run instead when there is no GPU")
+    p.add_argument("--host-sizes",   default="16384,131072")
+    return p.parse_args()
+
+
+def gpuNames():
+    # Empty when there is no NVIDIA driver or device
+    try:
+        out = subprocess.check_output(["nvidia-smi", "--query-gpu=name", "--format=csv,noheader"],
+                                      stderr=subprocess.STDOUT)
+    except (OSError, subprocess.CalledProcessError):
+        return []
+    return [l.strip() for l in out.decode().splitlines() if l.strip()]
+
+
+def machineKey(gpus):
+    return socket.gethostname() + "/" + (gpus[0] if gpus else "cpu")
+
+
+def caseArguments(args, case, procs):
+    if case == "tipsy":
+        return ["-i", args.tipsy]
+    if case == "plummer":
+        return ["--plummer", str(args.nplummer // procs)]
+    if case == "milkyway":
+        return ["--milkyway", str(args.nmilkyway // procs), "--mwdf", os.getcwd()]
+    raise ValueError("unknown case " + case)
+
+
+def supportsMilkyWay():
+    # The Milky Way generator reads the unzipped galactics_mw_df tables, bonsai2
+    # runs in the work directory and gets this one with --mwdf
+    return all(os.path.exists(f) for f in
+               ["dbh.dat", "cordbh.dat", "denspsihalo.dat", "denspsibulge.dat"])
+
+
+def readTelemetry(name, procs):
+    # With more than one process the aggregate (rank -1) is in the file of process 0
+    fileName = name + "-0" if procs > 1 else name
+    wantRank = -1 if procs > 1 else 0
+    records  = []
+    with open(fileName) as f:
+        for line in f:
+            rec = json.loads(line)
+            if rec["rank"] == wantRank:
+                records.append(rec)
+    return records
+
+
+def runCase(args, case, procs):
+    name    = case + "-" + str(procs)
+    workdir = os.path.abspath(os.path.join(args.workdir, name))
+    if not os.path.isdir(workdir):
+        os.makedirs(workdir)
+
+    telemetry = os.path.join(workdir, "telemetry.json")
+    cmd = []
+    if procs > 1:
+        cmd += args.mpirun.replace("{procs}", str(procs)).split()
+    cmd += [os.path.abspath(args.bonsai)]
+    cmd += caseArguments(args, case, procs)
+    cmd += ["-I", str(args.steps + args.warmup), "--telemetry", telemetry,
+            "--logfile", os.path.join(workdir, "gpuLog.log")]
+
+    # Relative input files are resolved from the current directory
+    if case == "tipsy":
+        cmd[cmd.index(args.tipsy)] = os.path.abspath(args.tipsy)
+
+    with open(os.path.join(workdir, "output.log"), "w") as log:
+        status = subprocess.call(cmd, cwd=workdir, stdout=log, stderr=subprocess.STDOUT)
+    if status != 0:
+        print(name + ": bonsai2 failed with status " + str(status) + ", see " + workdir + "/output.log")
+        return None
+
+    records = readTelemetry(telemetry, procs)
+    timed   = [r for r in records if r["iter"] >= args.warmup]
+    if len(timed) == 0:
+        print(name + ": no telemetry records")
+        return None
+
+    time = sum(r["step"] for r in timed)
+    return {
+        "particles":              timed[-1]["n"],
+        "steps":                  len(timed),
+        "stepsPerSecond":         len(timed) / time,
+        "particleStepsPerSecond": sum(r["n"] for r in timed) / time,
+        "energyError":            max(abs(r["dE"]) for r in records),
+        "finalEnergyError":       records[-1]["dE"],
+    }
+
+
+def runHostBenchmarks(args):
+    # Google Benchmark style JSON, one result per benchmark name
+    out = os.path.abspath(os.path.join(args.workdir, "host_benchmark.json"))
+    if not os.path.isdir(args.workdir):
+        os.makedirs(args.workdir)
+    cmd = [os.path.abspath(args.host_benchmark), "--sizes=" + args.host_sizes, "--benchmark_out=" + out]
+    with open(os.path.join(args.workdir, "host_benchmark.log"), "w") as log:
+        status = subprocess.call(cmd, stdout=log, stderr=subprocess.STDOUT)
+    if status != 0:
+        print("bonsai_benchmark failed with status " + str(status) + ", see " + args.workdir + "/host_benchmark.log")
+        return None
+    with open(out) as f:
+        data = json.load(f)
+    return dict((b["name"], {"itemsPerSecond": b["items_per_second"]}) for b in data["benchmarks"])
+
+
+def compare(args, name, res, base):
+    failures = []
+    for key in ["stepsPerSecond", "particleStepsPerSecond", "itemsPerSecond"]:
+        if key in res and res[key] < (1 - args.perf_tol) * base[key]:
+            failures.append("%s %.4g < %.4g" % (key, res[key], base[key]))
+
+    if "energyError" in res and res["energyError"] > args.energy_floor and \
+       res["energyError"] > (1 + args.energy_tol) * base["energyError"]:
+        failures.append("max |dE| %.4g > %.4g" % (res["energyError"], base["energyError"]))
+    return failures
+
+
+def loadBaseline(args):
+    baseline = {}
+    if os.path.exists(args.baseline):
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+    return baseline
+
+
+def storeBaseline(args, baseline, key, results):
+    baseline.setdefault(key, {}).update(results)
+    with open(args.baseline, "w") as f:
+        json.dump(baseline, f, indent=2, sort_keys=True)
+    print("Stored " + str(len(results)) + " baselines of " + key + " in " + args.baseline)
+
+
+def hostGate(args, baseline, key):
+    if not args.host_benchmark or not os.path.exists(args.host_benchmark):
+        print("SKIP: no GPU and no bonsai_benchmark (--host-benchmark, build with -DBUILD_BENCHMARKS=1)")
+        return SKIP_STATUS
+
+    print("No GPU, running the host benchmarks of " + key)
+    results = runHostBenchmarks(args)
+    if results is None:
+        return 1
+
+    failed = False
+    base   = baseline.get(key, {})
+    for name in sorted(results):
+        res = results[name]
+        if args.update:
+            status = "stored"
+        elif name not in base:
+            status = "FAIL: no baseline"
+            failed = True
+        else:
+            failures = compare(args, name, res, base[name])
+            status   = "ok" if len(failures) == 0 else "FAIL: " + ", ".join(failures)
+            failed   = failed or len(failures) > 0
+        print("%-52s %14.4g items/s  %s" % (name, res["itemsPerSecond"], status))
+
+    if args.update:
+        storeBaseline(args, baseline, key, results)
+    if args.out:
+        with open(args.out, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+    return 1 if failed else 0
+
+
+def main():
+    args     = parseArgs()
+    procs    = [int(p) for p in args.procs.split(",")]
+    cases    = args.cases.split(",")
+    gpus     = gpuNames()
+    key      = machineKey(gpus)
+    baseline = loadBaseline(args)
+
+    if not gpus:
+        sys.exit(hostGate(args, baseline, key))
+
+    if "milkyway" in cases and not supportsMilkyWay():
+        print("Skipping the Milky Way case, the galactics_mw_df tables are not unzipped here")
+        cases.remove("milkyway")
+
+    base    = baseline.get(key, {})
+    results = {}
+    failed  = False
+    print("Machine: " + key)
+    print("%-14s %10s %12s %16s %12s  %s" % ("case", "N", "steps/s", "particle-steps/s", "max |dE|", "status"))
+    for case in cases:
+        for p in procs:
+            name = case + "-" + str(p)
+            res  = runCase(args, case, p)
+            if res is None:
+                failed = True
+                continue
+            results[name] = res
+
+            if args.update:
+                status = "stored"
+            elif name not in base:
+                status = "FAIL: no baseline, store one with --update"
+                failed = True
+            else:
+                failures = compare(args, name, res, base[name])
+                status   = "ok" if len(failures) == 0 else "FAIL: " + ", ".join(failures)
+                failed   = failed or len(failures) > 0
+
+            print("%-14s %10d %12.3f %16.4g %12.4g  %s" % (name, res["particles"], res["stepsPerSecond"],
+                                                         res["particleStepsPerSecond"], res["energyError"], status))
+
+    if args.update:
+        storeBaseline(args, baseline, key, results)
+
+    if args.out:
+        with open(args.out, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
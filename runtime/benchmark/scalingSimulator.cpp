@@ -0,0 +1,424 @@
+/*
+
+Scaling simulator: replays the domain decomposition and the LET exchange of a
+run on P processes for one snapshot, on a single CPU only machine.
+
+The particles are sorted on their Peano-Hilbert key and split in P domains of
+equal particle count, which is what the sample based splitter converges to
+when all processes take the same time. Every virtual process builds its tree
+and boundary tree (extractGroupsTreeFull) and then, for every pair, the same
+decisions are made as in essential_tree_exchangeV2:
+ - the receiver uses the boundary of the sender if getLEToptQuickTreevsTree
+   says it is sufficient, no LET is sent
+ - otherwise the sender builds the LET against the boundary of the receiver
+   with getLEToptQuickFullTree. LETs with more than NCELLMAX cells take the
+   point to point path in a run, they are counted as fallbacks and their size
+   is that of the quick LET, an upper bound of the point to point LET
+
+Reported per process count: LET sizes, the communication volume, the load
+imbalance and the network time under an alpha-beta model:
+   t_msg      = alpha + bytes / beta
+   t_exchange = max over processes of max(sum t_msg sent, sum t_msg received)
+   t_boundary = (P-1)*alpha + (P-1)/P * total boundary bytes / beta (ring allgather)
+The work of a process is estimated as its local particles plus the imported
+particles and cells, the imbalance is max/mean of that estimate.
+
+The device memory of every process follows from its particle, node and group
+counts and the received LETs (estimateMemory). The largest particle count per
+device that fits in --device-mem assumes that these scale linearly with the
+particle count of the process that needs the most memory per particle.
+
+usage: bonsai_scaling [--infile=snapshot.tipsy | --plummer=N] [--procs=4,8,16]
+                      [--theta=0.75] [--alpha=2.0] [--beta=5.0]
+                      [--matrix=prefix] [--verbose]
+                      [--device-mem=6] [--walk-blocks=448]
+
+alpha is in microseconds, beta in GB/s, device-mem in GB. walk-blocks is the
+number of multiprocessors times 32 (16 on Fermi). --matrix writes prefix-P.csv with the
+bytes sent from process row to process column. --verbose prints the table per
+process.
+
+*/
+
+#include <mpi.h>
+#include <omp.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "log.h"
+#include "FileIO.h"
+#include "hostTree.h"
+#include "memoryEstimate.h"
+
+#define SCALING_NCELLMAX 1024   //Same limit as essential_tree_exchangeV2
+
+struct SimProcess
+{
+  HostTree           tree;
+  std::vector<real4> bndCentre, bndSize, bndMulti, bndBody;
+  double             tBoundary;
+
+  int    nBoundary()      const { return bndSize.size(); }
+  size_t boundaryBytes()  const { return sizeof(real4)*(1 + bndBody.size() + 5*bndSize.size()); }
+};
+
+struct SimConfig
+{
+  float       theta;
+  double      alpha;            //s
+  double      beta;             //bytes/s
+  double      deviceBytes;
+  int         walkBlocks;
+  std::string matrixPrefix;
+  bool        verbose;
+};
+
+struct SimPair
+{
+  bool      useBoundary;
+  bool      fallback;
+  int       nPtcl, nCell;
+  long long bytes;
+  double    tCheck;             //Boundary test, done by the receiver
+  double    tLET;               //LET selection, done by the sender
+};
+
+static std::vector<int> parseList(const std::string &list)
+{
+  std::vector<int> values;
+  for(size_t pos=0; pos < list.size(); )
+  {
+    values.push_back(atoi(list.c_str() + pos));
+    pos = list.find(',', pos);
+    if(pos == std::string::npos) break;
+    pos++;
+  }
+  return values;
+}
+
+//Split the key sorted particles in nProcs parts of equal size
+static void decompose(std::vector<SimProcess> &procs, const std::vector<real4> &pos,
+                      const std::vector<uint4> &sortedKeys, const float theta)
+{
+  const int    nProcs = procs.size();
+  const size_t n      = pos.size();
+
+  #pragma omp parallel for schedule(dynamic)
+  for(int p=0; p < nProcs; p++)
+  {
+    const size_t beg = (size_t(p)  *n)/nProcs;
+    const size_t end = (size_t(p+1)*n)/nProcs;
+
+    std::vector<real4> local(end-beg);
+    for(size_t i=beg; i < end; i++) local[i-beg] = pos[sortedKeys[i].w];
+
+    SimProcess &proc = procs[p];
+    buildHostTree(proc.tree, local, theta);
+
+    const double t0   = MPI_Wtime();
+    const int2   cell = proc.tree.levelList[proc.tree.startLevelMin];
+    extractGroupsTreeFull(proc.bndCentre, proc.bndSize, proc.bndMulti, proc.bndBody,
+                          &proc.tree.nodeCentre[0], &proc.tree.nodeSize[0], &proc.tree.multipole[0],
+                          &proc.tree.bodies[0], cell.x, cell.y, proc.tree.nNodes());
+    proc.tBoundary = MPI_Wtime() - t0;
+  }
+}
+
+static void exchange(std::vector<SimPair> &pairs, const std::vector<SimProcess> &procs)
+{
+  const int nProcs = procs.size();
+  pairs.resize(nProcs*nProcs);
+
+  size_t maxLET = 0;
+  for(int p=0; p < nProcs; p++)
+    maxLET = std::max(maxLET, 1 + procs[p].tree.bodies.size() + 5*procs[p].tree.nNodes());
+
+  #pragma omp parallel
+  {
+    GETLETBUFFERS      letBuffers;
+    std::vector<v4sf>  letBuffer;
+    letBuffer.reserve(maxLET);    //getLEToptQuickFullTree asserts that it does not reallocate
+
+    #pragma omp for schedule(dynamic)
+    for(int ij=0; ij < nProcs*nProcs; ij++)
+    {
+      const int src = ij / nProcs;
+      const int dst = ij % nProcs;
+      SimPair &pair = pairs[ij];
+      memset(&pair, 0, sizeof(SimPair));
+      if(src == dst) continue;
+
+      const SimProcess &s = procs[src];
+      const SimProcess &d = procs[dst];
+
+      //Test if the boundary of the sender is sufficient for the receiver
+      double t0 = MPI_Wtime();
+      double tCheck;
+      const int resultTree = getLEToptQuickTreevsTree(letBuffers,
+                                                      &s.bndCentre[0], &s.bndSize[0], &s.bndMulti[0], 0, 1,
+                                                      &d.tree.nodeSize[0], &d.tree.nodeCentre[0], 0, 1,
+                                                      s.nBoundary(), src, dst, tCheck);
+      pair.tCheck = MPI_Wtime() - t0;
+      if(resultTree == 0)
+      {
+        pair.useBoundary = true;
+        continue;
+      }
+
+      //The LET the sender builds against the boundary of the receiver
+      unsigned long long nflops;
+      double             tLET;
+      t0 = MPI_Wtime();
+      letBuffer.clear();
+      const int sizeTree = getLEToptQuickFullTree(letBuffer, letBuffers, 0x7FFFFFFF, MAXLEVELS,
+                                                  &s.tree.nodeCentre[0], &s.tree.nodeSize[0], &s.tree.multipole[0],
+                                                  0, 1, &s.tree.bodies[0], s.tree.bodies.size(),
+                                                  &d.bndSize[0], &d.bndCentre[0], 0, 1,
+                                                  s.tree.nNodes(), src, dst, nflops, tLET);
+      const real4 info = *(real4*)&letBuffer[0];
+      pair.nPtcl    = floatAsInt(info.x);
+      pair.nCell    = floatAsInt(info.y);
+      pair.bytes    = sizeof(real4)*(long long)sizeTree;
+      pair.fallback = pair.nCell > SCALING_NCELLMAX;
+      pair.tLET     = MPI_Wtime() - t0;
+    }
+  }
+}
+
+static void simulate(const std::vector<real4> &pos, const std::vector<uint4> &sortedKeys,
+                     const int nProcs, const SimConfig &cfg)
+{
+  const double t0 = MPI_Wtime();
+
+  std::vector<SimProcess> procs(nProcs);
+  decompose(procs, pos, sortedKeys, cfg.theta);
+
+  std::vector<SimPair> pairs;
+  exchange(pairs, procs);
+
+  std::vector<double>    tSend(nProcs, 0), tRecv(nProcs, 0), work(nProcs, 0), tLET(nProcs, 0);
+  std::vector<long long> bytesSend(nProcs, 0), bytesRecv(nProcs, 0), remoteItems(nProcs, 0);
+  long long totalBytes = 0, boundaryBytes = 0;
+  int       nBoundaryOk = 0, nFallback = 0;
+
+  for(int p=0; p < nProcs; p++)
+  {
+    work[p]        = procs[p].tree.bodies.size();
+    boundaryBytes += procs[p].boundaryBytes();
+  }
+
+  for(int src=0; src < nProcs; src++)
+  {
+    for(int dst=0; dst < nProcs; dst++)
+    {
+      if(src == dst) continue;
+      const SimPair &pair = pairs[src*nProcs+dst];
+      tLET[src] += pair.tLET;
+      tLET[dst] += pair.tCheck;
+      if(pair.useBoundary)
+      {
+        //The boundary of the sender enters the walk of the receiver
+        work[dst]        += procs[src].bndBody.size() + procs[src].nBoundary();
+        remoteItems[dst] += procs[src].boundaryBytes() / sizeof(real4);
+        nBoundaryOk++;
+        continue;
+      }
+
+      const double tMsg = cfg.alpha + pair.bytes/cfg.beta;
+      tSend[src]     += tMsg;
+      tRecv[dst]     += tMsg;
+      bytesSend[src] += pair.bytes;
+      bytesRecv[dst] += pair.bytes;
+      totalBytes     += pair.bytes;
+      work[dst]      += pair.nPtcl + pair.nCell;
+      remoteItems[dst] += pair.bytes / sizeof(real4);
+      nFallback      += pair.fallback;
+    }
+  }
+
+  //Device memory, groups are smaller than NCRIT and counted as 2n/NCRIT
+  std::vector<long long> memory(nProcs);
+  double    memMax = 0;
+  long long nDeviceMax = -1;
+  for(int p=0; p < nProcs; p++)
+  {
+    const long long n = procs[p].tree.bodies.size();
+    memory[p] = estimateMemory(n, procs[p].tree.nNodes(), 2*n/NCRIT, remoteItems[p],
+                               nProcs, cfg.walkBlocks).total();
+    memMax    = std::max(memMax, (double)memory[p]);
+
+    const long long nDevice = maxParticlesPerDevice(cfg.deviceBytes, procs[p].tree.nNodes()/(double)n,
+                                                    2.0/NCRIT, remoteItems[p]/(double)n,
+                                                    nProcs, cfg.walkBlocks);
+    nDeviceMax = (nDeviceMax < 0) ? nDevice : std::min(nDeviceMax, nDevice);
+  }
+
+  double tExchange = 0, workMax = 0, workSum = 0, tLETMax = 0;
+  size_t nMax = 0;
+  for(int p=0; p < nProcs; p++)
+  {
+    tExchange = std::max(tExchange, std::max(tSend[p], tRecv[p]));
+    workMax   = std::max(workMax, work[p]);
+    workSum  += work[p];
+    tLETMax   = std::max(tLETMax, tLET[p]);
+    nMax      = std::max(nMax, procs[p].tree.bodies.size());
+  }
+  const double tBoundary = (nProcs-1)*cfg.alpha + (nProcs-1)*(boundaryBytes/(double)nProcs)/cfg.beta;
+  const int    nPairs    = nProcs*(nProcs-1);
+
+  if(cfg.verbose)
+  {
+    fprintf(stdout, "\n%6s %10s %8s %12s %12s %12s %12s %10s %10s %10s\n", "proc", "n", "bnd",
+                    "sent [MB]", "recv [MB]", "work", "t_net [ms]", "t_bnd [ms]", "t_let [ms]", "mem [MB]");
+    for(int p=0; p < nProcs; p++)
+      fprintf(stdout, "%6d %10d %8d %12.3f %12.3f %12.0f %12.3f %10.3f %10.3f %10.1f\n",
+                      p, (int)procs[p].tree.bodies.size(), procs[p].nBoundary(),
+                      bytesSend[p]*1e-6, bytesRecv[p]*1e-6, work[p],
+                      std::max(tSend[p], tRecv[p])*1e3, procs[p].tBoundary*1e3, tLET[p]*1e3,
+                      memory[p]/(1024.0*1024.0));
+    fprintf(stdout, "\n");
+  }
+
+  fprintf(stdout, "%6d %6.2f %8.3f %8.1f%% %8.1f%% %12.2f %12.3f %10.3f %10.3f %10.3f %10.3f %10.1f %12lld %8.1f\n",
+                  nProcs, cfg.theta, nMax/(pos.size()/(double)nProcs),
+                  nPairs ? 100.0*nBoundaryOk/nPairs : 0.0, nPairs ? 100.0*nFallback/nPairs : 0.0,
+                  totalBytes*1e-6, boundaryBytes*1e-6, workMax/(workSum/nProcs),
+                  tExchange*1e3, tBoundary*1e3, tLETMax*1e3, memMax/(1024.0*1024.0), nDeviceMax,
+                  MPI_Wtime()-t0);
+  fflush(stdout);
+
+  if(!cfg.matrixPrefix.empty())
+  {
+    char fileName[512];
+    sprintf(fileName, "%s-%d.csv", cfg.matrixPrefix.c_str(), nProcs);
+    FILE *out = fopen(fileName, "w");
+    if(!out)
+    {
+      fprintf(stderr, "Can not open matrix file: %s\n", fileName);
+      return;
+    }
+    for(int src=0; src < nProcs; src++)
+    {
+      for(int dst=0; dst < nProcs; dst++)
+        fprintf(out, "%s%lld", dst ? "," : "", pairs[src*nProcs+dst].bytes);
+      fprintf(out, "\n");
+    }
+    fclose(out);
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  my_dev::base_mem::currentMemUsage = 0;
+  my_dev::base_mem::maxMemUsage     = 0;
+
+#if ENABLE_LOG
+  ENABLE_RUNTIME_LOG = false;
+  PREPEND_RANK       = false;
+#endif
+
+  std::string      fileName;
+  int              nPlummer = 0;
+  double           deviceGB = 6.0;    //Tesla K20X
+  std::vector<int> procList;
+
+  SimConfig cfg;
+  cfg.theta      = 0.75f;
+  cfg.alpha      = 2.0;               //us
+  cfg.beta       = 5.0;               //GB/s
+  cfg.walkBlocks = 14*32;
+  cfg.verbose    = false;
+
+  for(int i=1; i < argc; i++)
+  {
+    const std::string arg = argv[i];
+    if     (arg.compare(0, 9,  "--infile=")  == 0) fileName     = arg.substr(9);
+    else if(arg.compare(0, 10, "--plummer=") == 0) nPlummer     = atoi(arg.substr(10).c_str());
+    else if(arg.compare(0, 8,  "--procs=")   == 0) procList     = parseList(arg.substr(8));
+    else if(arg.compare(0, 8,  "--theta=")   == 0) cfg.theta        = atof(arg.substr(8).c_str());
+    else if(arg.compare(0, 8,  "--alpha=")   == 0) cfg.alpha        = atof(arg.substr(8).c_str());
+    else if(arg.compare(0, 7,  "--beta=")    == 0) cfg.beta         = atof(arg.substr(7).c_str());
+    else if(arg.compare(0, 9,  "--matrix=")  == 0) cfg.matrixPrefix = arg.substr(9);
+    else if(arg.compare(0, 13, "--device-mem=") == 0) deviceGB       = atof(arg.substr(13).c_str());
+    else if(arg.compare(0, 14, "--walk-blocks=") == 0) cfg.walkBlocks = atoi(arg.substr(14).c_str());
+    else if(arg == "--verbose")                    cfg.verbose      = true;
+    else
+    {
+      fprintf(stderr, "usage: %s [--infile=snapshot.tipsy | --plummer=N] [--procs=p1,p2,...] [--theta=t]\n"
+                      "          [--alpha=us] [--beta=GB/s] [--matrix=prefix] [--verbose]\n"
+                      "          [--device-mem=GB] [--walk-blocks=n]\n", argv[0]);
+      return 1;
+    }
+  }
+  if(procList.empty())
+  {
+    procList.push_back(4);
+    procList.push_back(8);
+    procList.push_back(16);
+  }
+  if(fileName.empty() && nPlummer == 0) nPlummer = 1 << 20;
+
+  MPI_Init(&argc, &argv);
+
+  std::vector<real4> pos;
+  if(!fileName.empty())
+  {
+    std::vector<real4> bodyVelocities, dustPositions, dustVelocities;
+    std::vector<int>   bodyIDs, dustIDs;
+    int NTotal, NFirst, NSecond, NThird;
+    read_tipsy_file_parallel(pos, bodyVelocities, bodyIDs, 0.05f*0.05f, fileName,
+                             0, 1, NTotal, NFirst, NSecond, NThird, NULL,
+                             dustPositions, dustVelocities, dustIDs, 1, 1, false);
+  }
+  else
+  {
+    makePlummer(pos, nPlummer, 19810614);
+  }
+
+  if(pos.empty())
+  {
+    fprintf(stderr, "No particles in the input\n");
+    MPI_Finalize();
+    return 1;
+  }
+
+  //Peano-Hilbert keys in the global box
+  std::vector<uint4> keys;
+  float4             corner;
+  makeCoordinates(keys, corner, pos, 30);
+  for(size_t i=0; i < keys.size(); i++)
+  {
+    const uint idx = keys[i].w;
+    keys[i]        = HostConstruction::host_get_key(keys[i]);
+    keys[i].w      = idx;
+  }
+  std::sort(keys.begin(), keys.end(), keyLess);
+
+  fprintf(stdout, "Particles: %d  alpha: %g us  beta: %g GB/s  device: %g GB  threads: %d\n",
+                  (int)pos.size(), cfg.alpha, cfg.beta, deviceGB, omp_get_max_threads());
+  fprintf(stdout, "%6s %6s %8s %9s %9s %12s %12s %10s %10s %10s %10s %10s %12s %8s\n",
+                  "procs", "theta", "n max", "bnd ok", "fallback", "LET [MB]", "bnd [MB]",
+                  "imbalance", "t_net[ms]", "t_bnd[ms]", "t_let[ms]", "mem [MB]", "N max/dev", "wall[s]");
+
+  //Convert to seconds and bytes per second
+  cfg.alpha      *= 1e-6;
+  cfg.beta       *= 1e9;
+  cfg.deviceBytes = deviceGB*1024*1024*1024;
+  for(size_t i=0; i < procList.size(); i++)
+  {
+    if(procList[i] < 1 || (size_t)procList[i] > pos.size() / NCRIT)
+    {
+      fprintf(stderr, "Skipping %d processes, not enough particles\n", procList[i]);
+      continue;
+    }
+    simulate(pos, keys, procList[i], cfg);
+  }
+
+  MPI_Finalize();
+  return 0;
+}
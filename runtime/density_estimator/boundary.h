@@ -1,10 +1,14 @@
+#ifndef __BOUNDARY_H__
+#define __BOUNDARY_H__
+
+#include <cmath>
 #include "vector3.h"
 
 template <typename REAL>
 struct boundary{
 	typedef vector3<REAL> vec;
 	vec min, max;
-	boundary() : min(HUGE), max(-HUGE) {}
+	boundary() : min(HUGE_VALF), max(-HUGE_VALF) {}
 	boundary(const vec &_min, const vec &_max) : min(_min), max(_max) {}
 	boundary(const vec &pos, const REAL &h = 0.0) : min(pos - vec(h)), max(pos + vec(h)) {}
 
@@ -76,3 +80,5 @@ struct boundary<float>{
 	}
 };
 #endif
+
+#endif /* __BOUNDARY_H__ */
@@ -1,70 +1,53 @@
+#include <cstdio>
+#include <iostream>
 #include "density.h"
 
-std::vector<Particle> Node::ptcl;
-std::vector<Node>     Node::Node_heap;
-std::vector<std::pair<Node*, Node*> > Node::pair_list;
-
 int main(int argc, char * argv[])
 {
-  Particle::Vector ptcl;
-
   int idum, nbody;
   std::cin >> idum >> nbody;
 
-  std::vector<int> nnb(nbody);
-  ptcl.reserve(nbody);
+  std::vector<float> posm(4*nbody);
+  std::vector<int>   nnb_in(nbody);
 
   for(int i=0; i<nbody; i++){
     float h;
     vec3 pos;
-    std::cin >> pos >> h >> nnb[i];
-    ptcl.push_back(Particle(i, pos, 1.0, 2.0*h));
+    std::cin >> pos >> h >> nnb_in[i];
+    posm[4*i+0] = pos.x;
+    posm[4*i+1] = pos.y;
+    posm[4*i+2] = pos.z;
+    posm[4*i+3] = 1.0f;
   }
   fprintf(stderr, "nbody= %d \n", nbody);
 
-  Node::allocate(nbody, nbody);
-  Density density(ptcl, nbody);
+  const int Nngb = argc > 1 ? atoi(argv[1]) : 32;
+  std::vector<float> h(nbody, 0.0f), dens(nbody);
+  std::vector<int>   nnb(nbody);
+
+  Density density(Nngb);
+  const double t0 = wtime();
+  density.compute(nbody, &posm[0], &h[0], &dens[0], &nnb[0]);
+  const double t1 = wtime();
+  fprintf(stderr, " -- Density done in %g sec [ %g ptcl/sec ]  build= %g  solve= %g  iterations= %d  unconverged= %d\n",
+      t1 - t0, nbody/(t1 - t0), density.getBuildTime(), density.getSolveTime(),
+      density.iterations(), density.unconverged());
 
   int ngb_min = nbody;
   int ngb_max = 0;
   double ngb_mean = 0;
   double ngb_mean2 = 0;
 
-  int imax = 0;
-#if 0
-  fprintf(stdout, "%d\n", nbody);
-#endif
   for (int i = 0; i < nbody; i++)
   {
-    std::vector<Particle> &ptcl = Node::ptcl;
-    const Particle &p = ptcl[i];
-#if 0
-    if (!(p.nnb == nnb[p.ID]))
-    {
-      fprintf(stderr, "i= %d: nnb_exact= %d  nnb_compute= %d\n",
-          i, nnb[p.ID], p.nnb);
-    }
-#endif
-
-    if (p.nnb > 128)
-    {
-#if 0
-      fprintf(stderr, "i= %d: nnb_exact= %d  nnb_compute= %d  h= %g pos= %g %g %g\n",
-          i, nnb[ID], p.nnb, p.h, p.pos.x, p.pos.y, p.pos.z);
-#endif
-      imax++;
-    }
-
-    ngb_min = std::min(ngb_min, p.nnb);
-    ngb_max = std::max(ngb_max, p.nnb);
-    ngb_mean  += p.nnb;
-    ngb_mean2 += p.nnb*p.nnb;
-    fprintf(stdout, " %d  %g %g %g   %g \n", p.ID, p.pos.x, p.pos.y, p.pos.z, p.density);
-
+    ngb_min = std::min(ngb_min, nnb[i]);
+    ngb_max = std::max(ngb_max, nnb[i]);
+    ngb_mean  += nnb[i];
+    ngb_mean2 += (double)nnb[i]*nnb[i];
+    fprintf(stdout, " %d  %g %g %g   %g \n", i, posm[4*i+0], posm[4*i+1], posm[4*i+2], dens[i]);
   }
   ngb_mean  *= 1.0/(float)nbody;
   ngb_mean2 *= 1.0/(float)nbody;
-  fprintf(stderr, " imax= %d \n", imax);
   fprintf(stderr, " nmin= %d  nmax= %d   nmean= %g  <sigma>= %g\n",
       ngb_min, ngb_max,
       ngb_mean,
@@ -72,5 +55,3 @@ int main(int argc, char * argv[])
 
   return 0;
 }
-
-
@@ -1,105 +1,876 @@
 #ifndef __DENSITY_H__
 #define __DENSITY_H__
 
+#include <vector>
 #include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <omp.h>
+#include <smmintrin.h>
+#ifdef USE_MPI
+  #include <mpi.h>
+#endif
 #include "Node.h"
+#include "morton_key.h"
 #include "wtime.h"
 
+/* SPH density estimator.
+ *
+ * Tree k nearest neighbour search: the range h of every particle is set
+ * between the distances of its Nngb-th and Nngb+1-th nearest particles
+ * (itself included), then
+ *   density_i = sum_j m_j W(|r_j - r_i| / h_i) / h_i^3
+ * The nearest are selected from the particles inside a search sphere. A
+ * sphere that holds Nngb or fewer grows by ((Nngb+1)/nnb)^(1/3) for the next
+ * sweep, so nnb is Nngb unless particles share the distance of the Nngb-th.
+ *
+ * Reentrant: the particles and the tree belong to the instance, estimators
+ * on different threads share nothing. A call runs on nThreads OpenMP threads
+ * (0 for the OpenMP default).
+ *
+ * Particles are passed as x,y,z,mass quadruplets, the layout of float4:
+ *
+ *   Density density(32);
+ *   density.compute(n, &pos[0].x, h, rho);     h[i] > 0 is the initial guess
+ *   density.correctBoundaries(comm, h, rho);   USE_MPI, every process
+ */
+class Density
+{
+  public:
+    typedef boundary<float> Boundary;
+    typedef unsigned long long key_t;
+    typedef __m128 v4sf;
 
-#if 0
-#define SLOW
+    Density(const int _Nngb = 32, const int _nThreads = 0) :
+      Nngb(_Nngb), maxIter(20), hMargin(1.1f),
+      nThreads(_nThreads > 0 ? _nThreads : omp_get_max_threads()),
+      nptcl(0), rsize(1.0f), nIter(0), nUnconverged(0), buildTime(0), solveTime(0)
+    {
+#ifdef USE_MPI
+      nGhosts = nRedone = 0;
 #endif
+    }
 
-struct Density
-{
-  typedef boundary<float> Boundary;
+    void setMaxIterations(const int n)    { maxIter = std::max(n, 1); }
+
+    /* Estimates h, density and, optionally, the neighbour count of n particles */
+    void compute(const int n, const float *posm, float *h, float *density, int *nnb = NULL)
+    {
+      const double t0 = wtime();
+      build(n, posm, NULL);
+      const double t1 = wtime();
+      solve(h);
+      scatter(h, density, nnb);
+      buildTime = t1 - t0;
+      solveTime = wtime() - t1;
+    }
+
+#ifdef USE_MPI
+    /* After compute() on every process of comm, with the same output arrays:
+     * redoes the particles whose sphere reaches into the bounding box of
+     * another process, with the particles of that process in range as ghosts.
+     * With compact (space filling curve) domains these are a thin shell.
+     * The ranges only shrink when ghosts are added, so the spheres of the
+     * first pass bound the ghosts that are needed. Collective */
+    void correctBoundaries(MPI_Comm comm, float *h, float *density, int *nnb = NULL)
+    {
+      int procId, nProcs;
+      MPI_Comm_rank(comm, &procId);
+      MPI_Comm_size(comm, &nProcs);
+      if(nProcs == 1) return;
+
+      const double t0 = wtime();
+      makeOuterBounds();
+
+      /* inner and outer box of every process */
+      const Node &root = nodes[0];
+      float box[12] = {root.bound_inner.min.x, root.bound_inner.min.y, root.bound_inner.min.z,
+                       root.bound_inner.max.x, root.bound_inner.max.y, root.bound_inner.max.z,
+                       root.bound_outer.min.x, root.bound_outer.min.y, root.bound_outer.min.z,
+                       root.bound_outer.max.x, root.bound_outer.max.y, root.bound_outer.max.z};
+      std::vector<float> boxes(12*nProcs);
+      MPI_Allgather(box, 12, MPI_FLOAT, &boxes[0], 12, MPI_FLOAT, comm);
+
+      /* ghosts for process p: our particles in its outer box */
+      std::vector<int>   sendCount(nProcs, 0), sendOffset(nProcs+1, 0);
+      std::vector<float> sendBuf;
+      std::vector<int>   list;
+      for(int p=0; p<nProcs; p++)
+      {
+        if(p != procId)
+        {
+          list.clear();
+          findInside(Boundary(vec3(&boxes[12*p+6]), vec3(&boxes[12*p+9])), list);
+          for(size_t k=0; k<list.size(); k++)
+          {
+            const int i = list[k];
+            sendBuf.push_back(x[i]);  sendBuf.push_back(y[i]);
+            sendBuf.push_back(z[i]);  sendBuf.push_back(m[i]);
+          }
+          sendCount[p] = 4*list.size();
+        }
+        sendOffset[p+1] = sendOffset[p] + sendCount[p];
+      }
+
+      std::vector<int> recvCount(nProcs), recvOffset(nProcs+1, 0);
+      MPI_Alltoall(&sendCount[0], 1, MPI_INT, &recvCount[0], 1, MPI_INT, comm);
+      for(int p=0; p<nProcs; p++) recvOffset[p+1] = recvOffset[p] + recvCount[p];
+      std::vector<float> ghosts(recvOffset[nProcs]);
+      MPI_Alltoallv(sendBuf.empty() ? NULL : &sendBuf[0], &sendCount[0], &sendOffset[0], MPI_FLOAT,
+                    ghosts .empty() ? NULL : &ghosts [0], &recvCount[0], &recvOffset[0], MPI_FLOAT, comm);
+      nGhosts = ghosts.size()/4;
+      nRedone = 0;
+
+      /* our particles whose sphere overlaps another domain */
+      std::vector<char> redo(nptcl, 0);
+      int nRedo = 0;
+      for(int p=0; p<nProcs; p++)
+      {
+        if(p == procId) continue;
+        list.clear();
+        findReaching(Boundary(vec3(&boxes[12*p]), vec3(&boxes[12*p+3])), list);
+        for(size_t k=0; k<list.size(); k++)
+          if(!redo[list[k]]) { redo[list[k]] = 1; nRedo++; }
+      }
+      if(nRedo == 0) return;
+
+      /* their neighbours: ghosts and our particles within reach of the spheres */
+      Boundary reach;
+      for(int i=0; i<nptcl; i++)
+        if(redo[i]) reach.merge(Boundary(vec3(x[i], y[i], z[i]), hs[i]));
+      list.clear();
+      findInside(reach, list);
+
+      const int nLocal = list.size();
+      const int nGhost = nGhosts;
+      std::vector<float> posm(4*(nLocal + nGhost));
+      std::vector<int>   index(nLocal + nGhost, -1);
+      std::vector<float> hGuess(nLocal + nGhost, 0.0f);
+      for(int k=0; k<nLocal; k++)
+      {
+        const int i = list[k];
+        posm[4*k+0] = x[i];  posm[4*k+1] = y[i];
+        posm[4*k+2] = z[i];  posm[4*k+3] = m[i];
+        if(redo[i])
+        {
+          index [k] = out[i];
+          hGuess[k] = hs[i];
+        }
+      }
+      std::copy(ghosts.begin(), ghosts.end(), posm.begin() + 4*nLocal);
+
+      build(nLocal + nGhost, &posm[0], &index[0]);
+      const double t2 = wtime();
+      solve(&hGuess[0]);
+      scatter(h, density, nnb);
+      buildTime = t2 - t0;
+      solveTime = wtime() - t2;
+      nRedone   = nRedo;
+    }
+
+    int ghostCount()  const { return nGhosts; }
+    int redoneCount() const { return nRedone; }
+#endif
+
+    /* of the last call */
+    int    iterations()  const { return nIter;        }
+    int    unconverged() const { return nUnconverged; }
+    double getBuildTime() const { return buildTime;   }
+    double getSolveTime() const { return solveTime;   }
 
-  Particle::Vector density;
-  Boundary BBox;  /* bounding box */
+  private:
+    enum {RADIX_BITS = 8, RADIX = 1 << RADIX_BITS};
+    enum {NGROUP = 32};       /* particles that are swept as one group     */
+    enum {NCELL  = 64};       /* nodes that are searched as one candidate cell */
 
-  struct cmp_particle_key 
-  {
-    bool operator () (const Particle &a, const Particle &b)
+    const int   Nngb;
+    int         maxIter;
+    const float hMargin;    /* of the guesses of h and of the reach */
+    const int nThreads;
+
+    /* particles in Morton order */
+    int                 nptcl;
+    std::vector<key_t>  keys, keysTmp;
+    std::vector<int>    order, orderTmp;  /* row of the input          */
+    std::vector<int>    out;              /* output index, -1: only a neighbour */
+    std::vector<float>  x, y, z, m, hs;
+    std::vector<float>  rho;
+    std::vector<int>    nb;
+    std::vector<char>   active;
+    std::vector<int>    radixCount;
+
+    std::vector<Node>   nodes;            /* level by level             */
+    std::vector<int>    levels;           /* first node of every level  */
+    std::vector<int>    leaves;           /* in Morton order            */
+    std::vector<Node>   groups;           /* the i particles of a sweep */
+    Boundary            BBox;
+    float               rsize;
+
+    int    nIter, nUnconverged;
+    double buildTime, solveTime;
+#ifdef USE_MPI
+    int    nGhosts, nRedone;
+#endif
+
+    /* Sorts the particles along the Morton curve and builds the tree. Rows
+     * with index -1 are only neighbours, index NULL outputs every row */
+    void build(const int n, const float *posm, const int *index)
     {
-      return a.key.val < b.key.val;
+      nptcl = n;
+
+      float xmin = HUGE_VALF, ymin = HUGE_VALF, zmin = HUGE_VALF;
+      float xmax = -HUGE_VALF, ymax = -HUGE_VALF, zmax = -HUGE_VALF;
+#pragma omp parallel for num_threads(nThreads) reduction(min:xmin,ymin,zmin) reduction(max:xmax,ymax,zmax)
+      for(int i=0; i<n; i++)
+      {
+        xmin = std::min(xmin, posm[4*i+0]);  xmax = std::max(xmax, posm[4*i+0]);
+        ymin = std::min(ymin, posm[4*i+1]);  ymax = std::max(ymax, posm[4*i+1]);
+        zmin = std::min(zmin, posm[4*i+2]);  zmax = std::max(zmax, posm[4*i+2]);
+      }
+      BBox = Boundary(vec3(xmin, ymin, zmin), vec3(xmax, ymax, zmax));
+      const vec3 vsize = BBox.hlen();
+      rsize = std::max(vsize.x, std::max(vsize.y, vsize.z)) * 2.0f;
+      if(!(rsize > 0.0f)) rsize = 1.0f;
+
+      keys .resize(n);
+      order.resize(n);
+      const vec3 origin = BBox.min;
+#pragma omp parallel for num_threads(nThreads)
+      for(int i=0; i<n; i++)
+      {
+        const vec3 pos(posm[4*i+0], posm[4*i+1], posm[4*i+2]);
+        keys [i] = morton_key<vec3, float>(pos - origin, rsize).val;
+        order[i] = i;
+      }
+      sortKeys(n);
+
+      /* padded for the last vector of interact() */
+      out.resize(n);
+      x.assign(n+4, 0.0f);  y.assign(n+4, 0.0f);  z.assign(n+4, 0.0f);  m.assign(n+4, 0.0f);
+#pragma omp parallel for num_threads(nThreads)
+      for(int i=0; i<n; i++)
+      {
+        const int row = order[i];
+        x[i] = posm[4*row+0];
+        y[i] = posm[4*row+1];
+        z[i] = posm[4*row+2];
+        m[i] = posm[4*row+3];
+        out[i] = index ? index[row] : row;
+      }
+
+      buildTree(n);
+      makeInnerBounds();
     }
-  };
 
-  struct cmp_particle_ID
-  {
-    bool operator () (const Particle &a, const Particle &b)
+    /* LSD radix sort of keys and order, only over the bits that differ */
+    void sortKeys(const int n)
     {
-      return a.ID < b.ID;
+      key_t kmin = ~0ULL, kmax = 0;
+#pragma omp parallel for num_threads(nThreads) reduction(min:kmin) reduction(max:kmax)
+      for(int i=0; i<n; i++)
+      {
+        kmin = std::min(kmin, keys[i]);
+        kmax = std::max(kmax, keys[i]);
+      }
+      int nBits = 0;
+      for(key_t diff = n > 0 ? kmin ^ kmax : 0; diff; diff >>= 1) nBits++;
+      const int nPass = (nBits + RADIX_BITS - 1) / RADIX_BITS;
+
+      keysTmp .resize(n);
+      orderTmp.resize(n);
+      for(int pass=0; pass<nPass; pass++)
+      {
+        const int shift = pass*RADIX_BITS;
+#pragma omp parallel num_threads(nThreads)
+        {
+          const int nt  = omp_get_num_threads();
+          const int tid = omp_get_thread_num();
+#pragma omp single
+          radixCount.assign(nt*RADIX, 0);
+
+          const int ib = (long long)n* tid   /nt;
+          const int ie = (long long)n*(tid+1)/nt;
+          int *count = &radixCount[tid*RADIX];
+          for(int i=ib; i<ie; i++) count[(keys[i] >> shift) & (RADIX-1)]++;
+#pragma omp barrier
+#pragma omp single
+          {
+            int sum = 0;
+            for(int d=0; d<RADIX; d++)
+              for(int t=0; t<nt; t++)
+              {
+                const int c = radixCount[t*RADIX+d];
+                radixCount[t*RADIX+d] = sum;
+                sum += c;
+              }
+          }
+          for(int i=ib; i<ie; i++)
+          {
+            const int dst = count[(keys[i] >> shift) & (RADIX-1)]++;
+            keysTmp [dst] = keys [i];
+            orderTmp[dst] = order[i];
+          }
+        }
+        keys .swap(keysTmp);
+        order.swap(orderTmp);
+      }
     }
-  };
 
-  Density(const Particle::Vector &ptcl_in, const int Nuse, const int Nngb = 32)
-  {
-    const double t0 = wtime();
+    /* One level at a time: every node splits at the octant digits of its
+     * sorted keys, the children of the level are allocated with a scan */
+    void buildTree(const int n)
+    {
+      nodes .clear();
+      levels.clear();
+      nodes.push_back(Node(n, 0, 0));
+
+      std::vector<int> split, offset;
+      for(int levelBegin = 0; levelBegin < (int)nodes.size(); )
+      {
+        const int levelEnd = nodes.size();
+        const int nLevel   = levelEnd - levelBegin;
+        levels.push_back(levelBegin);
+        split .resize(9*nLevel);
+        offset.resize(nLevel+1);
+
+#pragma omp parallel for num_threads(nThreads) schedule(dynamic, 64)
+        for(int k=0; k<nLevel; k++)
+        {
+          const Node &node = nodes[levelBegin+k];
+          int *s = &split[9*k];
+          int nchild = 0;
+          if(node.np >= Node::NLEAF && node.depth < Node::MAXDEPTH)
+          {
+            const int shift = node.key_shift();
+            s[0] = node.pfirst;
+            s[8] = node.pfirst + node.np;
+            for(int c=1; c<8; c++)
+              s[c] = std::lower_bound(&keys[s[c-1]], &keys[0] + s[8], c,
+                                      [shift](const key_t key, const int c)
+                                      { return (int)((key >> shift) & 7) < c; }) - &keys[0];
+            for(int c=0; c<8; c++)
+              if(s[c+1] > s[c]) nchild++;
+          }
+          offset[k] = nchild;
+        }
 
-    std::vector<Particle> &ptcl = Node::ptcl;
-    ptcl.reserve(Nuse);
-    const int Nin = ptcl_in.size();
-    assert(Nuse <= Nin);
+        int total = 0;
+        for(int k=0; k<nLevel; k++)
+        {
+          const int c = offset[k];
+          offset[k] = total;
+          total += c;
+        }
+        offset[nLevel] = total;
+        nodes.resize(levelEnd + total);
 
-    const float fac = std::max(1.0f, (float)Nin/(float)Nuse);
+#pragma omp parallel for num_threads(nThreads)
+        for(int k=0; k<nLevel; k++)
+        {
+          Node &node  = nodes[levelBegin+k];
+          node.nchild = offset[k+1] - offset[k];
+          if(node.nchild == 0) continue;
+          node.cfirst = levelEnd + offset[k];
+          const int *s = &split[9*k];
+          for(int c=0, child=node.cfirst; c<8; c++)
+            if(s[c+1] > s[c])
+              nodes[child++] = Node(s[c+1] - s[c], node.depth+1, s[c]);
+        }
+        levelBegin = levelEnd;
+      }
+      levels.push_back(nodes.size());
 
+      leaves.clear();
+      for(int i=0; i<(int)nodes.size(); i++)
+        if(nodes[i].is_leaf() && nodes[i].np > 0) leaves.push_back(i);
+      std::sort(leaves.begin(), leaves.end(), cmp_pfirst(nodes));
 
-    /* import particles and compute the Bounding Box */
-    for (int i = 0; i < Nuse; i++)
+      /* the largest nodes with at most NGROUP particles in Morton order,
+       * consecutive children of the same node are merged up to NGROUP */
+      groups.clear();
+      std::vector<std::pair<int, int> > stack(1, std::make_pair(0, -1));
+      int lastParent = -1;
+      while(!stack.empty())
+      {
+        const int parent = stack.back().second;
+        const Node &node = nodes[stack.back().first];
+        stack.pop_back();
+        if(node.np == 0) continue;
+        if(node.np <= NGROUP || node.is_leaf())
+        {
+          if(parent == lastParent && groups.back().np + node.np <= NGROUP)
+            groups.back().np += node.np;
+          else
+            groups.push_back(Node(node.np, node.depth, node.pfirst));
+          lastParent = parent;
+        }
+        else
+        {
+          for(int c=node.cfirst+node.nchild-1; c>=node.cfirst; c--)
+            stack.push_back(std::make_pair(c, &node - &nodes[0]));
+          lastParent = -1;
+        }
+      }
+    }
+
+    struct cmp_pfirst
     {
-      ptcl.push_back(ptcl_in[(int)(i * fac)]);
-      BBox.merge(Boundary(ptcl.back().pos));
+      const std::vector<Node> &nodes;
+      cmp_pfirst(const std::vector<Node> &_nodes) : nodes(_nodes) {}
+      bool operator () (const int a, const int b) const
+      {
+        return nodes[a].pfirst < nodes[b].pfirst;
+      }
+    };
+
+    /* bottom up, the nodes of a level in parallel */
+    void makeInnerBounds()
+    {
+      for(int l=(int)levels.size()-2; l>=0; l--)
+      {
+#pragma omp parallel for num_threads(nThreads)
+        for(int k=levels[l]; k<levels[l+1]; k++)
+        {
+          Node &node = nodes[k];
+          Boundary bound;
+          if(node.is_leaf())
+          {
+            for(int i=node.pfirst; i<node.pfirst+node.np; i++)
+              bound.merge(Boundary(vec3(x[i], y[i], z[i])));
+          }
+          else
+          {
+            for(int c=node.cfirst; c<node.cfirst+node.nchild; c++)
+              bound.merge(nodes[c].bound_inner);
+          }
+          node.bound_inner = bound;
+        }
+      }
     }
-    std::cerr << BBox.min << std::endl;
-    std::cerr << BBox.max << std::endl;
-    const vec3  vsize = BBox.hlen();
-    const float rsize = std::max(vsize.x, std::max(vsize.x, vsize.y)) * 2.0f;
 
-    /* now build the tree */
+    void makeOuterBounds()
+    {
+      for(int l=(int)levels.size()-2; l>=0; l--)
+      {
+#pragma omp parallel for num_threads(nThreads)
+        for(int k=levels[l]; k<levels[l+1]; k++)
+        {
+          Node &node = nodes[k];
+          Boundary bound;
+          if(node.is_leaf())
+          {
+            for(int i=node.pfirst; i<node.pfirst+node.np; i++)
+              bound.merge(Boundary(vec3(x[i], y[i], z[i]), hs[i]));
+          }
+          else
+          {
+            for(int c=node.cfirst; c<node.cfirst+node.nchild; c++)
+              bound.merge(nodes[c].bound_outer);
+          }
+          node.bound_outer = bound;
+        }
+      }
+    }
 
-    const int nbody = Nuse;
+    /* Iterates h of the particles with an output index. hGuess is per input
+     * row, values <= 0 start from the particle density of the leaf cell */
+    void solve(const float *hGuess)
+    {
+      const int n = nptcl;
+      hs   .resize(n);
+      rho  .assign(n, 0.0f);
+      nb   .assign(n, 0);
+      active.resize(n);
 
-    for (int i = 0; i < nbody; i++)
-      ptcl[i].compute_key(BBox.min, rsize);
+#pragma omp parallel for num_threads(nThreads)
+      for(int l=0; l<(int)leaves.size(); l++)
+      {
+        const Node &leaf = nodes[leaves[l]];
+        const float width = 2.0f*rsize / (float)(1 << leaf.depth);
+        const float hCell = hMargin * width * cbrtf(3.0f*Nngb / (4.0f*(float)M_PI*leaf.np));
+        for(int i=leaf.pfirst; i<leaf.pfirst+leaf.np; i++)
+        {
+          const float guess = hGuess ? hGuess[order[i]] : 0.0f;
+          hs    [i] = guess > 0.0f ? guess : hCell;
+          active[i] = out[i] >= 0;
+        }
+      }
 
-    std::sort(ptcl.begin(), ptcl.end(), cmp_particle_key());
+      std::vector<int> work;
+      for(int g=0; g<(int)groups.size(); g++)
+      {
+        const Node &group = groups[g];
+        for(int i=group.pfirst; i<group.pfirst+group.np; i++)
+          if(active[i]) { work.push_back(g); break; }
+      }
+      std::vector<char> busy(work.size());
 
-    Node::Node_heap.push_back(Node());
-    Node &root = Node::Node_heap[0];
-    for (int i = 0; i < nbody; i++)
-      root.push_particle(i, 60);
+      nIter = 0;
+      for(int iter=0; iter<maxIter && !work.empty(); iter++)
+      {
+        nIter++;
+        const bool last  = iter == maxIter-1;
+        const int  nWork = work.size();
+#pragma omp parallel num_threads(nThreads)
+        {
+          SweepBuffers buf;
+#pragma omp for schedule(dynamic, 4)
+          for(int w=0; w<nWork; w++)
+            busy[w] = sweepGroup(groups[work[w]], last, buf);
+        }
 
-#if 1  /* if h's are not know this set-up estimated range */
-    const float volume = rsize*rsize*rsize;
-    root.set_init_h(float(Nngb), volume);
-#endif
-    root.make_boundary();
+        int nBusy = 0;
+        for(int w=0; w<nWork; w++)
+          if(busy[w]) work[nBusy++] = work[w];
+        work.resize(nBusy);
+      }
 
-#ifdef SLOW
+      nUnconverged = 0;
+      for(size_t w=0; w<work.size(); w++)
+      {
+        const Node &group = groups[work[w]];
+        for(int i=group.pfirst; i<group.pfirst+group.np; i++)
+          nUnconverged += active[i];
+      }
+    }
+
+    struct SweepBuffers
+    {
+      std::vector<int>   stack;
+      std::vector<int>   cell;    /* first and last particle of the cells */
+      std::vector<float> box;     /* of the cells, SoA                    */
+      std::vector<float> r2, mc;  /* inside the sphere                    */
+    };
 
-#pragma omp parallel for
-    for(int i=0; i<nbody; i++)
-      ptcl[i] << root;
-#else /* FAST */
+    /* h and density of the active particles of group. The cells within reach
+     * of the group are the candidates of all of them. A sphere that holds
+     * Nngb or fewer grows on the same cells as long as it stays inside the
+     * reach, else in the next sweep with a larger reach. True if the group
+     * still has active particles */
+    bool sweepGroup(const Node &group, const bool last, SweepBuffers &buf)
+    {
+      Boundary reach;
+      for(int i=group.pfirst; i<group.pfirst+group.np; i++)
+        if(active[i]) reach.merge(Boundary(vec3(x[i], y[i], z[i]), hMargin*hs[i]));
 
-#ifdef _OPENMP
-    std::vector<Node *> group_list;
-    root.find_group_Node(2000, group_list);
-#pragma omp parallel for schedule(dynamic)
-    for(int i=0; i<(int)group_list.size(); i++)
-      *group_list[i] << root;
-#else
-    root << root;
-#endif /* _OPENMP */
+      /* the leaves and the nodes of at most NCELL particles in reach */
+      std::vector<int> &cell = buf.cell, &stack = buf.stack;
+      std::vector<float> &box = buf.box;
+      cell.clear();
+      box.clear();
+      stack.clear();
+      stack.push_back(0);
+      int nCand = 0;
+      while(!stack.empty())
+      {
+        const Node &node = nodes[stack.back()];
+        stack.pop_back();
+        if(not_overlapped(node.bound_inner, reach)) continue;
+        if(node.np > NCELL && !node.is_leaf())
+        {
+          for(int c=node.cfirst+node.nchild-1; c>=node.cfirst; c--)
+            stack.push_back(c);
+          continue;
+        }
+        cell.push_back(node.pfirst);
+        cell.push_back(node.pfirst + node.np);
+        nCand += node.np;
+        const Boundary &bound = node.bound_inner;
+        const float b[6] = {bound.min.x, bound.min.y, bound.min.z, bound.max.x, bound.max.y, bound.max.z};
+        box.insert(box.end(), b, b + 6);
+      }
 
-#endif /* SLOW */
+      /* the boxes four at a time, padded with empty ones */
+      const int nCell = cell.size()/2, nc4 = (nCell + 3) & ~3;
+      box.resize(12*nc4);
+      float *bxmin = &box[6*nc4],   *bymin = bxmin + nc4, *bzmin = bymin + nc4;
+      float *bxmax = bzmin + nc4,   *bymax = bxmax + nc4, *bzmax = bymax + nc4;
+      for(int c=0; c<nc4; c++)
+      {
+        const bool pad = c >= nCell;
+        bxmin[c] = pad ?  HUGE_VALF : box[6*c+0];  bxmax[c] = pad ? -HUGE_VALF : box[6*c+3];
+        bymin[c] = pad ?  HUGE_VALF : box[6*c+1];  bymax[c] = pad ? -HUGE_VALF : box[6*c+4];
+        bzmin[c] = pad ?  HUGE_VALF : box[6*c+2];  bzmax[c] = pad ? -HUGE_VALF : box[6*c+5];
+      }
 
-    const double t1 = wtime();
-    fprintf(stderr, " -- Density done in %g sec [ %g ptcl/sec ]\n",  t1 - t0, Nuse/(t1 - t0));
+      buf.r2.resize(nCand + 4);
+      buf.mc.resize(nCand + 4);
+      float *r2c = &buf.r2[0], *mc = &buf.mc[0];
 
-  };
-};
+      const float sigma = 8.0f/(float)M_PI;
+      bool  busy  = false;
+      float hPrev = 0.0f;
+      for(int i=group.pfirst; i<group.pfirst+group.np; i++)
+      {
+        if(!active[i]) continue;
+        const float xi = x[i], yi = y[i], zi = z[i];
+
+        /* the largest sphere that is inside the reach */
+        const float hLimit = std::min(std::min(std::min(xi - reach.min.x, reach.max.x - xi),
+                                               std::min(yi - reach.min.y, reach.max.y - yi)),
+                                               std::min(zi - reach.min.z, reach.max.z - zi));
+        float hi = std::min(hPrev > 0.0f ? hMargin*hPrev : hs[i], hLimit);
+        int   nIn;
+        for(;;)
+        {
+          nIn = gather(xi, yi, zi, hi*hi, buf, nc4, r2c, mc);
+          if(nIn > Nngb) break;
+
+          /* nnb scales with h^3, the margin avoids a second growth for most */
+          const float hNew = hi * hMargin * cbrtf((Nngb + 1.0f) / (float)std::max(nIn, 1));
+          if(hNew > hLimit || last)
+          {
+            if(!last) hs[i] = hNew;
+            break;
+          }
+          hi = hNew;
+        }
+        for(int p=nIn; p<nIn+4; p++) { r2c[p] = HUGE_VALF; mc[p] = 0.0f; }
+
+        if(nIn > Nngb)
+        {
+          /* the Nngb+1 nearest are inside, h goes half way (in h^2) between
+           * the Nngb-th and the Nngb+1-th */
+          float r2Last, r2Next;
+          selectNearest(r2c, nIn, Nngb, hi*hi, r2Last, r2Next);
+          const float h2New = 0.5f*(r2Last + r2Next);
+          const float hNew  = std::sqrt(h2New), hNewInv = 1.0f/hNew;
+          hs [i] = hPrev = hNew;
+          rho[i] = sumKernel(r2c, mc, nIn, h2New, hNewInv) * sigma * hNewInv*hNewInv*hNewInv;
+          nb [i] = countBelow(r2c, nIn, h2New);
+          active[i] = 0;
+        }
+        else
+        {
+          const float hinv = 1.0f/hi;
+          rho[i] = sumKernel(r2c, mc, nIn, hi*hi, hinv) * sigma * hinv*hinv*hinv;
+          nb [i] = nIn;
+          busy   = true;
+        }
+      }
+      return busy;
+    }
+
+    /* r2 of the k-th and k+1-th smallest of the n > k values in r2, all
+     * below h2. A threshold with k values below it is searched by
+     * interpolating the count in r2, with bisection as fallback. If values
+     * share the k-th distance no such threshold exists, then r2Last = r2Next.
+     * r2 is padded with HUGE_VALF to a multiple of 4 */
+    static void selectNearest(const float *r2, const int n, const int k, const float h2,
+                              float &r2Last, float &r2Next)
+    {
+      float lo = 0.0f, hi = h2;
+      int   cLo = 0,   cHi = n;
+      for(int step=0; ; step++)
+      {
+        float t = lo + (hi - lo)*((k + 0.5f - cLo) / (float)(cHi - cLo));
+        if(!(t > lo && t < hi) || (step >= 4 && (step & 1))) t = 0.5f*(lo + hi);
+        if(!(t > lo && t < hi))
+        {
+          minMax(r2, n, lo, r2Last, r2Next);
+          r2Last = r2Next;
+          return;
+        }
+
+        const int c = countBelow(r2, n, t);
+        if(c == k)
+        {
+          minMax(r2, n, t, r2Last, r2Next);
+          return;
+        }
+        if(c < k) { lo = t; cLo = c; }
+        else      { hi = t; cHi = c; }
+      }
+    }
+
+    /* the cubic spline of Wkernel as 2 max(1-q,0)^3 - 8 max(0.5-q,0)^3 */
+    static v4sf wkernel4(const v4sf q)
+    {
+      const v4sf zero = _mm_setzero_ps();
+      const v4sf a    = _mm_max_ps(_mm_sub_ps(_mm_set1_ps(1.0f), q), zero);
+      const v4sf b    = _mm_max_ps(_mm_sub_ps(_mm_set1_ps(0.5f), q), zero);
+      return _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(2.0f), _mm_mul_ps(a, _mm_mul_ps(a, a))),
+                        _mm_mul_ps(_mm_set1_ps(8.0f), _mm_mul_ps(b, _mm_mul_ps(b, b))));
+    }
+
+    static float hsum(const v4sf v)
+    {
+      float s[4];
+      _mm_storeu_ps(s, v);
+      return (s[0] + s[1]) + (s[2] + s[3]);
+    }
+
+    /* number of r2 below t, the arrays are padded to a multiple of 4 */
+    static int countBelow(const float *r2, const int n, const float t)
+    {
+      const v4sf vt = _mm_set1_ps(t);
+      int count = 0;
+      for(int k=0; k<n; k+=4)
+        count += __builtin_popcount(_mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(r2+k), vt)));
+      return count;
+    }
 
+    /* the largest r2 below t and the smallest at or above it */
+    static void minMax(const float *r2, const int n, const float t, float &below, float &above)
+    {
+      const v4sf vt = _mm_set1_ps(t);
+      v4sf vb = _mm_setzero_ps(), va = _mm_set1_ps(HUGE_VALF);
+      for(int k=0; k<n; k+=4)
+      {
+        const v4sf vr2 = _mm_loadu_ps(r2+k);
+        const v4sf lt  = _mm_cmplt_ps(vr2, vt);
+        vb = _mm_max_ps(vb, _mm_and_ps   (lt, vr2));
+        va = _mm_min_ps(va, _mm_blendv_ps(vr2, va, lt));
+      }
+      float sb[4], sa[4];
+      _mm_storeu_ps(sb, vb);
+      _mm_storeu_ps(sa, va);
+      below = std::max(std::max(sb[0], sb[1]), std::max(sb[2], sb[3]));
+      above = std::min(std::min(sa[0], sa[1]), std::min(sa[2], sa[3]));
+    }
+
+    static float sumKernel(const float *r2, const float *m, const int n, const float h2, const float hinv)
+    {
+      const v4sf vh2 = _mm_set1_ps(h2), vhinv = _mm_set1_ps(hinv);
+      v4sf sum = _mm_setzero_ps();
+      for(int k=0; k<n; k+=4)
+      {
+        const v4sf vr2 = _mm_loadu_ps(r2+k);
+        const v4sf w   = wkernel4(_mm_mul_ps(_mm_sqrt_ps(_mm_min_ps(vr2, vh2)), vhinv));
+        sum = _mm_add_ps(sum, _mm_and_ps(_mm_cmplt_ps(vr2, vh2), _mm_mul_ps(_mm_loadu_ps(m+k), w)));
+      }
+      return hsum(sum);
+    }
+
+    /* r2 and m of the particles inside h2, stored consecutively for the
+     * selection of the nearest neighbours. The cells whose box is within h
+     * are found four at a time, their particles are tested and packed four at
+     * a time without branches. The rows are padded, the last vector of a
+     * cell reads past it and is masked */
+    int gather(const float xi, const float yi, const float zi, const float h2,
+               const SweepBuffers &buf, const int nc4, float *r2out, float *mout) const
+    {
+      static const struct PackTable
+      {
+        __m128i shuffle[16];
+        PackTable()
+        {
+          for(int mask=0; mask<16; mask++)
+          {
+            char idx[16];
+            int  n = 0;
+            for(int b=0; b<4; b++)
+              if(mask & (1 << b))
+              {
+                for(int c=0; c<4; c++) idx[4*n+c] = 4*b+c;
+                n++;
+              }
+            for(int c=4*n; c<16; c++) idx[c] = (char)0x80;
+            shuffle[mask] = _mm_loadu_si128((const __m128i*)idx);
+          }
+        }
+      } pack;
+
+      const float *bxmin = &buf.box[6*nc4],  *bymin = bxmin + nc4, *bzmin = bymin + nc4;
+      const float *bxmax = bzmin + nc4,      *bymax = bxmax + nc4, *bzmax = bymax + nc4;
+      const float *xj = &x[0], *yj = &y[0], *zj = &z[0], *mj = &m[0];
+      const int   *cell = &buf.cell[0];
+      const v4sf vxi = _mm_set1_ps(xi);
+      const v4sf vyi = _mm_set1_ps(yi);
+      const v4sf vzi = _mm_set1_ps(zi);
+      const v4sf vh2 = _mm_set1_ps(h2), zero = _mm_setzero_ps();
+      const __m128i lane = _mm_set_epi32(3, 2, 1, 0);
+
+      int n = 0;
+      for(int c=0; c<nc4; c+=4)
+      {
+        const v4sf bx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(bxmin+c), vxi),
+                                              _mm_sub_ps(vxi, _mm_loadu_ps(bxmax+c))), zero);
+        const v4sf by = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(bymin+c), vyi),
+                                              _mm_sub_ps(vyi, _mm_loadu_ps(bymax+c))), zero);
+        const v4sf bz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(bzmin+c), vzi),
+                                              _mm_sub_ps(vzi, _mm_loadu_ps(bzmax+c))), zero);
+        const v4sf d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(bx, bx), _mm_mul_ps(by, by)), _mm_mul_ps(bz, bz));
+        for(int cells = _mm_movemask_ps(_mm_cmplt_ps(d2, vh2)); cells; cells &= cells-1)
+        {
+          const int k  = c + __builtin_ctz(cells);
+          const int jb = cell[2*k], je = cell[2*k+1];
+          const __m128i vje = _mm_set1_epi32(je);
+          for(int j=jb; j<je; j+=4)
+          {
+            const v4sf dx = _mm_sub_ps(_mm_loadu_ps(xj+j), vxi);
+            const v4sf dy = _mm_sub_ps(_mm_loadu_ps(yj+j), vyi);
+            const v4sf dz = _mm_sub_ps(_mm_loadu_ps(zj+j), vzi);
+            const v4sf r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+            const v4sf in = _mm_and_ps(_mm_cmplt_ps(r2, vh2),
+                                       _mm_castsi128_ps(_mm_cmplt_epi32(_mm_add_epi32(_mm_set1_epi32(j), lane), vje)));
+            const int mask = _mm_movemask_ps(in);
+            const __m128i shuffle = pack.shuffle[mask];
+            _mm_storeu_ps(r2out+n, _mm_castsi128_ps(_mm_shuffle_epi8(_mm_castps_si128(r2), shuffle)));
+            _mm_storeu_ps(mout +n, _mm_castsi128_ps(_mm_shuffle_epi8(_mm_castps_si128(_mm_loadu_ps(mj+j)), shuffle)));
+            n += __builtin_popcount(mask);
+          }
+        }
+      }
+      return n;
+    }
+
+    void scatter(float *h, float *density, int *nnb) const
+    {
+#pragma omp parallel for num_threads(nThreads)
+      for(int i=0; i<nptcl; i++)
+      {
+        const int k = out[i];
+        if(k < 0) continue;
+        h      [k] = hs [i];
+        density[k] = rho[i];
+        if(nnb) nnb[k] = nb[i];
+      }
+    }
+
+#ifdef USE_MPI
+    /* particles inside bound */
+    void findInside(const Boundary &bound, std::vector<int> &list) const
+    {
+      std::vector<int> stack(1, 0);
+      while(!stack.empty())
+      {
+        const Node &node = nodes[stack.back()];
+        stack.pop_back();
+        if(node.np == 0 || not_overlapped(node.bound_inner, bound)) continue;
+        if(node.is_leaf())
+        {
+          for(int i=node.pfirst; i<node.pfirst+node.np; i++)
+            if(overlapped(Boundary(vec3(x[i], y[i], z[i])), bound)) list.push_back(i);
+        }
+        else
+        {
+          for(int c=node.cfirst; c<node.cfirst+node.nchild; c++) stack.push_back(c);
+        }
+      }
+    }
+
+    /* particles whose sphere overlaps bound, needs makeOuterBounds() */
+    void findReaching(const Boundary &bound, std::vector<int> &list) const
+    {
+      std::vector<int> stack(1, 0);
+      while(!stack.empty())
+      {
+        const Node &node = nodes[stack.back()];
+        stack.pop_back();
+        if(node.np == 0 || not_overlapped(node.bound_outer, bound)) continue;
+        if(node.is_leaf())
+        {
+          for(int i=node.pfirst; i<node.pfirst+node.np; i++)
+            if(overlapped(Boundary(vec3(x[i], y[i], z[i]), hs[i]), bound)) list.push_back(i);
+        }
+        else
+        {
+          for(int c=node.cfirst; c<node.cfirst+node.nchild; c++) stack.push_back(c);
+        }
+      }
+    }
+#endif
+};
 
 #endif /* __DENSITY_H__ */
@@ -1,74 +1,52 @@
+#include <cstdio>
 #include "read_tipsy.h"
 #include "density.h"
 
-
-std::vector<Particle> Node::ptcl;
-std::vector<Node>     Node::Node_heap;
-std::vector<std::pair<Node*, Node*> > Node::pair_list;
-
 int main(int argc, char * argv[])
 {
   ReadTipsy data;
-  Particle::Vector ptcl_star, ptcl_dm;
 
   const int nbody = data.NTotal;
 
-  ptcl_dm  .reserve(nbody);
-  ptcl_star.reserve(nbody);
-
+  /* star particles, DM would be IDs >= 200e6 with Nngb = 64 */
+  std::vector<float> posm;
+  posm.reserve(4*nbody);
   for(int i=0; i<nbody; i++)
   {
-    const vec3 pos = vec3(data.positions[i].x, data.positions[i].y, data.positions[i].z);
-    if (data.IDs[i] < (int)200e6) 
-      ptcl_star.push_back(Particle(i, pos, 1.0, 0.0));
-    else
-      ptcl_dm.push_back(Particle(i, pos, 1.0, 0.0));
+    if (data.IDs[i] >= (int)200e6) continue;
+    posm.push_back(data.positions[i].x);
+    posm.push_back(data.positions[i].y);
+    posm.push_back(data.positions[i].z);
+    posm.push_back(data.positions[i].w);
   }
-  fprintf(stderr, "nbody= %d : star= %d  DM= %d\n", nbody,
-      (int)ptcl_star.size(),
-      (int)ptcl_dm  .size());
+  const int N = posm.size()/4;
+  fprintf(stderr, "nbody= %d : star= %d  DM= %d\n", nbody, N, nbody - N);
 
+  std::vector<float> h(N, 0.0f), dens(N);
+  std::vector<int>   nnb(N);
 
-  Node::allocate(nbody, nbody);
-  const int Ndesired = 100000;
-#if 1
-  const int N = std::min(Ndesired, (int)ptcl_star.size());
-  Density density(ptcl_star, N);
-#else
-  const int N = std::min(Ndesired, (int)ptcl_dm.size());
-  Density density(ptcl_dm, N, 64);
-#endif
+  Density density(32);
+  const double t0 = wtime();
+  density.compute(N, posm.empty() ? NULL : &posm[0], &h[0], &dens[0], &nnb[0]);
+  const double t1 = wtime();
+  fprintf(stderr, " -- Density done in %g sec [ %g ptcl/sec ]  iterations= %d  unconverged= %d\n",
+      t1 - t0, N/(t1 - t0), density.iterations(), density.unconverged());
 
-  int ngb_min = nbody;
+  int ngb_min = N;
   int ngb_max = 0;
   double ngb_mean = 0;
   double ngb_mean2 = 0;
 
-  int imax = 0;
   for (int i = 0; i < N; i++)
   {
-    std::vector<Particle> &ptcl = Node::ptcl;
-    const Particle &p = ptcl[i];
-
-    if (p.nnb > 128)
-    {
-#if 0
-      fprintf(stderr, "i= %d: nnb_exact= %d  nnb_compute= %d  h= %g pos= %g %g %g\n",
-          i, nnb[ID], p.nnb, p.h, p.pos.x, p.pos.y, p.pos.z);
-#endif
-      imax++;
-    }
-
-    ngb_min = std::min(ngb_min, p.nnb);
-    ngb_max = std::max(ngb_max, p.nnb);
-    ngb_mean  += p.nnb;
-    ngb_mean2 += p.nnb*p.nnb;
-    fprintf(stdout, " %d  %g %g %g   %g \n", p.ID, p.pos.x, p.pos.y, p.pos.z, p.density);
-
+    ngb_min = std::min(ngb_min, nnb[i]);
+    ngb_max = std::max(ngb_max, nnb[i]);
+    ngb_mean  += nnb[i];
+    ngb_mean2 += (double)nnb[i]*nnb[i];
+    fprintf(stdout, " %d  %g %g %g   %g %g \n", i, posm[4*i+0], posm[4*i+1], posm[4*i+2], h[i], dens[i]);
   }
-  ngb_mean  *= 1.0/(float)nbody;
-  ngb_mean2 *= 1.0/(float)nbody;
-  fprintf(stderr, " imax= %d \n", imax);
+  ngb_mean  *= 1.0/(float)N;
+  ngb_mean2 *= 1.0/(float)N;
   fprintf(stderr, " nmin= %d  nmax= %d   nmean= %g  <sigma>= %g\n",
       ngb_min, ngb_max,
       ngb_mean,
@@ -76,5 +54,3 @@ int main(int argc, char * argv[])
 
   return 0;
 }
-
-
@@ -1,7 +1,12 @@
+#ifndef __WTIME_H__
+#define __WTIME_H__
+
 #include <sys/time.h>
 
-double wtime(){
+inline double wtime(){
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
 	return tv.tv_sec + 1.e-6 * tv.tv_usec;
 }
+
+#endif /* __WTIME_H__ */
@@ -0,0 +1,69 @@
+/*
+ * StatsServer.h
+ *
+ * Live performance queries of a running simulation.
+ */
+
+#ifndef STATSSERVER_H_
+#define STATSSERVER_H_
+
+#include "telemetry.h"
+#include "jsoncons/json.hpp"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Stats endpoint
+ * - TCP socket with JSON requests, the same protocol as the WOGManager
+ * - Served by a monitoring thread, a query only copies records from the
+ *   telemetry history and never waits on the simulation loop
+ * - Runs on process 0, with more processes it reports the aggregate records
+ *
+ * Tasks: {"task": "stats"} summary of the last steps,
+ *        {"task": "history", "steps": n} the last n step records
+ */
+class StatsServer
+{
+ public:
+
+  /// Constructor opening the server socket and starting the monitoring thread
+  StatsServer(Telemetry const& telemetry, int port, int nProcs);
+
+  /// Destructor stopping the thread and closing the sockets
+  ~StatsServer();
+
+ private:
+
+  /// Accept clients and answer their requests until stopped
+  void serve();
+
+  /// Execute a client request
+  jsoncons::json execute_json(std::string const& buffer) const;
+
+  /// JSON object of a single step record
+  jsoncons::json record_json(TelemetryRecord const& rec) const;
+
+  Telemetry const& telemetry;
+
+  /// Rank of the records that are reported, -1 for the aggregate
+  int rank;
+
+  int server_socket;
+
+  std::vector<int> client_sockets;
+
+  std::atomic<bool> stop;
+
+  std::thread monitor;
+
+  /// Maximal number of connected clients
+  static constexpr auto max_number_of_clients = 8;
+
+  /// Buffer size for socket data transmission
+  static constexpr auto buffer_size = 1024;
+
+};
+
+#endif /* STATSSERVER_H_ */
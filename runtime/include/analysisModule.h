@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vector_types.h>
+
+//Interface of the in-situ analysis modules, run by the AnalysisScheduler.
+//
+//A run of a module covers the particles of one output time:
+//  begin()          on the main thread, before any batch
+//  consume()        once per batch on the pool threads, batches with a
+//                   different slot run concurrently. A slot is only used by one
+//                   thread at a time, it indexes the private accumulators
+//  merge()          once, on the pool thread that consumed the last batch
+//  reduceAndEmit()  on the main thread of every process at the same step,
+//                   MPI collectives are allowed
+//
+//Modules only see host arrays, they can be driven by synthetic particles
+//without a GPU
+
+//Host copy of the octree of the staged particles, in the layout of the device
+//tree: the nodes of level l are levels[l].x <= node < levels[l].y. A node is
+//a leaf if centre.w <= 0, the int in size.w is then its first particle |
+//(count-1) << LEAFBIT, otherwise its first child | nchild << 28. The boxes are
+//those of the last tree properties and may lag the staged positions
+struct AnalysisTree
+{
+  int           nNodes, nLevels;
+  const float4 *centre;
+  const float4 *size;
+  const uint2  *levels;
+};
+
+struct ParticleBatch
+{
+  int           n;
+  const float4 *pos;
+  const float4 *vel;
+  const int    *ids;
+  int                 first;    //Index of pos[0] in the staged particles
+  const AnalysisTree *tree;     //NULL unless a module of the run needsTree()
+};
+
+class AnalysisModule
+{
+  public:
+    virtual ~AnalysisModule() {}
+
+    virtual const char *name() const = 0;
+
+    //Whether the batches have to carry the tree
+    virtual bool needsTree() const { return false; }
+
+    //Starts a run at N-body time with nSlots private accumulators
+    virtual void begin(const int nSlots, const double time) = 0;
+
+    //Adds the particles of batch to the accumulators of slot
+    virtual void consume(const ParticleBatch &batch, const int slot) = 0;
+
+    //Combines the accumulators of the slots
+    virtual void merge() = 0;
+
+    //Sums over the processes, process 0 writes the output. Collective
+    virtual void reduceAndEmit(const int procId) = 0;
+};
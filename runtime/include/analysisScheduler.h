@@ -0,0 +1,114 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include "analysisModule.h"
+
+//Runs the registered analysis modules, each at its own cadence in N-body
+//time, on a fixed pool of host threads while the simulation continues.
+//
+//The particles of an output time are copied once into a staging buffer
+//(pinned when the allocator is cudaMallocHost, so the device copies straight
+//into it) that all modules due at that time read in batches. The number of
+//staging buffers is bounded. A run that has not finished when its module is
+//due again, or a due time without a free buffer, skips that output instead of
+//waiting: the simulation never blocks on the analysis. Whether a run finished
+//is agreed between the processes, so all of them skip and reduce the same runs.
+//
+//Per step on the main thread of every process:
+//  if(scheduler->poll(t))          //Collective while runs are in flight
+//  {
+//    AnalysisBuffer &buf = scheduler->buffer(n, scheduler->treeWanted() ? nNodes : 0);
+//    ...fill buf.pos, buf.vel, buf.ids and, with nodes, buf.nodeCentre,
+//       buf.nodeSize and buf.levels...
+//    scheduler->launch();
+//  }
+
+struct AnalysisBuffer
+{
+  int     n, capacity;
+  float4 *pos, *vel;
+  int    *ids;
+  int     users;          //Runs that still read the buffer
+
+  int     nNodes, nodeCapacity;
+  float4 *nodeCentre, *nodeSize;
+  std::vector<uint2> levels;
+  AnalysisTree       tree;  //View of the above handed to the modules
+};
+
+class AnalysisScheduler
+{
+  public:
+    typedef void *(*HostAlloc)(size_t bytes);
+    typedef void  (*HostFree) (void *ptr);
+
+    AnalysisScheduler(const int procId, const int nProcs, const int nThreads, const int nBuffers,
+                      HostAlloc hostAlloc, HostFree hostFree);
+
+    //Stops the pool, unfinished runs are dropped without their reduction
+    ~AnalysisScheduler();
+
+    //Takes ownership of module, the first output is at the first poll()
+    void addModule(AnalysisModule *module, const double interval);
+
+    //Completes the runs that finished on all processes and selects the modules
+    //due at time t. True if they can run, the caller then fills buffer() and
+    //calls launch(). Collective while runs are in flight
+    bool poll(const double t);
+
+    //True if a module selected by poll() needs the tree
+    bool treeWanted() const;
+
+    //The free staging buffer selected by poll(), with room for n particles
+    //and nNodes tree nodes
+    AnalysisBuffer &buffer(const int n, const int nNodes = 0);
+
+    //Starts the due modules on the filled buffer
+    void launch();
+
+    //Waits for all runs and completes them. Collective
+    void finish();
+
+  private:
+    struct Run
+    {
+      AnalysisModule  *module;
+      double           interval, nextTime;
+      bool             started;       //nextTime is valid
+      bool             inFlight, due;
+      int              buffer;
+      double           time;
+      std::atomic<int> remaining;     //Batches not yet consumed
+      bool             merged;        //Done on this process, guarded by mutex
+      int              skipped;
+    };
+
+    struct Task
+    {
+      int run, begin, end;
+    };
+
+    void work(const int slot);
+    void complete(const int r);
+    void collectFinished(std::vector<int> &finished);
+
+    const int procId, nProcs, nThreads;
+    HostAlloc hostAlloc;
+    HostFree  hostFree;
+
+    std::vector<Run*>           runs;
+    std::vector<AnalysisBuffer> buffers;
+    int                         freeBuffer;   //Selected by poll(), -1 if none
+    double                      dueTime;
+
+    std::vector<std::thread>    pool;
+    std::deque<Task>            tasks;
+    std::mutex                  mutex;
+    std::condition_variable     taskReady, runDone;
+    bool                        stop;
+};
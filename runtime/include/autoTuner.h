@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+//Runtime tuning of performance knobs (thread counts, launch sizes, rebuild
+//interval). The thread counts and launch sizes do not change the results, the
+//rebuild rate does: a refitted tree has other cells than a rebuilt one, so the
+//forces differ at the level of the tree error. During the first budget steps every
+//knob is hill-climbed over its candidate values while the other knobs stay
+//fixed, each trial runs trialSteps steps and is scored by the mean step time,
+//the maximum over the processes. All processes therefore take the same
+//decisions. The best configuration is kept for the rest of the run and
+//written to the tuning file, a later run with the same machine key and a
+//similar particle count loads it and skips the search.
+
+class AutoTuner
+{
+  public:
+    AutoTuner(const std::string &fileName, const std::string &machineKey,
+              const int procId, const int nProcs, const long long nTotal,
+              const int budget, const int trialSteps);
+
+    //Candidates in increasing order, *value is set to the best one found
+    void addKnob(const std::string &name, int *value, std::vector<int> candidates);
+
+    //Loads the tuning file, true if it matched and the knobs were set
+    bool load();
+
+    //Called once per step with the step time of this process. Collective
+    //at the end of every trial
+    void step(const double stepTime);
+
+    bool finished() const { return state == DONE; }
+
+  private:
+    struct Knob
+    {
+      std::string      name;
+      int             *value;
+      std::vector<int> candidates;
+      int              best;        //Index of the best candidate
+      double           bestTime;
+    };
+
+    enum State { WARMUP, SEARCH, DONE };
+
+    const std::string fileName, machineKey;
+    const int         procId, nProcs;
+    const long long   nTotal;
+    const int         budget, trialSteps;
+
+    std::vector<Knob> knobs;
+    State  state;
+    int    nSteps;                  //Steps since the start of the tuning
+    int    trialStep;               //Steps into the current trial
+    double trialTime;
+
+    int    knob;                    //Knob that is being climbed
+    int    trial;                   //Candidate index of the current trial
+    int    direction;               //+1 up, -1 down, 0 measuring the start value
+    int    climbStart;              //Candidate index the climb of this knob started from
+
+    void startKnob(const double startTime);
+    void nextTrial(const double time);
+    bool moveTo(const int idx);
+    void finish();
+    void save() const;
+};
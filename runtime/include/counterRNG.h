@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+
+//Philox4x32-10 counter based generator (Salmon et al., "Parallel random
+//numbers: as easy as 1, 2, 3", SC11). The output is a pure function of the
+//key and the counter, so a stream per particle, keyed by the seed and
+//counted by the particle index, gives the same numbers whichever thread or
+//process draws them.
+//
+//  PhiloxStream rng(seed, index);
+//  const double u = rng.uniform();   //in (0,1)
+
+struct Philox4x32
+{
+  static void mulhilo(const uint32_t a, const uint32_t b, uint32_t &hi, uint32_t &lo)
+  {
+    const uint64_t p = (uint64_t)a*b;
+    hi = (uint32_t)(p >> 32);
+    lo = (uint32_t)p;
+  }
+
+  //Ten rounds on ctr with key k, in place
+  static void generate(uint32_t ctr[4], const uint32_t k[2])
+  {
+    uint32_t k0 = k[0], k1 = k[1];
+    for(int round = 0; round < 10; round++)
+    {
+      uint32_t hi0, lo0, hi1, lo1;
+      mulhilo(0xD2511F53u, ctr[0], hi0, lo0);
+      mulhilo(0xCD9E8D57u, ctr[2], hi1, lo1);
+      const uint32_t c0 = hi1 ^ ctr[1] ^ k0;
+      const uint32_t c2 = hi0 ^ ctr[3] ^ k1;
+      ctr[0] = c0; ctr[1] = lo1;
+      ctr[2] = c2; ctr[3] = lo0;
+      k0 += 0x9E3779B9u;
+      k1 += 0xBB67AE85u;
+    }
+  }
+};
+
+//Sequence of uniform deviates of one stream: the counter is (stream, block)
+//and every block of four words gives two doubles with 53 random bits
+class PhiloxStream
+{
+  public:
+    PhiloxStream(const uint32_t seed, const uint64_t stream) : block(0), used(4)
+    {
+      key[0]  = seed;
+      key[1]  = 0x5A17B05Eu;
+      lo      = (uint32_t)stream;
+      hi      = (uint32_t)(stream >> 32);
+    }
+
+    //Uniform in the open interval (0,1)
+    double uniform()
+    {
+      if(used == 4)
+      {
+        words[0] = lo; words[1] = hi;
+        words[2] = block++; words[3] = 0;
+        Philox4x32::generate(words, key);
+        used = 0;
+      }
+      const uint64_t a = words[used++] >> 5;
+      const uint64_t b = words[used++] >> 6;
+      return ((a << 26 | b) + 0.5) * (1.0/9007199254740992.0);
+    }
+
+  private:
+    uint32_t key[2];
+    uint32_t lo, hi;
+    uint32_t block;
+    uint32_t words[4];
+    int      used;
+};
@@ -12,6 +12,7 @@
 #include <cassert>
 #include <mpi.h>
 #include <vector>
+#include "perfCounters.h"
 
 struct DD2D
 {
@@ -250,11 +251,14 @@ struct DD2D
     std::vector<Key> boundaries1d(nPx, Key::min());
     if (procId == 0)
     {
+      {
+        PERF_SCOPE(PERF_SAMPLE_SORT);
 #ifdef PARALLELSORT
-      __gnu_parallel::sort(keys1d_recv.begin(), keys1d_recv.end(), Key());
+        __gnu_parallel::sort(keys1d_recv.begin(), keys1d_recv.end(), Key());
 #else
-      std::sort(keys1d_recv.begin(), keys1d_recv.end(), Key());
+        std::sort(keys1d_recv.begin(), keys1d_recv.end(), Key());
 #endif
+      }
       chopSortedKeys(nPx, Key::min(), keys1d_recv, boundaries1d);
     }
 
@@ -306,11 +310,14 @@ struct DD2D
     std::vector<Key> boundaries2d(npy);
     if (procId < nPx)
     {
+      {
+        PERF_SCOPE(PERF_SAMPLE_SORT);
 #ifdef PARALLELSORT
-      __gnu_parallel::sort(keys2d_recv.begin(), keys2d_recv.end(), Key());
+        __gnu_parallel::sort(keys2d_recv.begin(), keys2d_recv.end(), Key());
 #else
-      std::sort(keys2d_recv.begin(), keys2d_recv.end(), Key());
+        std::sort(keys2d_recv.begin(), keys2d_recv.end(), Key());
 #endif
+      }
       const Key minkey = boundaries1d[procId];
       chopSortedKeys(npy, minkey, keys2d_recv, boundaries2d);
     }
@@ -46,8 +46,9 @@ extern "C" void  (split_move)( uint2 *valid, uint *output, uint *counts,  const
 extern "C" void  (compact_move)( uint2 *values, uint *output,  uint *counts,  const int N,setupParams2 sParam,const uint *workToDo);
 extern "C" void  (compact_count)(volatile uint2 *values,uint *counts, const int N, setupParams2 sParam,const uint *workToDo);
 extern "C" void  (exclusive_scan_block)(int *ptr, const int N, int *count);
-extern "C" void  (correct_dust_particles)(const int n_bodies, float dt_cb, uint   *active_list, real4 *vel, real4 *acc0, real4 *acc1);
-extern "C" void  (predict_dust_particles)(const int n_bodies, float tc, float tp, real4 *pos, real4 *vel, real4 *acc, uint  *body2grouplist, uint  *valid_list);
+extern "C" void  (correct_dust_particles)(const int n_bodies, float tc, float dt_base, float eta_eps, int max_level, int all_active, float2 *time, uint   *active_list, real4 *vel, real4 *acc0, real4 *acc1);
+extern "C" void  (predict_dust_particles)(const int n_bodies, float tc, float tp, real4 *pos, real4 *vel, real4 *acc);
+extern "C" void  (set_active_dust_groups)(const int n_bodies, float tc, float dt_base, float2 *time, uint  *body2grouplist, uint  *valid_list);
 extern "C" void  (store_dust_groups)(int n_groups, uint  *validList, uint  *body2group_list, uint2 *group_list, uint  *activeDustGroups);
 extern "C" void  (define_dust_groups)(int n_particles, real4  *dust_pos, uint  *validList);
 extern "C" void  (store_group_list)(int    n_particles, int n_groups, uint  *validList, uint  *body2group_list, uint2 *group_list);
@@ -61,8 +62,29 @@ extern "C" void  (gpu_setPHGroupData)(const int n_groups, const int n_particles,
 extern "C" void  (compute_scaling)(const int node_count, double4 *multipole, real4 *nodeLowerBounds, real4 *nodeUpperBounds, uint  *n_children, real4 *multipoleF, float theta, real4 *boxSizeInfo, real4 *boxCenterInfo, uint2 *node_bodies);
 extern "C" void  (compute_non_leaf)(const int curLevel, uint  *leafsIdxs, uint  *node_level_list, uint  *n_children, double4 *multipole, real4 *nodeLowerBounds, real4 *nodeUpperBounds);
 extern "C" void  (compute_energy_double)(const int n_bodies, real4 *pos, real4 *vel, real4 *acc, double2 *energy);
+#ifdef DOUBLE_ACCUMULATION
+extern "C" void  (correct_particles)(const int n_bodies, float tc, float2 *time,                                                                              uint   *active_list, real4 *vel, real4 *acc0, real4 *acc1, real4 *pos, real4 *pPos, real4 *pVel, uint  *unsorted, real4 *acc0_new, float2 *time_new, int *pIDS, real4 *specialParticles, real4 *posLo, real4 *velLo, real4 *pPosLo, real4 *pVelLo);
+#else
 extern "C" void  (correct_particles)(const int n_bodies, float tc, float2 *time,                                                                              uint   *active_list, real4 *vel, real4 *acc0, real4 *acc1, real4 *pos, real4 *pPos, real4 *pVel, uint  *unsorted, real4 *acc0_new, float2 *time_new, int *pIDS, real4 *specialParticles);
+#endif
+#ifdef PERIODIC
+#ifdef DOUBLE_ACCUMULATION
+extern "C" void  (predict_particles)(const int n_bodies, float tc, float tp, real4 *pos, real4 *vel, real4 *acc, float2 *time, real4 *pPos, real4 *pVel, const float periodicBoxSize, real4 *posLo, real4 *velLo, real4 *pPosLo, real4 *pVelLo);
+#else
+extern "C" void  (predict_particles)(const int n_bodies, float tc, float tp, real4 *pos, real4 *vel, real4 *acc, float2 *time, real4 *pPos, real4 *pVel, const float periodicBoxSize);
+#endif
+extern "C" void  (ewald_correction)(const int n_bodies, const int n_sources, const int stride, const float boxSize, real4 *body_pos, real4 *sources, real4 *table, real4 *acc);
+extern "C" void  gpu_setPeriodicBoxSize(const float boxSize);
+#ifdef TREEPM
+extern "C" void  gpu_setTreePMSplit(const float rs, const float rcut);
+#endif
+#else
+#ifdef DOUBLE_ACCUMULATION
+extern "C" void  (predict_particles)(const int n_bodies, float tc, float tp, real4 *pos, real4 *vel, real4 *acc, float2 *time, real4 *pPos, real4 *pVel, real4 *posLo, real4 *velLo, real4 *pPosLo, real4 *pVelLo);
+#else
 extern "C" void  (predict_particles)(const int n_bodies, float tc, float tp, real4 *pos, real4 *vel, real4 *acc, float2 *time, real4 *pPos, real4 *pVel);
+#endif
+#endif
 extern "C" void  (get_nactive)(const int n_bodies, uint *valid, uint *tnact);
 extern "C" void  (get_Tnext)(const int n_bodies, float2 *time, float *tnext);
 extern "C" void  (setActiveGroups)(const int n_bodies, float tc, float2 *time,uint  *body2grouplist, uint  *valid_list);
@@ -91,12 +113,24 @@ extern "C" void  (gpu_internalMove)(int n_extract, int       n_bodies,double4  x
 extern "C" void  (gpu_insertNewParticles)(int       n_extract, int       n_insert, int       n_oldbodies, int       offset, real4     *Ppos, real4     *Pvel, real4     *pos, real4     *vel, real4     *acc0, real4     *acc1, float2    *time, int       *body_id, bodyStruct *source);
 
 extern "C" void  (gpu_internalMoveSFC) (int       n_extract, int       n_bodies, uint4  lowBoundary, uint4  highBoundary, int       *extractList, int       *indexList, real4     *Ppos, real4     *Pvel, real4     *pos, real4     *vel, real4     *acc0, real4     *acc1, float2    *time, int       *body_id, uint4     *body_key);
+#ifdef DOUBLE_ACCUMULATION
+extern "C" void  (gpu_internalMoveSFC2) (int       n_extract, int       n_bodies, uint4  lowBoundary, uint4  highBoundary, int2       *extractList, int       *indexList, real4     *Ppos, real4     *Pvel, real4     *pos, real4     *vel, real4     *acc0, real4     *acc1, float2    *time, int       *body_id, uint4     *body_key, real4 *PposLo, real4 *PvelLo);
+#else
 extern "C" void  (gpu_internalMoveSFC2) (int       n_extract, int       n_bodies, uint4  lowBoundary, uint4  highBoundary, int2       *extractList, int       *indexList, real4     *Ppos, real4     *Pvel, real4     *pos, real4     *vel, real4     *acc0, real4     *acc1, float2    *time, int       *body_id, uint4     *body_key);
+#endif
 
 extern "C" void  (gpu_extractOutOfDomainParticlesAdvancedSFC)(int offset, int n_extract, int *extractList, real4 *Ppos, real4 *Pvel, real4 *pos, real4 *vel, real4 *acc0, real4 *acc1, float2 *time, int   *body_id, uint4 *body_key, bodyStruct *destination);
+#ifdef DOUBLE_ACCUMULATION
+extern "C" void  (gpu_extractOutOfDomainParticlesAdvancedSFC2)(int offset, int n_extract, uint2 *extractList, real4 *Ppos, real4 *Pvel, real4 *pos, real4 *vel, real4 *acc0, real4 *acc1, float2 *time, int   *body_id, uint4 *body_key, bodyStruct *destination, real4 *PposLo, real4 *PvelLo);
+#else
 extern "C" void  (gpu_extractOutOfDomainParticlesAdvancedSFC2)(int offset, int n_extract, uint2 *extractList, real4 *Ppos, real4 *Pvel, real4 *pos, real4 *vel, real4 *acc0, real4 *acc1, float2 *time, int   *body_id, uint4 *body_key, bodyStruct *destination);
+#endif
 
+#ifdef DOUBLE_ACCUMULATION
+extern "C" void  (gpu_insertNewParticlesSFC)(int       n_extract, int       n_insert, int       n_oldbodies, int       offset, real4     *Ppos, real4     *Pvel, real4     *pos, real4     *vel, real4     *acc0, real4     *acc1, float2    *time, int       *body_id, uint4     *body_key, bodyStruct *source, real4 *PposLo, real4 *PvelLo);
+#else
 extern "C" void  (gpu_insertNewParticlesSFC)(int       n_extract, int       n_insert, int       n_oldbodies, int       offset, real4     *Ppos, real4     *Pvel, real4     *pos, real4     *vel, real4     *acc0, real4     *acc1, float2    *time, int       *body_id, uint4     *body_key, bodyStruct *source);
+#endif
 extern "C" void  (gpu_extractSampleParticlesSFC)(int    n_bodies, int    sample_freq, uint4  *body_pos, uint4  *samplePosition);
 
 
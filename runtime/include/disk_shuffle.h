@@ -1,3 +1,5 @@
+#include "vector3.h"
+
 struct DiskShuffle
 {
 
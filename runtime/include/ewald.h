@@ -0,0 +1,211 @@
+#pragma once
+
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+//Ewald summation for a periodic cube of side L with G = 1, following
+//Hernquist, Bouchet & Suto (1991). The tree computes the force of the nearest
+//image of every particle, the table stores the difference between that and the
+//force (and potential) of the full periodic lattice including the neutralising
+//background. The correction is smooth, so it is tabulated for L = 1 on a grid
+//over [0, L/2]^3 and interpolated trilinearly. The force correction is odd in
+//each coordinate and the potential correction is even, which gives the other
+//octants.
+struct EwaldTable
+{
+  enum { EN = 64 };            //Table intervals per dimension over [0, L/2]
+  enum { NREP = 4 };           //Real space images, |n_i| <= NREP
+  enum { HMAX2 = 10 };         //Fourier space vectors, |h|^2 <= HMAX2
+
+  //Per grid point fx, fy, fz, pot for L = 1. Layout matches a float4 array
+  //so it can be copied to the device as is
+  std::vector<float> table;
+
+  static double alpha() { return 2.0; }  //Splitting scale 2/L for L = 1
+
+  static int index(const int i, const int j, const int k)
+  {
+    return (i*(EN+1) + j)*(EN+1) + k;
+  }
+
+  //Correction for a unit mass at the origin and a test particle at x (L = 1).
+  //The result does not depend on the splitting scale a, which is what the
+  //validation uses to get an independent reference
+  static void correction(const double x[3], double f[3], double &pot,
+                         const double a = alpha())
+  {
+    const double spi = sqrt(M_PI);
+
+    //n = 0 image minus the Newtonian force that the tree already computes.
+    //Written with erf so that it stays finite at r = 0
+    const double r = sqrt(x[0]*x[0] + x[1]*x[1] + x[2]*x[2]);
+    f[0] = f[1] = f[2] = 0;
+    if(r > 0)
+    {
+      const double val = erf(a*r) - 2.0*a*r/spi*exp(-a*a*r*r);
+      for(int d=0; d < 3; d++) f[d] += x[d]/(r*r*r)*val;
+      pot = erf(a*r)/r;
+    }
+    else
+    {
+      pot = 2.0*a/spi;
+    }
+    pot += M_PI/(a*a);
+
+    //Other real space images
+    for(int nx=-NREP; nx <= NREP; nx++)
+    for(int ny=-NREP; ny <= NREP; ny++)
+    for(int nz=-NREP; nz <= NREP; nz++)
+    {
+      if(nx == 0 && ny == 0 && nz == 0) continue;
+      const double dx[3] = {x[0] - nx, x[1] - ny, x[2] - nz};
+      const double rn    = sqrt(dx[0]*dx[0] + dx[1]*dx[1] + dx[2]*dx[2]);
+      const double val   = erfc(a*rn) + 2.0*a*rn/spi*exp(-a*a*rn*rn);
+      for(int d=0; d < 3; d++) f[d] -= dx[d]/(rn*rn*rn)*val;
+      pot -= erfc(a*rn)/rn;
+    }
+
+    //Fourier space
+    for(int hx=-NREP; hx <= NREP; hx++)
+    for(int hy=-NREP; hy <= NREP; hy++)
+    for(int hz=-NREP; hz <= NREP; hz++)
+    {
+      const int h2 = hx*hx + hy*hy + hz*hz;
+      if(h2 == 0 || h2 > HMAX2) continue;
+      const double hdotx = x[0]*hx + x[1]*hy + x[2]*hz;
+      const double e     = exp(-M_PI*M_PI*h2/(a*a));
+      const double val   = 2.0/h2*e*sin(2.0*M_PI*hdotx);
+      f[0] -= hx*val;
+      f[1] -= hy*val;
+      f[2] -= hz*val;
+      pot  -= e*cos(2.0*M_PI*hdotx)/(M_PI*h2);
+    }
+    //pot is the correction to the potential -1/r, so the periodic potential
+    //of the unit mass is -1/r + pot
+  }
+
+  void compute()
+  {
+    table.resize(4*(EN+1)*(EN+1)*(EN+1));
+
+    #pragma omp parallel for schedule(dynamic)
+    for(int i=0; i <= EN; i++)
+    {
+      for(int j=0; j <= EN; j++)
+      for(int k=0; k <= EN; k++)
+      {
+        const double x[3] = {0.5*i/EN, 0.5*j/EN, 0.5*k/EN};
+        double f[3], pot;
+        correction(x, f, pot);
+        float *t = &table[4*index(i, j, k)];
+        t[0] = (float)f[0];
+        t[1] = (float)f[1];
+        t[2] = (float)f[2];
+        t[3] = (float)pot;
+      }
+    }
+  }
+
+  //Trilinear interpolation of the correction of a unit mass for the
+  //minimum image separation dx (|dx_i| <= L/2) in a box of size L
+  void lookup(const double dx[3], const double L, double f[3], double &pot) const
+  {
+    double u[3];
+    int    i[3];
+    double w[3];
+    for(int d=0; d < 3; d++)
+    {
+      u[d] = std::min(fabs(dx[d])/L*2.0*EN, (double)EN);
+      i[d] = std::min((int)u[d], EN-1);
+      w[d] = u[d] - i[d];
+    }
+
+    double acc[4] = {0, 0, 0, 0};
+    for(int c=0; c < 8; c++)
+    {
+      const int    a  = (c >> 2) & 1, b = (c >> 1) & 1, e = c & 1;
+      const double wt = (a ? w[0] : 1-w[0])*(b ? w[1] : 1-w[1])*(e ? w[2] : 1-w[2]);
+      const float *t  = &table[4*index(i[0]+a, i[1]+b, i[2]+e)];
+      for(int q=0; q < 4; q++) acc[q] += wt*t[q];
+    }
+
+    for(int d=0; d < 3; d++)
+      f[d] = (dx[d] < 0 ? -acc[d] : acc[d])/(L*L);
+    pot = acc[3]/L;
+  }
+
+  //Brute force Ewald acceleration of n particles in a box of size L, used as
+  //reference. Every pair is evaluated with the full Ewald sums using splitting
+  //scale a and the separation as given (not the nearest image), so the result
+  //checks both the lattice sums and the periodicity of the table
+  static void bruteForce(const int n, const double *pos, const double *mass,
+                         const double L, const double a, double *acc)
+  {
+    #pragma omp parallel for
+    for(int i=0; i < n; i++)
+    {
+      acc[3*i+0] = acc[3*i+1] = acc[3*i+2] = 0;
+      for(int j=0; j < n; j++)
+      {
+        if(i == j) continue;
+        double x[3], f[3], pot;
+        for(int d=0; d < 3; d++) x[d] = (pos[3*i+d] - pos[3*j+d])/L;
+        correction(x, f, pot, a);
+        const double r = sqrt(x[0]*x[0] + x[1]*x[1] + x[2]*x[2]);
+        for(int d=0; d < 3; d++)
+          acc[3*i+d] += mass[j]*(f[d] - x[d]/(r*r*r))/(L*L);
+      }
+    }
+  }
+
+  //Compares nearest image Newton plus the table correction against the brute
+  //force Ewald sum for n random particles. Returns the maximum relative error
+  //of the accelerations, and in fzero the total periodic force at separation
+  //(L/2, 0, 0) which has to vanish by symmetry
+  double validate(const int n, double &fzero) const
+  {
+    const double L = 1.0;
+    std::vector<double> pos(3*n), mass(n), accRef(3*n);
+    srand48(12345);
+    for(int i=0; i < n; i++)
+    {
+      for(int d=0; d < 3; d++) pos[3*i+d] = drand48()*L - 0.5*L;
+      mass[i] = 1.0/n;
+    }
+
+    bruteForce(n, &pos[0], &mass[0], L, 1.25*alpha(), &accRef[0]);
+
+    double maxErr = 0;
+    for(int i=0; i < n; i++)
+    {
+      double a[3] = {0, 0, 0};
+      for(int j=0; j < n; j++)
+      {
+        if(i == j) continue;
+        //Separation of i from j, nearest image
+        double dx[3], f[3], pot;
+        for(int d=0; d < 3; d++)
+        {
+          dx[d]  = pos[3*i+d] - pos[3*j+d];
+          dx[d] -= L*floor(dx[d]/L + 0.5);
+        }
+        const double r = sqrt(dx[0]*dx[0] + dx[1]*dx[1] + dx[2]*dx[2]);
+        lookup(dx, L, f, pot);
+        for(int d=0; d < 3; d++)
+          a[d] += mass[j]*(f[d] - dx[d]/(r*r*r));
+      }
+      const double ref2 = accRef[3*i]*accRef[3*i] + accRef[3*i+1]*accRef[3*i+1] + accRef[3*i+2]*accRef[3*i+2];
+      const double dx   = a[0]-accRef[3*i], dy = a[1]-accRef[3*i+1], dz = a[2]-accRef[3*i+2];
+      if(ref2 > 0) maxErr = std::max(maxErr, sqrt((dx*dx + dy*dy + dz*dz)/ref2));
+    }
+
+    const double xh[3] = {0.5*L, 0, 0};
+    double f[3], pot;
+    lookup(xh, L, f, pot);
+    fzero = fabs(f[0] - xh[0]/(xh[0]*xh[0]*xh[0]));
+
+    return maxErr;
+  }
+};
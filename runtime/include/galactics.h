@@ -1,12 +1,18 @@
 #pragma once
 
-#include <sys/types.h> /* pid_t */
-#include <unistd.h>  /* _exit, fork */
-#include <sys/wait.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-
+#include <string>
+#include <vector>
+#ifdef GALACTICS
+  #include <cmath>
+  #include <cstdio>
+  #include <cstdlib>
+  #include <cassert>
+  #include <sys/types.h> /* pid_t */
+  #include <unistd.h>  /* _exit, fork */
+  #include <sys/wait.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
 
 extern "C"
 {
@@ -14,6 +20,41 @@ extern "C"
   void gen_bulge(int nptcl, int myseed, float *buffer, int verbose);
   void gen_halo (int nptcl, int myseed, float *buffer, int verbose);
 }
+#endif
+
+//Milky Way models from the tabulated distribution functions of GalactICS
+//(Kuijken & Dubinski 1995; Widrow, Pym & Dubinski 2008), the files of
+//galactics_mw_df unzipped in the directory path:
+//
+//  dbh.dat           harmonic expansion of the total potential, disk parameters
+//  denspsihalo.dat   halo density as a function of the relative potential
+//  denspsibulge.dat  bulge density as a function of the relative potential
+//  cordbh.dat        density and dispersion corrections of the disk DF
+//
+//The tables are read once into a model that the samplers only read, so all
+//threads draw from the same copy. Disk particles are placed on the target
+//exponential/sech^2 disk and get their velocities from the Kuijken & Dubinski
+//disk DF at that position. Halo and bulge particles are drawn from their
+//density and get isotropic velocities from f(E), the Eddington inversion of
+//the density table. The rejection steps use fixed envelopes, a particle that
+//exceeds its envelope or is not accepted in a bounded number of tries stops
+//the run.
+//
+//Particle i of a component comes from its own Philox stream keyed by the
+//component and its index in the whole model, every process generates a
+//contiguous range of each component. After centring the components on
+//their centre of mass and mean velocity, the model only depends on the
+//total numbers of particles, not on the number of threads or processes (up
+//to the rounding of the centring sums).
+//
+//  const Galactics g(procId, nProcs, ndisk, nbulge, nhalo, nThreads);
+//  g[i].x, g[i].vx, g[i].mass, g[i].id
+//
+//With GALACTICS (USE_GALACTICS) the Fortran gen_disk/gen_bulge/gen_halo of
+//galactics.parallel remain available as the reference generator, compare
+//the summary() of both before relying on the sampler:
+//
+//  const Galactics g = Galactics::reference(procId, nProcs, ndisk, nbulge, nhalo, nFork);
 
 struct Galactics
 {
@@ -27,20 +68,57 @@ struct Galactics
 
   private:
   int ndisk, nbulge, nhalo;
-  int childId;
   std::vector<Particle> ptcl;
 
+  Galactics() : ndisk(0), nbulge(0), nhalo(0) {}
+
   public:
 
+  //Seed of the disk, the bulge and halo streams use SEED+1 and SEED+2
+  enum { SEED = 19640417 };
+
   int get_ndisk() const { return ndisk; }
   int get_nbulge() const { return nbulge; }
   int get_nhalo() const { return nhalo; }
   int get_ntot() const { return ndisk+nbulge+nhalo; }
   const Particle& operator[](const int i) const {return ptcl[i];}
 
-  Galactics(const int procId, const int nProc, const int _ndisk, int _nbulge, int _nhalo, const int NCHILD = 4) : 
-    ndisk(_ndisk/NCHILD), nbulge(_nbulge/NCHILD), nhalo(_nhalo/NCHILD), childId(0)
+  //Samples the share of this process of a model with ndisk, nbulge and nhalo
+  //particles in total. nThreads <= 0 uses all OpenMP threads. The particles
+  //are ordered disk, bulge, halo, the ids follow the Bonsai ranges (disk from
+  //0, bulge from 100000000, halo from 200000000). The masses of a component
+  //add up to its mass in the model over all processes. Collective with USE_MPI
+  Galactics(const int procId, const int nProcs,
+            const long long ndisk, const long long nbulge, const long long nhalo,
+            const int nThreads = 0, const std::string &path = ".");
+
+  //Per component over all processes: particles, mass, centre of mass, mean
+  //velocity, mean R and |z|, mean v_phi and the dispersions of v_R, v_phi and
+  //v_z. Written by process 0, collective with USE_MPI
+  void summary(const int procId, const char *name) const;
+
+#ifdef GALACTICS
+  //Reference generator: every process forks NCHILD processes that each run
+  //the Fortran generators for a galaxy of ndisk/NCHILD, nbulge/NCHILD and
+  //nhalo/NCHILD particles. The counts are per process, the masses are scaled
+  //so that the components add up to their mass over all processes
+  static Galactics reference(const int procId, const int nProc, const int _ndisk, int _nbulge, int _nhalo,
+                             const int NCHILD = 4)
   {
+    Galactics g;
+    g.generateReference(procId, nProc, _ndisk, _nbulge, _nhalo, NCHILD);
+    return g;
+  }
+
+  private:
+  void generateReference(const int procId, const int nProc, const int _ndisk, int _nbulge, int _nhalo,
+                         const int NCHILD)
+  {
+    int childId = 0;
+    ndisk  = _ndisk/NCHILD;
+    nbulge = _nbulge/NCHILD;
+    nhalo  = _nhalo/NCHILD;
+
     const int nptcl = ndisk + nbulge + nhalo;
 
     const int nByteMap = nptcl*NCHILD*sizeof(Particle);
@@ -143,7 +221,7 @@ struct Galactics
       if (procId == 0)
         fprintf(stderr, "nptcl_per_proc= %d  nproc= %d  ntot= %d\n",
             nptcl, NCHILD, ntot);
-      const float mscale = 1.0/NCHILD;
+      const float mscale = 1.0/(NCHILD*nProc);
       ptcl.insert(ptcl.begin(), ptcl_list, ptcl_list+ntot);
       for (int i = 0; i < ntot; i++)
       {
@@ -165,4 +243,5 @@ struct Galactics
     nbulge *= NCHILD;
     nhalo  *= NCHILD;
   }
+#endif
 };
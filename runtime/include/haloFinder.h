@@ -0,0 +1,118 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#ifdef USE_MPI
+  #include <mpi.h>
+#endif
+#include "analysisModule.h"
+
+//Friends-of-friends groups and k nearest neighbours of the particles of one
+//process, on the host copy of the Bonsai octree (AnalysisTree). The tree is
+//only used for its topology: the node boxes are recomputed bottom-up from
+//the given positions, level by level as the device tree stores them.
+//
+//Particles closer than the linking length are joined in a union-find forest
+//that all threads update without locks. A root is linked under the smaller
+//root with a compare-and-swap and find() halves the paths, so the parent of
+//a particle never exceeds its index and the root of a group is its smallest
+//index.
+//
+//  HaloFinder fof(nThreads);
+//  fof.setParticles(n, pos, tree);
+//  fof.link(b);
+//  fof.labels(offset, label);                    //offset: global index of particle 0
+//  fof.mergeAcrossProcesses(comm, b, label);     //USE_MPI, collective
+//  fof.nearest(k, rk);
+//  fof.nearestAcrossProcesses(comm, k, rk);      //USE_MPI, collective
+//
+//After the merge label[i] is the smallest global index in the group of i, on
+//every process. Across processes only the particles near the domain
+//boundaries are exchanged, point to point with the processes whose domain
+//is in reach (the neighbouring SFC domains).
+
+class HaloFinder
+{
+  public:
+    HaloFinder(const int nThreads);
+    ~HaloFinder();
+
+    //pos and tree must stay valid until the next call
+    void setParticles(const int n, const float4 *pos, const AnalysisTree &tree);
+
+    //Joins the particles closer than b
+    void link(const float b);
+
+    //label[i] = offset + smallest index in the group of i
+    void labels(const long long offset, long long *label);
+
+    //Distance to the k-th nearest neighbour, the particle itself excluded.
+    //FLT_MAX if there are fewer than k other particles
+    void nearest(const int k, float *rk);
+
+#ifdef USE_MPI
+    //Joins the groups that are linked across the domain boundaries: particles
+    //within b of the bounding box of a neighbouring process are sent to it
+    //with their label, the links found there go back to the sender. The
+    //neighbours then exchange the smallest label of the groups on their
+    //common boundary until no label changes, so groups that span several
+    //domains get the same label everywhere. Collective
+    void mergeAcrossProcesses(MPI_Comm comm, const float b, long long *label);
+
+    //Completes the rk of nearest() with the particles of the other processes:
+    //a particle whose sphere of radius rk reaches the bounding box of another
+    //process is sent there, which returns its nearest distances within rk.
+    //Collective
+    void nearestAcrossProcesses(MPI_Comm comm, const int k, float *rk);
+#endif
+
+    int    nLeaves()    const { return leaves.size(); }
+    double getBoxTime() const { return boxTime;  }
+    double getLinkTime() const { return linkTime; }
+
+  private:
+    struct Box
+    {
+      float cx, cy, cz;   //Centre
+      float hx, hy, hz;   //Half size, negative for an empty box
+    };
+
+    void makeBoxes();
+    bool isLeaf(const int node) const { return tree.centre[node].w <= 0.0f; }
+    void children (const int node, int &first, int &count) const;
+    void particles(const int node, int &first, int &count) const;
+
+    int  find(int i);
+    void unite(int i, int j);
+    void linkLeaf(const int leaf, const float b, std::vector<int> &stack);
+
+    //Calls f(i) for every particle within r of (x,y,z)
+    template<typename F>
+    void query(const float x, const float y, const float z, const float r,
+               std::vector<int> &stack, F f) const;
+
+    //Max-heap of the (up to k) smallest squared distances below r2 from
+    //(x,y,z) to the particles other than skip
+    void nearestHeap(const float x, const float y, const float z, const int k,
+                     const int skip, const float r2, std::vector<float> &heap,
+                     std::vector<std::pair<float,int> > &stack,
+                     std::vector<std::pair<float,int> > &child) const;
+
+#ifdef USE_MPI
+    //Bounding box of the particles of every process, min then max (6 floats)
+    void domainBoxes(MPI_Comm comm, std::vector<float> &allBoxes) const;
+#endif
+
+    const int     nThreads;
+    int           n;
+    const float4 *pos;
+    AnalysisTree  tree;
+
+    std::vector<Box> boxes;
+    std::vector<int> leaves;
+
+    std::atomic<int> *parent;
+    int               parentCapacity;
+
+    double boxTime, linkTime;
+};
@@ -94,6 +94,8 @@ private:
   #endif
   }
 
+public:
+  //Public for the host benchmarks
   static uint4 host_get_key(uint4 crd)
   {
     const int bits = 30;  //20 to make it same number as morton order
@@ -169,6 +171,7 @@ private:
     return key_new;
   }
 
+private:
   void inline mergeBoxesForGrpTree(float4 cntA, float4 sizeA, float4 cntB, float4 sizeB,
                             float4 &tempCnt, float4 &tempSize)
   {
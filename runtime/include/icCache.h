@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <vector_types.h>
+
+//Cache of generated initial conditions (--iccache). Each process stores its
+//particles in its own file, named by a hash of the key: the generator name,
+//its parameters and seed, the content of its input tables and the process
+//layout (rank and number of processes). A later run with the same key reads
+//the file instead of generating the model again. The file is checked against
+//the full key text and a checksum of its contents before it is used.
+//
+//  ICCache cache(dir, "plummer", procId, nProcs);
+//  cache.add("n", n); cache.add("seed", seed);
+//  if(!cache.load(pos, vel, ids))
+//  {
+//    generate(pos, vel, ids);
+//    cache.store(pos, vel, ids);
+//  }
+//
+//The key only covers what is added to it, a change to the sampling code of a
+//generator needs a new generator name or an empty cache directory.
+//
+//Only the generators inside bonsai2 use the cache. Inputs that are read with
+//-i, such as the dust rings of the offline add_dust tool, are already stored
+//files.
+
+class ICCache
+{
+  public:
+    //An empty directory disables the cache, load then always fails
+    ICCache(const std::string &dir, const std::string &generator,
+            const int procId, const int nProcs);
+
+    void add(const std::string &name, const long long value);
+    void add(const std::string &name, const double value);
+    //Content of an input file of the generator, a missing file fails the key
+    void addFile(const std::string &fileName);
+
+    bool enabled() const { return !dir.empty(); }
+    std::string fileName() const;
+
+    //Fills the particles from the cache file. Collective: it only succeeds
+    //when every process found a valid file, so all processes either use the
+    //cache or generate the model (which may have collectives of its own)
+    bool load(std::vector<float4> &pos, std::vector<float4> &vel, std::vector<int> &ids) const;
+
+    //Writes the particles, a failure is reported but not fatal
+    void store(const std::vector<float4> &pos, const std::vector<float4> &vel,
+               const std::vector<int> &ids) const;
+
+  private:
+    const std::string dir, generator;
+    const int         procId, nProcs;
+    std::string       key;          //One "name value" line per entry
+    bool              valid;        //False if an input file could not be read
+
+    bool loadLocal(std::vector<float4> &pos, std::vector<float4> &vel, std::vector<int> &ids) const;
+};
@@ -32,7 +32,7 @@
         extern void prependrankLOGF(const char *fmt, ...);
         #define LOGF(file, ...) {if (ENABLE_RUNTIME_LOG) if(PREPEND_RANK)  prependrankLOGF(__VA_ARGS__); else fprintf(file, __VA_ARGS__);}
   #else
-        #define LOGF(file, fmt, ...) {if (ENABLE_RUNTIME_LOG) fprintf(file, fmt,__VA_ARGS__);}
+        #define LOGF(file, ...) {if (ENABLE_RUNTIME_LOG) fprintf(file, __VA_ARGS__);}
   #endif
 
 
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include "octree.h"
+
+//Memory of a run on one device, following the allocations in
+//allocateParticleMemory, build, allocateTreePropMemory and
+//mergeAndLaunchLETStructures. Every dev_mem has a host copy of the same size,
+//so the host memory is the same amount (most of it pageable).
+
+struct MemoryEstimate
+{
+  long long particles;          //Arrays with one item per particle
+  long long generalBuffer;      //Sort, build and tree-walk stack scratch space
+  long long tree;               //Node and group properties
+  long long remoteTree;         //Merged LET structures
+  long long fixed;              //Small buffers of fixed size
+
+  long long total() const { return particles + generalBuffer + tree + remoteTree + fixed; }
+};
+
+//nRemote is the number of real4 items of the received LETs, nBlocksForTreeWalk
+//the number of multiprocessors times getTreeWalkBlocksPerSM
+inline MemoryEstimate estimateMemory(const long long n, const long long nNodes, const long long nGroups,
+                                     const long long nRemote, const int nProcs, const int nBlocksForTreeWalk)
+{
+  MemoryEstimate mem;
+
+  const long long nBodies = (nProcs > 1) ? (long long)(n*MULTI_GPU_MEM_INCREASE) : n;
+  const long long nAlloc  = std::max(nBodies, 2048LL);
+
+  //pos, key, ids, Ppos and Pvel have one extra item
+  mem.particles = (nBodies+1)*(sizeof(real4) + sizeof(uint4) + sizeof(int) + 2*sizeof(real4)) +
+                  nBodies*(3*sizeof(real4) + sizeof(float2) + sizeof(int)) +         //vel, acc0, acc1, time, order
+                  (nBodies+2)*sizeof(uint) +                                          //activePartlist
+                  nBodies*(sizeof(uint) + sizeof(int2) + sizeof(uint)) +              //ngb, interactions, body2group
+                  nAlloc*(sizeof(uint) + sizeof(uint2));                              //n_children, node_bodies
+#ifdef DOUBLE_ACCUMULATION
+  mem.particles += nBodies*4*sizeof(real4);                                           //posLo, velLo, PposLo, PvelLo
+#endif
+
+  const long long walkStack = 2LL*(LMEM_STACK_SIZE*NTHREAD + LMEM_EXTRA_SIZE)*nBlocksForTreeWalk + 4096;
+  mem.generalBuffer = sizeof(uint)*std::max(3*std::max(nBodies, 4096LL)*4 + 4096, walkStack);
+
+  const long long nNodesAlloc = (long long)(nNodes*1.1f);
+  mem.tree = nNodesAlloc*(3*sizeof(real4) + 2*sizeof(float4)) +                      //multipole, box size and centre
+             nNodes*sizeof(uint) +                                                    //leafNodeIdx
+             nGroups*(2*sizeof(float4) + sizeof(uint2) + 2*sizeof(uint));            //group boxes and lists
+
+  mem.remoteTree = 0;
+  if(nProcs > 1)
+    mem.remoteTree = sizeof(float4)*std::max(std::max((long long)(nBodies*0.5), 2048LL), nRemote);
+
+  mem.fixed = MAXLEVELS*(sizeof(uint2) + 2*sizeof(uint)) +
+              2*NBLOCK_REDUCE*sizeof(uint) + 2*NBLOCK_BOUNDARY*sizeof(float4) +
+              2*NBLOCK_PREFIX*sizeof(uint) + 16*sizeof(real4);
+  if(nProcs > 1)
+    mem.fixed += (nProcs+1)*sizeof(uint4);
+
+  return mem;
+}
+
+//Largest local particle count that fits in deviceBytes. The tree, group and
+//LET sizes are given per particle and taken to scale linearly with n
+inline long long maxParticlesPerDevice(const long long deviceBytes, const double nodesPerParticle,
+                                       const double groupsPerParticle, const double remotePerParticle,
+                                       const int nProcs, const int nBlocksForTreeWalk)
+{
+  long long lo = 0, hi = 1;
+  while(estimateMemory(hi, (long long)(hi*nodesPerParticle), (long long)(hi*groupsPerParticle),
+                       (long long)(hi*remotePerParticle), nProcs, nBlocksForTreeWalk).total() <= deviceBytes)
+  {
+    lo  = hi;
+    hi *= 2;
+  }
+
+  while(hi - lo > 1)
+  {
+    const long long mid = (lo + hi) / 2;
+    if(estimateMemory(mid, (long long)(mid*nodesPerParticle), (long long)(mid*groupsPerParticle),
+                      (long long)(mid*remotePerParticle), nProcs, nBlocksForTreeWalk).total() <= deviceBytes)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
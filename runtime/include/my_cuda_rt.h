@@ -19,6 +19,9 @@
 #include <fstream>
 #include <cassert>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
 #include <cuda_runtime.h>
 #include <vector_functions.h>
 
@@ -85,6 +88,9 @@ __inline__ cudaError_t clFinish(int param)
 }
 
     
+//Receives every resolved timing region, times in milliseconds of the host steady clock
+typedef void (*timingTraceHook)(const char *text, const void *stream, double startMs, double endMs);
+
 static int getNumberOfCUDADevices()
 {
   // Get number of devices supporting CUDA
@@ -114,8 +120,52 @@ namespace my_dev {
     int logID;  //Unique ID to every log line
     
     
-    //Events:
-    cudaEvent_t start, stop;
+    //Timing regions. Events come from a pool and are only resolved in
+    //flushTiming, so timing does not synchronize the streams. Without a
+    //device context the host clock is used instead
+    struct timingRegion
+    {
+      std::string  text;
+      int          type;
+      cudaStream_t stream;
+      cudaEvent_t  start, stop;
+      double       hostStart, hostStop;
+    };
+    std::vector<cudaEvent_t>  eventPool;
+    std::vector<timingRegion> openRegions;   //Stack, regions can be nested
+    std::vector<timingRegion> closedRegions; //Waiting for flushTiming
+    bool hostTiming;
+
+    //Device events are placed on the host clock relative to a reference event
+    timingTraceHook traceHook;
+    cudaEvent_t     traceRef;
+    double          traceRefHost;
+
+    void setTraceReference()
+    {
+      CU_SAFE_CALL(cudaEventRecord(traceRef, 0));
+      CU_SAFE_CALL(cudaEventSynchronize(traceRef));
+      traceRefHost = hostTime();
+    }
+
+    cudaEvent_t getPoolEvent()
+    {
+      if(eventPool.empty())
+      {
+        cudaEvent_t event;
+        CU_SAFE_CALL(cudaEventCreateWithFlags(&event, cudaEventDefault));
+        return event;
+      }
+      cudaEvent_t event = eventPool.back();
+      eventPool.pop_back();
+      return event;
+    }
+
+    static double hostTime()
+    {
+      return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
     
     //Compute capability, important for default compilation mode
     int ccMajor;
@@ -134,12 +184,16 @@ namespace my_dev {
       hInit_flag        = false;
       logfile_flag      = false;
       disable_timing    = false;
+      hostTiming        = false;
+      traceHook         = NULL;
       
       hInit_flag        = true;                 
     }
     ~context() {
       if (hContext_flag )
       {
+        for(size_t i=0; i < eventPool.size(); i++)
+          cudaEventDestroy(eventPool[i]);
         CU_SAFE_CALL(cudaDeviceReset());
       }
     }
@@ -238,33 +292,112 @@ namespace my_dev {
     }
 
     
+    //Use the host clock for the timing regions instead of device events,
+    //for example when there is no device
+    void setHostTiming(bool host) { hostTiming = host; }
+
+    //Passes the resolved regions to hook as well, for example for a timeline
+    void setTraceHook(timingTraceHook hook)
+    {
+      traceHook = hook;
+      if(traceHook && hContext_flag && !hostTiming)
+      {
+        CU_SAFE_CALL(cudaEventCreateWithFlags(&traceRef, cudaEventDefault));
+        setTraceReference();
+      }
+    }
+
     void startTiming(cudaStream_t stream=0)
     {
       if(disable_timing) return;
-      int eventflags =  cudaEventDefault;      
-      CU_SAFE_CALL(cudaEventCreateWithFlags(&start, eventflags));  
-      CU_SAFE_CALL(cudaEventCreateWithFlags(&stop, eventflags));
-      CU_SAFE_CALL(cudaEventRecord(start, stream));
+
+      timingRegion region;
+      region.type      = -1;
+      region.stream    = stream;
+      region.start     = region.stop = 0;
+      region.hostStart = region.hostStop = 0;
+      if(hostTiming || !hContext_flag)
+      {
+        region.hostStart = hostTime();
+      }
+      else
+      {
+        region.start = getPoolEvent();
+        CU_SAFE_CALL(cudaEventRecord(region.start, stream));
+      }
+      openRegions.push_back(region);
     }
     
-    //Text and ID to be printed with the log message on screen / in the file
+    //Closes the innermost open region. Text and ID are printed with the log
+    //message on screen / in the file once the region is resolved by flushTiming
     void stopTiming(const char *text, int type = -1, cudaStream_t stream=0)
     {
       if(disable_timing) return;
-      
-      CU_SAFE_CALL(cudaEventRecord(stop, stream));
-      CU_SAFE_CALL(cudaEventSynchronize(stop));
-      float time;
-      CU_SAFE_CALL(cudaEventElapsedTime(&time, start, stop));      
-      CU_SAFE_CALL(cudaEventDestroy(start));
-      CU_SAFE_CALL(cudaEventDestroy(stop));      
-      
-      LOG("%s took:\t%f\t millisecond\n", text, time);
-      
-      if(logfile_flag)
+      if(openRegions.empty())
+      {
+        LOGF(stderr, "stopTiming(%s) without matching startTiming\n", text);
+        return;
+      }
+
+      timingRegion region = openRegions.back();
+      openRegions.pop_back();
+      region.text = text;
+      region.type = type;
+      if(region.start)
       {
-        (*logFile) << logID++ << "\t"  << type << "\t" << text << "\t" << time << endl;
+        region.stop = getPoolEvent();
+        CU_SAFE_CALL(cudaEventRecord(region.stop, stream));
       }
+      else
+      {
+        region.hostStop = hostTime();
+      }
+      closedRegions.push_back(region);
+    }
+
+    //Resolves the closed regions, waiting for their events if needed, logs
+    //them in the order in which they were closed and returns the events to the pool.
+    //If typeTimes is given the times are also summed per region type
+    void flushTiming(double *typeTimes = NULL, const int nTypes = 0)
+    {
+      for(size_t i=0; i < closedRegions.size(); i++)
+      {
+        timingRegion &region = closedRegions[i];
+        float time;
+        if(region.start)
+        {
+          CU_SAFE_CALL(cudaEventSynchronize(region.stop));
+          CU_SAFE_CALL(cudaEventElapsedTime(&time, region.start, region.stop));
+          if(traceHook)
+          {
+            float begin;
+            CU_SAFE_CALL(cudaEventElapsedTime(&begin, traceRef, region.start));
+            traceHook(region.text.c_str(), region.stream, traceRefHost + begin, traceRefHost + begin + time);
+          }
+          eventPool.push_back(region.start);
+          eventPool.push_back(region.stop);
+        }
+        else
+        {
+          time = (float)(region.hostStop - region.hostStart);
+          if(traceHook)
+            traceHook(region.text.c_str(), region.stream, region.hostStart, region.hostStop);
+        }
+
+        if(typeTimes && region.type >= 0 && region.type < nTypes)
+          typeTimes[region.type] += time;
+
+        LOG("%s took:\t%f\t millisecond\n", region.text.c_str(), time);
+
+        if(logfile_flag)
+        {
+          (*logFile) << logID++ << "\t"  << region.type << "\t" << region.text << "\t" << time << endl;
+        }
+      }
+      closedRegions.clear();
+
+      //New reference for the next regions, keeps the float event times accurate
+      if(traceHook && hContext_flag && !hostTiming) setTraceReference();
     }
     
     void writeLogEvent(const char *text)
@@ -340,24 +473,113 @@ namespace my_dev {
     
   ///////////////////////
   
+  //Usage of the buffers with one name. A dev_mem allocates the same number of
+  //bytes on the device and on the host, either pinned or pageable
+  struct memAccount
+  {
+    long long device, maxDevice;
+    long long host, pinned, maxHost;
+    long long maxView;          //Largest part handed out with cmalloc_copy
+
+    memAccount() : device(0), maxDevice(0), host(0), pinned(0), maxHost(0), maxView(0) {}
+  };
+
   class base_mem
   {
     public:     
     //Memory usage counters
     static long long currentMemUsage;
     static long long maxMemUsage;  
-    
-    void increaseMemUsage(int bytes)
+
+    //Per buffer name, buffers without a name are counted as "other"
+    static std::map<std::string, memAccount> &memAccounts()
     {
-      currentMemUsage +=  bytes;   
-      
-      if(currentMemUsage > maxMemUsage)
-        maxMemUsage = currentMemUsage;
+      static std::map<std::string, memAccount> accounts;
+      return accounts;
+    }
+
+    //Peak device usage and peak use of the shared buffers per phase of the step
+    static std::map<std::string, long long> &phasePeaks()
+    {
+      static std::map<std::string, long long> peaks;
+      return peaks;
+    }
+    static std::map<std::string, long long> &phaseViews()
+    {
+      static std::map<std::string, long long> views;
+      return views;
+    }
+    static std::string &memPhase()
+    {
+      static std::string phase("setup");
+      return phase;
+    }
+
+    //The LET threads allocate while the main thread runs, hence the critical sections
+    void increaseMemUsage(long long bytes, const char *name, bool pinned)
+    {
+      #pragma omp critical(memAccounting)
+      {
+        currentMemUsage +=  bytes;   
+
+        if(currentMemUsage > maxMemUsage)
+          maxMemUsage = currentMemUsage;
+
+        memAccount &acc = memAccounts()[name];
+        acc.device    += bytes;
+        acc.maxDevice  = std::max(acc.maxDevice, acc.device);
+        (pinned ? acc.pinned : acc.host) += bytes;
+        acc.maxHost    = std::max(acc.maxHost, acc.host + acc.pinned);
+
+        long long &peak = phasePeaks()[memPhase()];
+        peak = std::max(peak, currentMemUsage);
+      }
     }
     
-    void decreaseMemUsage(int bytes)
+    void decreaseMemUsage(long long bytes, const char *name, bool pinned)
     {
-      currentMemUsage -=  bytes;
+      #pragma omp critical(memAccounting)
+      {
+        currentMemUsage -=  bytes;
+
+        memAccount &acc = memAccounts()[name];
+        acc.device -= bytes;
+        (pinned ? acc.pinned : acc.host) -= bytes;
+      }
+    }
+
+    static void recordView(const char *name, long long bytes)
+    {
+      #pragma omp critical(memAccounting)
+      {
+        memAccount &acc = memAccounts()[name];
+        acc.maxView     = std::max(acc.maxView, bytes);
+
+        long long &view = phaseViews()[memPhase()];
+        view = std::max(view, bytes);
+      }
+    }
+
+    //Host memory that is not a dev_mem, such as the LET buffers. Sets the current size
+    static void setHostMemUsage(const char *name, long long bytes)
+    {
+      #pragma omp critical(memAccounting)
+      {
+        memAccount &acc = memAccounts()[name];
+        acc.host    = bytes;
+        acc.maxHost = std::max(acc.maxHost, acc.host + acc.pinned);
+      }
+    }
+
+    //Start of a phase of the time step, the peaks are kept per phase
+    static void setMemPhase(const char *phase)
+    {
+      #pragma omp critical(memAccounting)
+      {
+        memPhase() = phase;
+        long long &peak = phasePeaks()[phase];
+        peak = std::max(peak, currentMemUsage);
+      }
     }
     
     static void printMemUsage()
@@ -370,6 +592,27 @@ namespace my_dev {
       LOG("Build-in usage: free: %ld bytes ( %ld MB , total: %ld) \n", free, free / (1024*1024), total / (1024*1024));
       
     }  
+
+    static void printMemReport()
+    {
+      const double MB = 1.0/(1024*1024);
+      LOGF(stderr, "Memory per buffer [MB]  %-22s %10s %10s %10s %10s %10s\n",
+                   "name", "device", "max dev", "pinned", "max host", "max view");
+      std::map<std::string, memAccount>::const_iterator it;
+      for(it = memAccounts().begin(); it != memAccounts().end(); it++)
+      {
+        const memAccount &acc = it->second;
+        LOGF(stderr, "Memory per buffer [MB]  %-22s %10.2f %10.2f %10.2f %10.2f %10.2f\n", it->first.c_str(),
+                     acc.device*MB, acc.maxDevice*MB, acc.pinned*MB, acc.maxHost*MB, acc.maxView*MB);
+      }
+
+      LOGF(stderr, "Memory per phase [MB]   %-22s %10s %10s\n", "phase", "max dev", "max view");
+      std::map<std::string, long long>::const_iterator ph;
+      for(ph = phasePeaks().begin(); ph != phasePeaks().end(); ph++)
+        LOGF(stderr, "Memory per phase [MB]   %-22s %10.2f %10.2f\n", ph->first.c_str(),
+                     ph->second*MB, phaseViews()[ph->first]*MB);
+      LOGF(stderr, "Memory maximum [MB]     %.2f\n", maxMemUsage*MB);
+    }
     
     static long long getMaxMemUsage()
     {      
@@ -406,6 +649,8 @@ namespace my_dev {
     bool childMemory; //Indicates that this is a shared buffer that will be freed by a parent
     
     bool eventSet;
+
+    const char *name;       //Used for the memory accounting
     
     void cuda_free() {      
       if(childMemory) //Only free if we are NOT a child
@@ -419,7 +664,7 @@ namespace my_dev {
       {
 	assert(size > 0);
 	(cudaFree(hDeviceMem));
-        decreaseMemUsage(size*sizeof(T));
+        decreaseMemUsage(size*sizeof(T), name, pinned_mem);
         
         if(pinned_mem){
           (cudaFreeHost((void*)host_ptr));}
@@ -437,6 +682,7 @@ namespace my_dev {
     dev_mem() {
 //       CU_SAFE_CALL(cudaEventCreate(&asyncCopyEvent));
       eventSet = false;
+      name              = "other";
       size              = 0;
       pinned_mem        = false;
       hDeviceMem_flag   = false;
@@ -448,6 +694,7 @@ namespace my_dev {
     dev_mem(class context &c) {
       CU_SAFE_CALL(cudaEventCreate(&asyncCopyEvent));
       eventSet = true;
+      name              = "other";
       size              = 0;      
       pinned_mem        = false;
       context_flag      = false;
@@ -464,6 +711,7 @@ namespace my_dev {
 	    int flags = 0, bool pinned = false) {
       CU_SAFE_CALL(cudaEventCreate(&asyncCopyEvent));
       eventSet = true;
+      name              = "other";
       context_flag      = false;
       childMemory       = false;      
       hDeviceMem_flag   = false;
@@ -500,8 +748,10 @@ namespace my_dev {
     
     ///////////
 
-    void setContext(class context &c) {      
+    //The name groups the memory usage of this buffer in printMemReport
+    void setContext(class context &c, const char *_name = NULL) {      
       context_flag     = true;
+      if(_name) name   = _name;
       
       if(eventSet == false)
       {
@@ -574,6 +824,8 @@ namespace my_dev {
       //TODO for safety we could add a check if we go outside 
       //the memory bounds
 
+      recordView(sourcemem.get_name(), (currentOffset + padding)*sizeof(uint));
+
       return currentOffset + padding;
     }    
     
@@ -626,7 +878,7 @@ namespace my_dev {
         host_ptr = (T*)malloc(size*sizeof(T));}
         
       CU_SAFE_CALL(cudaMalloc((T**)&hDeviceMem, size*sizeof(T)));
-      increaseMemUsage(size*sizeof(T));
+      increaseMemUsage(size*sizeof(T), name, pinned_mem);
       DeviceMemPtr = (void*)(size_t)hDeviceMem;    
 
       hDeviceMem_flag = true;
@@ -649,7 +901,7 @@ namespace my_dev {
       CU_SAFE_CALL(cudaMalloc((T**)&hDeviceMem, size*sizeof(T)));           
       
       CU_SAFE_CALL(cudaMemset((void*)hDeviceMem, 0, size*sizeof(T)));     
-      increaseMemUsage(size*sizeof(T));
+      increaseMemUsage(size*sizeof(T), name, pinned_mem);
       DeviceMemPtr = (void*)(size_t)hDeviceMem;    
       
       hDeviceMem_flag = true;
@@ -692,12 +944,12 @@ namespace my_dev {
       //new memory and then copies the old one in the new one and free's the old one
       T *hDeviceMemNew;
       CU_SAFE_CALL(cudaMalloc((T**)&hDeviceMemNew, n*sizeof(T)));      
-      increaseMemUsage(n*sizeof(T));    
+      increaseMemUsage(n*sizeof(T), name, pinned_mem);
       int nToCopy = min(size, n); //Do not copy more than we have memory
       CU_SAFE_CALL(cudaMemcpy(hDeviceMemNew, hDeviceMem, nToCopy*sizeof(T), cudaMemcpyDeviceToDevice ));
       //Now free the old memory
       CU_SAFE_CALL(cudaFree(hDeviceMem));
-      decreaseMemUsage(size*sizeof(T));   
+      decreaseMemUsage(size*sizeof(T), name, pinned_mem);
       hDeviceMem = hDeviceMemNew;
       DeviceMemPtr = (void*)(size_t)hDeviceMem;    
       size = n;
@@ -752,9 +1004,9 @@ namespace my_dev {
      }
 
      CU_SAFE_CALL(cudaFree(hDeviceMem));
-     decreaseMemUsage(size*sizeof(T));
+     decreaseMemUsage(size*sizeof(T), name, pinned_mem);
      CU_SAFE_CALL(cudaMalloc((T**)&hDeviceMem, n*sizeof(T)));
-     increaseMemUsage(n*sizeof(T));
+     increaseMemUsage(n*sizeof(T), name, pinned_mem);
 
      DeviceMemPtr = (void*)(size_t)hDeviceMem;
      size = n;
@@ -963,6 +1215,7 @@ namespace my_dev {
 
     int  get_size(){return size;}
     bool get_pinned(){return pinned_mem;}
+    const char *get_name() const {return name;}
     bool get_flags(){return flags;}
   };     // end of class dev_mem
 
@@ -30,6 +30,7 @@
 #include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <thread>
 #include <sys/types.h>
 
 #ifndef WIN32
@@ -39,6 +40,8 @@
 #include "log.h"
 #include "Galaxy.h"
 
+struct PhaseTransform;
+
 #define PRINT_MPI_DEBUG
 
 using namespace std;
@@ -53,6 +56,8 @@ typedef unsigned int uint;
 
 #define NMAXSAMPLE 20000                //Used by first on host domain division
 
+#define LET_MAX_THREADS   64            //Per thread LET buffers in essential_tree_exchangeV2, caps letThreads
+
 #ifdef USE_B40C
 #include "sort.h"
 #endif
@@ -90,6 +95,10 @@ typedef struct bodyStruct
   int   id;
   int   temp;
   uint4 key;
+#ifdef DOUBLE_ACCUMULATION
+  real4 PposLo;   //Low words of Ppos and Pvel, the corrector rebuilds the
+  real4 PvelLo;   //pos and vel low words from these
+#endif
 } bodyStruct;
 
 typedef struct sampleRadInfo
@@ -167,6 +176,16 @@ class tree_structure
     my_dev::dev_mem<real4> bodies_Ppos;    //Predicted position
     my_dev::dev_mem<real4> bodies_Pvel;    //Predicted velocity
 
+#ifdef DOUBLE_ACCUMULATION
+    //Low words of the integrator state, position = pos + posLo. The Lo arrays
+    //keep the order of pos/vel, also PposLo and PvelLo which the sort does not
+    //reorder
+    my_dev::dev_mem<real4> bodies_posLo;
+    my_dev::dev_mem<real4> bodies_velLo;
+    my_dev::dev_mem<real4> bodies_PposLo;
+    my_dev::dev_mem<real4> bodies_PvelLo;
+#endif
+
     my_dev::dev_mem<uint2> level_list;    //List containing the start and end positions of each level
 
     my_dev::dev_mem<uint>  n_children;
@@ -231,6 +250,7 @@ class tree_structure
     #ifdef USE_DUST
 
       int n_dust_groups;                    //Number of dust groups
+      int n_active_dust_groups;             //Number of dust groups walked this step
       //Dust particle arrays
       my_dev::dev_mem<real4> dust_pos;    //The particles positions
       my_dev::dev_mem<uint4> dust_key;    //The particles keys
@@ -238,11 +258,13 @@ class tree_structure
       my_dev::dev_mem<real4> dust_acc0;    //Acceleration
       my_dev::dev_mem<real4> dust_acc1;    //Acceleration
       my_dev::dev_mem<int>   dust_ids;
+      my_dev::dev_mem<float2> dust_time;  //The timestep details (.x=tb, .y=te)
       
       my_dev::dev_mem<int>   dust2group_list;
       my_dev::dev_mem<int2>   dust_group_list;
       my_dev::dev_mem<int>   active_dust_list;
-      my_dev::dev_mem<int>   activeDustGrouplist;      
+      my_dev::dev_mem<uint>  activeDustGrpFlags;       //Non-compacted list of active dust grps
+      my_dev::dev_mem<uint>  activeDustGrouplist;      //Compacted list of active dust groups
       my_dev::dev_mem<int2>  dust_interactions;
       
       my_dev::dev_mem<int>   dust_ngb;
@@ -285,71 +307,79 @@ class tree_structure
 
   void setMemoryContexts()
   {
-    bodies_pos.setContext(*devContext);
-    bodies_key.setContext(*devContext);
+    bodies_pos.setContext(*devContext, "bodies_pos");
+    bodies_key.setContext(*devContext, "bodies_key");
 
-    n_children.setContext(*devContext);
-    node_bodies.setContext(*devContext);
-    leafNodeIdx.setContext(*devContext);
+    n_children.setContext(*devContext, "n_children");
+    node_bodies.setContext(*devContext, "node_bodies");
+    leafNodeIdx.setContext(*devContext, "leafNodeIdx");
 
-    node_level_list.setContext(*devContext);
-    multipole.setContext(*devContext);
+    node_level_list.setContext(*devContext, "node_level_list");
+    multipole.setContext(*devContext, "multipole");
 
 
-    body2group_list.setContext(*devContext);
+    body2group_list.setContext(*devContext, "body2group_list");
 
-    bodies_vel.setContext(*devContext);
-    bodies_acc0.setContext(*devContext);
-    bodies_acc1.setContext(*devContext);
-    bodies_time.setContext(*devContext);
-    bodies_ids.setContext(*devContext);
+    bodies_vel.setContext(*devContext, "bodies_vel");
+    bodies_acc0.setContext(*devContext, "bodies_acc0");
+    bodies_acc1.setContext(*devContext, "bodies_acc1");
+    bodies_time.setContext(*devContext, "bodies_time");
+    bodies_ids.setContext(*devContext, "bodies_ids");
 
-    bodies_Ppos.setContext(*devContext);
-    bodies_Pvel.setContext(*devContext);
+    bodies_Ppos.setContext(*devContext, "bodies_Ppos");
+    bodies_Pvel.setContext(*devContext, "bodies_Pvel");
+#ifdef DOUBLE_ACCUMULATION
+    bodies_posLo.setContext(*devContext, "bodies_posLo");
+    bodies_velLo.setContext(*devContext, "bodies_velLo");
+    bodies_PposLo.setContext(*devContext, "bodies_PposLo");
+    bodies_PvelLo.setContext(*devContext, "bodies_PvelLo");
+#endif
 
-    oriParticleOrder.setContext(*devContext);
-    activeGrpList.setContext(*devContext);
-    active_group_list.setContext(*devContext);
-    level_list.setContext(*devContext);
-    activePartlist.setContext(*devContext);
-    ngb.setContext(*devContext);
-    interactions.setContext(*devContext);
+    oriParticleOrder.setContext(*devContext, "oriParticleOrder");
+    activeGrpList.setContext(*devContext, "activeGrpList");
+    active_group_list.setContext(*devContext, "active_group_list");
+    level_list.setContext(*devContext, "level_list");
+    activePartlist.setContext(*devContext, "activePartlist");
+    ngb.setContext(*devContext, "ngb");
+    interactions.setContext(*devContext, "interactions");
 
-    group_list.setContext(*devContext);
-    coarseGroupCompact.setContext(*devContext);
+    group_list.setContext(*devContext, "group_list");
+    coarseGroupCompact.setContext(*devContext, "coarseGroupCompact");
 
     //BH Opening
-    boxSizeInfo.setContext(*devContext);
-    groupSizeInfo.setContext(*devContext);
-    boxCenterInfo.setContext(*devContext);
-    groupCenterInfo.setContext(*devContext);
+    boxSizeInfo.setContext(*devContext, "boxSizeInfo");
+    groupSizeInfo.setContext(*devContext, "groupSizeInfo");
+    boxCenterInfo.setContext(*devContext, "boxCenterInfo");
+    groupCenterInfo.setContext(*devContext, "groupCenterInfo");
 
-    parallelHashes.setContext(*devContext);
-    parallelBoundaries.setContext(*devContext);
+    parallelHashes.setContext(*devContext, "parallelHashes");
+    parallelBoundaries.setContext(*devContext, "parallelBoundaries");
 
     //General buffers
-    generalBuffer1.setContext(*devContext);
+    generalBuffer1.setContext(*devContext, "generalBuffer1");
    
-    fullRemoteTree.setContext(*devContext);
+    fullRemoteTree.setContext(*devContext, "fullRemoteTree");
     
     #ifdef USE_DUST
       //Dust buffers
-      dust_pos.setContext(*devContext);
-      dust_key.setContext(*devContext);
-      dust_vel.setContext(*devContext);
-      dust_acc0.setContext(*devContext);
-      dust_acc1.setContext(*devContext);
-      dust_ids.setContext(*devContext);
+      dust_pos.setContext(*devContext, "dust_pos");
+      dust_key.setContext(*devContext, "dust_key");
+      dust_vel.setContext(*devContext, "dust_vel");
+      dust_acc0.setContext(*devContext, "dust_acc0");
+      dust_acc1.setContext(*devContext, "dust_acc1");
+      dust_ids.setContext(*devContext, "dust_ids");
+      dust_time.setContext(*devContext, "dust_time");
       
-      dust2group_list.setContext(*devContext);
-      dust_group_list.setContext(*devContext);
-      active_dust_list.setContext(*devContext);
-      dust_interactions.setContext(*devContext);
-      activeDustGrouplist.setContext(*devContext);
+      dust2group_list.setContext(*devContext, "dust2group_list");
+      dust_group_list.setContext(*devContext, "dust_group_list");
+      active_dust_list.setContext(*devContext, "active_dust_list");
+      dust_interactions.setContext(*devContext, "dust_interactions");
+      activeDustGrpFlags.setContext(*devContext, "activeDustGrpFlags");
+      activeDustGrouplist.setContext(*devContext, "activeDustGrouplist");
       
-      dust_ngb.setContext(*devContext);
-      dust_groupSizeInfo.setContext(*devContext);
-      dust_groupCenterInfo.setContext(*devContext);
+      dust_ngb.setContext(*devContext, "dust_ngb");
+      dust_groupSizeInfo.setContext(*devContext, "dust_groupSizeInfo");
+      dust_groupCenterInfo.setContext(*devContext, "dust_groupCenterInfo");
     #endif
     
     
@@ -362,12 +392,46 @@ class tree_structure
 };
 
 
+class PMSolver;
+class Telemetry;
+class AutoTuner;
+class StatsServer;
+class AnalysisScheduler;
+struct StatisticsGrid;
 
 class octree {
 protected:
   int devID;
   int rebuild_tree_rate;
 
+  //Cost driven tree rebuild. Between rebuilds the tree is refitted (topology is kept, only
+  //the node boxes and multipoles are recomputed). A rebuild is triggered when the interaction
+  //count or the top-level box volume grew by the given factor. rebuildCostFactor = 0 disables
+  //this and uses the fixed rebuild_tree_rate, otherwise rebuild_tree_rate is the max interval
+  float     rebuildCostFactor;
+  float     rebuildBoxFactor;
+  int       lastRebuildIter;
+  long long lastInteractionCount;     //Interactions (appr+direct) of the previous step
+  long long rebuildInteractionCount;  //Interactions of the first step after a rebuild
+  double    rebuildBoxVolume;         //Volume of the startLevelMin boxes right after a rebuild
+  double    refitBoxGrowth;           //Cumulative growth of that volume since the rebuild
+  int       topBoxCopyCount;          //Boxes in the pending topBoxSize copy, 0 if none
+  bool      topBoxCopyRebuild;        //The pending copy is of a freshly built tree
+
+  //Dust block time steps and regrouping. Dust steps are timeStep*2^level with
+  //level <= dustMaxLevel (0 steps all dust every step), chosen with
+  //dustEta*sqrt(eps/|a|). Only the dust groups with a particle at the end of its
+  //step are walked. dustRegroupFactor = 0 regroups the dust with every tree
+  //rebuild, otherwise only when the dust group boxes grew by that factor
+  int       dustMaxLevel;
+  float     dustEta;
+  float     dustRegroupFactor;
+  int       dustGroupedN;             //Number of dust particles at the last regroup
+  double    dustGroupVolume;          //Volume of the dust groups right after the regroup
+  double    dustGroupGrowth;          //Growth of that volume since the regroup
+  int       dustBoxCopyCount;         //Groups in the pending dustBoxSize copy, 0 if none
+  bool      dustBoxCopyRegroup;       //The pending copy is of freshly made groups
+
   
   char *execPath;
   char *src_directory;
@@ -376,6 +440,11 @@ protected:
   int nMultiProcessors;
   int nBlocksForTreeWalk;
 
+  //Knobs of the autotuner, they only change the performance
+  int treeWalkBlocks;     //Blocks launched for the tree-walks, at most nBlocksForTreeWalk
+  int letThreads;         //OpenMP threads that compute the LETs
+  int exchangeThreads;    //OpenMP threads that copy the particles to exchange
+
    //Simulation properties
   int           iter;
   float         t_current, t_previous;
@@ -383,8 +452,7 @@ protected:
   string        snapshotFile;
   float         nextSnapTime;
 
-  float        statisticsIter;
-  float        nextStatsTime;
+  AnalysisScheduler *analysis;   //In-situ analysis modules, NULL when none is registered
 
   int   NTotal, NFirst, NSecond, NThird, snapShotAdd;
   
@@ -400,6 +468,23 @@ protected:
   float theta;
 
   bool  useDirectGravity;
+  int   forceCheckIter;   //Iteration at which the tree forces are compared to direct summation, -1 disables
+  float periodicBoxSize;  //Side of the periodic box centered on the origin, 0 for open boundaries
+  int   pmGrid;           //TreePM mesh size per dimension, 0 disables the mesh
+  float pmSplit;          //TreePM split scale rs in mesh cells
+  PMSolver *pmSolver;
+  std::vector<real4> pmAcc;      //Long range acceleration of the local particles
+  std::vector<real4> pmDustAcc;  //And of the local dust
+  std::thread pmThread;          //Runs the mesh next to the tree walk, see pm_gravity
+  bool   pmThreaded;
+  double pmTime;
+
+  Telemetry *telemetry;   //Per step performance records, NULL when disabled
+  StatsServer *statsServer; //Live queries of the telemetry, process 0 only
+  AutoTuner *autoTuner;   //Tunes the knobs during the first steps, NULL when disabled
+  string     autoTuneFile;
+  int        autoTuneSteps;
+  long long  letBytesSent, letBytesRecv;  //LET traffic of the current step
 
   //Sim stats
   double Ekin, Ekin0, Ekin1;
@@ -473,6 +558,7 @@ protected:
   my_dev::kernel distanceCheck;
   my_dev::kernel approxGravLET;
   my_dev::kernel determineLET;
+  my_dev::kernel ewaldCorrection;
   
   //Parallel kernels
   my_dev::kernel domainCheck;
@@ -544,12 +630,17 @@ public:
    //General memory buffers
    my_dev::dev_mem<float3>  devMemRMIN;
    my_dev::dev_mem<float3>  devMemRMAX;
+   my_dev::dev_mem<real4>   topBoxSize;   //Pinned host copy of the startLevelMin box sizes
+   my_dev::dev_mem<real4>   dustBoxSize;  //Pinned host copy of the dust group box sizes
 
    my_dev::dev_mem<uint> devMemCounts;
    my_dev::dev_mem<uint> devMemCountsx;
 
    my_dev::dev_mem<real4> specialParticles;//Buffer to store postions of selected particles
 
+   my_dev::dev_mem<real4> ewaldTable;      //Ewald force/potential correction of a unit box, see ewald.h
+   my_dev::dev_mem<real4> ewaldSources;    //Top level monopoles of all processes for the Ewald correction
+
 
    tree_structure localTree;
    tree_structure remoteTree;
@@ -593,6 +684,7 @@ public:
     void allocateParticleMemory(tree_structure &tree);
     void allocateTreePropMemory(tree_structure &tree);
     void reallocateParticleMemory(tree_structure &tree);
+    void clearParticleLowWords(tree_structure &tree);
 
     void build(tree_structure &tree);
     void compute_properties (tree_structure &tree);
@@ -638,10 +730,22 @@ public:
   void iterate_teardown(IterationData &idata); 
   bool iterate_once(IterationData &idata); 
 
+  bool   needTreeRebuild();
+  void   startTopLevelBoxCopy(tree_structure &tree, bool rebuilt);
+  void   updateRefitBoxGrowth();
+
   //Subfunctions of iterate, should probally be private 
   void predict(tree_structure &tree);
   void approximate_gravity(tree_structure &tree);
   void direct_gravity(tree_structure &tree);
+  void checkForceAccuracy(tree_structure &tree);
+  void checkMemoryEstimate(tree_structure &tree);
+  void ewald_correction(tree_structure &tree);
+  void periodicDirectAcc(tree_structure &tree, const std::vector<int> &targets, std::vector<double> &acc);
+  void pm_gravity(tree_structure &tree);
+  void pm_compute(tree_structure *tree);
+  void pm_wait();
+  void pm_addForces(tree_structure &tree);
   void correct(tree_structure &tree);
   double compute_energies(tree_structure &tree);
 
@@ -705,6 +809,7 @@ public:
   int  mpiGetRank();
   int  mpiGetNProcs();
   void AllSum(double &value);
+  void gatherEwaldSources(std::vector<real4> &sources);
   int  SumOnRootRank(int &value);
 
   //Main MPI functions
@@ -868,18 +973,23 @@ public:
     void approximate_dust(tree_structure &tree);
     void direct_dust(tree_structure &tree);
     void setDustGroupProperties(tree_structure &tree);
+    void updateDustGroups(tree_structure &tree, bool treeRebuilt);
+    void startDustGroupBoxCopy(tree_structure &tree, bool regrouped);
+    void updateDustGroupGrowth();
     
     my_dev::kernel define_dust_groups;
     my_dev::kernel store_dust_groups;
     my_dev::kernel predictDust;
+    my_dev::kernel setActiveDust;
     my_dev::kernel correctDust;
   #endif
   
   // Function for setting up the mergers
   bool addGalaxy(int galaxyID);
 
-  // WarOfGalaxies: add galaxy to simulation
-  void releaseGalaxy(Galaxy const& galaxy);
+  // WarOfGalaxies: add a copy of galaxy to the simulation, moved by placement
+  // and with user_id as last digit of its particle ids
+  void releaseGalaxy(Galaxy const& galaxy, PhaseTransform const& placement, int user_id);
 
   // WarOfGalaxies: remove particles of a user
   void removeGalaxy(int user_id);
@@ -928,6 +1038,40 @@ public:
          bool direct = false)
   : rebuild_tree_rate(_rebuild), procId(0), nProcs(1), thisPartLETExTime(0), useDirectGravity(direct)
   {
+    forceCheckIter          = -1;
+    periodicBoxSize         = 0;
+    pmGrid                  = 0;
+    pmSplit                 = 1.25f;
+    pmSolver                = NULL;
+    pmThreaded              = false;
+    pmTime                  = 0;
+    telemetry               = NULL;
+    statsServer             = NULL;
+    autoTuner               = NULL;
+    autoTuneSteps           = 0;
+    treeWalkBlocks          = 0;
+    letThreads              = 16;
+    exchangeThreads         = 4;
+    letBytesSent            = 0;
+    letBytesRecv            = 0;
+    rebuildCostFactor       = 0;
+    rebuildBoxFactor        = 2.0f;
+    lastRebuildIter         = 0;
+    lastInteractionCount    = 0;
+    rebuildInteractionCount = 0;
+    rebuildBoxVolume        = 0;
+    refitBoxGrowth          = 1;
+    topBoxCopyCount         = 0;
+    topBoxCopyRebuild       = false;
+    dustMaxLevel            = 0;
+    dustEta                 = 0.1f;
+    dustRegroupFactor       = 0;
+    dustGroupedN            = -1;
+    dustGroupVolume         = 0;
+    dustGroupGrowth         = 1;
+    dustBoxCopyCount        = 0;
+    dustBoxCopyRegroup      = false;
+
 #if USE_B40C
     sorter = 0;
 #endif
@@ -964,8 +1108,7 @@ public:
 
 //    LOGF(stderr, "Settings device : %d\t"  << devID << "\t" << device << "\t" << nProcs <<endl;
 
-    statisticsIter = 0; //0=disabled, 1 = Every N-body unit, 2= every 2nd n-body unit, etc..
-    nextStatsTime  = 0;
+    analysis       = NULL;
 
     snapshotIter = snapI;
     snapshotFile = snapF;
@@ -1073,6 +1216,25 @@ public:
 
   void setUseDirectGravity(bool s) { useDirectGravity = s;    }
   bool getUseDirectGravity() const { return useDirectGravity; }
+
+  void setRebuildCostFactors(float cost, float box) { rebuildCostFactor = cost; rebuildBoxFactor = box; }
+  void setDustSteps(int levels, float eta, float regroup) { dustMaxLevel = levels; dustEta = eta; dustRegroupFactor = regroup; }
+  void setForceCheckIter(int i) { forceCheckIter = i; }
+
+  void setPeriodicBoxSize(float L);
+  void initPeriodicBoundaries();
+  void setPeriodicCorner(real4 &corner);
+  void setTreePM(int grid, float split);
+  void initTreePM();
+  void setTelemetry(const string &fileName);
+  void setStatsServer(int port);
+  void setStatistics(float densityIter, float diskIter, float sphIter, int sphNgb,
+                     const StatisticsGrid &grid, int nThreads);
+  void setHaloFinder(float fofIter, float linkLength, int minMembers, int kNN, int nThreads);
+  void initAnalysis(int nThreads);
+  void stageAnalysis();
+  void setAutoTune(const string &fileName, int steps) { autoTuneFile = fileName; autoTuneSteps = steps; }
+  void initAutoTuner();
 };
 
 
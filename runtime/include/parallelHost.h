@@ -0,0 +1,147 @@
+#pragma once
+
+//Host side types and functions of the LET selection in parallel.cpp. They
+//are declared here so that the host benchmarks (benchmark/) can call the
+//same code as a run. The functions are only compiled with USE_MPI.
+
+#include <vector>
+#include "octree.h"
+
+typedef float  _v4sf  __attribute__((vector_size(16)));
+typedef int    _v4si  __attribute__((vector_size(16)));
+
+struct v4sf
+{
+  _v4sf data;
+  v4sf() {}
+  v4sf(const _v4sf _data) : data(_data) {}
+  operator const _v4sf&() const {return data;}
+  operator       _v4sf&()       {return data;}
+
+};
+
+/*
+ *
+ * OpenMP magic / chaos here, to prevent realloc of
+ * buffers which seems to be notoriously slow on
+ * HA-Pacs
+ */
+struct GETLETBUFFERS
+{
+  std::vector<int2> LETBuffer_node;
+  std::vector<int > LETBuffer_ptcl;
+
+  std::vector<uint4>  currLevelVecUI4;
+  std::vector<uint4>  nextLevelVecUI4;
+
+  std::vector<int>  currLevelVecI;
+  std::vector<int>  nextLevelVecI;
+
+
+  std::vector<int>    currGroupLevelVec;
+  std::vector<int>    nextGroupLevelVec;
+
+  //These are for getLET(Quick) only
+  std::vector<v4sf> groupCentreSIMD;
+  std::vector<v4sf> groupSizeSIMD;
+
+  std::vector<v4sf> groupCentreSIMDSwap;
+  std::vector<v4sf> groupSizeSIMDSwap;
+
+  std::vector<int>  groupSIMDkeys;
+
+#if 0 /* AVX */
+#ifndef __AVX__
+#error "AVX is not defined"
+#endif
+  std::vector< std::pair<v4sf,v4sf> > groupSplitFlag;
+#define AVXIMBH
+#else
+  std::vector<v4sf> groupSplitFlag;
+#define SSEIMBH
+#endif
+
+  //Reserved host memory, for the memory accounting
+  template<typename T>
+  static long long vecBytes(const std::vector<T> &v) { return v.capacity()*sizeof(T); }
+
+  long long capacityBytes() const
+  {
+    return vecBytes(LETBuffer_node)    + vecBytes(LETBuffer_ptcl) +
+           vecBytes(currLevelVecUI4)   + vecBytes(nextLevelVecUI4) +
+           vecBytes(currLevelVecI)     + vecBytes(nextLevelVecI) +
+           vecBytes(currGroupLevelVec) + vecBytes(nextGroupLevelVec) +
+           vecBytes(groupSplitFlag)    + vecBytes(groupCentreSIMD) + vecBytes(groupSizeSIMD) +
+           vecBytes(groupCentreSIMDSwap) + vecBytes(groupSizeSIMDSwap) + vecBytes(groupSIMDkeys);
+  }
+
+
+  char padding[512 -
+               ( sizeof(LETBuffer_node) +
+                 sizeof(LETBuffer_ptcl) +
+                 sizeof(currLevelVecUI4) +
+                 sizeof(nextLevelVecUI4) +
+                 sizeof(currLevelVecI) +
+                 sizeof(nextLevelVecI) +
+                 sizeof(currGroupLevelVec) +
+                 sizeof(nextGroupLevelVec) +
+                 sizeof(groupSplitFlag) +
+                 sizeof(groupCentreSIMD) +
+                 sizeof(groupSizeSIMD)
+               )];
+};
+/* End of Magic */
+
+
+void extractGroupsTreeFull(
+    std::vector<real4> &groupCentre,
+    std::vector<real4> &groupSize,
+    std::vector<real4> &groupMulti,
+    std::vector<real4> &groupBody,
+    const real4 *nodeCentre,
+    const real4 *nodeSize,
+    const real4 *nodeMulti,
+    const real4 *nodeBody,
+    const int cellBeg,
+    const int cellEnd,
+    const int nNodes);
+
+int getLEToptQuickTreevsTree(
+    GETLETBUFFERS &bufferStruct,
+    const real4 *nodeCentre,
+    const real4 *nodeSize,
+    const real4 *multipole,
+    const int cellBeg,
+    const int cellEnd,
+    const real4 *groupSizeInfo,
+    const real4 *groupCentreInfo,
+    const int groupBeg,
+    const int groupEnd,
+    const int nNodes,
+    const int procId,
+    const int ibox,
+    double &timeFunction);
+
+//Instantiated for T = v4sf in parallel.cpp
+template<typename T>
+int getLEToptQuickFullTree(
+    std::vector<T> &LETBuffer,
+    GETLETBUFFERS &bufferStruct,
+    const int NCELLMAX,
+    const int NDEPTHMAX,
+    const real4 *nodeCentre,
+    const real4 *nodeSize,
+    const real4 *multipole,
+    const int cellBeg,
+    const int cellEnd,
+    const real4 *bodies,
+    const int nParticles,
+    const real4 *groupSizeInfo,
+    const real4 *groupCentreInfo,
+    const int groupBeg,
+    const int groupEnd,
+    const int nNodes,
+    const int procId,
+    const int ibox,
+    unsigned long long &nflops,
+    double &time);
@@ -0,0 +1,82 @@
+#pragma once
+
+//Hardware counters of named host phases, read with perf_event_open (Linux).
+//Every thread that enters a phase opens its own counter group (cycles,
+//instructions, last level cache misses and branch misses) which counts that
+//thread only, the counts of a phase are summed over the threads. A scope
+//around an OpenMP parallel region only counts the thread that opened it, put
+//the scope inside the region to count all threads.
+//Disabled (and close to free) unless PerfCounters::init is called with true.
+
+enum PerfPhase
+{
+  PERF_LET_BUILD,       //getLEToptQuickFullTree / getLETquick
+  PERF_LET_CHECK,       //Remote boundary versus the local tree
+  PERF_LET_MERGE,       //Host part of mergeAndLaunchLETStructures
+  PERF_GROUP_TREE,      //extractGroupsTreeFull
+  PERF_SAMPLE_SORT,     //Sort of the domain decomposition samples
+  PERF_STATISTICS,      //Analysis modules (DENSITY, DISKSTATS), on the pool threads
+  PERF_NPHASES
+};
+
+enum PerfCounter
+{
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_LLC_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_NCOUNTERS
+};
+
+struct PerfPhaseCounts
+{
+  long long calls;
+  long long counts[PERF_NCOUNTERS];
+};
+
+class PerfCounters
+{
+  public:
+    static void init(const bool enable, const int procId);
+    static bool enabled() { return isEnabled; }
+
+    //Counter values of the calling thread, false if they are not available
+    static bool read(long long values[PERF_NCOUNTERS]);
+    static void add(const int phase, const long long begin[PERF_NCOUNTERS], const long long end[PERF_NCOUNTERS]);
+
+    //Sum over the threads since the previous call. Call it while no phase is running
+    static void collect(PerfPhaseCounts counts[PERF_NPHASES]);
+
+    //Counts of the whole run per phase and the IPC range over the threads
+    static void report();
+
+    static const char *phaseName(const int phase);
+
+  private:
+    static bool isEnabled;
+};
+
+//Counts the enclosing scope on the calling thread, or up to stop()
+class PerfScope
+{
+  public:
+    PerfScope(const int _phase) : phase(_phase),
+      running(PerfCounters::enabled() && PerfCounters::read(begin)) {}
+    ~PerfScope() { stop(); }
+
+    void stop()
+    {
+      long long end[PERF_NCOUNTERS];
+      if(running && PerfCounters::read(end)) PerfCounters::add(phase, begin, end);
+      running = false;
+    }
+
+  private:
+    const int phase;
+    long long begin[PERF_NCOUNTERS];
+    bool      running;
+};
+
+#define PERF_CONCAT2(a, b) a ## b
+#define PERF_CONCAT(a, b)  PERF_CONCAT2(a, b)
+#define PERF_SCOPE(phase)  PerfScope PERF_CONCAT(perfScope, __LINE__)(phase)
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+//Rigid transforms of particle sets in phase space, for the merger setup and
+//for galaxies released at runtime (War of Galaxies). A transform maps
+//
+//  x' = A x + a,   v' = B v + b,   m' = s m
+//
+//and is composed from the operations below, each acting on the result of
+//the previous ones, so centring, Euler rotation, rescaling, translation and
+//boost are applied to the particles in a single pass instead of a loop per
+//operation. The pass runs on all OpenMP threads and works in place or from
+//a source into another buffer (such as the pinned host buffers of the
+//tree). T4 is real4 or any type with x, y, z, w.
+//
+//  const PhaseMoments m = phaseMoments(pos, vel, n);
+//  PhaseTransform t;
+//  t.translate(-m.x[0], -m.x[1], -m.x[2]).boost(-m.v[0], -m.v[1], -m.v[2]);
+//  t.euler(inc, omega).translate(dx, dy, 0);
+//  t.apply(pos, vel, n);
+
+//Mass weighted sums of the positions and velocities and the plain sum of
+//the velocities, in double precision
+struct PhaseMoments
+{
+  double mass;
+  double x[3], v[3];        //Centre of mass and its velocity
+  double vMean[3];          //Mean velocity, not mass weighted
+};
+
+template<typename T4>
+PhaseMoments phaseMoments(const T4 *pos, const T4 *vel, const long n)
+{
+  double m = 0, mx = 0, my = 0, mz = 0, mvx = 0, mvy = 0, mvz = 0, vx = 0, vy = 0, vz = 0;
+
+#pragma omp parallel for schedule(static) reduction(+:m,mx,my,mz,mvx,mvy,mvz,vx,vy,vz)
+  for(long i = 0; i < n; i++)
+  {
+    const double w = pos[i].w;
+    m   += w;
+    mx  += w*pos[i].x; my  += w*pos[i].y; mz  += w*pos[i].z;
+    mvx += w*vel[i].x; mvy += w*vel[i].y; mvz += w*vel[i].z;
+    vx  += vel[i].x;   vy  += vel[i].y;   vz  += vel[i].z;
+  }
+
+  PhaseMoments r;
+  r.mass = m;
+  const double im = m != 0 ? 1.0/m : 0.0;
+  const double in = n > 0  ? 1.0/n : 0.0;
+  r.x[0] = mx*im;   r.x[1] = my*im;   r.x[2] = mz*im;
+  r.v[0] = mvx*im;  r.v[1] = mvy*im;  r.v[2] = mvz*im;
+  r.vMean[0] = vx*in; r.vMean[1] = vy*in; r.vMean[2] = vz*in;
+  return r;
+}
+
+struct PhaseTransform
+{
+  double A[3][3], a[3];     //Positions
+  double B[3][3], b[3];     //Velocities
+  double s;                 //Masses
+
+  PhaseTransform() : s(1)
+  {
+    for(int i = 0; i < 3; i++)
+    {
+      for(int j = 0; j < 3; j++) A[i][j] = B[i][j] = (i == j);
+      a[i] = b[i] = 0;
+    }
+  }
+
+  PhaseTransform& translate(const double x, const double y, const double z)
+  {
+    a[0] += x; a[1] += y; a[2] += z;
+    return *this;
+  }
+
+  PhaseTransform& boost(const double vx, const double vy, const double vz)
+  {
+    b[0] += vx; b[1] += vy; b[2] += vz;
+    return *this;
+  }
+
+  //Positions about the origin by sPos, velocities by sVel, masses by sMass
+  PhaseTransform& scale(const double sPos, const double sVel, const double sMass)
+  {
+    for(int i = 0; i < 3; i++)
+    {
+      for(int j = 0; j < 3; j++) { A[i][j] *= sPos; B[i][j] *= sVel; }
+      a[i] *= sPos;
+      b[i] *= sVel;
+    }
+    s *= sMass;
+    return *this;
+  }
+
+  //Rotation about the origin, r' = R r
+  PhaseTransform& rotate(const double R[3][3])
+  {
+    double A2[3][3], B2[3][3], a2[3], b2[3];
+    for(int i = 0; i < 3; i++)
+    {
+      a2[i] = b2[i] = 0;
+      for(int j = 0; j < 3; j++)
+      {
+        A2[i][j] = B2[i][j] = 0;
+        for(int k = 0; k < 3; k++) { A2[i][j] += R[i][k]*A[k][j]; B2[i][j] += R[i][k]*B[k][j]; }
+        a2[i] += R[i][j]*a[j];
+        b2[i] += R[i][j]*b[j];
+      }
+    }
+    for(int i = 0; i < 3; i++)
+    {
+      for(int j = 0; j < 3; j++) { A[i][j] = A2[i][j]; B[i][j] = B2[i][j]; }
+      a[i] = a2[i];
+      b[i] = b2[i];
+    }
+    return *this;
+  }
+
+  //Orientation of a galaxy disk in the merger setup: inclination inc and
+  //argument omega in radians, a disk in the xy plane gets the normal
+  //(-sin(inc) sin(omega), sin(inc) cos(omega), cos(inc))
+  PhaseTransform& euler(const double inc, const double omega)
+  {
+    const double R[3][3] = {{cos(omega), -cos(inc)*sin(omega), -sin(inc)*sin(omega)},
+                            {sin(omega),  cos(inc)*cos(omega),  sin(inc)*cos(omega)},
+                            {0.0,        -sin(inc),             cos(inc)}};
+    return rotate(R);
+  }
+
+  //Transforms n particles from src into dst, which may be the same arrays
+  template<typename T4>
+  void apply(const T4 *srcPos, const T4 *srcVel, T4 *dstPos, T4 *dstVel, const long n) const
+  {
+#pragma omp parallel for schedule(static)
+    for(long i = 0; i < n; i++) transform(srcPos[i], srcVel[i], dstPos[i], dstVel[i]);
+  }
+
+  template<typename T4>
+  void apply(T4 *pos, T4 *vel, const long n) const { apply(pos, vel, pos, vel, n); }
+
+  template<typename T4>
+  void transform(const T4 &p, const T4 &v, T4 &pOut, T4 &vOut) const
+  {
+    const double x  = p.x, y  = p.y, z  = p.z;
+    const double vx = v.x, vy = v.y, vz = v.z;
+    pOut.x = A[0][0]*x  + A[0][1]*y  + A[0][2]*z  + a[0];
+    pOut.y = A[1][0]*x  + A[1][1]*y  + A[1][2]*z  + a[1];
+    pOut.z = A[2][0]*x  + A[2][1]*y  + A[2][2]*z  + a[2];
+    pOut.w = s*p.w;
+    vOut.x = B[0][0]*vx + B[0][1]*vy + B[0][2]*vz + b[0];
+    vOut.y = B[1][0]*vx + B[1][1]*vy + B[1][2]*vz + b[1];
+    vOut.z = B[2][0]*vx + B[2][1]*vy + B[2][2]*vz + b[2];
+    vOut.w = v.w;
+  }
+};
+
+//A transform of the particles [first, first+n) of a buffer
+struct PhaseRange
+{
+  long           first, n;
+  PhaseTransform transform;
+};
+
+//Applies the transforms of several ranges of one buffer in place, in one
+//parallel region
+template<typename T4>
+void applyPhaseTransforms(T4 *pos, T4 *vel, const std::vector<PhaseRange> &ranges)
+{
+#pragma omp parallel
+  for(size_t r = 0; r < ranges.size(); r++)
+  {
+    const PhaseRange &range = ranges[r];
+#pragma omp for schedule(static) nowait
+    for(long i = range.first; i < range.first + range.n; i++)
+      range.transform.transform(pos[i], vel[i], pos[i], vel[i]);
+  }
+}
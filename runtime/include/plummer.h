@@ -1,190 +1,127 @@
 #pragma once
 
-#include <cstdio>
-#include <cstdlib>
 #include <cmath>
-#include <vector>
-#include <fstream>
-#include "vector3.h"
-
-struct Plummer{
-	std::vector<double> mass;
-	std::vector<dvec3> pos, vel;
-	Plummer(
-			unsigned long n, 
-			const int procId,
-			unsigned int  seed = 19810614, 
-			const char   *filename = "plummer.dat") 
-		: mass(n), pos(n), vel(n)
-		{
-#if 0
-			{
-				std::ifstream ifs(filename);
-				if(!ifs.fail()){
-					unsigned long ntmp, stmp;
-					ifs.read((char *)&ntmp, sizeof(unsigned long));
-					ifs.read((char *)&stmp, sizeof(unsigned long));
-					if(n == ntmp  && seed == stmp){
-						ifs.read((char *)&mass[0], n*sizeof(double));
-						ifs.read((char *)& pos[0], n*sizeof(dvec3));
-						ifs.read((char *)& vel[0], n*sizeof(dvec3));
-						if(!ifs.fail()){
-							fprintf(stdout, "plummer : read from %s\n", filename);
-						}
-						return;
-					}
-				}
-			}
-#endif
-			my_srand(seed);
-			unsigned long i = 0;
-			while(i < n){
-				const double X1 = my_rand();
-				const double X2 = my_rand();
-				const double X3 = my_rand();
-				const double c = (pow(X1,-2.0/3.0) - 1.0);
-        if (c < 0)
-        {
-          fprintf(stderr, "%d : THIS MAKES [c=%e] NaN, continue\n", (int)i, c);
-          continue;
-        }
-				const double R = 1.0/sqrt( c );
-        #ifdef WIN32
-        if(R != R) //nan compared with nan is false
-        {
-          fprintf(stderr, "%d : Nan detected R [c=%e] NaN, continue\n", (int)i, c);
-          continue;
-        }
-        #else
-        if(std::isnan(R))
-        {
-          fprintf(stderr, "%d : Nan detected R [c=%e] NaN, continue\n", (int)i, c);
-          continue;
-        }
-        #endif
-
-				if(R < 100.0) {
-					double Z = (1.0 - 2.0*X2)*R;
-					if((R*R - Z*Z) < 0.0){
-						fprintf(stderr, "%d : THIS MAKES NaN, continue\n", (int)i);
-						continue;
-					}
-					double X = sqrt(R*R - Z*Z) * cos(2.0*M_PI*X3);
-					double Y = sqrt(R*R - Z*Z) * sin(2.0*M_PI*X3);
-					
-					if(!(X == X)){
-						fprintf(stderr, "NaN detectd X[%d], continue\n", (int)i);
-						continue;
-					}
-					if(!(Y == Y)){
-						fprintf(stderr, "NaN detectd Y[%d], continue\n", (int)i);
-						continue;
-					}
-
-					const double Ve = sqrt(2.0)*pow( (1.0 + R*R), -0.25 );
-
-					double X4 = 0.0; 
-					double X5 = 0.0;
-
-					while( 0.1*X5 >= X4*X4*pow( (1.0-X4*X4), 3.5) ) {
-						X4 = my_rand(); X5 = my_rand(); 
-					} 
-
-					const double V = Ve*X4;
-
-					const double X6 = my_rand();
-					const double X7 = my_rand();
-
-					double Vz = (1.0 - 2.0*X6)*V;
-					double Vx = sqrt(V*V - Vz*Vz) * cos(2.0*M_PI*X7);
-					double Vy = sqrt(V*V - Vz*Vz) * sin(2.0*M_PI*X7);
-
-					const double conv = 3.0*M_PI/16.0;
-					X *= conv; Y *= conv; Z *= conv;    
-					Vx /= sqrt(conv); Vy /= sqrt(conv); Vz /= sqrt(conv);
-
-					double M = 1.0;
-					mass[i] = M / (double)n;
-
-					pos[i][0] = X;
-					pos[i][1] = Y;
-					pos[i][2] = Z;
-
-					vel[i][0] = Vx;
-					vel[i][1] = Vy;
-					vel[i][2] = Vz;
-
-					/*
-					   tmp_i = ldiv(i, 256);
-					   if(tmp_i.rem == 0) printf("i = %d \n", i);
-					   */
-
-					ldiv_t tmp_i = ldiv(i, n/64);
-
-					if(tmp_i.rem == 0 && procId == 0) {
-						printf(".");
-						fflush(stdout); 
-					}
-					i++; 
-				}		
-			} // while (i<n)
-			double mcm = 0.0;
-
-			double xcm[3], vcm[3];
-			for(int k=0;k<3;k++) {
-				xcm[k] = 0.0; vcm[k] = 0.0;
-			} /* k */
-
-			for(i=0; i<n; i++) {
-				mcm += mass[i];
-				for(int k=0;k<3;k++) {
-					xcm[k] += mass[i] * pos[i][k]; 
-					vcm[k] += mass[i] * vel[i][k]; 
-				} /* k */ 
-			}  /* i */
-			for(int k=0;k<3;k++) {
-				xcm[k] /= mcm; vcm[k] /= mcm;
-			} /* k */
-
-			for(i=0; i<n; i++) {
-				for(int k=0;k<3;k++) {
-					pos[i][k] -= xcm[k]; 
-					vel[i][k] -= vcm[k]; 
-				} /* k */ 
-			} /* i */ 
-			if (procId == 0)
-				printf("\n");
-#if 0
-			{
-				std::ofstream ofs(filename);
-				if(!ofs.fail()){
-					unsigned long ntmp = n;
-					unsigned long stmp = seed;
-					ofs.write((char *)&ntmp, sizeof(unsigned long));
-					ofs.write((char *)&stmp, sizeof(unsigned long));
-					ofs.write((char *)&mass[0], n*sizeof(double));
-					ofs.write((char *)& pos[0], n*sizeof(dvec3));
-					ofs.write((char *)& vel[0], n*sizeof(dvec3));
-					if(!ofs.fail()){
-						fprintf(stdout, "plummer : wrote to %s\n", filename);
-					}
-				}
-			}
-#endif
-		}
-#if 0
-	static void my_srand(const unsigned int seed){
-		srand(seed);
-	}
-	static double my_rand(void) {
-		return rand()/(1. + RAND_MAX);
-	}
-#else
-	static void my_srand(const int seed){
-		srand48(seed);
-	}
-	static double my_rand(void) {
-		return drand48();
-	}
-#endif
+#include "counterRNG.h"
+
+//Initial conditions for the --plummer and --sphere models, in N-body units
+//with a total mass of one. Particle i of the model is drawn from its own
+//Philox stream keyed by (seed, i), so the model only depends on the seed and
+//the total number of particles: every process fills its range [first,
+//first+n) of the global indices in parallel, directly into the position and
+//velocity arrays, and any split over threads or processes gives the same
+//particles. T4 is real4 or any type with x, y, z, w.
+//
+//  ICSums sums = makePlummer(pos, vel, first, n, nTotal, seed);
+//  MPI_Allreduce(MPI_IN_PLACE, sums.v, ICSums::N, MPI_LONG_LONG, MPI_SUM, comm);
+//  sums.centre(pos, vel, n, nTotal);
+
+//Default seeds of the models
+enum { PLUMMER_SEED = 19810614, SPHERE_SEED = 19840501 };
+
+//Sums of the positions and velocities for the centre of mass correction.
+//Every term is rounded to a multiple of 2^-SHIFT and added as an integer,
+//which is exact in any order, so the correction is identical as well
+struct ICSums
+{
+  enum {N = 6, SHIFT = 20};
+  long long v[N];
+
+  ICSums() { for(int k = 0; k < N; k++) v[k] = 0; }
+
+  static long long fixed(const double x) { return llrint(ldexp(x, SHIFT)); }
+
+  //The particles all have the same mass, the centre of mass is the mean
+  template<typename T4>
+  void centre(T4 *pos, T4 *vel, const int n, const long long nTotal) const
+  {
+    double c[N];
+    for(int k = 0; k < N; k++) c[k] = ldexp((double)v[k], -SHIFT) / nTotal;
+
+#pragma omp parallel for schedule(static)
+    for(int i = 0; i < n; i++)
+    {
+      pos[i].x -= c[0]; pos[i].y -= c[1]; pos[i].z -= c[2];
+      vel[i].x -= c[3]; vel[i].y -= c[4]; vel[i].z -= c[5];
+    }
+  }
 };
+
+//Plummer sphere (Aarseth, Henon & Wielen 1974) truncated at 100 scale
+//radii and scaled to a virial radius of one. Returns the local sums for the
+//centring, the particles are not centred yet
+template<typename T4>
+ICSums makePlummer(T4 *pos, T4 *vel, const long long first, const int n,
+                   const long long nTotal, const unsigned int seed = PLUMMER_SEED)
+{
+  const double conv = 3.0*M_PI/16.0;
+  const double mass = 1.0/nTotal;
+  long long s0 = 0, s1 = 0, s2 = 0, s3 = 0, s4 = 0, s5 = 0;
+
+#pragma omp parallel for schedule(static) reduction(+:s0,s1,s2,s3,s4,s5)
+  for(int i = 0; i < n; i++)
+  {
+    PhiloxStream rng(seed, first + i);
+
+    double R;
+    do
+    {
+      R = 1.0/sqrt(pow(rng.uniform(), -2.0/3.0) - 1.0);
+    } while(!(R < 100.0));
+
+    const double Z   = (1.0 - 2.0*rng.uniform())*R;
+    const double phi = 2.0*M_PI*rng.uniform();
+    const double Rxy = sqrt(fmax(R*R - Z*Z, 0.0));
+
+    //von Neumann rejection for q = v/v_escape, g(q) = q^2 (1-q^2)^3.5
+    double X4, X5;
+    do
+    {
+      X4 = rng.uniform();
+      X5 = rng.uniform();
+    } while(0.1*X5 >= X4*X4*pow(1.0 - X4*X4, 3.5));
+
+    const double V   = sqrt(2.0)*pow(1.0 + R*R, -0.25)*X4;
+    const double Vz  = (1.0 - 2.0*rng.uniform())*V;
+    const double psi = 2.0*M_PI*rng.uniform();
+    const double Vxy = sqrt(fmax(V*V - Vz*Vz, 0.0));
+
+    const double x[6] = {Rxy*cos(phi)*conv, Rxy*sin(phi)*conv, Z*conv,
+                         Vxy*cos(psi)/sqrt(conv), Vxy*sin(psi)/sqrt(conv), Vz/sqrt(conv)};
+
+    pos[i].x = x[0]; pos[i].y = x[1]; pos[i].z = x[2]; pos[i].w = mass;
+    vel[i].x = x[3]; vel[i].y = x[4]; vel[i].z = x[5]; vel[i].w = 0;
+
+    s0 += ICSums::fixed(x[0]); s1 += ICSums::fixed(x[1]); s2 += ICSums::fixed(x[2]);
+    s3 += ICSums::fixed(x[3]); s4 += ICSums::fixed(x[4]); s5 += ICSums::fixed(x[5]);
+  }
+
+  ICSums sums;
+  sums.v[0] = s0; sums.v[1] = s1; sums.v[2] = s2;
+  sums.v[3] = s3; sums.v[4] = s4; sums.v[5] = s5;
+  return sums;
+}
+
+//Uniform sphere of radius one at rest
+template<typename T4>
+void makeSphere(T4 *pos, T4 *vel, const long long first, const int n,
+                const long long nTotal, const unsigned int seed = SPHERE_SEED)
+{
+  const double mass = 1.0/nTotal;
+
+#pragma omp parallel for schedule(static)
+  for(int i = 0; i < n; i++)
+  {
+    PhiloxStream rng(seed, first + i);
+
+    double x, y, z;
+    do
+    {
+      x = 2.0*rng.uniform() - 1.0;
+      y = 2.0*rng.uniform() - 1.0;
+      z = 2.0*rng.uniform() - 1.0;
+    } while(x*x + y*y + z*z >= 1.0);
+
+    pos[i].x = x; pos[i].y = y; pos[i].z = z; pos[i].w = mass;
+    vel[i].x = 0; vel[i].y = 0; vel[i].z = 0; vel[i].w = 0;
+  }
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <cstdio>
+#include "perfCounters.h"
+
+//Structured per step performance records. Every process records one entry
+//per iteration, process 0 additionally records the aggregate over all
+//processes (rank -1). Records are put in a single producer / single consumer
+//ring buffer and written by a background thread, either as JSON lines or as
+//a binary file of TelemetryRecord structs (selected with a .bin extension).
+//The binary file starts with the magic "BTEL", the format version and the
+//size of a record.
+//With --perfcounters the records also hold the hardware counters of the
+//host phases of the step, the aggregate holds the sum.
+//The last TELEMETRY_HISTORY records are also kept in memory for the stats
+//server, with an empty file name only that history is kept.
+
+#define TELEMETRY_NREGIONS 16     //Timing region types, the type argument of stopTiming
+#define TELEMETRY_VERSION  3
+#define TELEMETRY_HISTORY  64     //Records kept in memory for queries
+
+struct TelemetryRecord
+{
+  int       iter;
+  int       rank;                 //-1 for the aggregate over all processes
+  int       n;
+  int       nActive;
+  double    tSim;
+
+  //Wall clock times in seconds of this step, the aggregate holds the maximum
+  double    stepTime;
+  double    gravTime;
+  double    buildTime;
+  double    domainTime;
+  double    waitTime;
+  double    letCommTime;
+  double    gpuGravLocal;         //ms
+  double    gpuGravLET;           //ms
+
+  long long nDirect;
+  long long nApprox;
+  long long letBytesSent;
+  long long letBytesRecv;
+  long long memHighWater;         //Device bytes, the aggregate holds the sum
+
+  double    imbalance;            //Aggregate only: max / mean stepTime
+  double    energyError;          //Relative total energy error since the start, (E - E0) / E0
+  double    regionTime[TELEMETRY_NREGIONS];  //ms per timing region type
+  PerfPhaseCounts perf[PERF_NPHASES];        //Host phase hardware counters
+};
+
+class Telemetry
+{
+  public:
+    Telemetry(const std::string &fileName, const int procId, const int nProcs,
+              const int capacity = 1024);
+    ~Telemetry();
+
+    //Called from the main thread once per step. With more than one process
+    //this is collective because of the aggregate
+    void record(const TelemetryRecord &rec);
+
+    long long getDropped() const { return dropped; }
+
+    //Copy of the most recent records of rank (-1 for the aggregate), oldest
+    //first. Safe to call from any thread
+    void recent(std::vector<TelemetryRecord> &records, const int rank, const int count) const;
+
+  private:
+    const int procId, nProcs;
+    bool      binary;
+    FILE     *out;
+
+    std::vector<TelemetryRecord> ring;
+    std::atomic<size_t>          head;   //Next slot to write, producer only
+    std::atomic<size_t>          tail;   //Next slot to read, consumer only
+    std::atomic<bool>            stop;
+    std::thread                  writer;
+    long long                    dropped;
+
+    mutable std::mutex           historyMutex;
+    std::vector<TelemetryRecord> history;      //Ring of TELEMETRY_HISTORY records
+    size_t                       historyCount;
+
+    void push(const TelemetryRecord &rec);
+    void aggregate(const TelemetryRecord &rec);
+    void writerLoop();
+    void write(const TelemetryRecord &rec);
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+
+//Timeline of host threads, MPI calls and GPU streams in the Chrome trace
+//event format (chrome://tracing, Perfetto). Events are buffered per thread
+//with the host steady clock and written per process at the end of the run.
+//The GPU regions come from the timing regions of the device context. The
+//time origin of every process is the exit of a barrier at start up, and the
+//time of a second barrier at the end is stored so that mergeTraces.py can
+//correct clock drift when it combines the files of all processes.
+//Disabled (and close to free) unless Trace::init is called.
+
+class Trace
+{
+  public:
+    //Collective, all processes have to call init and write
+    static void init(const std::string &fileName, const int procId, const int nProcs);
+    static void write();
+
+    static bool enabled() { return isEnabled; }
+
+    //Microseconds since the time origin
+    static double now();
+
+    //Event of the calling thread from begin to end (microseconds)
+    static void complete(const char *name, const double begin, const double end);
+    static void instant (const char *name);
+
+    //Device context timing hook, times in milliseconds of the host steady clock
+    static void gpuRegion(const char *name, const void *stream, const double startMs, const double endMs);
+    static void nameStream(const void *stream, const char *name);
+
+  private:
+    static bool isEnabled;
+};
+
+//Traces the enclosing scope on the calling thread
+class TraceScope
+{
+  public:
+    TraceScope(const char *_name) : name(_name), begin(Trace::enabled() ? Trace::now() : 0) {}
+    ~TraceScope() { if(Trace::enabled()) Trace::complete(name, begin, Trace::now()); }
+
+  private:
+    const char  *name;
+    const double begin;
+};
+
+#define TRACE_CONCAT2(a, b) a ## b
+#define TRACE_CONCAT(a, b)  TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name)   TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
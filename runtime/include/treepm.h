@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+#include <fftw3.h>
+#ifdef USE_MPI
+  #include <fftw3-mpi.h>
+#endif
+
+//Long range part of a TreePM force split. The density of the periodic box is
+//assigned to an N^3 mesh with CIC, the Poisson equation is solved with a
+//(distributed, slab decomposed) real to complex FFT and the force and
+//potential are interpolated back with CIC. The Green's function carries the
+//long range filter exp(-k^2 rs^2), the tree handles the complementary short
+//range part erfc(r / 2 rs) up to TREEPM_RCUT rs.
+//No process holds the full mesh: the particles are sent to the process that
+//owns the x-plane left of them, which assigns and interpolates in its slab
+//plus one ghost plane on the right.
+//The box is [-L/2, L/2)^3, G = 1
+
+#define TREEPM_RCUT 4.5    //Short range cutoff in units of rs
+
+class PMSolver
+{
+  public:
+    PMSolver(const int nGrid, const double boxSize, const double rSplit,
+             const int procId, const int nProcs);
+    ~PMSolver();
+
+    //Overwrites acc with the long range acceleration of the particles, the
+    //potential goes in .w. The tracers (dust) have no mass on the mesh and
+    //only get their acceleration in tracerAcc. Collective over the solver's
+    //own communicator, all processes have to call this
+    void compute(const real4 *pos,       const int n,       real4 *acc,
+                 const real4 *tracerPos, const int nTracer, real4 *tracerAcc);
+
+    double getRs()   const { return rs; }
+    double getRcut() const { return TREEPM_RCUT*rs; }
+
+  private:
+    const int    N;
+    const double L;
+    const double rs;
+    const int    procId, nProcs;
+#ifdef USE_MPI
+    MPI_Comm     comm;                //Duplicate of MPI_COMM_WORLD, keeps the PM
+                                      //messages apart from the LET exchange
+#endif
+
+    ptrdiff_t localN0, local0Start;   //x-planes of the slab of this process
+    std::vector<int> planeOwner;      //Process that owns each x-plane
+    int prevOwner, nextOwner;         //Owners of the planes left and right of the slab
+
+    float         *slabReal;          //Padded real slab, 2*(N/2+1) floats per row
+    fftwf_complex *slabK;             //Transform of the mass, then the potential
+    fftwf_complex *slabWork;          //Input of the inverse transforms
+    fftwf_plan     planForward;
+    fftwf_plan     planBackward;
+
+    std::vector<float> mesh;          //Slab plus ghost plane, (localN0+1)*N*N
+
+    //Particles sent to the slab owners, w is the mass (0 for tracers)
+    std::vector<real4> sendPos, recvPos;
+    std::vector<real4> sendAcc, recvAcc;
+    std::vector<int>   sendSlot;      //Index in sendPos of each local particle
+    std::vector<int>   sendCounts, sendDispls, recvCounts, recvDispls;
+
+    int  ownerPlane     (const float x) const;
+    void exchangeParticles(const real4 *pos, const int n, const real4 *tracerPos, const int nTracer);
+    void returnAcc      (real4 *acc, const int n, real4 *tracerAcc, const int nTracer);
+    void assignMass     ();
+    void addGhostPlane  ();
+    void fillGhostPlane ();
+    void meshToSlab     ();
+    void slabToMesh     ();
+    void applyGreens    ();
+    void interpolate    (const int component);
+};
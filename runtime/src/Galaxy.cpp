@@ -6,80 +6,40 @@
  */
 
 #include <Galaxy.h>
+#include "phaseTransform.h"
 
 real4 Galaxy::getCenterOfMass() const
 {
-  real mass;
-  real4 result = make_real4(0.0, 0.0, 0.0, 0.0);
-  for (auto const& p : pos)
-  {
-  	mass = p.w;
-    result.x += mass * p.x;
-    result.y += mass * p.y;
-    result.z += mass * p.z;
-    result.w += mass;
-  }
-
-  result.x /= result.w;
-  result.y /= result.w;
-  result.z /= result.w;
-  return result;
+  PhaseMoments m = phaseMoments(pos.data(), vel.data(), pos.size());
+  return make_real4(m.x[0], m.x[1], m.x[2], m.mass);
 }
 
 real4 Galaxy::getTotalVelocity() const
 {
-  real4 result = make_real4(0.0, 0.0, 0.0, 0.0);
-  for (auto const& v : vel)
-  {
-    result.x += v.x;
-    result.y += v.y;
-    result.z += v.z;
-  }
-
-  result.x /= vel.size();
-  result.y /= vel.size();
-  result.z /= vel.size();
-  return result;
+  PhaseMoments m = phaseMoments(pos.data(), vel.data(), pos.size());
+  return make_real4(m.vMean[0], m.vMean[1], m.vMean[2], 0.0);
 }
 
 void Galaxy::centering()
 {
   real4 center_of_mass = getCenterOfMass();
-  for (auto &p : pos)
-  {
-    p.x -= center_of_mass.x;
-    p.y -= center_of_mass.y;
-    p.z -= center_of_mass.z;
-  }
+  translate(make_real4(-center_of_mass.x, -center_of_mass.y, -center_of_mass.z, 0.0));
 }
 
 void Galaxy::steady()
 {
   real4 total_velocity = getTotalVelocity();
-  for (auto &v : vel)
-  {
-    v.x -= total_velocity.x;
-    v.y -= total_velocity.y;
-    v.z -= total_velocity.z;
-  }
+  accelerate(make_real4(-total_velocity.x, -total_velocity.y, -total_velocity.z, 0.0));
 }
 
 void Galaxy::translate(real4 w)
 {
-  for (auto &p : pos)
-  {
-    p.x += w.x;
-    p.y += w.y;
-    p.z += w.z;
-  }
+  PhaseTransform t;
+  t.translate(w.x, w.y, w.z).apply(pos.data(), vel.data(), pos.size());
 }
 
 void Galaxy::accelerate(real4 w)
 {
-  for (auto &v : vel)
-  {
-    v.x += w.x;
-    v.y += w.y;
-    v.z += w.z;
-  }
+  PhaseTransform t;
+  t.boost(w.x, w.y, w.z).apply(pos.data(), vel.data(), pos.size());
 }
@@ -0,0 +1,224 @@
+/*
+ * StatsServer.cpp
+ *
+ * Live performance queries of a running simulation.
+ */
+
+#include "StatsServer.h"
+#include "log.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+using jsoncons::json;
+
+StatsServer::StatsServer(Telemetry const& telemetry, int port, int nProcs)
+ : telemetry(telemetry),
+   rank(nProcs > 1 ? -1 : 0),
+   server_socket(-1),
+   stop(false)
+{
+  server_socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (server_socket == -1) {
+    perror("socket");
+    throw std::runtime_error("socket error");
+  }
+
+  int enable = 1;
+  if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
+    perror("setsockopt");
+    throw std::runtime_error("setsockopt(SO_REUSEADDR) failed");
+  }
+
+  sockaddr_in serverAddr;
+  memset(&serverAddr, 0, sizeof(serverAddr));
+  serverAddr.sin_family = AF_INET;
+  serverAddr.sin_port = htons(port);
+  serverAddr.sin_addr.s_addr = INADDR_ANY;
+
+  if (bind(server_socket, (struct sockaddr*)&serverAddr, sizeof(struct sockaddr)) == -1) {
+    perror("bind");
+    throw std::runtime_error("bind error");
+  }
+
+  if (listen(server_socket, max_number_of_clients) == -1) {
+    perror("listen");
+    throw std::runtime_error("listen error");
+  }
+
+  LOGF(stderr, "Stats server listening on port %d\n", port);
+
+  monitor = std::thread(&StatsServer::serve, this);
+}
+
+StatsServer::~StatsServer()
+{
+  stop = true;
+  monitor.join();
+  for (auto client_socket : client_sockets) close(client_socket);
+  close(server_socket);
+}
+
+void StatsServer::serve()
+{
+  while (!stop)
+  {
+    // Wait for new clients or requests, the timeout bounds the time to stop
+    std::vector<pollfd> fds(1 + client_sockets.size());
+    fds[0].fd = server_socket;
+    fds[0].events = POLLIN;
+    for (size_t i = 0; i < client_sockets.size(); ++i) {
+      fds[i+1].fd = client_sockets[i];
+      fds[i+1].events = POLLIN;
+    }
+
+    if (poll(&fds[0], fds.size(), 200) <= 0) continue;
+
+    std::vector<int> open_sockets;
+    for (size_t i = 0; i < client_sockets.size(); ++i)
+    {
+      int client_socket = client_sockets[i];
+      if (!(fds[i+1].revents & (POLLIN | POLLHUP | POLLERR))) {
+        open_sockets.push_back(client_socket);
+        continue;
+      }
+
+      char buffer[buffer_size];
+      int n = recv(client_socket, buffer, buffer_size - 1, 0);
+      if (n <= 0) {
+        close(client_socket);
+        continue;
+      }
+      buffer[n] = '\0';
+
+      json json_response;
+      try {
+        json_response = execute_json(buffer);
+      } catch (std::exception const& e) {
+        json_response["response"] = std::string("Error: ") + e.what();
+      } catch ( ... ) {
+        json_response["response"] = "Error: Unknown failure";
+      }
+
+      std::ostringstream oss;
+      oss << json_response << "\n";
+      std::string json_response_string = oss.str();
+
+      if (send(client_socket, json_response_string.c_str(), json_response_string.size(), MSG_NOSIGNAL) == -1) {
+        close(client_socket);
+        continue;
+      }
+      open_sockets.push_back(client_socket);
+    }
+    client_sockets.swap(open_sockets);
+
+    if (fds[0].revents & POLLIN)
+    {
+      int new_client_socket = accept(server_socket, NULL, NULL);
+      if (new_client_socket >= 0) {
+        if (client_sockets.size() < max_number_of_clients) client_sockets.push_back(new_client_socket);
+        else close(new_client_socket);
+      }
+    }
+  }
+}
+
+json StatsServer::record_json(TelemetryRecord const& rec) const
+{
+  json json_record;
+  json_record["iter"] = rec.iter;
+  json_record["time"] = rec.tSim;
+  json_record["n"] = rec.n;
+  json_record["n_active"] = rec.nActive;
+  json_record["step"] = rec.stepTime;
+  json_record["grav"] = rec.gravTime;
+  json_record["build"] = rec.buildTime;
+  json_record["domain"] = rec.domainTime;
+  json_record["wait"] = rec.waitTime;
+  json_record["let_comm"] = rec.letCommTime;
+  json_record["gpu_grav_local"] = rec.gpuGravLocal / 1000;
+  json_record["gpu_grav_let"] = rec.gpuGravLET / 1000;
+  json_record["direct"] = rec.nDirect;
+  json_record["approx"] = rec.nApprox;
+  json_record["let_bytes_sent"] = rec.letBytesSent;
+  json_record["let_bytes_recv"] = rec.letBytesRecv;
+  json_record["memory"] = rec.memHighWater;
+  json_record["imbalance"] = rec.imbalance;
+  json_record["energy_error"] = rec.energyError;
+  return json_record;
+}
+
+json StatsServer::execute_json(std::string const& json_request_string) const
+{
+  json json_response;
+
+  std::istringstream iss(json_request_string);
+  json json_request;
+  iss >> json_request;
+
+  std::string task = json_request["task"].as<std::string>();
+
+  std::vector<TelemetryRecord> records;
+
+  if (task == "stats")
+  {
+    telemetry.recent(records, rank, TELEMETRY_HISTORY);
+    json_response["response"] = task;
+    json_response["steps"] = static_cast<int>(records.size());
+    if (records.empty()) return json_response;
+
+    // Rates and the mean phase times over the steps in the history
+    double step = 0, grav = 0, build = 0, domain = 0, wait = 0, let_comm = 0, imbalance = 0;
+    double particle_steps = 0;
+    for (auto const& rec : records) {
+      step += rec.stepTime;
+      grav += rec.gravTime;
+      build += rec.buildTime;
+      domain += rec.domainTime;
+      wait += rec.waitTime;
+      let_comm += rec.letCommTime;
+      imbalance += rec.imbalance;
+      particle_steps += rec.n;
+    }
+    const double n = records.size();
+
+    json_response["step_rate"] = step > 0 ? n / step : 0.0;
+    json_response["particle_steps_per_second"] = step > 0 ? particle_steps / step : 0.0;
+    json_response["imbalance"] = imbalance / n;
+
+    json phases;
+    phases["step"] = step / n;
+    phases["grav"] = grav / n;
+    phases["build"] = build / n;
+    phases["domain"] = domain / n;
+    phases["wait"] = wait / n;
+    phases["let_comm"] = let_comm / n;
+    json_response["phases"] = phases;
+
+    json_response["last"] = record_json(records.back());
+  }
+  else if (task == "history")
+  {
+    int steps = json_request.has_member("steps") ? json_request["steps"].as<int>() : TELEMETRY_HISTORY;
+    if (steps < 1) throw std::runtime_error("Invalid number of steps");
+
+    telemetry.recent(records, rank, steps);
+    json_response["response"] = task;
+
+    json json_records = json::make_array();
+    for (auto const& rec : records) json_records.add(record_json(rec));
+    json_response["records"] = json_records;
+  }
+  else
+  {
+    throw std::runtime_error("Unknown task: " + task);
+  }
+
+  return json_response;
+}
@@ -7,6 +7,7 @@
 
 #include "FileIO.h"
 #include "WOGManager.h"
+#include "phaseTransform.h"
 
 using jsoncons::json;
 
@@ -261,14 +262,11 @@ json WOGManager::execute_json(std::string const& json_request_string)
       std::cout << "velocity: " << velocity.x << " " << velocity.y << " " << velocity.z << std::endl;
     #endif
 
-	Galaxy galaxy = galaxies[galaxy_id];
-	galaxy.translate(position);
-    galaxy.accelerate(velocity);
+	Galaxy const& galaxy = galaxies[galaxy_id];
+	PhaseTransform placement;
+	placement.translate(position.x, position.y, position.z).boost(velocity.x, velocity.y, velocity.z);
 
-    // Since the particle ids are not needed for the simulation, we use them to store the user_id in the first digit.
-	for (auto & id : galaxy.ids) id = id - id % 10 + user_id;
-
-    tree->releaseGalaxy(galaxy);
+    tree->releaseGalaxy(galaxy, placement, user_id);
 	user_particles[user_id] += galaxy.pos.size();
 
 	std::cout << "Galaxy with " + std::to_string(galaxy.pos.size()) + " particles of user " + std::to_string(user_id) + " was released.";
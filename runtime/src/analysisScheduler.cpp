@@ -0,0 +1,270 @@
+#ifdef USE_MPI
+  #include <mpi.h>
+#endif
+#include <cassert>
+#include <algorithm>
+#include "log.h"
+#include "perfCounters.h"
+#include "analysisScheduler.h"
+
+#define ANALYSIS_BATCH 65536    //Particles per task
+
+AnalysisScheduler::AnalysisScheduler(const int _procId, const int _nProcs, const int _nThreads, const int nBuffers,
+                                     HostAlloc _hostAlloc, HostFree _hostFree) :
+                                     procId(_procId), nProcs(_nProcs), nThreads(std::max(_nThreads, 1)),
+                                     hostAlloc(_hostAlloc), hostFree(_hostFree),
+                                     freeBuffer(-1), dueTime(0), stop(false)
+{
+  AnalysisBuffer empty = AnalysisBuffer();     //All counts zero, all pointers NULL
+  buffers.resize(std::max(nBuffers, 1), empty);
+
+  for(int i=0; i < nThreads; i++)
+    pool.push_back(std::thread(&AnalysisScheduler::work, this, i));
+}
+
+AnalysisScheduler::~AnalysisScheduler()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  taskReady.notify_all();
+  for(size_t i=0; i < pool.size(); i++) pool[i].join();
+
+  for(size_t r=0; r < runs.size(); r++)
+  {
+    delete runs[r]->module;
+    delete runs[r];
+  }
+  for(size_t b=0; b < buffers.size(); b++)
+  {
+    if(buffers[b].pos) hostFree(buffers[b].pos);
+    if(buffers[b].vel) hostFree(buffers[b].vel);
+    if(buffers[b].ids) hostFree(buffers[b].ids);
+    if(buffers[b].nodeCentre) hostFree(buffers[b].nodeCentre);
+    if(buffers[b].nodeSize)   hostFree(buffers[b].nodeSize);
+  }
+}
+
+void AnalysisScheduler::addModule(AnalysisModule *module, const double interval)
+{
+  Run *run      = new Run;
+  run->module   = module;
+  run->interval = interval;
+  run->nextTime = 0;
+  run->started  = false;
+  run->inFlight = false;
+  run->due      = false;
+  run->merged   = false;
+  run->buffer   = -1;
+  run->time     = 0;
+  run->remaining = 0;
+  run->skipped  = 0;
+  runs.push_back(run);
+}
+
+//Runs that finished their merge on every process
+void AnalysisScheduler::collectFinished(std::vector<int> &finished)
+{
+  std::vector<int> done(runs.size(), 1);
+  bool anyInFlight = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for(size_t r=0; r < runs.size(); r++)
+    {
+      if(!runs[r]->inFlight) continue;
+      anyInFlight = true;
+      done[r]     = runs[r]->merged;
+    }
+  }
+  if(!anyInFlight) return;
+
+#ifdef USE_MPI
+  if(nProcs > 1)
+    MPI_Allreduce(MPI_IN_PLACE, &done[0], done.size(), MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+#endif
+
+  for(size_t r=0; r < runs.size(); r++)
+    if(runs[r]->inFlight && done[r]) finished.push_back(r);
+}
+
+void AnalysisScheduler::complete(const int r)
+{
+  Run *run = runs[r];
+  run->module->reduceAndEmit(procId);
+  run->inFlight = false;
+  buffers[run->buffer].users--;
+}
+
+bool AnalysisScheduler::poll(const double t)
+{
+  std::vector<int> finished;
+  collectFinished(finished);
+  for(size_t i=0; i < finished.size(); i++) complete(finished[i]);
+
+  freeBuffer = -1;
+  dueTime    = t;
+  bool anyDue = false;
+  for(size_t r=0; r < runs.size(); r++)
+  {
+    Run *run = runs[r];
+    run->due = false;
+    if(run->started && t < run->nextTime) continue;
+
+    if(!run->started) run->nextTime = t;
+    run->started = true;
+    while(run->nextTime <= t) run->nextTime += run->interval;
+
+    if(run->inFlight)
+    {
+      run->skipped++;
+      if(procId == 0) LOGF(stderr, "Analysis %s: output at %f still running, skipping %f (%d skipped)\n",
+                           run->module->name(), run->time, t, run->skipped);
+      continue;
+    }
+    run->due = true;
+    anyDue   = true;
+  }
+  if(!anyDue) return false;
+
+  for(size_t b=0; b < buffers.size() && freeBuffer < 0; b++)
+    if(buffers[b].users == 0) freeBuffer = b;
+
+  if(freeBuffer < 0)
+  {
+    for(size_t r=0; r < runs.size(); r++)
+    {
+      if(!runs[r]->due) continue;
+      runs[r]->due = false;
+      runs[r]->skipped++;
+      if(procId == 0) LOGF(stderr, "Analysis %s: no free staging buffer, skipping %f (%d skipped)\n",
+                           runs[r]->module->name(), t, runs[r]->skipped);
+    }
+    return false;
+  }
+  return true;
+}
+
+bool AnalysisScheduler::treeWanted() const
+{
+  for(size_t r=0; r < runs.size(); r++)
+    if(runs[r]->due && runs[r]->module->needsTree()) return true;
+  return false;
+}
+
+AnalysisBuffer &AnalysisScheduler::buffer(const int n, const int nNodes)
+{
+  assert(freeBuffer >= 0);
+  AnalysisBuffer &buf = buffers[freeBuffer];
+  if(n > buf.capacity)
+  {
+    //Some slack, the particle count per process changes with the domain updates
+    if(buf.pos) hostFree(buf.pos);
+    if(buf.vel) hostFree(buf.vel);
+    if(buf.ids) hostFree(buf.ids);
+    buf.capacity = n + n/8;
+    buf.pos      = (float4*)hostAlloc(buf.capacity*sizeof(float4));
+    buf.vel      = (float4*)hostAlloc(buf.capacity*sizeof(float4));
+    buf.ids      = (int*)   hostAlloc(buf.capacity*sizeof(int));
+  }
+  if(nNodes > buf.nodeCapacity)
+  {
+    if(buf.nodeCentre) hostFree(buf.nodeCentre);
+    if(buf.nodeSize)   hostFree(buf.nodeSize);
+    buf.nodeCapacity = nNodes + nNodes/8;
+    buf.nodeCentre   = (float4*)hostAlloc(buf.nodeCapacity*sizeof(float4));
+    buf.nodeSize     = (float4*)hostAlloc(buf.nodeCapacity*sizeof(float4));
+  }
+  buf.n      = n;
+  buf.nNodes = nNodes;
+  buf.levels.clear();
+  return buf;
+}
+
+void AnalysisScheduler::launch()
+{
+  assert(freeBuffer >= 0);
+  AnalysisBuffer &buf = buffers[freeBuffer];
+
+  const AnalysisTree tree = {buf.nNodes, (int)buf.levels.size(), buf.nodeCentre, buf.nodeSize,
+                             buf.levels.empty() ? NULL : &buf.levels[0]};
+  buf.tree = tree;
+
+  //At least one batch, the last batch of a run triggers its merge
+  const int nBatches = std::max((buf.n + ANALYSIS_BATCH - 1) / ANALYSIS_BATCH, 1);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for(size_t r=0; r < runs.size(); r++)
+    {
+      Run *run = runs[r];
+      if(!run->due) continue;
+
+      run->module->begin(nThreads, dueTime);
+      run->due       = false;
+      run->inFlight  = true;
+      run->merged    = false;
+      run->buffer    = freeBuffer;
+      run->time      = dueTime;
+      run->remaining = nBatches;
+      buf.users++;
+
+      for(int b=0; b < nBatches; b++)
+      {
+        Task task = {(int)r, b*ANALYSIS_BATCH, std::min((b+1)*ANALYSIS_BATCH, buf.n)};
+        tasks.push_back(task);
+      }
+    }
+  }
+  taskReady.notify_all();
+  freeBuffer = -1;
+}
+
+void AnalysisScheduler::work(const int slot)
+{
+  for(;;)
+  {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      taskReady.wait(lock, [this]{ return stop || !tasks.empty(); });
+      if(stop) return;
+      task = tasks.front();
+      tasks.pop_front();
+    }
+
+    Run                  *run = runs[task.run];
+    const AnalysisBuffer &buf = buffers[run->buffer];
+    const ParticleBatch batch = {task.end - task.begin, buf.pos + task.begin,
+                                 buf.vel + task.begin,  buf.ids + task.begin, task.begin,
+                                 buf.nNodes > 0 ? &buf.tree : NULL};
+    PERF_SCOPE(PERF_STATISTICS);
+    run->module->consume(batch, slot);
+
+    if(run->remaining.fetch_sub(1) == 1)
+    {
+      run->module->merge();
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        run->merged = true;
+      }
+      runDone.notify_all();
+    }
+  }
+}
+
+void AnalysisScheduler::finish()
+{
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    runDone.wait(lock, [this]
+    {
+      for(size_t r=0; r < runs.size(); r++)
+        if(runs[r]->inFlight && !runs[r]->merged) return false;
+      return true;
+    });
+  }
+
+  //Every process has the same runs in flight
+  for(size_t r=0; r < runs.size(); r++)
+    if(runs[r]->inFlight) complete(r);
+}
@@ -0,0 +1,239 @@
+#ifdef USE_MPI
+  #include <mpi.h>
+#endif
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include "log.h"
+#include "autoTuner.h"
+
+#define AUTOTUNE_WARMUP   2       //Steps skipped before the first trial, they include the allocations
+#define AUTOTUNE_MIN_GAIN 0.02    //Relative improvement required to move, filters the noise
+
+AutoTuner::AutoTuner(const std::string &_fileName, const std::string &_machineKey,
+                     const int _procId, const int _nProcs, const long long _nTotal,
+                     const int _budget, const int _trialSteps)
+  : fileName(_fileName), machineKey(_machineKey), procId(_procId), nProcs(_nProcs),
+    nTotal(_nTotal), budget(_budget), trialSteps(std::max(_trialSteps, 1)),
+    state(WARMUP), nSteps(0), trialStep(0), trialTime(0), knob(0), trial(0), direction(0),
+    climbStart(0)
+{
+}
+
+void AutoTuner::addKnob(const std::string &name, int *value, std::vector<int> candidates)
+{
+  //The current value is always a candidate, it is where the climb starts
+  if(std::find(candidates.begin(), candidates.end(), *value) == candidates.end())
+    candidates.push_back(*value);
+  std::sort(candidates.begin(), candidates.end());
+  candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+  Knob k;
+  k.name       = name;
+  k.value      = value;
+  k.candidates = candidates;
+  k.best       = std::find(candidates.begin(), candidates.end(), *value) - candidates.begin();
+  k.bestTime   = 0;
+  knobs.push_back(k);
+}
+
+bool AutoTuner::load()
+{
+  //Process 0 reads the file, the others receive the values
+  std::vector<int> values(knobs.size(), 0);
+  int match = 0;
+
+  if(procId == 0)
+  {
+    FILE *in = fopen(fileName.c_str(), "r");
+    if(in)
+    {
+      char      line[512], key[256], name[256];
+      int       procs = 0, value = 0, nFound = 0;
+      long long particles = 0;
+      bool      sameMachine = false;
+      for(size_t i=0; i < knobs.size(); i++) values[i] = *knobs[i].value;
+
+      while(fgets(line, sizeof(line), in))
+      {
+        if(line[0] == '#') continue;
+        if(sscanf(line, "machine %255s", key)    == 1) sameMachine = (machineKey == key);
+        if(sscanf(line, "procs %d", &procs)      == 1) continue;
+        if(sscanf(line, "particles %lld", &particles) == 1) continue;
+        if(sscanf(line, "knob %255s %d", name, &value) == 2)
+        {
+          for(size_t i=0; i < knobs.size(); i++)
+            if(knobs[i].name == name) { values[i] = value; nFound++; }
+        }
+      }
+      fclose(in);
+
+      //Only reuse the file for the same setup, the best values depend on the load per process
+      match = sameMachine && procs == nProcs && nFound == (int)knobs.size() &&
+              particles > 0 && particles < 2*nTotal && 2*particles > nTotal;
+      if(!match)
+        LOGF(stderr, "Tuning file %s is for another setup, tuning again\n", fileName.c_str());
+    }
+  }
+
+#ifdef USE_MPI
+  if(nProcs > 1)
+  {
+    MPI_Bcast(&match, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if(!knobs.empty())
+      MPI_Bcast(&values[0], knobs.size(), MPI_INT, 0, MPI_COMM_WORLD);
+  }
+#endif
+
+  if(!match) return false;
+
+  for(size_t i=0; i < knobs.size(); i++)
+  {
+    *knobs[i].value = values[i];
+    if(procId == 0) LOGF(stderr, "Autotune: %s = %d (from %s)\n", knobs[i].name.c_str(), values[i], fileName.c_str());
+  }
+  state = DONE;
+  return true;
+}
+
+void AutoTuner::step(const double stepTime)
+{
+  if(state == DONE) return;
+  nSteps++;
+
+  if(state == WARMUP)
+  {
+    if(nSteps < AUTOTUNE_WARMUP) return;
+
+    //Start by measuring the current configuration with the first knob that has a choice
+    for(knob=0; knob < (int)knobs.size() && knobs[knob].candidates.size() < 2; knob++);
+    if(knob == (int)knobs.size() || nSteps + trialSteps > budget)
+    {
+      finish();
+      return;
+    }
+    state      = SEARCH;
+    trial      = knobs[knob].best;
+    climbStart = trial;
+    direction  = 0;
+    trialStep  = 0;
+    trialTime  = 0;
+    return;
+  }
+
+  trialTime += stepTime;
+  if(++trialStep < trialSteps) return;
+
+  double time = trialTime / trialSteps;
+#ifdef USE_MPI
+  if(nProcs > 1)
+  {
+    double maxTime;
+    MPI_Allreduce(&time, &maxTime, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    time = maxTime;
+  }
+#endif
+  if(procId == 0)
+    LOGF(stderr, "Autotune: %s = %d step time: %lg\n", knobs[knob].name.c_str(),
+                 knobs[knob].candidates[trial], time);
+
+  trialStep = 0;
+  trialTime = 0;
+  nextTrial(time);
+}
+
+//Moves the current knob to candidate idx, false if there is no such candidate
+//or the budget does not allow another trial
+bool AutoTuner::moveTo(const int idx)
+{
+  Knob &k = knobs[knob];
+  if(idx < 0 || idx >= (int)k.candidates.size()) return false;
+  if(nSteps + trialSteps > budget)               return false;
+
+  trial    = idx;
+  *k.value = k.candidates[idx];
+  return true;
+}
+
+void AutoTuner::nextTrial(const double time)
+{
+  Knob &k = knobs[knob];
+
+  if(direction == 0)
+  {
+    startKnob(time);
+    return;
+  }
+
+  if(time < (1-AUTOTUNE_MIN_GAIN)*k.bestTime)
+  {
+    //Improvement, keep going in this direction
+    k.best     = trial;
+    k.bestTime = time;
+    if(moveTo(trial+direction)) return;
+  }
+  else if(direction == +1 && k.best == climbStart)
+  {
+    //The first step up did not help, try down instead
+    direction = -1;
+    if(moveTo(k.best-1)) return;
+  }
+
+  //This knob is done, the next one starts from the time of the current best configuration
+  *k.value = k.candidates[k.best];
+  const double bestTime = k.bestTime;
+
+  for(knob++; knob < (int)knobs.size() && knobs[knob].candidates.size() < 2; knob++);
+  if(knob == (int)knobs.size())
+  {
+    finish();
+    return;
+  }
+
+  startKnob(bestTime);
+}
+
+//Starts the climb of knob, the current configuration was measured at startTime
+void AutoTuner::startKnob(const double startTime)
+{
+  Knob &k    = knobs[knob];
+  k.bestTime = startTime;
+  climbStart = k.best;
+  direction  = +1;
+  if(moveTo(k.best+1)) return;
+  direction  = -1;
+  if(moveTo(k.best-1)) return;
+
+  //No budget left for this knob
+  finish();
+}
+
+void AutoTuner::finish()
+{
+  for(size_t i=0; i < knobs.size(); i++)
+  {
+    *knobs[i].value = knobs[i].candidates[knobs[i].best];
+    if(procId == 0) LOGF(stderr, "Autotune: %s = %d\n", knobs[i].name.c_str(), *knobs[i].value);
+  }
+  state = DONE;
+  save();
+}
+
+void AutoTuner::save() const
+{
+  if(procId != 0) return;
+
+  FILE *out = fopen(fileName.c_str(), "w");
+  if(!out)
+  {
+    LOGF(stderr, "Can not open tuning file: %s\n", fileName.c_str());
+    return;
+  }
+  fprintf(out, "# Bonsai tuning file, delete it to tune again\n");
+  fprintf(out, "machine %s\n",     machineKey.c_str());
+  fprintf(out, "procs %d\n",       nProcs);
+  fprintf(out, "particles %lld\n", nTotal);
+  for(size_t i=0; i < knobs.size(); i++)
+    fprintf(out, "knob %s %d\n", knobs[i].name.c_str(), *knobs[i].value);
+  fclose(out);
+}
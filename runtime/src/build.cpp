@@ -1,5 +1,6 @@
 #include "octree.h"
 #include "build.h"
+#include "trace.h"
 
 void octree::allocateParticleMemory(tree_structure &tree)
 {
@@ -29,6 +30,13 @@ void octree::allocateParticleMemory(tree_structure &tree)
   tree.bodies_acc1.ccalloc(n_bodies, false);    //ccalloc -> init to 0
   tree.bodies_time.ccalloc(n_bodies, false);    //ccalloc -> init to 0
 
+#ifdef DOUBLE_ACCUMULATION
+  tree.bodies_posLo.ccalloc(n_bodies, false);   //ccalloc -> loaded positions are exact floats
+  tree.bodies_velLo.ccalloc(n_bodies, false);
+  tree.bodies_PposLo.ccalloc(n_bodies, false);
+  tree.bodies_PvelLo.ccalloc(n_bodies, false);
+#endif
+
   tree.oriParticleOrder.cmalloc(n_bodies, false);      //To desort the bodies tree later on
   //iteration properties / information
   tree.activePartlist.ccalloc(n_bodies+2, false);   //+2 since we use the last two values as a atomicCounter (for grp count and semaphore access)
@@ -85,25 +93,28 @@ void octree::allocateParticleMemory(tree_structure &tree)
   //General memory buffers
 
   //Set the context for the memory
-  this->tnext.setContext(devContext);
+  this->tnext.setContext(devContext, "tnext");
   this->tnext.ccalloc(NBLOCK_REDUCE,false);
 
-  this->nactive.setContext(devContext);
+  this->nactive.setContext(devContext, "nactive");
   this->nactive.ccalloc(NBLOCK_REDUCE,false);
 
-  this->devMemRMIN.setContext(devContext);
+  this->devMemRMIN.setContext(devContext, "devMemRMIN");
   this->devMemRMIN.cmalloc(NBLOCK_BOUNDARY, false);
 
-  this->devMemRMAX.setContext(devContext);
+  this->devMemRMAX.setContext(devContext, "devMemRMAX");
   this->devMemRMAX.cmalloc(NBLOCK_BOUNDARY, false);
 
-  this->devMemCounts.setContext(devContext);
+  this->topBoxSize.setContext(devContext, "topBoxSize");
+  this->dustBoxSize.setContext(devContext, "dustBoxSize");
+
+  this->devMemCounts.setContext(devContext, "devMemCounts");
   this->devMemCounts.cmalloc(NBLOCK_PREFIX, false);
 
-  this->devMemCountsx.setContext(devContext);
+  this->devMemCountsx.setContext(devContext, "devMemCountsx");
   this->devMemCountsx.cmalloc(NBLOCK_PREFIX, true);
 
-  this->specialParticles.setContext(devContext);
+  this->specialParticles.setContext(devContext, "specialParticles");
   this->specialParticles.cmalloc(16, true);
 
 
@@ -159,6 +170,13 @@ void octree::reallocateParticleMemory(tree_structure &tree)
   tree.bodies_acc1.cresize(n_bodies, reduce);    //ccalloc -> init to 0
   tree.bodies_time.cresize(n_bodies, reduce);    //ccalloc -> init to 0
 
+#ifdef DOUBLE_ACCUMULATION
+  tree.bodies_posLo.cresize(n_bodies, reduce);
+  tree.bodies_velLo.cresize(n_bodies, reduce);
+  tree.bodies_PposLo.cresize(n_bodies, reduce);
+  tree.bodies_PvelLo.cresize(n_bodies, reduce);
+#endif
+
   tree.oriParticleOrder.cresize(n_bodies,   reduce);     //To desort the bodies tree later on
   //iteration properties / information
   tree.activePartlist.cresize(  n_bodies+2, reduce);      //+1 since we use the last value as a atomicCounter
@@ -200,6 +218,18 @@ void octree::reallocateParticleMemory(tree_structure &tree)
   my_dev::base_mem::printMemUsage();
 }
 
+//Host code that rewrites pos/vel between steps (adding or removing particles)
+//restarts the integrator state from the float values
+void octree::clearParticleLowWords(tree_structure &tree)
+{
+#ifdef DOUBLE_ACCUMULATION
+  tree.bodies_posLo.zeroMem();
+  tree.bodies_velLo.zeroMem();
+#else
+  (void)tree;
+#endif
+}
+
 void octree::allocateTreePropMemory(tree_structure &tree)
 {
   int n_nodes = tree.n_nodes;
@@ -232,6 +262,7 @@ void octree::allocateTreePropMemory(tree_structure &tree)
 }
 
 void octree::build (tree_structure &tree) {
+  TRACE_SCOPE("build");
 
   int level      = 0;
   int validCount = 0;
@@ -587,6 +618,9 @@ void octree::parallelDataSummary(tree_structure &tree, float lastExecTime, float
                               0.5f*(r_min.y + r_max.y) - 0.5f*size,
                               0.5f*(r_min.z + r_max.z) - 0.5f*size,
                               size/(1 << MAXLEVELS));
+#ifdef PERIODIC
+   if(periodicBoxSize > 0) setPeriodicCorner(tree.corner);
+#endif
 
    //Compute keys again, needed for the redistribution
    //Note we can call this in parallel with the computation of the domain.
@@ -770,6 +804,9 @@ void octree::parallelDataSummary(tree_structure &tree, float lastExecTime, float
                              0.5f*(r_min.y + r_max.y) - 0.5f*size,
                              0.5f*(r_min.z + r_max.z) - 0.5f*size, size);
   tree.corner.w = size/(1 << MAXLEVELS);
+#ifdef PERIODIC
+  if(periodicBoxSize > 0) setPeriodicCorner(tree.corner);
+#endif
 
 #endif
 
@@ -877,6 +914,9 @@ void octree::parallelDataSummary(tree_structure &tree, float lastExecTime, float
                              0.5f*(r_min.y + r_max.y) - 0.5f*size,
                              0.5f*(r_min.z + r_max.z) - 0.5f*size, size);
   tree.corner.w = size/(1 << MAXLEVELS);
+#ifdef PERIODIC
+  if(periodicBoxSize > 0) setPeriodicCorner(tree.corner);
+#endif
 
 
   execStream->sync(); //Make sure segmentedSummaryBasic and d2h completed
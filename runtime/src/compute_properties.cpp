@@ -1,8 +1,10 @@
 #include "octree.h"
+#include "trace.h"
 
 
 
 void octree::compute_properties(tree_structure &tree) {
+  TRACE_SCOPE("compute_properties");
 
   /*****************************************************          
     Assign the memory buffers, note that we check the size first
@@ -2,6 +2,10 @@
 
 #ifdef USE_DUST
 
+//Created in iterate_setup with the other step events
+extern cudaEvent_t dustPropertiesDone;
+extern cudaEvent_t dustBoxCopied;
+
 void octree::allocateDustMemory(tree_structure &tree)
 {
   if(tree.n_dust == 0) return;
@@ -29,6 +33,7 @@ void octree::allocateDustMemory(tree_structure &tree)
     tree.dust_acc0.cresize(n_dust, false);     
     tree.dust_acc1.cresize(n_dust, false);     
     tree.dust_ids.cresize(n_dust+1, false);     
+    tree.dust_time.cresize(n_dust, false);
     
     tree.dust2group_list.cresize(n_dust, false);
     tree.active_dust_list.cresize(n_dust+10, false);      //Extra space for atomics
@@ -38,6 +43,7 @@ void octree::allocateDustMemory(tree_structure &tree)
     
     tree.dust2group_list.zeroMem();
     
+    tree.activeDustGrpFlags.cresize(n_dust, false);
     tree.activeDustGrouplist.cresize(n_dust, false);
   }
   else
@@ -60,6 +66,7 @@ void octree::allocateDustMemory(tree_structure &tree)
     tree.dust_acc0.cmalloc(n_dust, false);     
     tree.dust_acc1.cmalloc(n_dust, false);     
     tree.dust_ids.cmalloc(n_dust+1, false);     
+    tree.dust_time.cmalloc(n_dust, false);
     
     tree.dust2group_list.cmalloc(n_dust, false);
     tree.active_dust_list.cmalloc(n_dust+10, false);      //Extra space for atomics
@@ -67,6 +74,7 @@ void octree::allocateDustMemory(tree_structure &tree)
     
     tree.dust_ngb.cmalloc(n_dust, false); 
     
+    tree.activeDustGrpFlags.cmalloc(n_dust, false);
     tree.activeDustGrouplist.cmalloc(n_dust, false);
 
     tree.dust2group_list.zeroMem();
@@ -92,6 +100,7 @@ void octree::allocateDustGroupBuffers(tree_structure &tree)
   if(tree.dust_group_list.get_size() > 0)
   {
     tree.dust_group_list.cresize(tree.n_dust_groups, reduce);
+    tree.activeDustGrpFlags.cresize(tree.n_dust_groups, reduce);
     tree.activeDustGrouplist.cresize(tree.n_dust_groups, reduce);
     tree.dust_groupSizeInfo.cresize(tree.n_dust_groups, reduce);
     tree.dust_groupCenterInfo.cresize(tree.n_dust_groups, reduce);
@@ -99,6 +108,7 @@ void octree::allocateDustGroupBuffers(tree_structure &tree)
   else
   {
     tree.dust_group_list.cmalloc(tree.n_dust_groups, false);
+    tree.activeDustGrpFlags.cmalloc(tree.n_dust_groups, false);
     tree.activeDustGrouplist.cmalloc(tree.n_dust_groups, false);
     tree.dust_groupSizeInfo.cmalloc(tree.n_dust_groups, false);
     tree.dust_groupCenterInfo.cmalloc(tree.n_dust_groups, false);    
@@ -216,7 +226,7 @@ void octree::sort_dust(tree_structure &tree)
   
   dataReorderF2.set_arg<int>(0,      &tree.n_dust);
   dataReorderF2.set_arg<cl_mem>(1,   tree.dust_key.p());    
-  dataReorderF2.set_arg<cl_mem>(2,   float2Buffer.p()); //Place holder, dust has no time
+  dataReorderF2.set_arg<cl_mem>(2,   tree.dust_time.p());
   dataReorderF2.set_arg<cl_mem>(3,   float2Buffer.p()); //Reuse as destination1
   dataReorderF2.set_arg<cl_mem>(4,   tree.dust_ids.p()); 
   dataReorderF2.set_arg<cl_mem>(5,   sortPermutation.p()); //Reuse as destination2  
@@ -224,6 +234,7 @@ void octree::sort_dust(tree_structure &tree)
   dataReorderF2.execute(execStream->s());
 
   tree.dust_ids.copy(sortPermutation, sortPermutation.get_size());  
+  tree.dust_time.copy(float2Buffer, tree.n_dust);
   
   
   devContext.stopTiming("DustSortReorder", -1, execStream->s());  
@@ -303,15 +314,15 @@ void octree::setDustGroupProperties(tree_structure &tree)
   if(tree.n_dust == 0) return;
    //Set the group properties, note that it is not based on the nodes anymore
   //but on self created groups based on particle order setPHGroupData    
-  copyNodeDataToGroupData.set_arg<int>(0,    &tree.n_dust_groups);
-  copyNodeDataToGroupData.set_arg<int>(1,    &tree.n_dust);
-  copyNodeDataToGroupData.set_arg<cl_mem>(2, tree.dust_pos.p());  
-  copyNodeDataToGroupData.set_arg<cl_mem>(3, tree.dust_group_list.p());
-  copyNodeDataToGroupData.set_arg<cl_mem>(4, tree.dust_groupCenterInfo.p());  
-  copyNodeDataToGroupData.set_arg<cl_mem>(5, tree.dust_groupSizeInfo.p());
+  setPHGroupData.set_arg<int>(0,    &tree.n_dust_groups);
+  setPHGroupData.set_arg<int>(1,    &tree.n_dust);
+  setPHGroupData.set_arg<cl_mem>(2, tree.dust_pos.p());  
+  setPHGroupData.set_arg<cl_mem>(3, tree.dust_group_list.p());
+  setPHGroupData.set_arg<cl_mem>(4, tree.dust_groupCenterInfo.p());  
+  setPHGroupData.set_arg<cl_mem>(5, tree.dust_groupSizeInfo.p());
  
-  copyNodeDataToGroupData.setWork(-1, NCRIT, tree.n_dust_groups);    
-  copyNodeDataToGroupData.execute(execStream->s());
+  setPHGroupData.setWork(-1, NCRIT, tree.n_dust_groups);    
+  setPHGroupData.execute(execStream->s());
 
 
   /*
@@ -398,6 +409,85 @@ void octree::setDustGroupProperties(tree_structure &tree)
 }
 
 
+//The dust group box volumes measure how much the groups have spread since
+//they were made. As for the tree boxes (startTopLevelBoxCopy) the boxes are
+//copied on the copy stream once their properties are set and only summed at
+//the next regroup check, so the step never waits on the copy
+void octree::startDustGroupBoxCopy(tree_structure &tree, bool regrouped)
+{
+  const int n = tree.n_dust_groups;
+  if(n <= 0) return;
+
+  //A copy that was never summed may still be writing into the buffer
+  if(dustBoxCopyCount > 0) CU_SAFE_CALL(cudaEventSynchronize(dustBoxCopied));
+
+  if(dustBoxSize.get_size() == 0)
+    dustBoxSize.cmalloc(n, true);
+  else
+    dustBoxSize.cresize_nocpy(n, false);
+
+  CU_SAFE_CALL(cudaEventRecord(dustPropertiesDone, execStream->s()));
+  CU_SAFE_CALL(cudaStreamWaitEvent(copyStream->s(), dustPropertiesDone, 0));
+  CU_SAFE_CALL(cudaMemcpyAsync(&dustBoxSize[0], tree.dust_groupSizeInfo.d(),
+                               n*sizeof(real4), cudaMemcpyDeviceToHost, copyStream->s()));
+  CU_SAFE_CALL(cudaEventRecord(dustBoxCopied, copyStream->s()));
+
+  dustBoxCopyCount   = n;
+  dustBoxCopyRegroup = regrouped;
+}
+
+void octree::updateDustGroupGrowth()
+{
+  if(dustBoxCopyCount == 0) return;
+
+  CU_SAFE_CALL(cudaEventSynchronize(dustBoxCopied));
+
+  double volume = 0;
+  for(int i=0; i < dustBoxCopyCount; i++)
+  {
+    volume += 8.0*dustBoxSize[i].x*dustBoxSize[i].y*dustBoxSize[i].z;
+  }
+
+  if(dustBoxCopyRegroup)
+  {
+    dustGroupVolume = volume;
+    dustGroupGrowth = 1;
+  }
+  else if(dustGroupVolume > 0)
+    dustGroupGrowth = volume / dustGroupVolume;
+
+  dustBoxCopyCount = 0;
+}
+
+//Sort and group the dust, or only update the group boxes. Without
+//dustRegroupFactor this follows the tree rebuilds, otherwise the dust
+//is regrouped when its groups grew too much or dust was added. The growth
+//is that of the previous step, the boxes of this step are still being copied
+void octree::updateDustGroups(tree_structure &tree, bool treeRebuilt)
+{
+  if(tree.n_dust == 0) return;
+
+  bool regroup = treeRebuilt;
+  if(dustRegroupFactor > 0)
+  {
+    updateDustGroupGrowth();
+    regroup = (tree.n_dust != dustGroupedN) || dustGroupGrowth > dustRegroupFactor;
+    LOGF(stderr, "Dust group box growth: %f regroup: %d\n", dustGroupGrowth, regroup);
+  }
+
+  if(regroup)
+  {
+    sort_dust(tree);
+    make_dust_groups(tree);
+    dustGroupedN = tree.n_dust;
+  }
+  setDustGroupProperties(tree);
+
+  if(dustRegroupFactor > 0)
+    startDustGroupBoxCopy(tree, regroup);
+}
+
+
 void octree::predictDustStep(tree_structure &tree)
 {
   if(tree.n_dust == 0) return;
@@ -408,8 +498,6 @@ void octree::predictDustStep(tree_structure &tree)
   predictDust.set_arg<cl_mem>(idx++, tree.dust_pos.p());
   predictDust.set_arg<cl_mem>(idx++, tree.dust_vel.p());
   predictDust.set_arg<cl_mem>(idx++, tree.dust_acc0.p());
-  predictDust.set_arg<cl_mem>(idx++, tree.dust2group_list.p());
-  predictDust.set_arg<cl_mem>(idx++, tree.activeDustGrouplist.p());
   predictDust.setWork(tree.n_dust, 128);
   predictDust.execute(execStream->s());
 } //End predict
@@ -418,10 +506,22 @@ void octree::predictDustStep(tree_structure &tree)
 void octree::correctDustStep(tree_structure &tree)
 {
   if(tree.n_dust == 0) return;
+  //Direct gravity computes the force on all dust, the tree-walk only
+  //on the active groups
+  int allActive = useDirectGravity;
+  if(!allActive && tree.n_active_dust_groups == 0) return;
+
+  float etaEps = dustEta*sqrtf(sqrtf(this->eps2));
+
   //Correct the dust particles
   int idx = 0;
   correctDust.set_arg<int   >(idx++, &tree.n_dust);
-  correctDust.set_arg<float >(idx++, &timeStep);  
+  correctDust.set_arg<float >(idx++, &t_current);
+  correctDust.set_arg<float >(idx++, &timeStep);
+  correctDust.set_arg<float >(idx++, &etaEps);
+  correctDust.set_arg<int   >(idx++, &dustMaxLevel);
+  correctDust.set_arg<int   >(idx++, &allActive);
+  correctDust.set_arg<cl_mem>(idx++, tree.dust_time.p());
   correctDust.set_arg<cl_mem>(idx++, tree.active_dust_list.p());
   correctDust.set_arg<cl_mem>(idx++, tree.dust_vel.p());
   correctDust.set_arg<cl_mem>(idx++, tree.dust_acc0.p());
@@ -442,8 +542,27 @@ void octree::approximate_dust(tree_structure &tree)
   //Reset the active particles
   tree.active_dust_list.zeroMem();
 
+  //Select the groups with a particle at the end of its time step
+  tree.activeDustGrpFlags.zeroMemGPUAsync(execStream->s());
+  setActiveDust.set_arg<int>(0,    &tree.n_dust);
+  setActiveDust.set_arg<float>(1,  &t_current);
+  setActiveDust.set_arg<float>(2,  &timeStep);
+  setActiveDust.set_arg<cl_mem>(3, tree.dust_time.p());
+  setActiveDust.set_arg<cl_mem>(4, tree.dust2group_list.p());
+  setActiveDust.set_arg<cl_mem>(5, tree.activeDustGrpFlags.p());
+  setActiveDust.setWork(tree.n_dust, 128);
+  setActiveDust.execute(execStream->s());
+
+  this->devMemCountsx[0] = 1;
+  this->devMemCountsx.h2d(1);
+  gpuCompact(devContext, tree.activeDustGrpFlags, tree.activeDustGrouplist,
+             tree.n_dust_groups, &tree.n_active_dust_groups);
+
+  LOG("Active dust groups: %d (Total: %d)\n", tree.n_active_dust_groups, tree.n_dust_groups);
+  if(tree.n_active_dust_groups == 0) return;
+
   //Set the kernel parameters, many!
-  approxGrav.set_arg<int>(0,     &tree.n_dust_groups);
+  approxGrav.set_arg<int>(0,     &tree.n_active_dust_groups);
   approxGrav.set_arg<int>(1,     &tree.n_dust);
   approxGrav.set_arg<float>(2,   &(this->eps2));
   approxGrav.set_arg<uint2>(3,   &node_begend);
@@ -0,0 +1,154 @@
+#include "octree.h"
+#include "devFunctionDefinitions.h"
+#include "ewald.h"
+
+#ifdef PERIODIC
+
+//Builds the Ewald table, checks it against a brute force Ewald sum and puts it
+//on the device. Called from load_kernels once the device context exists
+void octree::initPeriodicBoundaries()
+{
+  gpu_setPeriodicBoxSize(periodicBoxSize);
+
+  //With a TreePM mesh the long range periodic force comes from the mesh
+  if(periodicBoxSize <= 0 || pmGrid > 0) return;
+
+  double t0 = get_time();
+  EwaldTable ewald;
+  ewald.compute();
+
+  if(procId == 0)
+  {
+    double fzero;
+    const double maxErr = ewald.validate(64, fzero);
+    char buff[512];
+    sprintf(buff, "EWALD box: %f\ttable: %d^3\tbuild: %lg s\tmax. rel. error vs brute force (N=64): %e\tforce at (L/2,0,0): %e\n",
+                  periodicBoxSize, EwaldTable::EN+1, get_time() - t0, maxErr, fzero);
+    LOGF(stderr, "%s", buff);
+    devContext.writeLogEvent(buff);
+  }
+
+  const int n = (EwaldTable::EN+1)*(EwaldTable::EN+1)*(EwaldTable::EN+1);
+  ewaldTable.setContext(devContext, "ewaldTable");
+  ewaldTable.cmalloc(n, false);
+  memcpy(&ewaldTable[0], &ewald.table[0], n*sizeof(real4));
+  ewaldTable.h2d();
+
+  ewaldSources.setContext(devContext, "ewaldSources");
+}
+
+//With periodic boundaries the key space is the box itself instead of the
+//bounding box of the particles. build_key_list rounds to the nearest cell,
+//the half cell shift makes [-L/2, L/2) map onto [0, 2^MAXLEVELS)
+void octree::setPeriodicCorner(real4 &corner)
+{
+  const real h = periodicBoxSize/(1 << MAXLEVELS);
+#ifdef EXACT_KEY
+  const real shift = 0;
+#else
+  const real shift = 0.5f*h;
+#endif
+  corner = make_real4(-0.5f*periodicBoxSize + shift,
+                      -0.5f*periodicBoxSize + shift,
+                      -0.5f*periodicBoxSize + shift, h);
+}
+
+//Reference accelerations for --forcecheck with periodic boundaries: direct
+//nearest image sum over all particles plus the Ewald table correction per
+//pair, in double on the host. The table itself is checked against the brute
+//force Ewald sum at startup (EWALD line), so this tests the tree walk, the
+//top-level source approximation of ewald_correction or the TreePM split
+void octree::periodicDirectAcc(tree_structure &tree, const std::vector<int> &targets,
+                               std::vector<double> &acc)
+{
+  EwaldTable ewald;
+  const int nTable = (EwaldTable::EN+1)*(EwaldTable::EN+1)*(EwaldTable::EN+1);
+  if(ewaldTable.get_size() >= nTable)
+    ewald.table.assign((float*)&ewaldTable[0], (float*)&ewaldTable[0] + 4*nTable);
+  else
+    ewald.compute();      //TreePM runs have no table on the device
+
+  tree.bodies_Ppos.d2h(tree.n);
+  const real4  *pos = &tree.bodies_Ppos[0];
+  const double  L   = periodicBoxSize;
+  const int     n   = tree.n;
+  const int     nt  = (int)targets.size();
+
+  acc.assign(3*nt, 0.0);
+
+#pragma omp parallel for schedule(dynamic, 16)
+  for(int t=0; t < nt; t++)
+  {
+    const int i = targets[t];
+    double    a[3] = {0, 0, 0};
+    for(int j=0; j < n; j++)
+    {
+      if(j == i) continue;
+      double dx[3], f[3], pot;
+      dx[0] = (double)pos[i].x - pos[j].x;
+      dx[1] = (double)pos[i].y - pos[j].y;
+      dx[2] = (double)pos[i].z - pos[j].z;
+      for(int d=0; d < 3; d++) dx[d] -= L*floor(dx[d]/L + 0.5);
+
+      const double r2   = dx[0]*dx[0] + dx[1]*dx[1] + dx[2]*dx[2];
+      const double rinv = 1.0/sqrt(r2 + eps2);
+      ewald.lookup(dx, L, f, pot);
+      for(int d=0; d < 3; d++)
+        a[d] += pos[j].w*(f[d] - dx[d]*rinv*rinv*rinv);
+    }
+    acc[3*t+0] = a[0];
+    acc[3*t+1] = a[1];
+    acc[3*t+2] = a[2];
+  }
+}
+
+//Adds the difference between the periodic and the nearest image force. The
+//correction is smooth on the scale of the box, so the sources are the
+//monopoles of the startLevelMin nodes of all processes. With one process the
+//kernel reads them straight from the device multipoles, otherwise the host
+//copy made by makeLET is used, so no extra device to host copy is needed
+void octree::ewald_correction(tree_structure &tree)
+{
+  if(periodicBoxSize <= 0 || pmGrid > 0) return;
+
+  const uint2 begEnd = tree.level_list[tree.startLevelMin];
+  int nSources = begEnd.y - begEnd.x;
+  int stride   = 3;
+  void *srcLoc = tree.multipole.a(3*begEnd.x);
+
+  if(nProcs > 1)
+  {
+    std::vector<real4> sources;
+    sources.reserve(nSources);
+    for(uint i=begEnd.x; i < begEnd.y; i++)
+      sources.push_back(tree.multipole[3*i]);
+
+    gatherEwaldSources(sources);
+    nSources = sources.size();
+
+    if(ewaldSources.get_size() == 0)
+      ewaldSources.cmalloc(nSources, true);
+    else if(ewaldSources.get_size() < nSources)
+      ewaldSources.cresize_nocpy(nSources, false);
+    memcpy(&ewaldSources[0], &sources[0], nSources*sizeof(real4));
+    ewaldSources.h2d(nSources, false, gravStream->s());
+
+    stride = 1;
+    srcLoc = ewaldSources.a(0);
+  }
+  if(nSources == 0) return;
+
+  ewaldCorrection.set_arg<int>(0,    &tree.n);
+  ewaldCorrection.set_arg<int>(1,    &nSources);
+  ewaldCorrection.set_arg<int>(2,    &stride);
+  ewaldCorrection.set_arg<float>(3,  &periodicBoxSize);
+  ewaldCorrection.set_arg<cl_mem>(4, tree.bodies_Ppos.p());
+  ewaldCorrection.set_arg<cl_mem>(5, &srcLoc);
+  ewaldCorrection.set_arg<cl_mem>(6, ewaldTable.p());
+  ewaldCorrection.set_arg<cl_mem>(7, tree.bodies_acc1.p());
+  ewaldCorrection.setWork(tree.n, 256);
+  ewaldCorrection.execute(gravStream->s());
+  gravStream->sync();
+}
+
+#endif
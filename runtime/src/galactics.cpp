@@ -0,0 +1,617 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+#ifdef USE_MPI
+  #include <mpi.h>
+#endif
+#include "galactics.h"
+#include "counterRNG.h"
+
+namespace
+{
+  const int NL = 6;   //Even multipoles l = 0..10 of dbh.dat
+
+  const int MAXTRIES = 100000;  //Rejection steps per sample before giving up
+
+  //Stops all processes, the others would wait in the collectives
+  void abortAll()
+  {
+#ifdef USE_MPI
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+#endif
+    exit(EXIT_FAILURE);
+  }
+
+  void fail(const char *what, const std::string &file)
+  {
+    fprintf(stderr, "Galactics: %s %s\n", what, file.c_str());
+    abortAll();
+  }
+
+  //Numbers of a header line of dbh.dat, after the '#'
+  std::vector<double> headerValues(std::istream &in, const std::string &file)
+  {
+    std::string line;
+    if (!std::getline(in, line)) fail("unexpected end of", file);
+    const size_t hash = line.find('#');
+    std::istringstream s(hash == std::string::npos ? line : line.substr(hash+1));
+    std::vector<double> v;
+    double x;
+    while (s >> x) v.push_back(x);
+    return v;
+  }
+
+  //Even Legendre polynomials P_0(c)..P_10(c) with the sqrt((2l+1)/4pi)
+  //normalisation of the expansion
+  void legendre(const double c, double p[NL])
+  {
+    double pm = 1.0, pl = c;
+    p[0] = 1.0;
+    for (int l = 1; l < 2*(NL-1); l++)
+    {
+      const double pp = ((2*l+1)*c*pl - l*pm)/(l+1);
+      pm = pl;
+      pl = pp;
+      if ((l+1) % 2 == 0) p[(l+1)/2] = pp;
+    }
+    for (int k = 0; k < NL; k++) p[k] *= sqrt((4*k+1)/(4*M_PI));
+  }
+
+  double gaussian(PhiloxStream &rng)
+  {
+    return sqrt(-2.0*log(rng.uniform())) * cos(2.0*M_PI*rng.uniform());
+  }
+
+  //Point on the unit sphere
+  void direction(PhiloxStream &rng, double &x, double &y, double &z)
+  {
+    z = 2.0*rng.uniform() - 1.0;
+    const double phi = 2.0*M_PI*rng.uniform();
+    const double s   = sqrt(std::max(1.0 - z*z, 0.0));
+    x = s*cos(phi);
+    y = s*sin(phi);
+  }
+
+  //Index and fraction of x in the ascending table t, clamped to its ends
+  void locate(const std::vector<double> &t, const double x, int &k, double &f)
+  {
+    const int n = t.size();
+    if (x <= t[0])   { k = 0;   f = 0; return; }
+    if (x >= t[n-1]) { k = n-2; f = 1; return; }
+    k = std::upper_bound(t.begin(), t.end(), x) - t.begin() - 1;
+    f = (x - t[k])/(t[k+1] - t[k]);
+  }
+
+  double lerp(const std::vector<double> &v, const int k, const double f)
+  {
+    return v[k] + f*(v[k+1] - v[k]);
+  }
+
+  //Halo or bulge: density as a function of the relative potential psi = -phi
+  //and the isotropic DF from the Eddington inversion
+  struct Spheroid
+  {
+    double psic;                      //The density vanishes for psi <= psic
+    std::vector<double> psi, logRho;  //Ascending psi, log10 of the density
+    std::vector<double> eps, f, fmax; //DF at the bin midpoints, running maximum
+    std::vector<double> cdf;          //Envelope mass within r_k
+    double mass;
+
+    double density(const double p) const
+    {
+      if (p <= psic) return 0.0;
+      if (p < psi[0]) return pow(10.0, logRho[0]) * (p - psic)/(psi[0] - psic);
+      int k; double t;
+      locate(psi, p, k, t);
+      return pow(10.0, logRho[k] + t*(logRho[k+1] - logRho[k]));
+    }
+
+    double df(const double e) const
+    {
+      if (e <= psic) return 0.0;
+      int k; double t;
+      locate(eps, e, k, t);
+      return lerp(f, k, t);
+    }
+
+    //Upper bound of f on (psic, e]
+    double dfBound(const double e) const
+    {
+      int k; double t;
+      locate(eps, e, k, t);
+      return fmax[std::min(k+1, (int)fmax.size()-1)];
+    }
+
+    void read(const std::string &file, const double psiCut)
+    {
+      std::ifstream in(file.c_str());
+      if (!in) fail("can not open", file);
+      int n; double dummy;
+      if (!(in >> n >> dummy)) fail("can not read", file);
+      psic = psiCut;
+      std::vector<std::pair<double,double> > rows(n);
+      for (int i = 0; i < n; i++)
+        if (!(in >> dummy >> rows[i].second >> rows[i].first)) fail("can not read", file);
+      std::sort(rows.begin(), rows.end());
+      for (int i = 0; i < n; i++)
+      {
+        psi.push_back(rows[i].first);
+        logRho.push_back(rows[i].second);
+      }
+    }
+
+    //f(E) = 1/(sqrt(8) pi^2) d/dE int_psic^E drho/dpsi dpsi/sqrt(E-psi), with
+    //the density linear between the nodes the integral is exact per segment
+    void eddington()
+    {
+      std::vector<double> x(1, psic), rho(1, 0.0);
+      for (size_t i = 0; i < psi.size(); i++)
+      {
+        x.push_back(psi[i]);
+        rho.push_back(pow(10.0, logRho[i]));
+      }
+      const int n = x.size();
+      std::vector<double> G(n, 0.0);
+      for (int k = 1; k < n; k++)
+        for (int j = 0; j < k; j++)
+        {
+          const double d = (rho[j+1] - rho[j])/(x[j+1] - x[j]);
+          G[k] += 2.0*d*(sqrt(x[k] - x[j]) - sqrt(x[k] - x[j+1]));
+        }
+
+      double running = 0;
+      for (int k = 0; k+1 < n; k++)
+      {
+        eps.push_back(0.5*(x[k] + x[k+1]));
+        f.push_back(std::max((G[k+1] - G[k])/(x[k+1] - x[k]) / (sqrt(8.0)*M_PI*M_PI), 0.0));
+        running = std::max(running, f.back());
+        fmax.push_back(running);
+      }
+    }
+  };
+
+  class GalacticsModel
+  {
+    public:
+      GalacticsModel(const std::string &path);
+
+      //False if the rejection failed: the DF exceeded its envelope or no
+      //sample was accepted in MAXTRIES
+      bool disk    (PhiloxStream &rng, Galactics::Particle &p) const;
+      bool spheroid(const Spheroid &s, PhiloxStream &rng, Galactics::Particle &p) const;
+
+      double diskMass() const { return diskCdf.back(); }
+
+      Spheroid halo, bulge;
+
+    private:
+      double potential(const double R, const double z) const;
+      double surfaceDensity(const double R) const;
+      double diskSigmaR2(const double R) const;
+      double diskDF(const double vphi, const double R, const double phiR0, const double dphiZ,
+                    int &k, double &t) const;
+
+      //Harmonic expansion of the potential on r_k = k*dr, k = 0..nr
+      int    nr;
+      double dr;
+      std::vector<double> apot[NL], fr[NL], fr2[NL];
+
+      //Disk parameters and DF corrections
+      double mdisk, rdisk, zdisk, outdisk, drtrunc;
+      double sigr0, disksr;
+      std::vector<double> corR, corDens, corSig;
+      double corSigMax;
+
+      //Midplane tables on R_k = k*dr: potential, circular velocity and the
+      //disk DF terms as functions of the guiding centre radius
+      std::vector<double> phi0, vc, Lc, Ec, sigR2, sigZ2, amp;
+      std::vector<double> diskCdf;
+  };
+
+  GalacticsModel::GalacticsModel(const std::string &path)
+  {
+    //dbh.dat: parameters, then adens, apot, fr and fr2 on nr+1 radii
+    const std::string dbh = path + "/dbh.dat";
+    std::ifstream in(dbh.c_str());
+    if (!in) fail("can not open", dbh);
+    headerValues(in, dbh);
+    const std::vector<double> grid = headerValues(in, dbh);     //c,v0,a,cbulge,v0bulge,abulge,dr,nr,lmax
+    headerValues(in, dbh);
+    headerValues(in, dbh);                                     //psi0, haloconst, bulgeconst
+    headerValues(in, dbh);
+    const std::vector<double> disk = headerValues(in, dbh);     //Mdisk, rdisk, zdisk, outdisk, drtrunc
+    headerValues(in, dbh);
+    const std::vector<double> cut = headerValues(in, dbh);      //psic_bulge, psic_halo, psi0_prime, bhmass
+    headerValues(in, dbh);
+    headerValues(in, dbh);
+    if (grid.size() < 9 || disk.size() < 5 || cut.size() < 2 || (int)grid[8] != 2*(NL-1))
+      fail("unexpected header in", dbh);
+
+    dr = grid[6];
+    nr = (int)grid[7];
+    mdisk = disk[0]; rdisk = disk[1]; zdisk = disk[2]; outdisk = disk[3]; drtrunc = disk[4];
+
+    std::vector<double> *blocks[4] = {NULL, apot, fr, fr2};
+    for (int b = 0; b < 4; b++)
+    {
+      for (int l = 0; b > 0 && l < NL; l++) blocks[b][l].resize(nr+1);
+      for (int k = 0; k <= nr; k++)
+      {
+        double r, c;
+        if (!(in >> r)) fail("can not read", dbh);
+        for (int l = 0; l < NL; l++)
+        {
+          if (!(in >> c)) fail("can not read", dbh);
+          if (b > 0) blocks[b][l][k] = c;
+        }
+      }
+    }
+
+    //cordbh.dat: sigr0, disksr, n, then radius, density and sigma_R^2 corrections
+    const std::string cor = path + "/cordbh.dat";
+    std::ifstream cin(cor.c_str());
+    if (!cin) fail("can not open", cor);
+    const std::vector<double> corHead = headerValues(cin, cor);
+    if (corHead.size() < 3) fail("unexpected header in", cor);
+    sigr0  = corHead[0];
+    disksr = corHead[1];
+    corR.resize((int)corHead[2]+1); corDens.resize(corR.size()); corSig.resize(corR.size());
+    for (size_t i = 0; i < corR.size(); i++)
+      if (!(cin >> corR[i] >> corDens[i] >> corSig[i])) fail("can not read", cor);
+    corSigMax = *std::max_element(corSig.begin(), corSig.end());
+
+    halo .read(path + "/denspsihalo.dat",  -cut[1]);
+    bulge.read(path + "/denspsibulge.dat", -cut[0]);
+    halo .eddington();
+    bulge.eddington();
+
+    //Midplane. The potential is smooth, its derivatives come from fr, fr2
+    double p[NL];
+    legendre(0.0, p);
+    const int n = nr+1;
+    phi0.resize(n); vc.resize(n); Lc.resize(n); Ec.resize(n);
+    sigR2.resize(n); sigZ2.resize(n); amp.resize(n);
+    std::vector<double> omega(n), kappa(n);
+    for (int k = 0; k < n; k++)
+    {
+      const double R = k*dr;
+      double d1 = 0, d2 = 0;
+      phi0[k] = 0;
+      for (int l = 0; l < NL; l++)
+      {
+        phi0[k] += apot[l][k]*p[l];
+        d1      += fr  [l][k]*p[l];
+        d2      += fr2 [l][k]*p[l];
+      }
+      vc[k]    = sqrt(std::max(R*d1, 0.0));
+      omega[k] = k > 0 ? vc[k]/R : 0;
+      kappa[k] = k > 0 ? sqrt(std::max(d2 + 3*d1/R, 1e-30)) : 0;
+      Ec[k]    = phi0[k] + 0.5*vc[k]*vc[k];
+    }
+    omega[0] = omega[1];
+    kappa[0] = kappa[1];
+
+    //Guiding centre radius from L_z: the table has to be increasing
+    for (int k = 0; k < n; k++)
+      Lc[k] = std::max(k*dr*vc[k], k > 0 ? Lc[k-1] + 1e-12 : 0.0);
+
+    //DF of the disk in the guiding centre radius, without the energies
+    for (int k = 0; k < n; k++)
+    {
+      const double R     = k*dr;
+      const double sigma = surfaceDensity(R);
+      int c; double t;
+      locate(corR, R, c, t);
+      sigR2[k] = diskSigmaR2(R);
+      sigZ2[k] = M_PI*sigma*zdisk;
+      amp[k]   = sigma > 0 ? omega[k]/(M_PI*kappa[k]) * sigma*lerp(corDens, c, t) / sigR2[k] : 0.0;
+    }
+
+    //Radial mass distributions of the disk and of the spheroids. The
+    //spheroids are most dense in the plane, where the potential is deepest
+    const double cosines[8] = {0.0625, 0.1875, 0.3125, 0.4375, 0.5625, 0.6875, 0.8125, 0.9375};
+    diskCdf.assign(n, 0.0);
+    halo .cdf.assign(n, 0.0); halo .mass = 0;
+    bulge.cdf.assign(n, 0.0); bulge.mass = 0;
+    for (int k = 1; k < n; k++)
+    {
+      const double r = (k-0.5)*dr;
+      diskCdf[k] = diskCdf[k-1] + 2*M_PI*r*surfaceDensity(r)*dr;
+
+      Spheroid *s[2] = {&halo, &bulge};
+      for (int i = 0; i < 2; i++)
+      {
+        s[i]->cdf[k] = s[i]->cdf[k-1] + 4*M_PI*r*r*s[i]->density(-potential(r, 0))*dr;
+        double mean = 0;
+        for (int j = 0; j < 8; j++)
+          mean += s[i]->density(-potential(r*sqrt(1 - cosines[j]*cosines[j]), r*cosines[j]))/8;
+        s[i]->mass += 4*M_PI*r*r*mean*dr;
+      }
+    }
+  }
+
+  double GalacticsModel::surfaceDensity(const double R) const
+  {
+    return mdisk/(2*M_PI*rdisk*rdisk) * exp(-R/rdisk) * 0.5*erfc((R - outdisk)/(sqrt(2.0)*drtrunc));
+  }
+
+  double GalacticsModel::diskSigmaR2(const double R) const
+  {
+    int c; double t;
+    locate(corR, R, c, t);
+    return sigr0*sigr0*exp(-R/disksr) * lerp(corSig, c, t);
+  }
+
+  //Harmonic expansion plus the analytic disk part that it leaves out,
+  //2 pi Sigma(r) z_d log cosh(z/z_d) with the spherical radius r
+  double GalacticsModel::potential(const double R, const double z) const
+  {
+    const double r = sqrt(R*R + z*z);
+    double p[NL];
+    legendre(r > 0 ? z/r : 0.0, p);
+
+    double phi = 0;
+    const double x = r/dr;
+    if (x >= nr)
+    {
+      phi = apot[0][nr]*p[0] * nr*dr/r;
+    }
+    else
+    {
+      const int    k = (int)x;
+      const double t = x - k;
+      for (int l = 0; l < NL; l++)
+        phi += (apot[l][k] + t*(apot[l][k+1] - apot[l][k]))*p[l];
+    }
+
+    const double a = fabs(z)/zdisk;
+    const double logCosh = a + log1p(exp(-2*a)) - log(2.0);
+    return phi + 2*M_PI*surfaceDensity(r)*zdisk*logCosh;
+  }
+
+  //Disk DF integrated over v_R and v_z, as a function of v_phi at radius R.
+  //phiR0 is the midplane potential at R, dphiZ = phi(R,z) - phiR0. Returns
+  //the position of the guiding centre radius in the tables in k, t
+  double GalacticsModel::diskDF(const double vphi, const double R, const double phiR0, const double dphiZ,
+                                int &k, double &t) const
+  {
+    locate(Lc, R*vphi, k, t);
+    const double a  = lerp(amp,   k, t);
+    const double s2 = lerp(sigR2, k, t);
+    const double z2 = lerp(sigZ2, k, t);
+    if (a <= 0 || s2 <= 0 || z2 <= 0) return 0.0;
+    const double Ep = 0.5*vphi*vphi + phiR0;
+    return a*sqrt(s2) * exp(-(Ep - lerp(Ec, k, t))/s2) * exp(-dphiZ/z2);
+  }
+
+  //Position on the target disk. v_phi by rejection from the DF integrated
+  //over v_R and v_z, then v_R and v_z are Gaussian with the dispersions of
+  //the guiding centre radius
+  bool GalacticsModel::disk(PhiloxStream &rng, Galactics::Particle &p) const
+  {
+    int    k;
+    double t;
+    locate(diskCdf, rng.uniform()*diskCdf.back(), k, t);
+    const double R   = (k + t)*dr;
+    const double z   = zdisk*atanh(2*rng.uniform() - 1);
+    const double phi = 2*M_PI*rng.uniform();
+
+    const double phiR0 = potential(R, 0);
+    const double dphiZ = potential(R, z) - phiR0;
+
+    const int    kr  = std::min((int)(R/dr), nr-1);
+    const double vcR = vc[kr] + (R/dr - kr)*(vc[kr+1] - vc[kr]);
+    const double s   = sqrt(sigr0*sigr0*exp(-R/disksr)*std::max(corSigMax, 1.0));
+    const double lo  = std::max(0.0, vcR - 6*s);
+    const double hi  = vcR + 6*s;
+
+    //Fixed envelope: the maximum on a grid over [lo, hi], refined on a finer
+    //grid around the largest node, with a margin. The DF is a smooth single
+    //peak of width ~s, a sample above the envelope is an error
+    const int NGRID = 64;
+    const double h  = (hi-lo)/NGRID;
+    double fmax = 0;
+    int    imax = 0;
+    for (int i = 0; i < NGRID; i++)
+    {
+      const double f = diskDF(lo + h*(i+0.5), R, phiR0, dphiZ, k, t);
+      if (f > fmax) { fmax = f; imax = i; }
+    }
+    for (int i = 0; i <= NGRID; i++)
+      fmax = std::max(fmax, diskDF(lo + h*(imax - 0.5 + 2.0*i/NGRID), R, phiR0, dphiZ, k, t));
+    fmax *= 1.1;
+    if (fmax <= 0) return false;
+
+    double vphi = 0;
+    int    tries;
+    for (tries = 0; tries < MAXTRIES; tries++)
+    {
+      vphi = lo + (hi-lo)*rng.uniform();
+      const double f = diskDF(vphi, R, phiR0, dphiZ, k, t);
+      if (f > fmax) return false;
+      if (rng.uniform()*fmax < f) break;
+    }
+    if (tries == MAXTRIES) return false;
+
+    diskDF(vphi, R, phiR0, dphiZ, k, t);     //Guiding centre of the accepted v_phi
+    const double vR = sqrt(lerp(sigR2, k, t))*gaussian(rng);
+    const double vz = sqrt(lerp(sigZ2, k, t))*gaussian(rng);
+
+    p.x  = R*cos(phi);
+    p.y  = R*sin(phi);
+    p.z  = z;
+    p.vx = vR*cos(phi) - vphi*sin(phi);
+    p.vy = vR*sin(phi) + vphi*cos(phi);
+    p.vz = vz;
+    return true;
+  }
+
+  //Radius from the midplane density, accepted with the density at the
+  //drawn inclination. The speed by rejection from v^2 f(psi - v^2/2)
+  bool GalacticsModel::spheroid(const Spheroid &s, PhiloxStream &rng, Galactics::Particle &p) const
+  {
+    double x, y, z, r, psi;
+    int    tries;
+    for (tries = 0; tries < MAXTRIES; tries++)
+    {
+      int    k;
+      double t;
+      locate(s.cdf, rng.uniform()*s.cdf.back(), k, t);
+      r = (k + t)*dr;
+      direction(rng, x, y, z);
+      const double R = r*sqrt(x*x + y*y);
+      psi = -potential(R, r*z);
+      const double rhoPlane = s.density(-potential(r, 0));
+      const double rho      = s.density(psi);
+      if (rho > rhoPlane) return false;
+      if (rhoPlane > 0 && rng.uniform()*rhoPlane <= rho) break;
+    }
+    if (tries == MAXTRIES) return false;
+    p.x = r*x;
+    p.y = r*y;
+    p.z = r*z;
+
+    //Envelope of v^2 f(psi - v^2/2) over cells of v: f is at most the running
+    //maximum below the energy at the lower end of the cell. Near the centre f
+    //peaks at the highest energies, where v^2 is small, vesc^2 times the
+    //maximum of f below psi would accept one sample in thousands there
+    const int    NV    = 64;
+    const double vesc  = sqrt(2*std::max(psi - s.psic, 0.0));
+    double       bound = 0;
+    for (int i = 0; i < NV; i++)
+    {
+      const double v0 = vesc*i/NV, v1 = vesc*(i+1)/NV;
+      bound = std::max(bound, v1*v1*s.dfBound(psi - 0.5*v0*v0));
+    }
+    if (bound <= 0) return false;
+    double v = 0;
+    for (tries = 0; tries < MAXTRIES; tries++)
+    {
+      v = vesc*rng.uniform();
+      if (rng.uniform()*bound <= v*v*s.df(psi - 0.5*v*v)) break;
+    }
+    if (tries == MAXTRIES) return false;
+    direction(rng, x, y, z);
+    p.vx = v*x;
+    p.vy = v*y;
+    p.vz = v*z;
+    return true;
+  }
+}
+
+Galactics::Galactics(const int procId, const int nProcs,
+                     const long long ndiskTotal, const long long nbulgeTotal, const long long nhaloTotal,
+                     const int nThreads, const std::string &path)
+{
+  const GalacticsModel model(path);
+  if (procId == 0)
+    fprintf(stderr, "Galactics: disk mass= %g  bulge mass= %g  halo mass= %g\n",
+        model.diskMass(), model.bulge.mass, model.halo.mass);
+
+  //Every process samples a contiguous range of the particles of each
+  //component of the whole model
+  const long long    total[3]  = {ndiskTotal, nbulgeTotal, nhaloTotal};
+  const int          idBase[3] = {0, 100000000, 200000000};
+  const unsigned int seed[3]   = {SEED, SEED+1, SEED+2};
+  const double       mass[3]   = {model.diskMass(), model.bulge.mass, model.halo.mass};
+  const char        *name[3]   = {"disk", "bulge", "halo"};
+  long long begin[3];
+  int       count[3], first[3];
+  for (int c = 0; c < 3; c++)
+  {
+    begin[c] = total[c]* procId   /nProcs;
+    count[c] = total[c]*(procId+1)/nProcs - begin[c];
+    first[c] = c == 0 ? 0 : first[c-1] + count[c-1];
+  }
+  ndisk  = count[0];
+  nbulge = count[1];
+  nhalo  = count[2];
+  ptcl.resize(get_ntot());
+
+#ifdef _OPENMP
+  const int nt = nThreads > 0 ? nThreads : omp_get_max_threads();
+#endif
+  for (int c = 0; c < 3; c++)
+  {
+    long long nFailed = 0;
+#pragma omp parallel for schedule(dynamic, 1024) num_threads(nt) reduction(+:nFailed)
+    for (int i = 0; i < count[c]; i++)
+    {
+      const long long index = begin[c] + i;
+      PhiloxStream rng(seed[c], index);
+      Particle &p = ptcl[first[c] + i];
+      const bool ok = c == 0 ? model.disk(rng, p)
+                             : model.spheroid(c == 1 ? model.bulge : model.halo, rng, p);
+      if (!ok) nFailed++;
+      p.mass = mass[c]/total[c];
+      p.id   = idBase[c] + index;
+    }
+    if (nFailed > 0)
+    {
+      fprintf(stderr, "Galactics: procId= %d  rejection sampling of the %s failed for %lld particles "
+                      "(DF above its envelope or no sample accepted in %d tries)\n",
+                      procId, name[c], nFailed, MAXTRIES);
+      abortAll();
+    }
+
+    //Centre of mass and mean velocity of the component over all processes,
+    //equal masses
+    double sum[6] = {0, 0, 0, 0, 0, 0};
+    for (int i = first[c]; i < first[c] + count[c]; i++)
+    {
+      sum[0] += ptcl[i].x;   sum[1] += ptcl[i].y;   sum[2] += ptcl[i].z;
+      sum[3] += ptcl[i].vx;  sum[4] += ptcl[i].vy;  sum[5] += ptcl[i].vz;
+    }
+#ifdef USE_MPI
+    if (nProcs > 1) MPI_Allreduce(MPI_IN_PLACE, sum, 6, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+#endif
+    for (int k = 0; k < 6; k++) sum[k] /= std::max(total[c], 1LL);
+    for (int i = first[c]; i < first[c] + count[c]; i++)
+    {
+      ptcl[i].x  -= sum[0];  ptcl[i].y  -= sum[1];  ptcl[i].z  -= sum[2];
+      ptcl[i].vx -= sum[3];  ptcl[i].vy -= sum[4];  ptcl[i].vz -= sum[5];
+    }
+  }
+}
+
+void Galactics::summary(const int procId, const char *name) const
+{
+  //Per component: n, m, m*(x, y, z, vx, vy, vz, R, |z|, vphi, vR^2, vphi^2, vz^2)
+  const int NSUM = 14;
+  double sum[3][NSUM] = {{0}};
+  const int first[3] = {0, ndisk, ndisk+nbulge};
+  const int count[3] = {ndisk, nbulge, nhalo};
+  for (int c = 0; c < 3; c++)
+    for (int i = first[c]; i < first[c] + count[c]; i++)
+    {
+      const Particle &p = ptcl[i];
+      const double R    = sqrt((double)p.x*p.x + (double)p.y*p.y);
+      const double vR   = R > 0 ? (p.x*p.vx + p.y*p.vy)/R : 0.0;
+      const double vphi = R > 0 ? (p.x*p.vy - p.y*p.vx)/R : 0.0;
+      const double v[NSUM] = {1, 1, p.x, p.y, p.z, p.vx, p.vy, p.vz, R, fabs(p.z), vphi, vR*vR, vphi*vphi, p.vz*p.vz};
+      sum[c][0] += 1;
+      for (int k = 1; k < NSUM; k++) sum[c][k] += p.mass*v[k];
+    }
+#ifdef USE_MPI
+  MPI_Allreduce(MPI_IN_PLACE, &sum[0][0], 3*NSUM, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+#endif
+  if (procId != 0) return;
+
+  const char *component[3] = {"disk", "bulge", "halo"};
+  fprintf(stderr, "Galactics %s: component n mass com(x,y,z) vmean(x,y,z) <R> <|z|> <vphi> sigma(R,phi,z)\n", name);
+  for (int c = 0; c < 3; c++)
+  {
+    const double *s = sum[c];
+    const double  m = s[1] > 0 ? s[1] : 1;
+    const double  vphi = s[10]/m;
+    fprintf(stderr, "  %-5s %.0f %g  %g %g %g  %g %g %g  %g %g %g  %g %g %g\n", component[c], s[0], s[1],
+            s[2]/m, s[3]/m, s[4]/m, s[5]/m, s[6]/m, s[7]/m, s[8]/m, s[9]/m, vphi,
+            sqrt(s[11]/m), sqrt(std::max(s[12]/m - vphi*vphi, 0.0)), sqrt(s[13]/m));
+  }
+}
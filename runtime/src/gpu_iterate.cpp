@@ -1,6 +1,12 @@
 #include "octree.h"
-#include "postProcessModules.h"
+#include "analysisScheduler.h"
 #include "thrust_war_of_galaxies.h"
+#include "telemetry.h"
+#include "trace.h"
+#include "perfCounters.h"
+#include "autoTuner.h"
+#include "phaseTransform.h"
+#include "memoryEstimate.h"
 
 #include <iostream>
 #include <algorithm>
@@ -16,6 +22,10 @@ cudaEvent_t startLocalGrav;
 cudaEvent_t startRemoteGrav;
 cudaEvent_t endLocalGrav;
 cudaEvent_t endRemoteGrav;
+cudaEvent_t propertiesDone;
+cudaEvent_t topBoxCopied;
+cudaEvent_t dustPropertiesDone;
+cudaEvent_t dustBoxCopied;
 
 
 float runningLETTimeSum;
@@ -355,11 +365,14 @@ bool octree::addGalaxy(int galaxyID)
       this->localTree.dust_ids.h2d();
 
       this->localTree.dust_acc0.d2h();
+      this->localTree.dust_time.d2h();
       for(int i=old_ndust; i < old_ndust + n_addGalaxy_dust; i++)
       {
-        //Zero the accelerations of the new particles
+        //Zero the accelerations of the new particles, they are walked next step
         this->localTree.dust_acc0[i] = make_float4(0.0f,0.0f,0.0f,0.0f);
+        this->localTree.dust_time[i] = make_float2(t_current, t_current);
       }
+      this->localTree.dust_time.h2d();
     //  fprintf(stderr, "Dust info %d %d \n", old_ndust, n_addGalaxy_dust);      this->localTree.dust_acc0.h2d();
       this->localTree.dust_acc1.zeroMem();
     }
@@ -389,6 +402,7 @@ bool octree::addGalaxy(int galaxyID)
   //Fill the predicted arrays
   this->localTree.bodies_Ppos.copy(this->localTree.bodies_pos, localTree.n);
   this->localTree.bodies_Pvel.copy(this->localTree.bodies_pos, localTree.n);
+  this->clearParticleLowWords(this->localTree);
   
   resetEnergy();
   
@@ -415,7 +429,7 @@ bool octree::addGalaxy(int galaxyID)
   
 }
 
-void octree::releaseGalaxy(Galaxy const& galaxy)
+void octree::releaseGalaxy(Galaxy const& galaxy, PhaseTransform const& placement, int user_id)
 {
   // Get particle data back to the host so we can add our new data
   this->localTree.bodies_pos.d2h();
@@ -423,45 +437,32 @@ void octree::releaseGalaxy(Galaxy const& galaxy)
   this->localTree.bodies_vel.d2h();
   this->localTree.bodies_time.d2h();
   this->localTree.bodies_ids.d2h();
-  this->localTree.bodies_Ppos.d2h();
-  this->localTree.bodies_Pvel.d2h();
-
-  vector<real4> new_pos;
-  vector<real4> new_vel;
-  vector<int> new_ids;
-  int old_nb_particles = this->localTree.n;
-  int new_nb_particles = old_nb_particles + galaxy.pos.size();
-
-  for (int i(0); i != old_nb_particles; ++i)
-  {
-    new_pos.push_back(this->localTree.bodies_pos[i]);
-    new_vel.push_back(this->localTree.bodies_vel[i]);
-    new_ids.push_back(this->localTree.bodies_ids[i]);
-  }
 
-  for (int i(0); i != galaxy.pos.size(); ++i)
-  {
-    new_pos.push_back(galaxy.pos[i]);
-    new_vel.push_back(galaxy.vel[i]);
-    new_ids.push_back(galaxy.ids[i]);
-  }
+  const int old_nb_particles = this->localTree.n;
+  const int n_galaxy         = galaxy.pos.size();
+  const int new_nb_particles = old_nb_particles + n_galaxy;
+  const float2 curTime       = this->localTree.bodies_time[0];
 
-  // Set new size of the buffers
+  // Set new size of the buffers, resize preserves original data
   this->localTree.setN(new_nb_particles);
-
-  // Resize preserves original data
   this->reallocateParticleMemory(this->localTree);
 
-  // Copy back to host storage
-  memcpy(&this->localTree.bodies_pos[0], &new_pos[0], sizeof(real4) * new_nb_particles);
-  memcpy(&this->localTree.bodies_vel[0], &new_vel[0], sizeof(real4) * new_nb_particles);
-  memcpy(&this->localTree.bodies_ids[0], &new_ids[0], sizeof(int) * new_nb_particles);
+  // The new particles are moved into place while they are copied into the
+  // host buffers, in one pass
+  real4 *pos = &this->localTree.bodies_pos[old_nb_particles];
+  real4 *vel = &this->localTree.bodies_vel[old_nb_particles];
+  int   *ids = &this->localTree.bodies_ids[old_nb_particles];
+  placement.apply(galaxy.pos.data(), galaxy.vel.data(), pos, vel, n_galaxy);
 
-  float2 curTime = this->localTree.bodies_time[0];
+  // Since the particle ids are not needed for the simulation, we use them to store the user_id in the first digit.
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < n_galaxy; ++i)
+  {
+    ids[i] = galaxy.ids[i] - galaxy.ids[i] % 10 + user_id;
+    this->localTree.bodies_acc0[old_nb_particles + i] = make_float4(0.0, 0.0, 0.0, 0.0);
+  }
   for (int i(0); i != new_nb_particles; ++i)
     this->localTree.bodies_time[i] = curTime;
-  for (int i(old_nb_particles); i != new_nb_particles; ++i)
-    this->localTree.bodies_acc0[i] = make_float4(0.0, 0.0, 0.0, 0.0);
   this->localTree.bodies_acc1.zeroMem();
 
   this->localTree.bodies_pos.h2d();
@@ -472,7 +473,8 @@ void octree::releaseGalaxy(Galaxy const& galaxy)
 
   // Fill the predicted arrays
   this->localTree.bodies_Ppos.copy(this->localTree.bodies_pos, localTree.n);
-  this->localTree.bodies_Pvel.copy(this->localTree.bodies_pos, localTree.n);
+  this->localTree.bodies_Pvel.copy(this->localTree.bodies_vel, localTree.n);
+  this->clearParticleLowWords(this->localTree);
 
   resetEnergy();
 }
@@ -528,6 +530,7 @@ void octree::removeGalaxy(int user_id)
   // Fill the predicted arrays
   this->localTree.bodies_Ppos.copy(this->localTree.bodies_pos, localTree.n);
   this->localTree.bodies_Pvel.copy(this->localTree.bodies_pos, localTree.n);
+  this->clearParticleLowWords(this->localTree);
 
   resetEnergy();
 }
@@ -542,6 +545,7 @@ void octree::removeParticles(real deletion_radius_square, my_dev::dev_mem<uint>
 
   // Resize preserves original data
   this->reallocateParticleMemory(this->localTree);
+  this->clearParticleLowWords(this->localTree);
 
 #else
 
@@ -600,15 +604,94 @@ void octree::removeParticles(real deletion_radius_square, my_dev::dev_mem<uint>
   // Fill the predicted arrays
   this->localTree.bodies_Ppos.copy(this->localTree.bodies_pos, localTree.n);
   this->localTree.bodies_Pvel.copy(this->localTree.bodies_pos, localTree.n);
+  this->clearParticleLowWords(this->localTree);
 
 #endif
 
   resetEnergy();
 }
 
+//The box volumes at the level where the tree-walk starts measure how much the
+//refitted boxes have grown since the last rebuild. The boxes are copied on the
+//copy stream once compute_properties is done and only summed at the next
+//rebuild check, so the step itself never waits on the copy
+void octree::startTopLevelBoxCopy(tree_structure &tree, bool rebuilt)
+{
+  const uint2 begEnd = tree.level_list[tree.startLevelMin];
+  const int   n      = begEnd.y - begEnd.x;
+  if(n <= 0) return;
+
+  //A copy that was never summed may still be writing into the buffer
+  if(topBoxCopyCount > 0) CU_SAFE_CALL(cudaEventSynchronize(topBoxCopied));
+
+  if(topBoxSize.get_size() == 0)
+    topBoxSize.cmalloc(n, true);
+  else
+    topBoxSize.cresize_nocpy(n, false);
+
+  CU_SAFE_CALL(cudaEventRecord(propertiesDone, execStream->s()));
+  CU_SAFE_CALL(cudaStreamWaitEvent(copyStream->s(), propertiesDone, 0));
+  CU_SAFE_CALL(cudaMemcpyAsync(&topBoxSize[0], (real4*)tree.boxSizeInfo.d() + begEnd.x,
+                               n*sizeof(real4), cudaMemcpyDeviceToHost, copyStream->s()));
+  CU_SAFE_CALL(cudaEventRecord(topBoxCopied, copyStream->s()));
+
+  topBoxCopyCount   = n;
+  topBoxCopyRebuild = rebuilt;
+}
+
+void octree::updateRefitBoxGrowth()
+{
+  if(topBoxCopyCount == 0) return;
+
+  CU_SAFE_CALL(cudaEventSynchronize(topBoxCopied));
+
+  double volume = 0;
+  for(int i=0; i < topBoxCopyCount; i++)
+  {
+    volume += 8.0*topBoxSize[i].x*topBoxSize[i].y*topBoxSize[i].z;
+  }
+
+  if(topBoxCopyRebuild)
+  {
+    rebuildBoxVolume = volume;
+    refitBoxGrowth   = 1;
+  }
+  else if(rebuildBoxVolume > 0)
+    refitBoxGrowth = volume / rebuildBoxVolume;
+
+  topBoxCopyCount = 0;
+}
+
+//Decide if the tree has to be rebuild this step or if we can refit the current
+//tree. The decision has to be the same on all processes since the domain update
+//is coupled to the rebuild
+bool octree::needTreeRebuild()
+{
+  if(rebuildCostFactor <= 0)
+    return ((iter % rebuild_tree_rate) == 0);
+
+  if(iter == 0) return true;
+
+  updateRefitBoxGrowth();
+
+  double rebuild = 0;
+  if((iter - lastRebuildIter) >= rebuild_tree_rate) rebuild = 1;
+  if(rebuildInteractionCount > 0 &&
+     lastInteractionCount > rebuildCostFactor*rebuildInteractionCount) rebuild = 1;
+  if(refitBoxGrowth > rebuildBoxFactor) rebuild = 1;
+
+  AllSum(rebuild);
+
+  LOGF(stderr, "Rebuild check iter: %d since: %d interactions: %lld / %lld box growth: %f rebuild: %d\n",
+                iter, iter-lastRebuildIter, lastInteractionCount, rebuildInteractionCount,
+                refitBoxGrowth, rebuild > 0);
+  return (rebuild > 0);
+}
+
 // returns true if this iteration is the last (t_current >= t_end), false otherwise
 bool octree::iterate_once(IterationData &idata) {
     double t1 = 0;
+    const double tStepStart = get_time();
 
     //if(t_current < 1) //Clear startup timings
     //if(0)
@@ -633,6 +716,7 @@ bool octree::iterate_once(IterationData &idata) {
     
     bool forceTreeRebuild = false;
     bool needDomainUpdate = true;
+    const bool rebuildStep = needTreeRebuild();
 
     double tTempTime = get_time();
 
@@ -646,10 +730,11 @@ bool octree::iterate_once(IterationData &idata) {
     if(nProcs > 1)
     {
       //if(1) //Always update domain boundaries/particles
-      if((iter % rebuild_tree_rate) == 0)
+      if(rebuildStep)
       {
         double domUp =0, domEx = 0;
         double tZ = get_time();
+        my_dev::base_mem::setMemPhase("domain");
         devContext.startTiming(execStream->s());
         parallelDataSummary(localTree, lastTotal, lastLocal, domUp, domEx);
         devContext.stopTiming("UpdateDomain", 6, execStream->s());
@@ -696,14 +781,16 @@ bool octree::iterate_once(IterationData &idata) {
       // bool rebuild_tree = Nact_since_last_tree_rebuild > 4*this->localTree.n;   
       bool rebuild_tree = true;
 
-      rebuild_tree = ((iter % rebuild_tree_rate) == 0);
+      rebuild_tree = rebuildStep;
       if(rebuild_tree)
       {
         t1 = get_time();
         //Rebuild the tree
+        my_dev::base_mem::setMemPhase("sort");
         this->sort_bodies(this->localTree, needDomainUpdate);
 
 
+        my_dev::base_mem::setMemPhase("build");
         devContext.startTiming(execStream->s());
         this->build(this->localTree);
         devContext.stopTiming("Tree-construction", 2, execStream->s());
@@ -712,6 +799,7 @@ bool octree::iterate_once(IterationData &idata) {
 
         LOGF(stderr, " done in %g sec : %g Mptcl/sec\n", tTemp-t1, this->localTree.n/1e6/(tTemp-t1));
 
+        my_dev::base_mem::setMemPhase("properties");
         devContext.startTiming(execStream->s());
         this->allocateTreePropMemory(this->localTree);
         devContext.stopTiming("Memory", 11, execStream->s());      
@@ -730,12 +818,17 @@ bool octree::iterate_once(IterationData &idata) {
         idata.lastBuildTime   = get_time() - t1;
         idata.totalBuildTime += idata.lastBuildTime;  
 
+        if(rebuildCostFactor > 0)
+        {
+          lastRebuildIter         = iter;
+          rebuildInteractionCount = 0; //Set after the first gravity step on this tree
+          startTopLevelBoxCopy(this->localTree, true);
+        }
+
 
         #ifdef USE_DUST
-                //Sort and set properties
-                sort_dust(this->localTree);
-                make_dust_groups(this->localTree);
-                setDustGroupProperties(this->localTree);
+                //Sort, group and set properties
+                updateDustGroups(this->localTree, true);
         #endif
 
       }
@@ -748,24 +841,41 @@ bool octree::iterate_once(IterationData &idata) {
           idata.Nact_since_last_tree_rebuild = 0;
         #endif        
         //Dont rebuild only update the current boxes
+        my_dev::base_mem::setMemPhase("properties");
         devContext.startTiming(execStream->s());
         this->compute_properties(this->localTree);
         devContext.stopTiming("Compute-properties", 3, execStream->s());
 
+        if(rebuildCostFactor > 0)
+          startTopLevelBoxCopy(this->localTree, false);
+
         #ifdef USE_DUST
-                setDustGroupProperties(this->localTree);
+                updateDustGroups(this->localTree, false);
         #endif
 
       }//end rebuild tree
 
       //Approximate gravity
       t1 = get_time();
-      //devContext.startTiming(gravStream->s());
+#ifdef TREEPM
+      //Host copy for the mesh, made before the walk so it does not wait on
+      //it. The mesh runs on its own thread during the walk and makeLET
+      if(pmSolver)
+      {
+        localTree.bodies_Ppos.d2h();
+        pm_gravity(this->localTree);
+      }
+#endif
+      my_dev::base_mem::setMemPhase("gravity");
+      devContext.startTiming(gravStream->s());
       approximate_gravity(this->localTree);
-//      devContext.stopTiming("Approximation", 4, gravStream->s());
+      devContext.stopTiming("Approximation", 4, gravStream->s());
 
       runningLETTimeSum = 0;
+      letBytesSent      = 0;
+      letBytesRecv      = 0;
 
+      my_dev::base_mem::setMemPhase("LET");
       if(nProcs > 1)
         makeLET();
 
@@ -777,6 +887,17 @@ bool octree::iterate_once(IterationData &idata) {
     }//else if useDirectGravity
 
     gravStream->sync();
+    my_dev::base_mem::setMemPhase("correct");
+
+#ifdef PERIODIC
+    if(!useDirectGravity) ewald_correction(this->localTree);
+#endif
+#ifdef TREEPM
+    if(!useDirectGravity && pmSolver) pm_addForces(this->localTree);
+#endif
+
+    if(iter == forceCheckIter && !useDirectGravity)
+      checkForceAccuracy(this->localTree);
 
     idata.lastGravTime      = get_time() - t1;
     idata.totalGravTime    += idata.lastGravTime;
@@ -801,6 +922,9 @@ bool octree::iterate_once(IterationData &idata) {
    sprintf(buff2, "INT Interaction at (rank= %d ) iter: %d\tdirect: %llu\tappr: %llu\tavg dir: %f\tavg appr: %f\n",
                    procId,iter, directSum ,apprSum, directSum / (float)localTree.n, apprSum / (float)localTree.n);
    devContext.writeLogEvent(buff2);
+
+   lastInteractionCount = apprSum + directSum;
+   if(rebuildInteractionCount == 0) rebuildInteractionCount = lastInteractionCount;
 #endif
    LOGF(stderr,"Stats calculation took: %lg \n", get_time()-tTempTime);
 
@@ -852,13 +976,15 @@ bool octree::iterate_once(IterationData &idata) {
       correctDustStep(this->localTree);  
     #endif     
     
+    double stepWaitTime = 0;
     if(nProcs > 1)
     { //Wait on all processes and time how long the waiting took
       t1 = get_time();
       devContext.startTiming(execStream->s());
       mpiSync();
       devContext.stopTiming("Unbalance", 12, execStream->s());
-      idata.lastWaitTime  += get_time() - t1;
+      stepWaitTime         = get_time() - t1;
+      idata.lastWaitTime  += stepWaitTime;
       idata.totalWaitTime += idata.lastWaitTime;
     }
     
@@ -871,35 +997,50 @@ bool octree::iterate_once(IterationData &idata) {
     devContext.stopTiming("Energy", 7, execStream->s());
     idata.totalPredCor += get_time() - tTempTime;
 
-    if(statisticsIter > 0)
+    //Resolve the timing regions of this iteration in one go
+    double regionTimes[TELEMETRY_NREGIONS] = {0};
+    devContext.flushTiming(regionTimes, TELEMETRY_NREGIONS);
+
+    const double stepTime = get_time() - tStepStart;
+    if(autoTuner) autoTuner->step(stepTime);
+
+    if(telemetry)
     {
-      if(t_current >= nextStatsTime)
-      {
-        nextStatsTime += statisticsIter;
-        double tDens0 = get_time();
-        localTree.bodies_pos.d2h();
-        localTree.bodies_vel.d2h();
-        localTree.bodies_ids.d2h();
+      TelemetryRecord rec;
+      rec.iter         = iter;
+      rec.rank         = procId;
+      rec.n            = localTree.n;
+      rec.nActive      = localTree.n_active_particles;
+      rec.tSim         = t_current;
+      rec.stepTime     = stepTime;
+      rec.gravTime     = idata.lastGravTime;
+      rec.buildTime    = rebuildStep ? idata.lastBuildTime : 0;
+      rec.domainTime   = rebuildStep ? idata.lastDomTime   : 0;
+      rec.waitTime     = stepWaitTime;
+      rec.letCommTime  = idata.lastLETCommTime;
+      rec.gpuGravLocal = idata.lastGPUGravTimeLocal;
+      rec.gpuGravLET   = idata.lastGPUGravTimeLET;
+      rec.nDirect      = directSum;
+      rec.nApprox      = apprSum;
+      rec.letBytesSent = letBytesSent;
+      rec.letBytesRecv = letBytesRecv;
+      rec.memHighWater = my_dev::base_mem::getMaxMemUsage();
+      rec.imbalance    = 1;
+      rec.energyError  = de;
+      memcpy(rec.regionTime, regionTimes, sizeof(regionTimes));
+      PerfCounters::collect(rec.perf);
+      telemetry->record(rec);
+    }
 
-        double tDens1 = get_time();
-        const DENSITY dens(procId, nProcs, localTree.n,
-                           &localTree.bodies_pos[0],
-                           &localTree.bodies_vel[0],
-                           &localTree.bodies_ids[0],
-                           1, 2.33e9, 20, "density", t_current);
-
-        double tDens2 = get_time();
-        if(procId == 0) LOGF(stderr,"Density took: Copy: %lg Create: %lg \n", tDens1-tDens0, tDens2-tDens1);
-
-        double tDisk1 = get_time();
-        const DISKSTATS diskstats(procId, nProcs, localTree.n,
-                           &localTree.bodies_pos[0],
-                           &localTree.bodies_vel[0],
-                           &localTree.bodies_ids[0],
-                           1, 2.33e9, "diskstats", t_current);
-
-        double tDisk2 = get_time();
-        if(procId == 0) LOGF(stderr,"Diskstats took: Create: %lg \n", tDisk2-tDisk1);
+    if(analysis)
+    {
+      //Completes the runs that finished during this step, never waits for the others
+      if(analysis->poll(t_current))
+      {
+        double tStats = get_time();
+        stageAnalysis();
+        analysis->launch();
+        if(procId == 0) LOGF(stderr,"Analysis launch took: %lg \n", get_time()-tStats);
       }
     }//Statistics dumping
 
@@ -943,7 +1084,12 @@ bool octree::iterate_once(IterationData &idata) {
 
 #ifndef WAR_OF_GALAXIES
     std::cout << "hey" << std::endl;
-    if (iter >= iterEnd) return true;
+    if (iter >= iterEnd)
+    {
+      if(procId == 0) my_dev::base_mem::printMemReport();
+      if(procId == 0) checkMemoryEstimate(this->localTree);
+      return true;
+    }
 
     if(t_current >= tEnd)
     {
@@ -952,6 +1098,8 @@ bool octree::iterate_once(IterationData &idata) {
       LOG("Finished: %f > %f \tLoop alone took: %f\n", t_current, tEnd, totalTime);
      
       my_dev::base_mem::printMemUsage();
+      if(procId == 0) my_dev::base_mem::printMemReport();
+      if(procId == 0) checkMemoryEstimate(this->localTree);
 
       return true;
     }
@@ -988,6 +1136,15 @@ void octree::iterate_setup(IterationData &idata) {
   if(LETDataToHostStream == NULL)
     LETDataToHostStream = new my_dev::dev_stream(0);
 
+  if(Trace::enabled())
+  {
+    devContext.setTraceHook(&Trace::gpuRegion);
+    Trace::nameStream(execStream->s(),          "execStream");
+    Trace::nameStream(gravStream->s(),          "gravStream");
+    Trace::nameStream(copyStream->s(),          "copyStream");
+    Trace::nameStream(LETDataToHostStream->s(), "LETDataToHostStream");
+  }
+
 
   CU_SAFE_CALL(cudaEventCreate(&startLocalGrav));
   CU_SAFE_CALL(cudaEventCreate(&endLocalGrav));
@@ -995,7 +1152,14 @@ void octree::iterate_setup(IterationData &idata) {
   CU_SAFE_CALL(cudaEventCreate(&startRemoteGrav));
   CU_SAFE_CALL(cudaEventCreate(&endRemoteGrav));
 
+  CU_SAFE_CALL(cudaEventCreateWithFlags(&propertiesDone, cudaEventDisableTiming));
+  CU_SAFE_CALL(cudaEventCreateWithFlags(&topBoxCopied,   cudaEventDisableTiming));
+  CU_SAFE_CALL(cudaEventCreateWithFlags(&dustPropertiesDone, cudaEventDisableTiming));
+  CU_SAFE_CALL(cudaEventCreateWithFlags(&dustBoxCopied,      cudaEventDisableTiming));
+
   devContext.writeLogEvent("Starting execution \n");
+
+  if(autoTuner == NULL) initAutoTuner();
   
   //Start construction of the tree
   sort_bodies(localTree, true);
@@ -1038,35 +1202,47 @@ void octree::iterate_setup(IterationData &idata) {
   t1 = get_time();
    
   //Approximate gravity  
+#ifdef TREEPM
+  if(pmSolver) localTree.bodies_Ppos.d2h();
+#endif
   devContext.startTiming(gravStream->s());
   approximate_gravity(this->localTree);
   devContext.stopTiming("Approximation", 4, gravStream->s());
   LOGF(stderr, "APP Time during first step: %g \n", get_time() - t1);
   
   #ifdef USE_DUST
-      //Sort the dust
-      sort_dust(localTree);
-      //make the dust groups
-      make_dust_groups(localTree);
       //Predict
       predictDustStep(this->localTree);
       
-      //Set the group properties of dust
-      setDustGroupProperties(this->localTree);
+      //Sort the dust, make the groups and set their properties
+      updateDustGroups(this->localTree, true);
       
       devContext.startTiming(gravStream->s());
       approximate_dust(this->localTree);
       devContext.stopTiming("Approximatin_dust", 4, gravStream->s());
-      //Correct
-      correctDustStep(this->localTree);  
   #endif
-  
-  
+
+#ifdef TREEPM
+  //After the dust prediction, the dust gets the mesh force as well
+  if(pmSolver) pm_gravity(this->localTree);
+#endif
 
   if(nProcs > 1)  makeLET();
 
   gravStream->sync();  
 
+#ifdef PERIODIC
+  ewald_correction(this->localTree);
+#endif
+#ifdef TREEPM
+  if(pmSolver) pm_addForces(this->localTree);
+#endif
+
+  #ifdef USE_DUST
+      //Correct, after the mesh force is in
+      correctDustStep(this->localTree);
+  #endif
+
 
   lastLocal            = get_time() - t1;
   //  lastLocal = 1;//Setting this to 1 disables load-balance (all processes took equal time '1')
@@ -1121,38 +1297,14 @@ void octree::iterate_setup(IterationData &idata) {
       }//if 1
   }//if snapShotIter > 0
 
-  if(statisticsIter > 0)
+  //The modules have their first output at the start time
+  if(analysis && analysis->poll(t_current))
   {
-    if(1)
-    {
-      nextStatsTime = t_current + statisticsIter;
-      double tDens0 = get_time();
-      localTree.bodies_pos.d2h();
-      localTree.bodies_vel.d2h();
-      localTree.bodies_ids.d2h();
-
-      double tDens1 = get_time();
-      const DENSITY dens(procId, nProcs, localTree.n,
-                         &localTree.bodies_pos[0],
-                         &localTree.bodies_vel[0],
-                         &localTree.bodies_ids[0],
-                         1, 2.33e9, 20, "density", t_current);
-
-      double tDens2 = get_time();
-      if(procId == 0) LOGF(stderr,"Density took: Copy: %lg Create: %lg \n", tDens1-tDens0, tDens2-tDens1);
-
-      double tDisk1 = get_time();
-      const DISKSTATS diskstats(procId, nProcs, localTree.n,
-                         &localTree.bodies_pos[0],
-                         &localTree.bodies_vel[0],
-                         &localTree.bodies_ids[0],
-                         1, 2.33e9, "diskstats", t_current);
-
-      double tDisk2 = get_time();
-      if(procId == 0) LOGF(stderr,"Diskstats took: Create: %lg \n", tDisk2-tDisk1);
-    }
-  }//Statistics dumping
+    stageAnalysis();
+    analysis->launch();
+  }
 
+  devContext.flushTiming();
   idata.startTime = get_time();
 }
 
@@ -1181,8 +1333,37 @@ void octree::iterate_teardown(IterationData &idata) {
                   idata.totalLETCommTime,
                   idata.totalBuildTime, idata.totalDomTime, idata.lastWaitTime,
                   idata.totalDomUp, idata.totalDomEx, idata.totalDomWait, idata.totalPredCor);
+
+  if(analysis != NULL)
+  {
+    analysis->finish();
+    delete analysis;
+    analysis = NULL;
+  }
+
+  devContext.flushTiming();
+  Trace::write();
+  PerfCounters::report();
   devContext.writeLogEvent(buff);
 
+  if(statsServer != NULL)
+  {
+    delete statsServer;
+    statsServer = NULL;
+  }
+
+  if(telemetry != NULL)
+  {
+    delete telemetry;
+    telemetry = NULL;
+  }
+
+  if(autoTuner != NULL)
+  {
+    delete autoTuner;
+    autoTuner = NULL;
+  }
+
   if(execStream != NULL)
   {
     delete execStream;
@@ -1306,6 +1487,20 @@ void octree::predict(tree_structure &tree)
   predictParticles.set_arg<cl_mem>(6, tree.bodies_time.p());
   predictParticles.set_arg<cl_mem>(7, tree.bodies_Ppos.p());
   predictParticles.set_arg<cl_mem>(8, tree.bodies_Pvel.p());  
+#ifdef PERIODIC
+  predictParticles.set_arg<float>(9,  &periodicBoxSize);
+#endif
+#ifdef DOUBLE_ACCUMULATION
+  //The low words follow the optional box size
+  int loArg = 9;
+  #ifdef PERIODIC
+    loArg = 10;
+  #endif
+  predictParticles.set_arg<cl_mem>(loArg+0, tree.bodies_posLo.p());
+  predictParticles.set_arg<cl_mem>(loArg+1, tree.bodies_velLo.p());
+  predictParticles.set_arg<cl_mem>(loArg+2, tree.bodies_PposLo.p());
+  predictParticles.set_arg<cl_mem>(loArg+3, tree.bodies_PvelLo.p());
+#endif
 
   predictParticles.setWork(tree.n, 128);
   predictParticles.execute(execStream->s());
@@ -1365,8 +1560,117 @@ void octree::direct_gravity(tree_structure &tree)
   directGrav.execute(gravStream->s());  //First half
 }
 
+//Compares estimateMemory (memoryEstimate.h, used by the scaling simulator to
+//predict the largest N per device) with the recorded device usage of this
+//run. The estimate mirrors the allocations by hand, this catches the drift
+//when an allocation changes. The counts are those of the last step, the LET
+//size is taken from the allocated remote tree. The current usage is the fair
+//comparison, the peak also holds buffers that were freed before the end
+void octree::checkMemoryEstimate(tree_structure &tree)
+{
+  const long long nRemote = (nProcs > 1) ? remoteTree.fullRemoteTree.get_size() : 0;
+  const MemoryEstimate mem = estimateMemory(tree.n, tree.n_nodes, tree.n_groups, nRemote,
+                                            nProcs, nBlocksForTreeWalk);
+
+  const double    MB      = 1.0/(1024*1024);
+  const long long current = my_dev::base_mem::currentMemUsage;
+  const long long peak    = my_dev::base_mem::maxMemUsage;
+  const double    ratio   = current > 0 ? mem.total() / (double)current : 0;
+
+  char buff[512];
+  sprintf(buff, "MEMCHECK estimate: %.2f MB (particles %.2f, buffer %.2f, tree %.2f, remote %.2f, fixed %.2f)"
+                "\tcurrent: %.2f MB\tpeak: %.2f MB\testimate/current: %.3f\n",
+                mem.total()*MB, mem.particles*MB, mem.generalBuffer*MB, mem.tree*MB, mem.remoteTree*MB,
+                mem.fixed*MB, current*MB, peak*MB, ratio);
+  LOGF(stderr, "%s", buff);
+  devContext.writeLogEvent(buff);
+
+  if(ratio < 0.95 || ratio > 1.05)
+    LOGF(stderr, "MEMCHECK the estimate is off by more than 5%%, update memoryEstimate.h to the allocations\n");
+}
+
+//Compares the tree-code accelerations of this step with a direct N^2 sum and
+//prints the distribution of the relative errors. The tree accelerations are
+//restored afterwards so the integration is not affected. With periodic
+//boundaries the reference is a direct Ewald sum on the host (periodicDirectAcc)
+//for at most FORCECHECK_PERIODIC_TARGETS evenly spaced particles
+#define FORCECHECK_PERIODIC_TARGETS 4096
+void octree::checkForceAccuracy(tree_structure &tree)
+{
+  if(nProcs > 1)
+  {
+    if(procId == 0) LOGF(stderr, "Force accuracy check is only supported on a single process\n");
+    return;
+  }
+
+  gravStream->sync();
+  tree.bodies_acc1.d2h();
+  tree.activePartlist.d2h();
+
+  std::vector<real4> treeAcc(&tree.bodies_acc1[0], &tree.bodies_acc1[0] + tree.n);
+  std::vector<double> relErr;
+  relErr.reserve(tree.n);
+
+#ifdef PERIODIC
+  if(periodicBoxSize > 0)
+  {
+    std::vector<int> targets;
+    const int stride = std::max(1, tree.n / FORCECHECK_PERIODIC_TARGETS);
+    for(int i=0; i < tree.n; i += stride)
+      if(tree.activePartlist[i] == 1) targets.push_back(i);
+
+    std::vector<double> ref;
+    const double t0 = get_time();
+    periodicDirectAcc(tree, targets, ref);
+    LOGF(stderr, "Direct Ewald reference for %d particles took: %lg s\n", (int)targets.size(), get_time()-t0);
+
+    for(size_t t=0; t < targets.size(); t++)
+    {
+      const real4  at = treeAcc[targets[t]];
+      const double dx = at.x - ref[3*t+0];
+      const double dy = at.y - ref[3*t+1];
+      const double dz = at.z - ref[3*t+2];
+      const double a2 = ref[3*t]*ref[3*t] + ref[3*t+1]*ref[3*t+1] + ref[3*t+2]*ref[3*t+2];
+      if(a2 > 0) relErr.push_back(sqrt((dx*dx + dy*dy + dz*dz) / a2));
+    }
+  }
+  else
+#endif
+  {
+    direct_gravity(tree);
+    gravStream->sync();
+    tree.bodies_acc1.d2h();
+
+    for(int i=0; i < tree.n; i++)
+    {
+      if(tree.activePartlist[i] != 1) continue;
+      const real4 ad = tree.bodies_acc1[i];
+      const double dx = treeAcc[i].x - ad.x;
+      const double dy = treeAcc[i].y - ad.y;
+      const double dz = treeAcc[i].z - ad.z;
+      const double a2 = (double)ad.x*ad.x + (double)ad.y*ad.y + (double)ad.z*ad.z;
+      if(a2 > 0) relErr.push_back(sqrt((dx*dx + dy*dy + dz*dz) / a2));
+    }
+
+    //Put the tree accelerations back
+    for(int i=0; i < tree.n; i++) tree.bodies_acc1[i] = treeAcc[i];
+    tree.bodies_acc1.h2d();
+  }
+
+  if(relErr.empty()) return;
+  std::sort(relErr.begin(), relErr.end());
+  const int n = (int)relErr.size();
+
+  char buff[512];
+  sprintf(buff, "FORCEACC iter: %d\tn: %d\tmedian: %e\t90%%: %e\t99%%: %e\tmax: %e\n",
+                iter, n, relErr[n/2], relErr[(int)(0.90*(n-1))], relErr[(int)(0.99*(n-1))], relErr[n-1]);
+  LOGF(stderr, "%s", buff);
+  devContext.writeLogEvent(buff);
+}
+
 void octree::approximate_gravity(tree_structure &tree)
 { 
+  TRACE_SCOPE("approximate_gravity");
   uint2 node_begend;
   int level_start = tree.startLevelMin;
   node_begend.x   = tree.level_list[level_start].x;
@@ -1401,7 +1705,7 @@ void octree::approximate_gravity(tree_structure &tree)
   approxGrav.set_arg<real4>(20, tree.multipole, 4, "texMultipole");
   approxGrav.set_arg<real4>(21, tree.bodies_Ppos, 4, "texBody");
     
-  approxGrav.setWork(-1, NTHREAD, nBlocksForTreeWalk);
+  approxGrav.setWork(-1, NTHREAD, treeWalkBlocks);
 
   cudaEventRecord(startLocalGrav, gravStream->s());
   approxGrav.execute(gravStream->s());  //First half
@@ -1578,6 +1882,7 @@ void octree::approximate_gravity(tree_structure &tree)
 
 void octree::approximate_gravity_let(tree_structure &tree, tree_structure &remoteTree, int bufferSize, bool doActiveParticles)
 {
+  TRACE_SCOPE("approximate_gravity_let");
   //Start and end node of the remote tree structure
   uint2 node_begend;  
   node_begend.x =  0;
@@ -1639,7 +1944,7 @@ void octree::approximate_gravity_let(tree_structure &tree, tree_structure &remot
                                3*remoteN);
   approxGravLET.set_arg<real4>(21, remoteTree.fullRemoteTree, 4, "texBody", 0, remoteP);  
 
-  approxGravLET.setWork(-1, NTHREAD, nBlocksForTreeWalk);
+  approxGravLET.setWork(-1, NTHREAD, treeWalkBlocks);
     
   if(letRunning)
   {
@@ -1795,6 +2100,12 @@ void octree::correct(tree_structure &tree)
   correctParticles.set_arg<cl_mem>(13, tree.bodies_ids.p());
   correctParticles.set_arg<cl_mem>(14, specialParticles.p());
 
+#endif
+#ifdef DOUBLE_ACCUMULATION
+  correctParticles.set_arg<cl_mem>(15, tree.bodies_posLo.p());
+  correctParticles.set_arg<cl_mem>(16, tree.bodies_velLo.p());
+  correctParticles.set_arg<cl_mem>(17, tree.bodies_PposLo.p());
+  correctParticles.set_arg<cl_mem>(18, tree.bodies_PvelLo.p());
 #endif
 
   correctParticles.setWork(tree.n, 128);
@@ -1920,6 +2231,7 @@ void octree::checkRemovalDistance(tree_structure &tree)
     tree.bodies_acc1.h2d();    //Acceleration                                                                                                               
     tree.bodies_time.h2d();  //The timestep details (.x=tb, .y=te                                                                                           
     tree.bodies_ids.h2d();                                                                                                                                  
+    clearParticleLowWords(tree);
                                                                                                                                                             
     //Compute the energy!                                                                                                                                   
     store_energy_flag = true;                                                                                                                               
@@ -0,0 +1,746 @@
+#include <cmath>
+#include <cstdio>
+#include <cfloat>
+#include <algorithm>
+#include <sys/time.h>
+#include <omp.h>
+#include "haloFinder.h"
+#include "node_specs.h"
+
+static double haloTime()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.e-6*tv.tv_usec;
+}
+
+static inline int floatAsInt(const float val)
+{
+  union{float f; int i;} u; //__float_as_int
+  u.f = val;
+  return u.i;
+}
+
+//Squared distance between two boxes, 0 if they overlap
+static inline float boxDistance2(const float dcx, const float dcy, const float dcz,
+                                 const float hx,  const float hy,  const float hz)
+{
+  const float dx = std::max(std::fabs(dcx) - hx, 0.0f);
+  const float dy = std::max(std::fabs(dcy) - hy, 0.0f);
+  const float dz = std::max(std::fabs(dcz) - hz, 0.0f);
+  return dx*dx + dy*dy + dz*dz;
+}
+
+HaloFinder::HaloFinder(const int _nThreads) :
+  nThreads(std::max(_nThreads, 1)), n(0), pos(NULL), parent(NULL), parentCapacity(0),
+  boxTime(0), linkTime(0)
+{
+  AnalysisTree empty = {0, 0, NULL, NULL, NULL};
+  tree = empty;
+}
+
+HaloFinder::~HaloFinder()
+{
+  delete[] parent;
+}
+
+void HaloFinder::children(const int node, int &first, int &count) const
+{
+  const int info = floatAsInt(tree.size[node].w);
+  first = info & 0x0FFFFFFF;
+  count = ((unsigned int)info & 0xF0000000) >> 28;
+}
+
+void HaloFinder::particles(const int node, int &first, int &count) const
+{
+  const int info = floatAsInt(tree.size[node].w);
+  first = info & BODYMASK;
+  count = (((unsigned int)info & INVBMASK) >> LEAFBIT) + 1;
+}
+
+void HaloFinder::setParticles(const int _n, const float4 *_pos, const AnalysisTree &_tree)
+{
+  n    = _n;
+  pos  = _pos;
+  tree = _tree;
+
+  if(n > parentCapacity)
+  {
+    delete[] parent;
+    parentCapacity = n + n/8;
+    parent         = new std::atomic<int>[parentCapacity];
+  }
+
+  const double t0 = haloTime();
+  makeBoxes();
+  boxTime = haloTime() - t0;
+}
+
+//Children live one level deeper, so the levels are done deepest first
+void HaloFinder::makeBoxes()
+{
+  boxes.resize(tree.nNodes);
+  for(int level = tree.nLevels-1; level >= 0; level--)
+  {
+    const int begin = tree.levels[level].x;
+    const int end   = tree.levels[level].y;
+#pragma omp parallel for num_threads(nThreads) schedule(static)
+    for(int node = begin; node < end; node++)
+    {
+      float xmin =  FLT_MAX, ymin =  FLT_MAX, zmin =  FLT_MAX;
+      float xmax = -FLT_MAX, ymax = -FLT_MAX, zmax = -FLT_MAX;
+      int first, count;
+      if(isLeaf(node))
+      {
+        particles(node, first, count);
+        for(int i=first; i < first+count; i++)
+        {
+          xmin = std::min(xmin, pos[i].x);  xmax = std::max(xmax, pos[i].x);
+          ymin = std::min(ymin, pos[i].y);  ymax = std::max(ymax, pos[i].y);
+          zmin = std::min(zmin, pos[i].z);  zmax = std::max(zmax, pos[i].z);
+        }
+      }
+      else
+      {
+        children(node, first, count);
+        for(int c=first; c < first+count; c++)
+        {
+          const Box &b = boxes[c];
+          if(b.hx < 0) continue;
+          xmin = std::min(xmin, b.cx - b.hx);  xmax = std::max(xmax, b.cx + b.hx);
+          ymin = std::min(ymin, b.cy - b.hy);  ymax = std::max(ymax, b.cy + b.hy);
+          zmin = std::min(zmin, b.cz - b.hz);  zmax = std::max(zmax, b.cz + b.hz);
+        }
+      }
+
+      Box &box = boxes[node];
+      if(xmin > xmax)
+      {
+        box.cx = box.cy = box.cz = 0;
+        box.hx = box.hy = box.hz = -1;
+        continue;
+      }
+      box.cx = 0.5f*(xmin + xmax);  box.hx = 0.5f*(xmax - xmin);
+      box.cy = 0.5f*(ymin + ymax);  box.hy = 0.5f*(ymax - ymin);
+      box.cz = 0.5f*(zmin + zmax);  box.hz = 0.5f*(zmax - zmin);
+    }
+  }
+
+  leaves.clear();
+  for(int node=0; node < tree.nNodes; node++)
+    if(isLeaf(node)) leaves.push_back(node);
+}
+
+int HaloFinder::find(int i)
+{
+  for(;;)
+  {
+    int p = parent[i].load(std::memory_order_relaxed);
+    if(p == i) return i;
+    const int gp = parent[p].load(std::memory_order_relaxed);
+    //Path halving, a concurrent update of parent[i] just makes this a no-op
+    if(gp != p) parent[i].compare_exchange_weak(p, gp, std::memory_order_relaxed);
+    i = gp;
+  }
+}
+
+void HaloFinder::unite(int i, int j)
+{
+  for(;;)
+  {
+    i = find(i);
+    j = find(j);
+    if(i == j) return;
+    if(i < j) std::swap(i, j);
+
+    //Fails if i stopped being a root in the meantime, then retry from the top
+    int expected = i;
+    if(parent[i].compare_exchange_strong(expected, j)) return;
+  }
+}
+
+//Links the particles of leaf with those of itself and of the leaves with a
+//larger index, so every pair of leaves is visited once
+void HaloFinder::linkLeaf(const int leaf, const float b, std::vector<int> &stack)
+{
+  const float b2 = b*b;
+  const Box  &bi = boxes[leaf];
+  int fi, ci;
+  particles(leaf, fi, ci);
+
+  //All within b if the box diagonal is
+  if(4*(bi.hx*bi.hx + bi.hy*bi.hy + bi.hz*bi.hz) < b2)
+  {
+    for(int p=fi+1; p < fi+ci; p++) unite(fi, p);
+  }
+  else
+  {
+    for(int p=fi; p < fi+ci; p++)
+      for(int q=p+1; q < fi+ci; q++)
+      {
+        const float dx = pos[q].x - pos[p].x;
+        const float dy = pos[q].y - pos[p].y;
+        const float dz = pos[q].z - pos[p].z;
+        if(dx*dx + dy*dy + dz*dz < b2) unite(p, q);
+      }
+  }
+
+  stack.clear();
+  for(int node = tree.levels[0].x; node < (int)tree.levels[0].y; node++) stack.push_back(node);
+  while(!stack.empty())
+  {
+    const int node = stack.back();
+    stack.pop_back();
+    const Box &bj = boxes[node];
+    if(bj.hx < 0) continue;
+
+    const float dcx = bj.cx - bi.cx, dcy = bj.cy - bi.cy, dcz = bj.cz - bi.cz;
+    if(boxDistance2(dcx, dcy, dcz, bi.hx + bj.hx, bi.hy + bj.hy, bi.hz + bj.hz) >= b2) continue;
+
+    int first, count;
+    if(!isLeaf(node))
+    {
+      children(node, first, count);
+      for(int c=first; c < first+count; c++) stack.push_back(c);
+      continue;
+    }
+    if(node <= leaf) continue;
+
+    particles(node, first, count);
+
+    //All pairs within b if the farthest corners are
+    const float fx = std::fabs(dcx) + bi.hx + bj.hx;
+    const float fy = std::fabs(dcy) + bi.hy + bj.hy;
+    const float fz = std::fabs(dcz) + bi.hz + bj.hz;
+    if(fx*fx + fy*fy + fz*fz < b2)
+    {
+      for(int p=fi+1; p < fi+ci; p++) unite(fi, p);
+      for(int q=first; q < first+count; q++) unite(fi, q);
+      continue;
+    }
+
+    for(int p=fi; p < fi+ci; p++)
+    {
+      const float px = pos[p].x, py = pos[p].y, pz = pos[p].z;
+      for(int q=first; q < first+count; q++)
+      {
+        const float dx = pos[q].x - px;
+        const float dy = pos[q].y - py;
+        const float dz = pos[q].z - pz;
+        if(dx*dx + dy*dy + dz*dz < b2) unite(p, q);
+      }
+    }
+  }
+}
+
+void HaloFinder::link(const float b)
+{
+  const double t0 = haloTime();
+
+#pragma omp parallel for num_threads(nThreads) schedule(static)
+  for(int i=0; i < n; i++) parent[i].store(i, std::memory_order_relaxed);
+
+  const int nLeaf = leaves.size();
+#pragma omp parallel num_threads(nThreads)
+  {
+    std::vector<int> stack;
+#pragma omp for schedule(dynamic, 16)
+    for(int l=0; l < nLeaf; l++)
+      linkLeaf(leaves[l], b, stack);
+  }
+
+  linkTime = haloTime() - t0;
+}
+
+void HaloFinder::labels(const long long offset, long long *label)
+{
+#pragma omp parallel for num_threads(nThreads) schedule(static)
+  for(int i=0; i < n; i++) label[i] = offset + find(i);
+}
+
+template<typename F>
+void HaloFinder::query(const float x, const float y, const float z, const float r,
+                       std::vector<int> &stack, F f) const
+{
+  const float r2 = r*r;
+  stack.clear();
+  for(int node = tree.levels[0].x; node < (int)tree.levels[0].y; node++) stack.push_back(node);
+  while(!stack.empty())
+  {
+    const int node = stack.back();
+    stack.pop_back();
+    const Box &bj = boxes[node];
+    if(bj.hx < 0) continue;
+    if(boxDistance2(bj.cx - x, bj.cy - y, bj.cz - z, bj.hx, bj.hy, bj.hz) >= r2) continue;
+
+    int first, count;
+    if(!isLeaf(node))
+    {
+      children(node, first, count);
+      for(int c=first; c < first+count; c++) stack.push_back(c);
+      continue;
+    }
+    particles(node, first, count);
+    for(int q=first; q < first+count; q++)
+    {
+      const float dx = pos[q].x - x;
+      const float dy = pos[q].y - y;
+      const float dz = pos[q].z - z;
+      if(dx*dx + dy*dy + dz*dz < r2) f(q);
+    }
+  }
+}
+
+//Depth first, the nearest child first, cells beyond the current k-th distance
+//(or r2 while the heap is not full) are skipped
+void HaloFinder::nearestHeap(const float px, const float py, const float pz, const int k,
+                             const int skip, const float r2max, std::vector<float> &heap,
+                             std::vector<std::pair<float,int> > &stack,
+                             std::vector<std::pair<float,int> > &child) const
+{
+  heap.clear();
+  stack.clear();
+  for(int node = tree.levels[0].x; node < (int)tree.levels[0].y; node++)
+    stack.push_back(std::make_pair(0.0f, node));
+
+  while(!stack.empty())
+  {
+    const float d2   = stack.back().first;
+    const int   node = stack.back().second;
+    stack.pop_back();
+    if(d2 >= ((int)heap.size() == k ? heap.front() : r2max)) continue;
+
+    int first, count;
+    if(isLeaf(node))
+    {
+      particles(node, first, count);
+      for(int q=first; q < first+count; q++)
+      {
+        if(q == skip) continue;
+        const float dx = pos[q].x - px;
+        const float dy = pos[q].y - py;
+        const float dz = pos[q].z - pz;
+        const float r2 = dx*dx + dy*dy + dz*dz;
+        if((int)heap.size() < k)
+        {
+          if(r2 >= r2max) continue;
+          heap.push_back(r2);
+          std::push_heap(heap.begin(), heap.end());
+        }
+        else if(r2 < heap.front())
+        {
+          std::pop_heap(heap.begin(), heap.end());
+          heap.back() = r2;
+          std::push_heap(heap.begin(), heap.end());
+        }
+      }
+      continue;
+    }
+
+    children(node, first, count);
+    child.clear();
+    for(int c=first; c < first+count; c++)
+    {
+      const Box &bc = boxes[c];
+      if(bc.hx < 0) continue;
+      child.push_back(std::make_pair(boxDistance2(bc.cx - px, bc.cy - py, bc.cz - pz,
+                                                  bc.hx, bc.hy, bc.hz), c));
+    }
+    //Farthest pushed first, so the nearest is popped first
+    std::sort(child.begin(), child.end());
+    stack.insert(stack.end(), child.rbegin(), child.rend());
+  }
+}
+
+void HaloFinder::nearest(const int k, float *rk)
+{
+  const int nLeaf = leaves.size();
+#pragma omp parallel num_threads(nThreads)
+  {
+    std::vector<std::pair<float,int> > stack, child;
+    std::vector<float>                 heap;
+#pragma omp for schedule(dynamic, 16)
+    for(int l=0; l < nLeaf; l++)
+    {
+      int fi, ci;
+      particles(leaves[l], fi, ci);
+      for(int p=fi; p < fi+ci; p++)
+      {
+        nearestHeap(pos[p].x, pos[p].y, pos[p].z, k, p, FLT_MAX, heap, stack, child);
+        rk[p] = (int)heap.size() < k ? FLT_MAX : std::sqrt(heap.front());
+      }
+    }
+  }
+}
+
+#ifdef USE_MPI
+struct HaloGhost
+{
+  float     x, y, z, pad;
+  long long label;
+};
+
+//Squared distance between the boxes of two processes, FLT_MAX if one is empty
+static float domainDistance2(const float *a, const float *b)
+{
+  if(a[0] > a[3] || b[0] > b[3]) return FLT_MAX;
+  return boxDistance2(0.5f*(b[0] + b[3]) - 0.5f*(a[0] + a[3]),
+                      0.5f*(b[1] + b[4]) - 0.5f*(a[1] + a[4]),
+                      0.5f*(b[2] + b[5]) - 0.5f*(a[2] + a[5]),
+                      0.5f*(a[3] - a[0]) + 0.5f*(b[3] - b[0]),
+                      0.5f*(a[4] - a[1]) + 0.5f*(b[4] - b[1]),
+                      0.5f*(a[5] - a[2]) + 0.5f*(b[5] - b[2]));
+}
+
+//Sends send[j] to process sendTo[j] and receives recv[j] from recvFrom[j].
+//Only these processes are involved, every sender has to be in the recvFrom
+//list of its destination
+template<typename T>
+static void exchangeSparse(MPI_Comm comm, const std::vector<int> &sendTo,
+                           const std::vector<std::vector<T> > &send,
+                           const std::vector<int> &recvFrom, std::vector<std::vector<T> > &recv)
+{
+  const int tagCount = 4301, tagData = 4302;
+  const int nSend = sendTo.size(), nRecv = recvFrom.size();
+  std::vector<MPI_Request> req(nSend + nRecv);
+  std::vector<int>         sendCount(nSend), recvCount(nRecv);
+
+  for(int j=0; j < nRecv; j++)
+    MPI_Irecv(&recvCount[j], 1, MPI_INT, recvFrom[j], tagCount, comm, &req[j]);
+  for(int j=0; j < nSend; j++)
+  {
+    sendCount[j] = send[j].size()*sizeof(T);
+    MPI_Isend(&sendCount[j], 1, MPI_INT, sendTo[j], tagCount, comm, &req[nRecv+j]);
+  }
+  if(!req.empty()) MPI_Waitall(req.size(), &req[0], MPI_STATUSES_IGNORE);
+
+  recv.resize(nRecv);
+  for(int j=0; j < nRecv; j++)
+  {
+    recv[j].resize(recvCount[j]/sizeof(T));
+    MPI_Irecv(recv[j].empty() ? NULL : (void*)&recv[j][0], recvCount[j], MPI_BYTE,
+              recvFrom[j], tagData, comm, &req[j]);
+  }
+  for(int j=0; j < nSend; j++)
+    MPI_Isend(send[j].empty() ? NULL : (void*)&send[j][0], sendCount[j], MPI_BYTE,
+              sendTo[j], tagData, comm, &req[nRecv+j]);
+  if(!req.empty()) MPI_Waitall(req.size(), &req[0], MPI_STATUSES_IGNORE);
+}
+
+void HaloFinder::domainBoxes(MPI_Comm comm, std::vector<float> &allBoxes) const
+{
+  int nProcs;
+  MPI_Comm_size(comm, &nProcs);
+
+  float box[6] = {FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX};
+  for(int node = (n > 0 ? tree.levels[0].x : 0); node < (n > 0 ? (int)tree.levels[0].y : 0); node++)
+  {
+    const Box &bn = boxes[node];
+    if(bn.hx < 0) continue;
+    box[0] = std::min(box[0], bn.cx - bn.hx);  box[3] = std::max(box[3], bn.cx + bn.hx);
+    box[1] = std::min(box[1], bn.cy - bn.hy);  box[4] = std::max(box[4], bn.cy + bn.hy);
+    box[2] = std::min(box[2], bn.cz - bn.hz);  box[5] = std::max(box[5], bn.cz + bn.hz);
+  }
+  allBoxes.resize(6*nProcs);
+  MPI_Allgather(box, 6, MPI_FLOAT, &allBoxes[0], 6, MPI_FLOAT, comm);
+}
+
+//Smallest label of every set of linked labels, keys sorted and unique
+static void resolveLinks(const std::vector<long long> &links, std::vector<long long> &keys,
+                         std::vector<long long> &rep)
+{
+  keys = links;
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+  //Sorted keys: the smallest index of a set is its smallest label
+  std::vector<int> root(keys.size());
+  for(size_t i=0; i < root.size(); i++) root[i] = i;
+  struct Forest
+  {
+    static int find(std::vector<int> &root, int i)
+    {
+      while(root[i] != i) i = root[i] = root[root[i]];
+      return i;
+    }
+  };
+  for(size_t k=0; k < links.size(); k += 2)
+  {
+    int i = Forest::find(root, std::lower_bound(keys.begin(), keys.end(), links[k  ]) - keys.begin());
+    int j = Forest::find(root, std::lower_bound(keys.begin(), keys.end(), links[k+1]) - keys.begin());
+    if(i == j) continue;
+    if(i < j) std::swap(i, j);
+    root[i] = j;
+  }
+  rep.resize(keys.size());
+  for(size_t i=0; i < keys.size(); i++) rep[i] = keys[Forest::find(root, i)];
+}
+
+void HaloFinder::mergeAcrossProcesses(MPI_Comm comm, const float b, long long *label)
+{
+  int procId, nProcs;
+  MPI_Comm_rank(comm, &procId);
+  MPI_Comm_size(comm, &nProcs);
+  if(nProcs == 1) return;
+
+  std::vector<float> allBoxes;
+  domainBoxes(comm, allBoxes);
+
+  //Processes within b, the relation is symmetric
+  const float      b2 = b*b;
+  std::vector<int> neighbours;
+  for(int p=0; p < nProcs; p++)
+    if(p != procId && domainDistance2(&allBoxes[6*procId], &allBoxes[6*p]) < b2) neighbours.push_back(p);
+  const int nNgb = neighbours.size();
+
+  //Our particles within b of the box of each neighbour, as its ghosts
+  std::vector<std::vector<HaloGhost> > sendGhosts(nNgb), ghosts;
+  std::vector<int> stack;
+  for(int j=0; j < nNgb; j++)
+  {
+    const float *pb = &allBoxes[6*neighbours[j]];
+    const float cx = 0.5f*(pb[0] + pb[3]), hx = 0.5f*(pb[3] - pb[0]);
+    const float cy = 0.5f*(pb[1] + pb[4]), hy = 0.5f*(pb[4] - pb[1]);
+    const float cz = 0.5f*(pb[2] + pb[5]), hz = 0.5f*(pb[5] - pb[2]);
+
+    stack.clear();
+    for(int node = tree.levels[0].x; node < (int)tree.levels[0].y; node++) stack.push_back(node);
+    while(!stack.empty())
+    {
+      const int node = stack.back();
+      stack.pop_back();
+      const Box &bn = boxes[node];
+      if(bn.hx < 0) continue;
+      if(boxDistance2(bn.cx - cx, bn.cy - cy, bn.cz - cz, bn.hx + hx, bn.hy + hy, bn.hz + hz) >= b2) continue;
+
+      int first, count;
+      if(!isLeaf(node))
+      {
+        children(node, first, count);
+        for(int c=first; c < first+count; c++) stack.push_back(c);
+        continue;
+      }
+      particles(node, first, count);
+      for(int q=first; q < first+count; q++)
+      {
+        if(boxDistance2(pos[q].x - cx, pos[q].y - cy, pos[q].z - cz, hx, hy, hz) >= b2) continue;
+        const HaloGhost g = {pos[q].x, pos[q].y, pos[q].z, 0, label[q]};
+        sendGhosts[j].push_back(g);
+      }
+    }
+  }
+  exchangeSparse(comm, neighbours, sendGhosts, neighbours, ghosts);
+
+  //Links between the label of a ghost and the labels of our particles near
+  //it, per neighbour. They go back to the owner of the ghost, so both sides
+  //of a boundary know the links across it
+  std::vector<std::vector<long long> > found(nNgb), returned;
+  for(int j=0; j < nNgb; j++)
+  {
+    const int nGhosts = ghosts[j].size();
+#pragma omp parallel num_threads(nThreads)
+    {
+      std::vector<long long> local;
+      std::vector<int>       stack;
+#pragma omp for schedule(dynamic, 64)
+      for(int g=0; g < nGhosts; g++)
+      {
+        const long long gl   = ghosts[j][g].label;
+        long long       last = gl;
+        query(ghosts[j][g].x, ghosts[j][g].y, ghosts[j][g].z, b, stack, [&](const int q)
+        {
+          if(label[q] == last) return;
+          last = label[q];
+          local.push_back(gl);
+          local.push_back(last);
+        });
+      }
+#pragma omp critical
+      found[j].insert(found[j].end(), local.begin(), local.end());
+    }
+  }
+  exchangeSparse(comm, neighbours, found, neighbours, returned);
+
+  //Labels on the boundary with each neighbour, and all links we know of
+  std::vector<std::vector<long long> > shared(nNgb);
+  std::vector<long long> links;
+  for(int j=0; j < nNgb; j++)
+  {
+    shared[j] = found[j];
+    shared[j].insert(shared[j].end(), returned[j].begin(), returned[j].end());
+    links.insert(links.end(), shared[j].begin(), shared[j].end());
+    std::sort(shared[j].begin(), shared[j].end());
+    shared[j].erase(std::unique(shared[j].begin(), shared[j].end()), shared[j].end());
+  }
+
+  //A group can span several domains, its smallest label travels one domain
+  //per round. Every round the labels whose smallest label changed are sent to
+  //the neighbours that share them, until no process sends anything
+  std::vector<long long> keys, rep, lastKeys, lastRep;
+  for(;;)
+  {
+    resolveLinks(links, keys, rep);
+
+    std::vector<std::vector<long long> > update(nNgb), received;
+    int nUpdates = 0;
+    for(int j=0; j < nNgb; j++)
+    {
+      for(size_t s=0; s < shared[j].size(); s++)
+      {
+        const long long l    = shared[j][s];
+        const long long r    = rep[std::lower_bound(keys.begin(), keys.end(), l) - keys.begin()];
+        const size_t    k    = std::lower_bound(lastKeys.begin(), lastKeys.end(), l) - lastKeys.begin();
+        const long long prev = (k < lastKeys.size() && lastKeys[k] == l) ? lastRep[k] : l;
+        if(r == prev) continue;
+        update[j].push_back(l);
+        update[j].push_back(r);
+      }
+      nUpdates += update[j].size();
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &nUpdates, 1, MPI_INT, MPI_SUM, comm);
+    if(nUpdates == 0) break;
+
+    exchangeSparse(comm, neighbours, update, neighbours, received);
+    for(int j=0; j < nNgb; j++) links.insert(links.end(), received[j].begin(), received[j].end());
+    lastKeys.swap(keys);
+    lastRep .swap(rep);
+  }
+  if(keys.empty()) return;
+
+#pragma omp parallel for num_threads(nThreads) schedule(static)
+  for(int i=0; i < n; i++)
+  {
+    const std::vector<long long>::const_iterator it = std::lower_bound(keys.begin(), keys.end(), label[i]);
+    if(it != keys.end() && *it == label[i]) label[i] = rep[it - keys.begin()];
+  }
+}
+
+void HaloFinder::nearestAcrossProcesses(MPI_Comm comm, const int k, float *rk)
+{
+  int procId, nProcs;
+  MPI_Comm_rank(comm, &procId);
+  MPI_Comm_size(comm, &nProcs);
+  if(nProcs == 1 || k <= 0) return;
+
+  std::vector<float> allBoxes;
+  domainBoxes(comm, allBoxes);
+
+  //Largest search radius of every process
+  float rkMax = 0;
+  for(int i=0; i < n; i++) rkMax = std::max(rkMax, rk[i]);
+  std::vector<float> allRk(nProcs);
+  MPI_Allgather(&rkMax, 1, MPI_FLOAT, &allRk[0], 1, MPI_FLOAT, comm);
+
+  //We query the processes in reach of our spheres, and answer those whose
+  //spheres reach us. FLT_MAX (fewer than k local neighbours) reaches all
+  std::vector<int> queryTo, queryFrom;
+  for(int p=0; p < nProcs; p++)
+  {
+    if(p == procId) continue;
+    const float d2 = domainDistance2(&allBoxes[6*procId], &allBoxes[6*p]);
+    if(d2 == FLT_MAX) continue;
+    if(rkMax    == FLT_MAX || d2 < rkMax*rkMax)       queryTo  .push_back(p);
+    if(allRk[p] == FLT_MAX || d2 < allRk[p]*allRk[p]) queryFrom.push_back(p);
+  }
+
+  //Our particles whose sphere reaches the box of each queried process, .w is
+  //the squared radius
+  std::vector<std::vector<float4> > queries(queryTo.size()), recvQueries;
+  std::vector<std::vector<int> >    queryIdx(queryTo.size());
+  for(size_t j=0; j < queryTo.size(); j++)
+  {
+    const float *pb = &allBoxes[6*queryTo[j]];
+    const float cx = 0.5f*(pb[0] + pb[3]), hx = 0.5f*(pb[3] - pb[0]);
+    const float cy = 0.5f*(pb[1] + pb[4]), hy = 0.5f*(pb[4] - pb[1]);
+    const float cz = 0.5f*(pb[2] + pb[5]), hz = 0.5f*(pb[5] - pb[2]);
+    for(size_t l=0; l < leaves.size(); l++)
+    {
+      int first, count;
+      particles(leaves[l], first, count);
+      float leafRk = 0;
+      for(int q=first; q < first+count; q++) leafRk = std::max(leafRk, rk[q]);
+
+      const Box  &bl     = boxes[leaves[l]];
+      const float leafR2 = leafRk == FLT_MAX ? FLT_MAX : leafRk*leafRk;
+      if(boxDistance2(bl.cx - cx, bl.cy - cy, bl.cz - cz, bl.hx + hx, bl.hy + hy, bl.hz + hz) >= leafR2) continue;
+
+      for(int q=first; q < first+count; q++)
+      {
+        const float r2 = rk[q] == FLT_MAX ? FLT_MAX : rk[q]*rk[q];
+        if(boxDistance2(pos[q].x - cx, pos[q].y - cy, pos[q].z - cz, hx, hy, hz) >= r2) continue;
+        const float4 query = {pos[q].x, pos[q].y, pos[q].z, r2};
+        queries [j].push_back(query);
+        queryIdx[j].push_back(q);
+      }
+    }
+  }
+  exchangeSparse(comm, queryTo, queries, queryFrom, recvQueries);
+
+  //Up to k squared distances per query, padded with FLT_MAX
+  std::vector<std::vector<float> > answers(queryFrom.size()), recvAnswers;
+  for(size_t j=0; j < queryFrom.size(); j++)
+  {
+    const int nQuery = recvQueries[j].size();
+    answers[j].assign((size_t)nQuery*k, FLT_MAX);
+#pragma omp parallel num_threads(nThreads)
+    {
+      std::vector<std::pair<float,int> > stack, child;
+      std::vector<float>                 heap;
+#pragma omp for schedule(dynamic, 16)
+      for(int q=0; q < nQuery; q++)
+      {
+        const float4 qp = recvQueries[j][q];
+        if(n > 0) nearestHeap(qp.x, qp.y, qp.z, k, -1, qp.w, heap, stack, child);
+        else      heap.clear();
+        std::copy(heap.begin(), heap.end(), answers[j].begin() + (size_t)q*k);
+      }
+    }
+  }
+  exchangeSparse(comm, queryFrom, answers, queryTo, recvAnswers);
+
+  //Remote candidates per queried particle, merged with its local neighbours
+  std::vector<std::pair<int,float> > remote;
+  for(size_t j=0; j < queryTo.size(); j++)
+    for(size_t q=0; q < queryIdx[j].size(); q++)
+      for(int c=0; c < k; c++)
+      {
+        const float d2 = recvAnswers[j][q*k + c];
+        if(d2 < FLT_MAX) remote.push_back(std::make_pair(queryIdx[j][q], d2));
+      }
+  std::sort(remote.begin(), remote.end());
+
+  std::vector<size_t> start;
+  for(size_t r=0; r < remote.size(); r++)
+    if(r == 0 || remote[r].first != remote[r-1].first) start.push_back(r);
+  start.push_back(remote.size());
+
+  const int nQueried = start.size() - 1;
+#pragma omp parallel num_threads(nThreads)
+  {
+    std::vector<std::pair<float,int> > stack, child;
+    std::vector<float>                 heap;
+#pragma omp for schedule(dynamic, 16)
+    for(int s=0; s < nQueried; s++)
+    {
+      const int p = remote[start[s]].first;
+      nearestHeap(pos[p].x, pos[p].y, pos[p].z, k, p, FLT_MAX, heap, stack, child);
+      for(size_t r=start[s]; r < start[s+1]; r++)
+      {
+        const float d2 = remote[r].second;
+        if((int)heap.size() < k)
+        {
+          heap.push_back(d2);
+          std::push_heap(heap.begin(), heap.end());
+        }
+        else if(d2 < heap.front())
+        {
+          std::pop_heap(heap.begin(), heap.end());
+          heap.back() = d2;
+          std::push_heap(heap.begin(), heap.end());
+        }
+      }
+      rk[p] = (int)heap.size() < k ? FLT_MAX : std::sqrt(heap.front());
+    }
+  }
+}
+#endif
@@ -0,0 +1,278 @@
+#ifdef USE_MPI
+  #include <mpi.h>
+#endif
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "log.h"
+#include "icCache.h"
+
+//File layout: the header, the key text, padding up to DATA_ALIGN and then
+//the positions, velocities and ids of the n particles as stored in memory.
+//The checksum covers the key text and the three particle arrays
+#define ICCACHE_VERSION 1
+#define DATA_ALIGN      4096
+#define HASH_BLOCK      (1 << 20)     //Bytes per independently hashed block
+
+namespace
+{
+  struct Header
+  {
+    char     magic[8];
+    uint32_t version;
+    uint32_t keyLength;
+    uint64_t keyHash;
+    int64_t  n;
+    uint64_t checksum;
+    uint64_t dataOffset;
+  };
+
+  const char magic[8] = {'B','O','N','S','A','I','I','C'};
+
+  uint64_t fnv1a(const char *p, const size_t bytes, uint64_t h = 0xcbf29ce484222325ULL)
+  {
+    for(size_t i=0; i < bytes; i++) h = (h ^ (unsigned char)p[i]) * 0x100000001b3ULL;
+    return h;
+  }
+
+  inline uint64_t mix(uint64_t h, const uint64_t w)
+  {
+    h ^= w * 0x87c37b91114253d5ULL;
+    h  = (h << 31) | (h >> 33);
+    return h * 0x4cf5ad432745937fULL;
+  }
+
+  //Word-wise hash of blocks of HASH_BLOCK bytes on all threads, the block
+  //hashes are combined in order so the result does not depend on the threads
+  uint64_t checksum(const char *p, const size_t bytes)
+  {
+    const long nBlocks = (long)((bytes + HASH_BLOCK - 1) / HASH_BLOCK);
+    std::vector<uint64_t> blockHash(nBlocks);
+
+#pragma omp parallel for schedule(static)
+    for(long b=0; b < nBlocks; b++)
+    {
+      const char  *q = p + (size_t)b*HASH_BLOCK;
+      const size_t m = std::min((size_t)HASH_BLOCK, bytes - (size_t)b*HASH_BLOCK);
+      uint64_t h = m;
+      size_t   i = 0;
+      for(; i + 8 <= m; i += 8)
+      {
+        uint64_t w;
+        memcpy(&w, q + i, 8);
+        h = mix(h, w);
+      }
+      uint64_t tail = 0;
+      memcpy(&tail, q + i, m - i);
+      blockHash[b] = mix(h, tail);
+    }
+
+    uint64_t h = bytes;
+    for(long b=0; b < nBlocks; b++) h = mix(h, blockHash[b]);
+    return h;
+  }
+
+  uint64_t checksum(const std::string &key, const void *pos, const void *vel,
+                    const void *ids, const size_t n)
+  {
+    uint64_t h = fnv1a(key.data(), key.size());
+    h = mix(h, checksum((const char*)pos, n*sizeof(float4)));
+    h = mix(h, checksum((const char*)vel, n*sizeof(float4)));
+    return mix(h, checksum((const char*)ids, n*sizeof(int)));
+  }
+
+  size_t dataOffset(const size_t keyLength)
+  {
+    return (sizeof(Header) + keyLength + DATA_ALIGN - 1) / DATA_ALIGN * DATA_ALIGN;
+  }
+
+  size_t dataBytes(const long long n)
+  {
+    return n*(2*sizeof(float4) + sizeof(int));
+  }
+
+  //pread of the full range, large reads may return in parts
+  bool readAt(const int fd, void *dst, size_t bytes, off_t offset)
+  {
+    char *p = (char*)dst;
+    while(bytes > 0)
+    {
+      const ssize_t m = pread(fd, p, bytes, offset);
+      if(m <= 0) return false;
+      p      += m;
+      bytes  -= m;
+      offset += m;
+    }
+    return true;
+  }
+}
+
+ICCache::ICCache(const std::string &_dir, const std::string &_generator,
+                 const int _procId, const int _nProcs)
+  : dir(_dir), generator(_generator), procId(_procId), nProcs(_nProcs), valid(true)
+{
+  char buff[64];
+  key  = "generator " + generator + "\n";
+  sprintf(buff, "procs %d\nrank %d\n", nProcs, procId);
+  key += buff;
+}
+
+void ICCache::add(const std::string &name, const long long value)
+{
+  char buff[32];
+  sprintf(buff, "%lld", value);
+  key += name + " " + buff + "\n";
+}
+
+void ICCache::add(const std::string &name, const double value)
+{
+  char buff[32];
+  sprintf(buff, "%.17g", value);
+  key += name + " " + buff + "\n";
+}
+
+void ICCache::addFile(const std::string &fileName)
+{
+  if(!enabled()) return;
+
+  FILE *in = fopen(fileName.c_str(), "rb");
+  if(!in)
+  {
+    LOGF(stderr, "IC cache: can not read %s, the cache is not used\n", fileName.c_str());
+    valid = false;
+    return;
+  }
+  std::vector<char> buff(1 << 20);
+  uint64_t h = fnv1a(NULL, 0);
+  size_t   m;
+  while((m = fread(&buff[0], 1, buff.size(), in)) > 0) h = fnv1a(&buff[0], m, h);
+  fclose(in);
+
+  char hex[32];
+  sprintf(hex, "%016llx", (unsigned long long)h);
+  key += "file " + fileName.substr(fileName.find_last_of('/') + 1) + " " + hex + "\n";
+}
+
+std::string ICCache::fileName() const
+{
+  char hex[32];
+  sprintf(hex, "%016llx", (unsigned long long)fnv1a(key.data(), key.size()));
+  return dir + "/ic-" + generator + "-" + hex + ".bin";
+}
+
+bool ICCache::load(std::vector<float4> &pos, std::vector<float4> &vel, std::vector<int> &ids) const
+{
+  if(!enabled()) return false;
+
+  int found = valid && loadLocal(pos, vel, ids);
+#ifdef USE_MPI
+  if(nProcs > 1)
+    MPI_Allreduce(MPI_IN_PLACE, &found, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+#endif
+  if(procId == 0)
+    LOGF(stderr, "IC cache: %s %s\n", found ? "using" : "no valid", fileName().c_str());
+  return found;
+}
+
+bool ICCache::loadLocal(std::vector<float4> &pos, std::vector<float4> &vel, std::vector<int> &ids) const
+{
+  const std::string name = fileName();
+  const int fd = open(name.c_str(), O_RDONLY);
+  if(fd < 0) return false;
+
+  struct stat st;
+  Header h;
+  if(fstat(fd, &st) != 0 || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+     memcmp(h.magic, magic, sizeof(magic)) != 0 || h.version != ICCACHE_VERSION ||
+     h.keyLength != key.size() || h.n < 0 || h.dataOffset != dataOffset(h.keyLength) ||
+     (size_t)st.st_size != h.dataOffset + dataBytes(h.n))
+  {
+    LOGF(stderr, "IC cache: %s has the wrong layout\n", name.c_str());
+    close(fd);
+    return false;
+  }
+
+  //Read straight into the particle arrays, the checksum is then taken over
+  //them in place
+  const size_t n = h.n;
+  std::string fileKey(key.size(), '\0');
+  pos.resize(n);
+  vel.resize(n);
+  ids.resize(n);
+  bool match = readAt(fd, &fileKey[0], key.size(), sizeof(Header)) && fileKey == key;
+  if(match && n > 0)
+    match = readAt(fd, &pos[0], n*sizeof(float4), h.dataOffset)                      &&
+            readAt(fd, &vel[0], n*sizeof(float4), h.dataOffset + n*sizeof(float4))   &&
+            readAt(fd, &ids[0], n*sizeof(int),    h.dataOffset + 2*n*sizeof(float4));
+  close(fd);
+
+  if(match)
+    match = checksum(key, n ? (const void*)&pos[0] : NULL, n ? (const void*)&vel[0] : NULL,
+                     n ? (const void*)&ids[0] : NULL, n) == h.checksum;
+  if(!match)
+  {
+    LOGF(stderr, "IC cache: %s does not match its key or checksum\n", name.c_str());
+    pos.clear();
+    vel.clear();
+    ids.clear();
+  }
+  return match;
+}
+
+void ICCache::store(const std::vector<float4> &pos, const std::vector<float4> &vel,
+                    const std::vector<int> &ids) const
+{
+  if(!enabled() || !valid) return;
+
+  const size_t n = pos.size();
+  const void  *p = n ? (const void*)&pos[0] : NULL;
+  const void  *v = n ? (const void*)&vel[0] : NULL;
+  const void  *i = n ? (const void*)&ids[0] : NULL;
+
+  Header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, magic, sizeof(magic));
+  h.version    = ICCACHE_VERSION;
+  h.keyLength  = key.size();
+  h.keyHash    = fnv1a(key.data(), key.size());
+  h.n          = n;
+  h.checksum   = checksum(key, p, v, i, n);
+  h.dataOffset = dataOffset(key.size());
+
+  //Written under a temporary name and renamed, concurrent runs with the same
+  //key never see a partial file
+  const std::string name = fileName();
+  char suffix[32];
+  sprintf(suffix, ".%d.tmp", (int)getpid());
+  const std::string tmpName = name + suffix;
+
+  mkdir(dir.c_str(), 0755);
+  FILE *out = fopen(tmpName.c_str(), "wb");
+  if(!out)
+  {
+    LOGF(stderr, "IC cache: can not create %s\n", tmpName.c_str());
+    return;
+  }
+  const std::vector<char> pad(h.dataOffset - sizeof(h) - key.size(), 0);
+  fwrite(&h, sizeof(h), 1, out);
+  fwrite(key.data(), 1, key.size(), out);
+  if(!pad.empty())  fwrite(&pad[0],  1, pad.size(),  out);
+  if(n > 0)
+  {
+    fwrite(p, sizeof(float4), n, out);
+    fwrite(v, sizeof(float4), n, out);
+    fwrite(i, sizeof(int),    n, out);
+  }
+  const bool failed = ferror(out);
+  if(fclose(out) != 0 || failed || rename(tmpName.c_str(), name.c_str()) != 0)
+  {
+    LOGF(stderr, "IC cache: writing %s failed\n", name.c_str());
+    remove(tmpName.c_str());
+    return;
+  }
+  if(procId == 0) LOGF(stderr, "IC cache: stored %s\n", name.c_str());
+}
@@ -63,6 +63,7 @@ void octree::load_kernels() {
                           this->getDevContext()->getComputeCapabilityMinor());
  
   nBlocksForTreeWalk = nMultiProcessors*blocksPerSM;
+  treeWalkBlocks     = nBlocksForTreeWalk;
   
 
   std::string pathName;
@@ -326,6 +327,16 @@ void octree::load_kernels() {
   determineLET.create("dev_determineLET", (const void*)&dev_determineLET);
 #endif
 
+#ifdef PERIODIC
+  ewaldCorrection.setContext(devContext);
+  ewaldCorrection.load_source("./ewald.ptx", pathName.c_str(), "", -1);
+  ewaldCorrection.create("ewald_correction", (const void*)&::ewald_correction);
+  initPeriodicBoundaries();
+#endif
+#ifdef TREEPM
+  initTreePM();
+#endif
+
 #else
   getTNext.load_source("", "");
   
@@ -401,19 +412,23 @@ void octree::load_kernels() {
 #ifdef USE_DUST
    define_dust_groups.setContext(devContext);
    define_dust_groups.load_source("./build_tree.ptx", pathName.c_str());
-   define_dust_groups.create("define_dust_groups");
+   define_dust_groups.create("define_dust_groups", (const void*)&define_dust_groups);
    
    store_dust_groups.setContext(devContext);
    store_dust_groups.load_source("./build_tree.ptx", pathName.c_str());
-   store_dust_groups.create("store_dust_groups");
+   store_dust_groups.create("store_dust_groups", (const void*)&store_dust_groups);
    
    predictDust.setContext(devContext);
    predictDust.load_source("./build_tree.ptx", pathName.c_str());
-   predictDust.create("predict_dust_particles");   
+   predictDust.create("predict_dust_particles", (const void*)&predict_dust_particles);   
    
+   setActiveDust.setContext(devContext);
+   setActiveDust.load_source("./build_tree.ptx", pathName.c_str());
+   setActiveDust.create("set_active_dust_groups", (const void*)&set_active_dust_groups);
+
    correctDust.setContext(devContext);
    correctDust.load_source("./build_tree.ptx", pathName.c_str());
-   correctDust.create("correct_dust_particles");     
+   correctDust.create("correct_dust_particles", (const void*)&correct_dust_particles);     
    
    
    
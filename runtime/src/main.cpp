@@ -51,11 +51,11 @@ double drand48()
 #include "anyoption.h"
 #include "renderloop.h"
 #include "plummer.h"
+#include "icCache.h"
+#include "phaseTransform.h"
 #include "disk_shuffle.h"
 #include "FileIO.h"
-#ifdef GALACTICS
 #include "galactics.h"
-#endif
 
 
 #if ENABLE_LOG
@@ -99,6 +99,9 @@ extern void displayTimers()
 }
 
 #include "octree.h"
+#include "trace.h"
+#include "perfCounters.h"
+#include "postProcessModules.h"
 
 #ifdef USE_OPENGL
 #include "renderloop.h"
@@ -324,115 +327,12 @@ void read_generate_cube(vector<real4> &bodyPositions, vector<real4> &bodyVelocit
 }
 
 
-double rot[3][3];
-
-void rotmat(double i,double w)
-{
-    rot[0][0] = cos(w);
-    rot[0][1] = -cos(i)*sin(w);
-    rot[0][2] = -sin(i)*sin(w);
-    rot[1][0] = sin(w);
-    rot[1][1] = cos(i)*cos(w);
-    rot[1][2] = sin(i)*cos(w);
-    rot[2][0] = 0.0;
-    rot[2][1] = -sin(i);
-    rot[2][2] = cos(i);
-    fprintf(stderr,"%g %g %g\n",rot[0][0], rot[0][1], rot[0][2]);
-    fprintf(stderr,"%g %g %g\n",rot[1][0], rot[1][1], rot[1][2]);
-    fprintf(stderr,"%g %g %g\n",rot[2][0], rot[2][1], rot[2][2]);
-}
-
-void rotate(double rot[3][3],float *vin)
-{
-    static double vout[3];
-
-    for(int i=0; i<3; i++) {
-      vout[i] = 0;
-      for(int j=0; j<3; j++)
-        vout[i] += rot[i][j] * vin[j]; 
-      /* Remember the rotation matrix is the transpose of rot */
-    }
-    for(int i=0; i<3; i++)
-            vin[i] = (float) vout[i];
-}
-
-void euler(vector<real4> &bodyPositions,
-           vector<real4> &bodyVelocities,
-           double inc, double omega)
-{
-  rotmat(inc,omega);
-  size_t nobj = bodyPositions.size();
-  for(uint i=0; i < nobj; i++)
-  {
-      float r[3], v[3];
-      r[0] = bodyPositions[i].x;
-      r[1] = bodyPositions[i].y;
-      r[2] = bodyPositions[i].z;
-      v[0] = bodyVelocities[i].x;
-      v[1] = bodyVelocities[i].y;
-      v[2] = bodyVelocities[i].z;
-
-      rotate(rot,r);
-      rotate(rot,v);
-
-      bodyPositions[i].x = r[0]; 
-      bodyPositions[i].y = r[1]; 
-      bodyPositions[i].z = r[2]; 
-      bodyVelocities[i].x = v[0];
-      bodyVelocities[i].y = v[1];
-      bodyVelocities[i].z = v[2];
-  }
-}
-
-
-
-double centerGalaxy(vector<real4> &bodyPositions,
-                    vector<real4> &bodyVelocities)
-{
-    size_t nobj = bodyPositions.size();
-    float xc, yc, zc, vxc, vyc, vzc, mtot;
-  
-
-    mtot = 0;
-    xc = yc = zc = vxc = vyc = vzc = 0;
-    for(uint i=0; i< nobj; i++) {
-            xc   += bodyPositions[i].w*bodyPositions[i].x;
-            yc   += bodyPositions[i].w*bodyPositions[i].y;
-            zc   += bodyPositions[i].w*bodyPositions[i].z;
-            vxc  += bodyPositions[i].w*bodyVelocities[i].x;
-            vyc  += bodyPositions[i].w*bodyVelocities[i].y;
-            vzc  += bodyPositions[i].w*bodyVelocities[i].z;
-            mtot += bodyPositions[i].w;
-    }
-    xc /= mtot;
-    yc /= mtot;
-    zc /= mtot;
-    vxc /= mtot;
-    vyc /= mtot;
-    vzc /= mtot;
-    for(uint i=0; i< nobj; i++)
-    {
-      bodyPositions[i].x  -= xc;
-      bodyPositions[i].y  -= yc;
-      bodyPositions[i].z  -= zc;
-      bodyVelocities[i].x -= vxc;
-      bodyVelocities[i].y -= vyc;
-      bodyVelocities[i].z -= vzc;
-    }
-    
-    return mtot;
-}
-
-
-
-
 int setupMergerModel(vector<real4> &bodyPositions1,
                      vector<real4> &bodyVelocities1,
                      vector<int>   &bodyIDs1,
                      vector<real4> &bodyPositions2,
                      vector<real4> &bodyVelocities2,
                      vector<int>   &bodyIDs2){
-        uint i;
         double ds=1.0, vs, ms=1.0;
         double mu1, mu2, vp;
         double b=1.0, rsep=10.0;
@@ -498,9 +398,11 @@ int setupMergerModel(vector<real4> &bodyPositions1,
         vs = sqrt(ms/ds); /* adjustment for internal velocities */
 
 
-        //Center everything in galaxy 1 and galaxy 2
-        double galaxyMass1 = centerGalaxy(bodyPositions1, bodyVelocities1);
-        double galaxyMass2 = centerGalaxy(bodyPositions2, bodyVelocities2);
+        //Centre of mass of galaxy 1 and galaxy 2, both are centred by their transform
+        const PhaseMoments moments1 = phaseMoments(&bodyPositions1[0], &bodyVelocities1[0], (long)bodyPositions1.size());
+        const PhaseMoments moments2 = phaseMoments(&bodyPositions2[0], &bodyVelocities2[0], (long)bodyPositions2.size());
+        double galaxyMass1 = moments1.mass;
+        double galaxyMass2 = moments2.mass;
 
 
         galaxyMass2 = ms*galaxyMass2;             //Adjust total mass
@@ -543,33 +445,29 @@ int setupMergerModel(vector<real4> &bodyPositions1,
         vy1 =  mu1*vy; vy2  =  mu2*vy;
 
 
-        /* Rotate the galaxies */
-        euler(bodyPositions1, bodyVelocities1, inc1,omega1);
-        euler(bodyPositions2, bodyVelocities2, inc2,omega2);
-
-        for(i=0; i< bodyPositions1.size(); i++) {
-                bodyPositions1[i].x  = (float) (bodyPositions1[i].x  + x1);
-                bodyPositions1[i].y  = (float) (bodyPositions1[i].y  + y1);
-                bodyVelocities1[i].x = (float) (bodyVelocities1[i].x + vx1);
-                bodyVelocities1[i].y = (float) (bodyVelocities1[i].y + vy1);
-        }
-        /* Rescale and reset the second galaxy */
-        for(i=0; i< bodyPositions2.size(); i++) {
-                bodyPositions2[i].w = (float) ms*bodyPositions2[i].w;
-                bodyPositions2[i].x = (float) (ds*bodyPositions2[i].x + x2);
-                bodyPositions2[i].y = (float) (ds*bodyPositions2[i].y + y2);
-                bodyPositions2[i].z = (float) ds*bodyPositions2[i].z;
-                bodyVelocities2[i].x = (float) (vs*bodyVelocities2[i].x + vx2);
-                bodyVelocities2[i].y = (float) (vs*bodyVelocities2[i].y + vy2);
-                bodyVelocities2[i].z = (float) vs*bodyVelocities2[i].z;
-        }
+        /* Centre, rotate, rescale the second galaxy and put both on the orbit,
+           one transform per galaxy applied in a single pass over the particles */
+        PhaseTransform t1, t2;
+        t1.translate(-moments1.x[0], -moments1.x[1], -moments1.x[2]);
+        t1.boost(-moments1.v[0], -moments1.v[1], -moments1.v[2]);
+        t1.euler(inc1, omega1).translate(x1, y1, 0).boost(vx1, vy1, 0);
 
+        t2.translate(-moments2.x[0], -moments2.x[1], -moments2.x[2]);
+        t2.boost(-moments2.v[0], -moments2.v[1], -moments2.v[2]);
+        t2.euler(inc2, omega2).scale(ds, vs, ms).translate(x2, y2, 0).boost(vx2, vy2, 0);
 
         //Put them into one 
+        const long n1 = bodyPositions1.size();
+        const long n2 = bodyPositions2.size();
         bodyPositions1.insert(bodyPositions1.end(),  bodyPositions2.begin(), bodyPositions2.end());
         bodyVelocities1.insert(bodyVelocities1.end(), bodyVelocities2.begin(), bodyVelocities2.end());
         bodyIDs1.insert(bodyIDs1.end(), bodyIDs2.begin(), bodyIDs2.end());
-  
+
+        std::vector<PhaseRange> ranges(2);
+        ranges[0].first = 0;  ranges[0].n = n1; ranges[0].transform = t1;
+        ranges[1].first = n1; ranges[1].n = n2; ranges[1].transform = t2;
+        if(n1 + n2 > 0)
+          applyPhaseTransforms(&bodyPositions1[0], &bodyVelocities1[0], ranges);
 
         return 0;
 }
@@ -602,16 +500,41 @@ int main(int argc, char** argv)
 
   string fileName       =  "";
   string logFileName    = "gpuLog.log";
+  string telemetryFile  = "";
+  string traceFile      = "";
+  string tuneFile       = "";
+  int    statsPort      = 0;
+  int    autoTuneSteps  = 0;
   string snapshotFile   = "snapshot_";
   float snapshotIter     = -1;
+  float statisticsIter   = 0;
+  float diskStatsIter    = -1;
+  float sphDensityIter   = 0;
+  int   sphDensityNgb    = 32;
+  float fofIter          = 0;
+  float fofLink          = 0.01;
+  int   fofMinMembers    = 20;
+  int   fofKNN           = 16;
+  int   statisticsThreads = 4;
+  StatisticsGrid statisticsGrid;
   float  remoDistance   = -1.0;
   int    snapShotAdd    =  0;
   int rebuild_tree_rate = 2;
+  float rebuildCost     = 0;
+  float rebuildBox      = 2.0;
+  int   forceCheckIter  = -1;
+  float periodicBox     = 0;
+  int   pmGrid          = 0;
+  float pmSplit         = 1.25;
   int reduce_bodies_factor = 1;
   int reduce_dust_factor = 1;
+  int   dustLevels      = 0;
+  float dustEta         = 0.1f;
+  float dustRegroup     = 0;
   string gameModeString = "";
   bool fullscreen = false;
   bool direct = false;
+  bool perfCounters = false;
   bool displayFPS = false;
   bool diskmode = false;
   bool stereo   = false;
@@ -630,7 +553,12 @@ int main(int argc, char** argv)
   int nPlummer  = -1;
   int nSphere   = -1;
   int nMilkyWay = -1;
-  int nMWfork   =  4;
+  int nMWthreads = 0;
+  string mwPath   = ".";
+#ifdef GALACTICS
+  int nMWfork   =  0;
+#endif
+  string icCacheDir;
 
   std::string wogPath;
   int wogPort = 50007;
@@ -651,6 +579,12 @@ int main(int argc, char** argv)
 		ADDUSAGE(" -i  --infile #             Input snapshot filename ");
 		ADDUSAGE("     --restart              Let each process restart from a snapshot as specified by 'infile'");
 		ADDUSAGE("     --logfile #            Log filename [" << logFileName << "]");
+		ADDUSAGE("     --telemetry #          per step performance records, JSON lines or binary with a .bin extension [" << telemetryFile << "]");
+		ADDUSAGE("     --trace #              Chrome trace timeline of the host threads, MPI and GPU streams [" << traceFile << "]");
+		ADDUSAGE("     --stats-port #         serve live step rate, phase times, imbalance and memory as JSON on this port [" << statsPort << "]");
+		ADDUSAGE("     --perfcounters         hardware counters (IPC, cache and branch misses) of the host phases");
+		ADDUSAGE("     --autotune #           tune threads, tree-walk blocks and rebuild rate during the first # steps [" << autoTuneSteps << "]");
+		ADDUSAGE("     --tunefile #           tuning file, reused by later runs [bonsai_tuning_<host>.txt]");
 		ADDUSAGE("     --dev #                Device ID [" << devID << "]");
 		ADDUSAGE("     --renderdev #          Rendering Device ID [" << renderDevID << "]");
 		ADDUSAGE(" -t  --dt #                 time step [" << timeStep << "]");
@@ -660,18 +594,43 @@ int main(int argc, char** argv)
 		ADDUSAGE(" -o  --theta #              opening angle (theta) [" <<theta << "]");
 		ADDUSAGE("     --snapname #           snapshot base name (N-body time is appended in 000000 format) [" << snapshotFile << "]");
 		ADDUSAGE("     --snapiter #           snapshot iteration (N-body time) [" << snapshotIter << "]");
+		ADDUSAGE("     --statsiter #          density maps and disk profiles every # N-body time units, 0 to disable [" << statisticsIter << "]");
+		ADDUSAGE("     --diskstats-iter #     disk profiles every # N-body time units, 0 to disable [--statsiter]");
+		ADDUSAGE("     --stats-grid #,#,#,#   statistics resolution: density map, R-Phi radial, R-Phi azimuthal, disk profile bins ["
+		         << statisticsGrid.nMesh << "," << statisticsGrid.nMeshR << "," << statisticsGrid.nMeshPhi << "," << statisticsGrid.nDiskBins << "]");
+		ADDUSAGE("     --sphdens-iter #       SPH density of the star particles every # N-body time units, 0 to disable [" << sphDensityIter << "]");
+		ADDUSAGE("     --sphdens-ngb #        neighbours of the SPH density [" << sphDensityNgb << "]");
+		ADDUSAGE("     --fof-iter #           friends-of-friends groups every # N-body time units, 0 to disable [" << fofIter << "]");
+		ADDUSAGE("     --fof-link #           friends-of-friends linking length in N-body units [" << fofLink << "]");
+		ADDUSAGE("     --fof-min #            smallest group in the catalogue [" << fofMinMembers << "]");
+		ADDUSAGE("     --fof-knn #            distance to the #-th neighbour per particle, 0 to disable [" << fofKNN << "]");
+		ADDUSAGE("     --stats-threads #      host threads that run the analysis modules [" << statisticsThreads << "]");
 		ADDUSAGE("     --rmdist #             Particle removal distance (-1 to disable) [" << remoDistance << "]");
 		ADDUSAGE("     --valueadd #           value to add to the snapshot [" << snapShotAdd << "]");
 		ADDUSAGE(" -r  --rebuild #            rebuild tree every # steps [" << rebuild_tree_rate << "]");
+		ADDUSAGE("     --rebuildcost #        refit the tree and only rebuild when the interaction count grew by factor #,");
+		ADDUSAGE("                            -r becomes the max rebuild interval (0 to disable) [" << rebuildCost << "]");
+		ADDUSAGE("     --rebuildbox #         with --rebuildcost also rebuild when the refitted boxes grew by factor # [" << rebuildBox << "]");
 		ADDUSAGE("     --reducebodies #       cut down bodies dataset by # factor ");
 #ifdef USE_DUST
         ADDUSAGE("     --reducedust #         cut down dust dataset by # factor ");
+        ADDUSAGE("     --dust-levels #        dust block time steps of up to 2^# times dt, 0 steps all dust every step [" << dustLevels << "]");
+        ADDUSAGE("     --dust-eta #           dust time step criterion eta*sqrt(eps/|a|) [" << dustEta << "]");
+        ADDUSAGE("     --dust-regroup #       only regroup the dust when its group boxes grew by factor # (0 regroups with the tree) [" << dustRegroup << "]");
 #endif
 #if ENABLE_LOG
         ADDUSAGE("     --log                  enable logging ");
         ADDUSAGE("     --prepend-rank         prepend the MPI rank in front of the log-lines ");
 #endif
         ADDUSAGE("     --direct               enable N^2 direct gravitation [" << (direct ? "on" : "off") << "]");
+        ADDUSAGE("     --forcecheck #         compare tree forces with direct N^2 forces at iteration # (-1 to disable) [" << forceCheckIter << "]");
+#ifdef PERIODIC
+        ADDUSAGE("     --periodic #           periodic box of size # centered on the origin, Ewald summation (0 for open boundaries) [" << periodicBox << "]");
+#endif
+#ifdef TREEPM
+        ADDUSAGE("     --pmgrid #             TreePM mesh with #^3 cells for the long range force, needs --periodic (0 to disable) [" << pmGrid << "]");
+        ADDUSAGE("     --rsplit #             TreePM force split scale in mesh cells [" << pmSplit << "]");
+#endif
 #ifdef USE_OPENGL
 		ADDUSAGE("     --fullscreen           set fullscreen");
 		ADDUSAGE("     --gameMode #           set game mode string");
@@ -683,11 +642,14 @@ int main(int argc, char** argv)
 
 
 		ADDUSAGE("     --plummer  #           use plummer model with # particles per proc");
-#ifdef GALACTICS
 		ADDUSAGE("     --milkyway #           use Milky Way model with # particles per proc");
-		ADDUSAGE("     --mwfork   #           fork Milky Way generator into # processes [" << nMWfork << "]");
+		ADDUSAGE("     --mwthreads #          threads of the Milky Way generator, 0 for all [" << nMWthreads << "]");
+		ADDUSAGE("     --mwdf #               directory of the unzipped galactics_mw_df tables [" << mwPath << "]");
+#ifdef GALACTICS
+		ADDUSAGE("     --mwfork   #           fork the reference Fortran generator into # processes, 0 for the DF sampler [" << nMWfork << "]");
 #endif
 		ADDUSAGE("     --sphere   #           use spherical model with # particles per proc");
+		ADDUSAGE("     --iccache #            directory of the cache of generated initial conditions, empty to disable [" << icCacheDir << "]");
         ADDUSAGE("     --diskmode             use diskmode to read same input file all MPI taks and randomly shuffle its positions");
         ADDUSAGE("     --war-of-galaxies #    input path for WarOfGalaxies");
         ADDUSAGE("     --port #               Port for WarOfGalaxies");
@@ -706,28 +668,60 @@ int main(int argc, char** argv)
 		opt.setOption( "eps",     'e' );
 		opt.setOption( "theta",   'o' );
 		opt.setOption( "rebuild", 'r' );
+		opt.setOption( "rebuildcost");
+		opt.setOption( "rebuildbox");
     opt.setOption( "plummer");
-#ifdef GALACTICS
     opt.setOption( "milkyway");
+    opt.setOption( "mwthreads");
+    opt.setOption( "mwdf");
+#ifdef GALACTICS
     opt.setOption( "mwfork");
 #endif
     opt.setOption( "sphere");
+    opt.setOption( "iccache");
     opt.setOption( "dev" );
     opt.setOption( "renderdev" );
     opt.setOption( "logfile" );
+    opt.setOption( "telemetry" );
+    opt.setOption( "trace" );
+    opt.setOption( "stats-port" );
+    opt.setFlag( "perfcounters" );
+    opt.setOption( "autotune" );
+    opt.setOption( "tunefile" );
     opt.setOption( "snapname");
     opt.setOption( "snapiter");
+    opt.setOption( "statsiter");
+    opt.setOption( "diskstats-iter");
+    opt.setOption( "stats-grid");
+    opt.setOption( "sphdens-iter");
+    opt.setOption( "sphdens-ngb");
+    opt.setOption( "fof-iter");
+    opt.setOption( "fof-link");
+    opt.setOption( "fof-min");
+    opt.setOption( "fof-knn");
+    opt.setOption( "stats-threads");
     opt.setOption( "rmdist");
     opt.setOption( "valueadd");
     opt.setOption( "reducebodies");
 #ifdef USE_DUST
     opt.setOption( "reducedust");
+    opt.setOption( "dust-levels");
+    opt.setOption( "dust-eta");
+    opt.setOption( "dust-regroup");
 #endif /* USE_DUST */
 #if ENABLE_LOG
     opt.setFlag("log");
     opt.setFlag("prepend-rank");
 #endif
     opt.setFlag("direct");
+    opt.setOption("forcecheck");
+#ifdef PERIODIC
+    opt.setOption("periodic");
+#endif
+#ifdef TREEPM
+    opt.setOption("pmgrid");
+    opt.setOption("rsplit");
+#endif
 #ifdef USE_OPENGL
     opt.setFlag("fullscreen");
     opt.setOption("gameMode");
@@ -756,6 +750,7 @@ int main(int argc, char** argv)
     }
 
     if (opt.getFlag("direct"))     direct = true;
+    if (opt.getFlag("perfcounters")) perfCounters = true;
     if (opt.getFlag("restart"))    restartSim = true;
     if (opt.getFlag("displayfps")) displayFPS = true;
     if (opt.getFlag("diskmode"))   diskmode = true;
@@ -772,9 +767,19 @@ int main(int argc, char** argv)
     if ((optarg = opt.getValue("infile")))            fileName                = string(optarg);
     if ((optarg = opt.getValue("plummer")))           nPlummer                = atoi(optarg);
     if ((optarg = opt.getValue("milkyway")))          nMilkyWay               = atoi(optarg);
+    if ((optarg = opt.getValue("mwthreads")))         nMWthreads              = atoi(optarg);
+    if ((optarg = opt.getValue("mwdf")))              mwPath                  = string(optarg);
+#ifdef GALACTICS
     if ((optarg = opt.getValue("mwfork")))            nMWfork                 = atoi(optarg);
+#endif
     if ((optarg = opt.getValue("sphere")))            nSphere                 = atoi(optarg);
+    if ((optarg = opt.getValue("iccache")))           icCacheDir              = string(optarg);
     if ((optarg = opt.getValue("logfile")))           logFileName             = string(optarg);
+    if ((optarg = opt.getValue("telemetry")))         telemetryFile           = string(optarg);
+    if ((optarg = opt.getValue("trace")))             traceFile               = string(optarg);
+    if ((optarg = opt.getValue("stats-port")))        statsPort               = atoi(optarg);
+    if ((optarg = opt.getValue("autotune")))          autoTuneSteps           = atoi(optarg);
+    if ((optarg = opt.getValue("tunefile")))          tuneFile                = string(optarg);
     if ((optarg = opt.getValue("dev")))               devID                   = atoi(optarg);
     renderDevID = devID;
     if ((optarg = opt.getValue("renderdev")))         renderDevID             = atoi(optarg);
@@ -785,11 +790,46 @@ int main(int argc, char** argv)
     if ((optarg = opt.getValue("theta")))             theta                   = (float)atof(optarg);
     if ((optarg = opt.getValue("snapname")))          snapshotFile            = string(optarg);
     if ((optarg = opt.getValue("snapiter")))          snapshotIter            = (float)atof(optarg);
+    if ((optarg = opt.getValue("statsiter")))         statisticsIter          = (float)atof(optarg);
+    if ((optarg = opt.getValue("diskstats-iter")))    diskStatsIter           = (float)atof(optarg);
+    if ((optarg = opt.getValue("sphdens-iter")))      sphDensityIter          = (float)atof(optarg);
+    if ((optarg = opt.getValue("sphdens-ngb")))       sphDensityNgb           = atoi(optarg);
+    if ((optarg = opt.getValue("fof-iter")))          fofIter                 = (float)atof(optarg);
+    if ((optarg = opt.getValue("fof-link")))          fofLink                 = (float)atof(optarg);
+    if ((optarg = opt.getValue("fof-min")))           fofMinMembers           = atoi(optarg);
+    if ((optarg = opt.getValue("fof-knn")))           fofKNN                  = atoi(optarg);
+    if ((optarg = opt.getValue("stats-threads")))     statisticsThreads       = atoi(optarg);
+    if ((optarg = opt.getValue("stats-grid")))
+    {
+      StatisticsGrid grid;
+      if(sscanf(optarg, "%d,%d,%d,%d", &grid.nMesh, &grid.nMeshR, &grid.nMeshPhi, &grid.nDiskBins) != 4 ||
+         grid.nMesh < 1 || grid.nMeshR < 1 || grid.nMeshPhi < 1 || grid.nDiskBins < 3)
+      {
+        fprintf(stderr, "Invalid --stats-grid %s, expected four sizes like 200,20,128,600\n", optarg);
+        exit(1);
+      }
+      statisticsGrid = grid;
+    }
     if ((optarg = opt.getValue("rmdist")))            remoDistance            = (float)atof(optarg);
     if ((optarg = opt.getValue("valueadd")))          snapShotAdd             = atoi(optarg);
     if ((optarg = opt.getValue("rebuild")))           rebuild_tree_rate       = atoi(optarg);
+    if ((optarg = opt.getValue("rebuildcost")))       rebuildCost             = (float)atof(optarg);
+    if ((optarg = opt.getValue("rebuildbox")))        rebuildBox              = (float)atof(optarg);
     if ((optarg = opt.getValue("reducebodies")))      reduce_bodies_factor    = atoi(optarg);
+    if ((optarg = opt.getValue("forcecheck")))        forceCheckIter          = atoi(optarg);
+#ifdef PERIODIC
+    if ((optarg = opt.getValue("periodic")))          periodicBox             = (float)atof(optarg);
+#endif
+#ifdef TREEPM
+    if ((optarg = opt.getValue("pmgrid")))            pmGrid                  = atoi(optarg);
+    if ((optarg = opt.getValue("rsplit")))            pmSplit                 = (float)atof(optarg);
+#endif
     if ((optarg = opt.getValue("reducedust")))	      reduce_dust_factor      = atoi(optarg);
+#ifdef USE_DUST
+    if ((optarg = opt.getValue("dust-levels")))       dustLevels              = atoi(optarg);
+    if ((optarg = opt.getValue("dust-eta")))          dustEta                 = (float)atof(optarg);
+    if ((optarg = opt.getValue("dust-regroup")))      dustRegroup             = (float)atof(optarg);
+#endif
     if ((optarg = opt.getValue("war-of-galaxies")))   wogPath                 = string(optarg);
     if ((optarg = opt.getValue("port")))              wogPort                 = atoi(optarg);
     if ((optarg = opt.getValue("camera-distance")))   wogCameraDistance       = atof(optarg);
@@ -810,8 +850,8 @@ int main(int argc, char** argv)
     /// WarOfGalaxies: Deactivate unneeded flags if WarOfGalaxies path will be used
     if (!wogPath.empty()) {
       throw_if_flag_is_used(opt, {{"direct", "restart", "displayfps", "diskmode", "stereo", "prepend-rank"}});
-      throw_if_option_is_used(opt, {{"plummer", "milkyway", "mwfork", "sphere", "dt", "tend", "iend",
-        "snapname", "snapiter", "rmdist", "valueadd", "rebuild", "reducebodies", "reducedust", "gameMode"}});
+      throw_if_option_is_used(opt, {{"plummer", "milkyway", "mwthreads", "mwdf", "mwfork", "sphere", "iccache", "dt", "tend", "iend",
+        "snapname", "snapiter", "rmdist", "valueadd", "rebuild", "rebuildcost", "rebuildbox", "periodic", "pmgrid", "rsplit", "reducebodies", "reducedust", "gameMode"}});
     }
 
 #undef ADDUSAGE
@@ -854,6 +894,17 @@ int main(int argc, char** argv)
 
   //Creat the octree class and set the properties
   octree *tree = new octree(argv, devID, theta, eps, snapshotFile, snapshotIter,  timeStep, tEnd, iterEnd, (int)remoDistance, snapShotAdd, rebuild_tree_rate, direct);
+  tree->setRebuildCostFactors(rebuildCost, rebuildBox);
+  tree->setDustSteps(std::max(0, std::min(dustLevels, 16)), dustEta, dustRegroup);
+  tree->setForceCheckIter(forceCheckIter);
+  tree->setPeriodicBoxSize(periodicBox);
+  tree->setTreePM(pmGrid, pmSplit);
+  tree->setTelemetry(telemetryFile);
+  tree->setStatsServer(statsPort);
+  tree->setStatistics(statisticsIter, diskStatsIter < 0 ? statisticsIter : diskStatsIter,
+                      sphDensityIter, sphDensityNgb, statisticsGrid, statisticsThreads);
+  tree->setHaloFinder(fofIter, fofLink, fofMinMembers, fofKNN, statisticsThreads);
+  tree->setAutoTune(tuneFile, autoTuneSteps);
 
   double tStartup = tree->get_time();
 
@@ -861,12 +912,19 @@ int main(int argc, char** argv)
   int procId = tree->mpiGetRank();
   int nProcs = tree->mpiGetNProcs();
 
+  Trace::init(traceFile, procId, nProcs);
+  PerfCounters::init(perfCounters, procId);
+
   if (procId == 0)
   {
     //NOte cant use LOGF here since MPI isnt initialized yet
     cerr << "[INIT]\tUsed settings: \n";
     cerr << "[INIT]\tInput filename " << fileName << endl;
     cerr << "[INIT]\tLog filename " << logFileName << endl;
+    if (!telemetryFile.empty())
+      cerr << "[INIT]\tTelemetry filename " << telemetryFile << endl;
+    if (!traceFile.empty())
+      cerr << "[INIT]\tTrace filename " << traceFile << endl;
     cerr << "[INIT]\tTheta: \t\t"             << theta        << "\t\teps: \t\t"          << eps << endl;
     cerr << "[INIT]\tTimestep: \t"          << timeStep     << "\t\ttEnd: \t\t"         << tEnd << endl;
     cerr << "[INIT]\titerEnd: \t" << iterEnd << endl;
@@ -875,12 +933,18 @@ int main(int argc, char** argv)
     cerr << "[INIT]\tRemove dist: \t"   << remoDistance << endl;
     cerr << "[INIT]\tSnapshot Addition: \t"  << snapShotAdd << endl;
     cerr << "[INIT]\tRebuild tree every " << rebuild_tree_rate << " timestep\n";
+    if(rebuildCost > 0)
+      cerr << "[INIT]\tRefit tree, rebuild at interaction growth: " << rebuildCost << "\tbox growth: " << rebuildBox << endl;
 
 
     if( reduce_bodies_factor > 1 )
       cout << "[INIT]\tReduce number of non-dust bodies by " << reduce_bodies_factor << " \n";
     if( reduce_dust_factor > 1 )
       cout << "[INIT]\tReduce number of dust bodies by " << reduce_dust_factor << " \n";
+#ifdef USE_DUST
+    if(dustLevels > 0 || dustRegroup > 0)
+      cerr << "[INIT]\tDust levels: " << dustLevels << "\teta: " << dustEta << "\tregroup at box growth: " << dustRegroup << endl;
+#endif
 
 #if ENABLE_LOG
     if (ENABLE_RUNTIME_LOG)
@@ -889,6 +953,10 @@ int main(int argc, char** argv)
       cerr << "[INIT]\tRuntime logging is DISABLED \n";
 #endif
     cerr << "[INIT]\tDirect gravitation is " << (direct ? "ENABLED" : "DISABLED") << endl;
+    if (periodicBox > 0)
+      cerr << "[INIT]\tPeriodic box size: " << periodicBox << endl;
+    if (pmGrid > 0)
+      cerr << "[INIT]\tTreePM mesh: " << pmGrid << "^3\tsplit: " << pmSplit << " cells" << endl;
 #if USE_OPENGL
     cerr << "[INIT]\tTglow = " << TstartGlow << endl;
     cerr << "[INIT]\tdTglow = " << dTstartGlow << endl;
@@ -1086,10 +1154,8 @@ int main(int argc, char** argv)
   }
   else if(nMilkyWay >= 0)
   {
-#ifdef GALACTICS
-    if (procId == 0) printf("Using MilkyWay model with n= %d per proc, forked %d times \n", nMilkyWay, nMWfork);
+    if (procId == 0) printf("Using MilkyWay model with n= %d per proc \n", nMilkyWay);
     assert(nMilkyWay > 0);
-    assert(nMWfork > 0);
  
 
 #if 1 /* in this setup all particles will be of equal mass (exact number are galactic-depednant)  */
@@ -1104,78 +1170,105 @@ int main(int argc, char** argv)
 
     const float fsum = fdisk + fhalo + fbulge;
 
-    const int ndisk  = (int)(nMilkyWay * fdisk/fsum);
-    const int nbulge = (int)(nMilkyWay * fbulge/fsum);
-    const int nhalo  = (int)(nMilkyWay * fhalo/fsum);
+    //Components of the whole model, the sampler splits them over the processes
+    const long long nTotal = (long long)nMilkyWay*nProcs;
+    const long long ndisk  = (long long)(nTotal * fdisk/fsum);
+    const long long nbulge = (long long)(nTotal * fbulge/fsum);
+    const long long nhalo  = (long long)(nTotal * fhalo/fsum);
 
     assert(ndisk  > 0);
     assert(nbulge > 0);
     assert(nhalo  > 0);
 
-    const double t0 = tree->get_time();
-    const Galactics g(procId, nProcs, ndisk, nbulge, nhalo, nMWfork);
-    const double dt = tree->get_time() - t0;
-    if (procId == 0)
-      printf("  ndisk= %d  nbulge= %d  nhalo= %d :: ntotal= %d in %g sec\n",
-          g.get_ndisk(), g.get_nbulge(), g.get_nhalo(), g.get_ntot(), dt);
-
-    const int ntot = g.get_ntot();
-    bodyPositions.resize(ntot);
-    bodyVelocities.resize(ntot);
-    bodyIDs.resize(ntot);
-    for (int i= 0; i < ntot; i++)
+    ICCache cache(icCacheDir, "milkyway", procId, nProcs);
+    cache.add("ndisk",  ndisk);
+    cache.add("nbulge", nbulge);
+    cache.add("nhalo",  nhalo);
+    cache.add("seed",   (long long)Galactics::SEED);
+#ifdef GALACTICS
+    cache.add("mwfork", (long long)nMWfork);
+#endif
+    cache.addFile(mwPath + "/dbh.dat");
+    cache.addFile(mwPath + "/cordbh.dat");
+    cache.addFile(mwPath + "/denspsihalo.dat");
+    cache.addFile(mwPath + "/denspsibulge.dat");
+    if (!cache.load(bodyPositions, bodyVelocities, bodyIDs))
     {
-      assert(!std::isnan(g[i].x));
-      assert(!std::isnan(g[i].y));
-      assert(!std::isnan(g[i].z));
-      assert(g[i].mass > 0.0);
-      bodyIDs[i] = g[i].id;
-
-      bodyPositions[i].x = g[i].x;
-      bodyPositions[i].y = g[i].y;
-      bodyPositions[i].z = g[i].z;
-      bodyPositions[i].w = g[i].mass * 1.0/(double)nProcs;
-      
-      assert(!std::isnan(g[i].vx));
-      assert(!std::isnan(g[i].vy));
-      assert(!std::isnan(g[i].vz));
-
-      bodyVelocities[i].x = g[i].vx;
-      bodyVelocities[i].y = g[i].vy;
-      bodyVelocities[i].z = g[i].vz;
-      bodyVelocities[i].w = 0.0;
-    }
+      const double t0 = tree->get_time();
+#ifdef GALACTICS
+      //Reference generator, per process counts
+      const Galactics g = nMWfork > 0 ?
+        Galactics::reference(procId, nProcs, (int)(nMilkyWay * fdisk/fsum), (int)(nMilkyWay * fbulge/fsum),
+                             (int)(nMilkyWay * fhalo/fsum), nMWfork) :
+        Galactics(procId, nProcs, ndisk, nbulge, nhalo, nMWthreads, mwPath);
 #else
-    assert(0);
+      const Galactics g(procId, nProcs, ndisk, nbulge, nhalo, nMWthreads, mwPath);
+#endif
+      const double dt = tree->get_time() - t0;
+      if (procId == 0)
+        printf("  ndisk= %d  nbulge= %d  nhalo= %d :: ntotal= %d in %g sec\n",
+            g.get_ndisk(), g.get_nbulge(), g.get_nhalo(), g.get_ntot(), dt);
+#ifdef GALACTICS
+      g.summary(procId, nMWfork > 0 ? "reference" : "sampler");
+#else
+      g.summary(procId, "sampler");
 #endif
+
+      const int ntot = g.get_ntot();
+      bodyPositions.resize(ntot);
+      bodyVelocities.resize(ntot);
+      bodyIDs.resize(ntot);
+      for (int i= 0; i < ntot; i++)
+      {
+        assert(!std::isnan(g[i].x));
+        assert(!std::isnan(g[i].y));
+        assert(!std::isnan(g[i].z));
+        assert(g[i].mass > 0.0);
+        bodyIDs[i] = g[i].id;
+
+        bodyPositions[i].x = g[i].x;
+        bodyPositions[i].y = g[i].y;
+        bodyPositions[i].z = g[i].z;
+        bodyPositions[i].w = g[i].mass;
+      
+        assert(!std::isnan(g[i].vx));
+        assert(!std::isnan(g[i].vy));
+        assert(!std::isnan(g[i].vz));
+
+        bodyVelocities[i].x = g[i].vx;
+        bodyVelocities[i].y = g[i].vy;
+        bodyVelocities[i].z = g[i].vz;
+        bodyVelocities[i].w = 0.0;
+      }
+      cache.store(bodyPositions, bodyVelocities, bodyIDs);
+    }
   }
   else if(nPlummer >= 0)
   {
     if (procId == 0) printf("Using plummer model with n= %d per proc \n", nPlummer);
     assert(nPlummer > 0);
-    const int seed = 19810614 + procId;
-    const Plummer m(nPlummer, procId, seed);
-    bodyPositions.resize(nPlummer);
-    bodyVelocities.resize(nPlummer);
-    bodyIDs.resize(nPlummer);
-    for (int i= 0; i < nPlummer; i++)
+    //Global particle indices, the model is the same for any number of processes
+    const long long first  = (long long)nPlummer*procId;
+    const long long nTotal = (long long)nPlummer*nProcs;
+
+    ICCache cache(icCacheDir, "plummer", procId, nProcs);
+    cache.add("n",    (long long)nPlummer);
+    cache.add("seed", (long long)PLUMMER_SEED);
+    if (!cache.load(bodyPositions, bodyVelocities, bodyIDs))
     {
+      bodyPositions.resize(nPlummer);
+      bodyVelocities.resize(nPlummer);
+      bodyIDs.resize(nPlummer);
 
-      assert(!std::isnan(m.pos[i].x));
-      assert(!std::isnan(m.pos[i].y));
-      assert(!std::isnan(m.pos[i].z));
-      assert(m.mass[i] > 0.0);
-      bodyIDs[i]   = nPlummer*procId + i;
-
-      bodyPositions[i].x = m.pos[i].x;
-      bodyPositions[i].y = m.pos[i].y;
-      bodyPositions[i].z = m.pos[i].z;
-      bodyPositions[i].w = m.mass[i] * 1.0/nProcs;
+      ICSums sums = makePlummer(&bodyPositions[0], &bodyVelocities[0], first, nPlummer, nTotal, PLUMMER_SEED);
+#ifdef USE_MPI
+      MPI_Allreduce(MPI_IN_PLACE, sums.v, ICSums::N, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+#endif
+      sums.centre(&bodyPositions[0], &bodyVelocities[0], nPlummer, nTotal);
 
-      bodyVelocities[i].x = m.vel[i].x;
-      bodyVelocities[i].y = m.vel[i].y;
-      bodyVelocities[i].z = m.vel[i].z;
-      bodyVelocities[i].w = 0;
+      for (int i= 0; i < nPlummer; i++)
+        bodyIDs[i] = first + i;
+      cache.store(bodyPositions, bodyVelocities, bodyIDs);
     }
   }
   else if (nSphere >= 0)
@@ -1183,36 +1276,25 @@ int main(int argc, char** argv)
     //Sphere
     if (procId == 0) printf("Using Spherical model with n= %d per proc \n", nSphere);
     assert(nSphere >= 0);
-    bodyPositions.resize(nSphere);
-    bodyVelocities.resize(nSphere);
-    bodyIDs.resize(nSphere);
+    const long long first  = (long long)nSphere*procId;
+    const long long nTotal = (long long)nSphere*nProcs;
 
-    srand48(procId+19840501);
-
-    /* generate uniform sphere */
-    int np = 0;
-    while (np < nSphere)
+    ICCache cache(icCacheDir, "sphere", procId, nProcs);
+    cache.add("n",    (long long)nSphere);
+    cache.add("seed", (long long)SPHERE_SEED);
+    if (!cache.load(bodyPositions, bodyVelocities, bodyIDs))
     {
-      const double x = 2.0*drand48()-1.0;
-      const double y = 2.0*drand48()-1.0;
-      const double z = 2.0*drand48()-1.0;
-      const double r2 = x*x+y*y+z*z;
-      if (r2 < 1)
-      {
-        bodyIDs[np]   = nSphere*procId + np;
-
-        bodyPositions[np].x = x;
-        bodyPositions[np].y = y;
-        bodyPositions[np].z = z;
-        bodyPositions[np].w = (1.0/nSphere) * 1.0/nProcs;
-
-        bodyVelocities[np].x = 0;
-        bodyVelocities[np].y = 0;
-        bodyVelocities[np].z = 0;
-        bodyVelocities[np].w = 0;
-        np++;
-      }//if
-    }//while
+      bodyPositions.resize(nSphere);
+      bodyVelocities.resize(nSphere);
+      bodyIDs.resize(nSphere);
+
+      if (nSphere > 0)
+        makeSphere(&bodyPositions[0], &bodyVelocities[0], first, nSphere, nTotal, SPHERE_SEED);
+
+      for (int i= 0; i < nSphere; i++)
+        bodyIDs[i] = first + i;
+      cache.store(bodyPositions, bodyVelocities, bodyIDs);
+    }
   }//else
   else if (diskmode)
   {
@@ -1350,11 +1432,13 @@ int main(int argc, char** argv)
       tree->localTree.dust_pos[i] = dustPositions[i];
       tree->localTree.dust_vel[i] = dustVelocities[i];
       tree->localTree.dust_ids[i] = dustIDs[i];
+      tree->localTree.dust_time[i] = make_float2(tree->get_t_current(), tree->get_t_current());
     }
 
     tree->localTree.dust_pos.h2d();
     tree->localTree.dust_vel.h2d();
     tree->localTree.dust_ids.h2d();    
+    tree->localTree.dust_time.h2d();
   }
 #endif //ifdef USE_DUST
 
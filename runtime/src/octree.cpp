@@ -1,4 +1,11 @@
 #include "octree.h"
+#include "telemetry.h"
+#include "autoTuner.h"
+#include "StatsServer.h"
+#include "analysisScheduler.h"
+#include "postProcessModules.h"
+#include <unistd.h>
+#include <omp.h>
 
 #ifndef WIN32
 #include <sys/time.h>
@@ -10,6 +17,131 @@
 
 
 
+//Opens the per step telemetry stream, an empty name disables it
+void octree::setTelemetry(const string &fileName)
+{
+  if(fileName.empty()) return;
+  telemetry = new Telemetry(fileName, procId, nProcs);
+}
+
+//Serves the telemetry history on a socket, without a telemetry file the
+//records are only kept in memory
+void octree::setStatsServer(int port)
+{
+  if(port <= 0) return;
+  if(telemetry == NULL)
+    telemetry = new Telemetry("", procId, nProcs);
+  if(procId == 0)
+    statsServer = new StatsServer(*telemetry, port, nProcs);
+}
+
+//Staging buffers of the analysis, pinned so the particles are copied straight into them
+static void *allocPinned(size_t bytes)
+{
+  void *ptr = NULL;
+  if(bytes > 0) CU_SAFE_CALL(cudaMallocHost(&ptr, bytes));
+  return ptr;
+}
+
+static void freePinned(void *ptr)
+{
+  CU_SAFE_CALL(cudaFreeHost(ptr));
+}
+
+//Density maps, disk profiles and SPH densities every densityIter / diskIter /
+//sphIter N-body time units (0 disables), computed on nThreads host threads
+//while the simulation continues
+void octree::setStatistics(float densityIter, float diskIter, float sphIter, int sphNgb,
+                           const StatisticsGrid &grid, int nThreads)
+{
+  if(densityIter <= 0 && diskIter <= 0 && sphIter <= 0) return;
+
+  initAnalysis(nThreads);
+  if(densityIter > 0)
+    analysis->addModule(new DENSITY(grid, 1, 2.33e9, 20, "density"), densityIter);
+  if(diskIter > 0)
+    analysis->addModule(new DISKSTATS(grid, 1, 2.33e9, "diskstats"), diskIter);
+  if(sphIter > 0)
+    analysis->addModule(new SPHDENSITY(sphNgb, nThreads, "sphdensity"), sphIter);
+}
+
+//Friends-of-friends groups with linking length linkLength (N-body units) every
+//fofIter N-body time units (0 disables), kNN > 0 adds the distance to the kNN-th
+//neighbour. Groups with fewer than minMembers particles are not reported
+void octree::setHaloFinder(float fofIter, float linkLength, int minMembers, int kNN, int nThreads)
+{
+  if(fofIter <= 0) return;
+
+  initAnalysis(nThreads);
+  analysis->addModule(new FOF(linkLength, minMembers, kNN, nThreads, "fof"), fofIter);
+}
+
+void octree::initAnalysis(int nThreads)
+{
+  if(analysis == NULL)
+    analysis = new AnalysisScheduler(procId, nProcs, nThreads, 2, allocPinned, freePinned);
+}
+
+//Copies the particles, and the tree if a due module needs it, into the staging
+//buffer selected by analysis->poll()
+void octree::stageAnalysis()
+{
+  const int nNodes = analysis->treeWanted() ? localTree.n_nodes : 0;
+  AnalysisBuffer &buf = analysis->buffer(localTree.n, nNodes);
+  localTree.bodies_pos.d2h(localTree.n, buf.pos);
+  localTree.bodies_vel.d2h(localTree.n, buf.vel);
+  localTree.bodies_ids.d2h(localTree.n, buf.ids);
+  if(nNodes > 0)
+  {
+    localTree.boxCenterInfo.d2h(nNodes, buf.nodeCentre);
+    localTree.boxSizeInfo  .d2h(nNodes, buf.nodeSize);
+    //level_list is on the host since the last build, n_levels is the deepest level
+    buf.levels.assign(&localTree.level_list[0], &localTree.level_list[0] + localTree.n_levels + 1);
+  }
+}
+
+//Registers the knobs with the autotuner, the tuning file is per machine and
+//only reused for the same number of processes and a similar particle count
+void octree::initAutoTuner()
+{
+  if(autoTuneSteps <= 0) return;
+
+  char host[256];
+  if(gethostname(host, sizeof(host)) != 0) sprintf(host, "unknown");
+  char key[512];
+  sprintf(key, "%s_sm%d%d_x%d", host, devContext.getComputeCapabilityMajor(),
+          devContext.getComputeCapabilityMinor(), nMultiProcessors);
+
+  string fileName = autoTuneFile;
+  if(fileName.empty())
+    fileName = string("bonsai_tuning_") + host + ".txt";
+
+  //Every trial sees the same number of rebuilds for all rebuild rates
+  const int rebuildRates[] = {1, 2, 4, 8};
+  autoTuner = new AutoTuner(fileName, key, procId, nProcs, nTotalFreq_ull, autoTuneSteps, 8);
+
+  const int blocksPerSM = nBlocksForTreeWalk / nMultiProcessors;
+  std::vector<int> walkBlocks;
+  for(int i=1; i <= 4; i++)
+    walkBlocks.push_back(nMultiProcessors*std::max((blocksPerSM*i)/4, 1));
+  autoTuner->addKnob("treeWalkBlocks", &treeWalkBlocks, walkBlocks);
+
+  autoTuner->addKnob("rebuildRate", &rebuild_tree_rate, std::vector<int>(rebuildRates, rebuildRates+4));
+
+  if(nProcs > 1)
+  {
+    std::vector<int> threads;
+    for(int i=2; i <= std::min(omp_get_num_procs(), LET_MAX_THREADS); i *= 2) threads.push_back(i);
+    autoTuner->addKnob("letThreads", &letThreads, threads);
+
+    threads.clear();
+    for(int i=1; i <= std::min(omp_get_num_procs(), 8); i *= 2) threads.push_back(i);
+    autoTuner->addKnob("exchangeThreads", &exchangeThreads, threads);
+  }
+
+  autoTuner->load();
+}
+
 void octree::set_src_directory(string src_dir) {                                                                                                                                 
     this->src_directory = (char*)src_dir.c_str();                                                                                                                                
 }   
@@ -1,4 +1,6 @@
 #include "octree.h"
+#include "trace.h"
+#include "perfCounters.h"
 
 //#define USE_MPI
 
@@ -24,76 +26,7 @@ extern "C" uint2 thrust_partitionDomains( my_dev::dev_mem<uint2> &validList,
 
 
 
-typedef float  _v4sf  __attribute__((vector_size(16)));
-typedef int    _v4si  __attribute__((vector_size(16)));
-
-struct v4sf
-{
-  _v4sf data;
-  v4sf() {}
-  v4sf(const _v4sf _data) : data(_data) {}
-  operator const _v4sf&() const {return data;}
-  operator       _v4sf&()       {return data;}
-
-};
-
-/*
- *
- * OpenMP magic / chaos here, to prevent realloc of
- * buffers which seems to be notoriously slow on
- * HA-Pacs
- */
-struct GETLETBUFFERS
-{
-  std::vector<int2> LETBuffer_node;
-  std::vector<int > LETBuffer_ptcl;
-
-  std::vector<uint4>  currLevelVecUI4;
-  std::vector<uint4>  nextLevelVecUI4;
-
-  std::vector<int>  currLevelVecI;
-  std::vector<int>  nextLevelVecI;
-
-
-  std::vector<int>    currGroupLevelVec;
-  std::vector<int>    nextGroupLevelVec;
-
-  //These are for getLET(Quick) only
-  std::vector<v4sf> groupCentreSIMD;
-  std::vector<v4sf> groupSizeSIMD;
-
-  std::vector<v4sf> groupCentreSIMDSwap;
-  std::vector<v4sf> groupSizeSIMDSwap;
-
-  std::vector<int>  groupSIMDkeys;
-
-#if 0 /* AVX */
-#ifndef __AVX__
-#error "AVX is not defined"
-#endif
-  std::vector< std::pair<v4sf,v4sf> > groupSplitFlag;
-#define AVXIMBH
-#else
-  std::vector<v4sf> groupSplitFlag;
-#define SSEIMBH
-#endif
-
-
-  char padding[512 -
-               ( sizeof(LETBuffer_node) +
-                 sizeof(LETBuffer_ptcl) +
-                 sizeof(currLevelVecUI4) +
-                 sizeof(nextLevelVecUI4) +
-                 sizeof(currLevelVecI) +
-                 sizeof(nextLevelVecI) +
-                 sizeof(currGroupLevelVec) +
-                 sizeof(nextGroupLevelVec) +
-                 sizeof(groupSplitFlag) +
-                 sizeof(groupCentreSIMD) +
-                 sizeof(groupSizeSIMD)
-               )];
-};
-/* End of Magic */
+#include "parallelHost.h"
 
 
 
@@ -151,6 +84,29 @@ inline float host_int_as_float(int val)
 }
 
 
+//Separation along an axis for the LET tests. With periodic boundaries this is
+//the minimum image distance min(|d|, L - |d|). letPeriodicBox is huge when
+//the box is open so the min always picks |d|
+#ifdef PERIODIC
+static float letPeriodicBox = 1.0e30f;
+
+static inline float __pabs1(const float x)
+{
+  const float a = fabs(x);
+  return std::min(a, letPeriodicBox - a);
+}
+#else
+#define __pabs1 fabs
+#endif
+
+//TreePM short range cutoff. Cells with ds2 > (cutoff + opening radius)^2 are
+//ignored by the GPU walk (skip_node_treepm) so they do not have to be opened
+//for the LET. Huge when there is no mesh
+#ifdef TREEPM
+#include "treepm.h"
+static float letTreePMCut = 1.0e30f;
+#endif
+
 //SSE stuff for local tree-walk
 #ifdef USE_MPI
 
@@ -174,6 +130,29 @@ static inline _v8sf __abs8(const _v8sf x)
 }
 #endif
 
+//Separation along an axis for the LET tests, see __pabs1
+#ifdef PERIODIC
+static inline _v4sf __pabs(const _v4sf x)
+{
+  const _v4sf a = __abs(x);
+  const _v4sf L = {letPeriodicBox, letPeriodicBox, letPeriodicBox, letPeriodicBox};
+  return __builtin_ia32_minps(a, L - a);
+}
+
+#ifdef __AVX__
+static inline _v8sf __pabs8(const _v8sf x)
+{
+  const _v8sf a = __abs8(x);
+  const _v8sf L = {letPeriodicBox, letPeriodicBox, letPeriodicBox, letPeriodicBox,
+                   letPeriodicBox, letPeriodicBox, letPeriodicBox, letPeriodicBox};
+  return __builtin_ia32_minps256(a, L - a);
+}
+#endif
+#else
+#define __pabs  __abs
+#define __pabs8 __abs8
+#endif
+
 
 
 inline void _v4sf_transpose(_v4sf &a, _v4sf &b, _v4sf &c, _v4sf &d){
@@ -232,9 +211,9 @@ inline int split_node_grav_impbh_box4( // takes 4 tree nodes and returns 4-bit i
   _v4sf bsw =  (boxSize[3]);
   _v4sf_transpose(bsx, bsy, bsz, bsw);
 
-  _v4sf dx = __abs(bcx - ncx) - bsx;
-  _v4sf dy = __abs(bcy - ncy) - bsy;
-  _v4sf dz = __abs(bcz - ncz) - bsz;
+  _v4sf dx = __pabs(bcx - ncx) - bsx;
+  _v4sf dy = __pabs(bcy - ncy) - bsy;
+  _v4sf dz = __pabs(bcz - ncz) - bsz;
 
   _v4sf zero = {0.0, 0.0, 0.0, 0.0};
   dx = __builtin_ia32_maxps(dx, zero);
@@ -280,9 +259,9 @@ inline _v4sf split_node_grav_impbh_box4a( // takes 4 tree nodes and returns 4-bi
   _v4sf bsw =  (boxSize[3]);
   _v4sf_transpose(bsx, bsy, bsz, bsw);
 
-  _v4sf dx = __abs(bcx - ncx) - bsx;
-  _v4sf dy = __abs(bcy - ncy) - bsy;
-  _v4sf dz = __abs(bcz - ncz) - bsz;
+  _v4sf dx = __pabs(bcx - ncx) - bsx;
+  _v4sf dy = __pabs(bcy - ncy) - bsy;
+  _v4sf dz = __pabs(bcz - ncz) - bsz;
 
   const _v4sf zero = {0.0f, 0.0f, 0.0f, 0.0f};
   dx = __builtin_ia32_maxps(dx, zero);
@@ -301,6 +280,11 @@ inline _v4sf split_node_grav_impbh_box4a( // takes 4 tree nodes and returns 4-bi
   _v4sf ret =
     __builtin_ia32_cmpleps(ds2, size);
 #endif
+#ifdef TREEPM
+  const _v4sf rcut = {letTreePMCut, letTreePMCut, letTreePMCut, letTreePMCut};
+  const _v4sf rmax = rcut + __builtin_ia32_sqrtps(size);
+  ret = __builtin_ia32_andps(ret, __builtin_ia32_cmpleps(ds2, rmax*rmax));
+#endif
 #if 0
   const _v4si mask1 = {1,1,1,1};
   const _v4si mask2 = {2,2,2,2};
@@ -351,9 +335,9 @@ inline std::pair<v4sf,v4sf> split_node_grav_impbh_box8a( // takes 4 tree nodes a
   _v8sf bsw = pack_2xmm(boxSize[3], boxSize[7]);
   _v8sf_transpose(bsx, bsy, bsz, bsw);
 
-  _v8sf dx = __abs8(bcx - ncx) - bsx;
-  _v8sf dy = __abs8(bcy - ncy) - bsy;
-  _v8sf dz = __abs8(bcz - ncz) - bsz;
+  _v8sf dx = __pabs8(bcx - ncx) - bsx;
+  _v8sf dy = __pabs8(bcy - ncy) - bsy;
+  _v8sf dz = __pabs8(bcz - ncz) - bsz;
 
   const _v8sf zero = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f,0.0f,0.0f,0.0f};
   dx = __builtin_ia32_maxps256(dx, zero);
@@ -372,6 +356,12 @@ inline std::pair<v4sf,v4sf> split_node_grav_impbh_box8a( // takes 4 tree nodes a
   _v8sf ret =
     __builtin_ia32_cmpps256(ds2, size, 18);
 #endif
+#ifdef TREEPM
+  const _v8sf rcut = {letTreePMCut, letTreePMCut, letTreePMCut, letTreePMCut,
+                      letTreePMCut, letTreePMCut, letTreePMCut, letTreePMCut};
+  const _v8sf rmax = rcut + __builtin_ia32_sqrtps256(size);
+  ret = __builtin_ia32_andps256(ret, __builtin_ia32_cmpps256(ds2, rmax*rmax, 18));
+#endif
 #if 0
   const _v4si mask1 = {1,1,1,1};
   const _v4si mask2 = {2,2,2,2};
@@ -699,8 +689,15 @@ void octree::mpiInit(int argc,char *argv[], int &procId, int &nProcs)
 
   if(!mpiInitialized)
   {
+#ifdef TREEPM
+    //The TreePM mesh communicates from its own thread while makeLET runs,
+    //initTreePM falls back to the main thread if this is not provided
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+#else
     MPI_Init(&argc,&argv);
     int provided;
+#endif
     //MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
     //assert(provided == MPI_THREAD_MULTIPLE);
 
@@ -768,8 +765,48 @@ int octree::SumOnRootRank(int &value)
   return value;
 #endif
 }
+
+//Replaces sources by the concatenation of the sources of all processes
+void octree::gatherEwaldSources(std::vector<real4> &sources)
+{
+#ifdef USE_MPI
+  int nLocal = sources.size()*sizeof(real4);
+  std::vector<int> counts(nProcs), displ(nProcs);
+  MPI_Allgather(&nLocal, 1, MPI_INT, &counts[0], 1, MPI_INT, MPI_COMM_WORLD);
+
+  int total = 0;
+  for(int i=0; i < nProcs; i++)
+  {
+    displ[i] = total;
+    total   += counts[i];
+  }
+
+  std::vector<real4> local(sources);
+  sources.resize(total / sizeof(real4));
+  MPI_Allgatherv(local.empty() ? NULL : &local[0], nLocal, MPI_BYTE,
+                 sources.empty() ? NULL : &sources[0], &counts[0], &displ[0], MPI_BYTE, MPI_COMM_WORLD);
+#endif
+}
 //end utility
 
+void octree::setTreePM(int grid, float split)
+{
+  pmGrid  = grid;
+  pmSplit = split;
+#ifdef TREEPM
+  if(grid > 0 && periodicBoxSize > 0)
+    letTreePMCut = TREEPM_RCUT*split*periodicBoxSize/grid;
+#endif
+}
+
+void octree::setPeriodicBoxSize(float L)
+{
+  periodicBoxSize = L;
+#ifdef PERIODIC
+  letPeriodicBox  = (L > 0) ? L : 1.0e30f;
+#endif
+}
+
 
 
 //Main functions
@@ -1167,7 +1204,10 @@ void octree::exchangeSamplesAndUpdateBoundarySFC(uint4 *sampleKeys,    int  nSam
 
     //JB, TODO check if this is the correct location to put this
     //and or use parallel sort
-    std::sort(key_sample2d.begin(), key_sample2d.end(), DD2D::Key());
+    {
+      PERF_SCOPE(PERF_SAMPLE_SORT);
+      std::sort(key_sample2d.begin(), key_sample2d.end(), DD2D::Key());
+    }
 
     const DD2D dd(procId, npx, nProcs, key_sample1d, key_sample2d, MPI_COMM_WORLD);
 
@@ -1507,6 +1547,10 @@ void octree::gpuRedistributeParticles_SFC(uint4 *boundaries)
             extractOutOfDomainParticlesAdvancedSFC2.set_arg<cl_mem>(10, localTree.bodies_ids.p());
             extractOutOfDomainParticlesAdvancedSFC2.set_arg<cl_mem>(11, localTree.bodies_key.p());
             extractOutOfDomainParticlesAdvancedSFC2.set_arg<cl_mem>(12, bodyBuffer.p());
+#ifdef DOUBLE_ACCUMULATION
+            extractOutOfDomainParticlesAdvancedSFC2.set_arg<cl_mem>(13, localTree.bodies_PposLo.p());
+            extractOutOfDomainParticlesAdvancedSFC2.set_arg<cl_mem>(14, localTree.bodies_PvelLo.p());
+#endif
             extractOutOfDomainParticlesAdvancedSFC2.setWork(items, 128);
             extractOutOfDomainParticlesAdvancedSFC2.execute(execStream->s());
 
@@ -1516,7 +1560,7 @@ void octree::gpuRedistributeParticles_SFC(uint4 *boundaries)
               bodyBuffer.d2h(items, &extraBodyBuffer[extractOffset]); //Copy to our custom buffer, non-pinned
       #else
               bodyBuffer.d2h(items);
-              omp_set_num_threads(4); //Experiment with this number to see what is fastest
+              omp_set_num_threads(exchangeThreads); //Set by the autotuner
       #pragma omp parallel for
               for(int cpIdx=0; cpIdx < items; cpIdx++)
                 extraBodyBuffer[extractOffset+cpIdx] = bodyBuffer[cpIdx];
@@ -1570,6 +1614,10 @@ void octree::gpuRedistributeParticles_SFC(uint4 *boundaries)
         internalMoveSFC2.set_arg<cl_mem>(12, localTree.bodies_time.p());
         internalMoveSFC2.set_arg<cl_mem>(13, localTree.bodies_ids.p());
         internalMoveSFC2.set_arg<cl_mem>(14, localTree.bodies_key.p());
+#ifdef DOUBLE_ACCUMULATION
+        internalMoveSFC2.set_arg<cl_mem>(15, localTree.bodies_PposLo.p());
+        internalMoveSFC2.set_arg<cl_mem>(16, localTree.bodies_PvelLo.p());
+#endif
         internalMoveSFC2.setWork(validCount, 128);
         internalMoveSFC2.execute(execStream->s());
         //  execStream->sync();
@@ -1908,6 +1956,12 @@ int octree::gpu_exchange_particles_with_overflow_check_SFC2(tree_structure &tree
   tree.bodies_Ppos.cresize(memSize + 1, false);
   tree.bodies_Pvel.cresize(memSize + 1, false);
   tree.bodies_key. cresize(memSize + 1, false);
+#ifdef DOUBLE_ACCUMULATION
+  tree.bodies_posLo. cresize(memSize, false);
+  tree.bodies_velLo. cresize(memSize, false);
+  tree.bodies_PposLo.cresize(memSize, false);
+  tree.bodies_PvelLo.cresize(memSize, false);
+#endif
 
   memSize = tree.bodies_acc0.get_size();
   //This one has to be at least the same size as the number of particles in order to
@@ -1958,6 +2012,10 @@ int octree::gpu_exchange_particles_with_overflow_check_SFC2(tree_structure &tree
       insertNewParticlesSFC.set_arg<cl_mem>(11, localTree.bodies_ids.p());
       insertNewParticlesSFC.set_arg<cl_mem>(12, localTree.bodies_key.p());
       insertNewParticlesSFC.set_arg<cl_mem>(13, bodyBuffer.p());
+#ifdef DOUBLE_ACCUMULATION
+      insertNewParticlesSFC.set_arg<cl_mem>(14, localTree.bodies_PposLo.p());
+      insertNewParticlesSFC.set_arg<cl_mem>(15, localTree.bodies_PvelLo.p());
+#endif
       insertNewParticlesSFC.setWork(items, 128);
       insertNewParticlesSFC.execute(execStream->s());
     }// if items > 0
@@ -2397,6 +2455,12 @@ int octree::gpu_exchange_particles_with_overflow_check_SFC(tree_structure &tree,
   tree.bodies_Ppos.cresize(memSize + 1, false);
   tree.bodies_Pvel.cresize(memSize + 1, false);
   tree.bodies_key. cresize(memSize + 1, false);
+#ifdef DOUBLE_ACCUMULATION
+  tree.bodies_posLo. cresize(memSize, false);
+  tree.bodies_velLo. cresize(memSize, false);
+  tree.bodies_PposLo.cresize(memSize, false);
+  tree.bodies_PvelLo.cresize(memSize, false);
+#endif
 
   //This one has to be at least the same size as the number of particles in order to
   //have enough space to store the other buffers
@@ -2450,6 +2514,10 @@ int octree::gpu_exchange_particles_with_overflow_check_SFC(tree_structure &tree,
       insertNewParticlesSFC.set_arg<cl_mem>(11, localTree.bodies_ids.p());
       insertNewParticlesSFC.set_arg<cl_mem>(12, localTree.bodies_key.p());
       insertNewParticlesSFC.set_arg<cl_mem>(13, bodyBuffer.p());
+#ifdef DOUBLE_ACCUMULATION
+      insertNewParticlesSFC.set_arg<cl_mem>(14, localTree.bodies_PposLo.p());
+      insertNewParticlesSFC.set_arg<cl_mem>(15, localTree.bodies_PvelLo.p());
+#endif
       insertNewParticlesSFC.setWork(items, 128);
       insertNewParticlesSFC.execute(execStream->s());
     }
@@ -2525,16 +2593,19 @@ void octree::sendCurrentInfoGrpTree()
 
     localTree.multipole.waitForCopyEvent();
 
-    extractGroupsTreeFull(
-      groupCentre, groupSize,
-      groupMulti, groupBody,
-      &localTree.boxCenterInfo[0],
-      &localTree.boxSizeInfo[0],
-      &localTree.multipole[0],
-      &localTree.bodies_Ppos[0],
-      localTree.level_list[localTree.startLevelMin].x,
-      localTree.level_list[localTree.startLevelMin].y,
-      localTree.n_nodes);
+    {
+      PERF_SCOPE(PERF_GROUP_TREE);
+      extractGroupsTreeFull(
+        groupCentre, groupSize,
+        groupMulti, groupBody,
+        &localTree.boxCenterInfo[0],
+        &localTree.boxSizeInfo[0],
+        &localTree.multipole[0],
+        &localTree.bodies_Ppos[0],
+        localTree.level_list[localTree.startLevelMin].x,
+        localTree.level_list[localTree.startLevelMin].y,
+        localTree.n_nodes);
+    }
 
     int nGroups = groupCentre.size();
     LOGF(stderr, "ExtractGroupsTreeFull n: %d [%d] Multi: %d \tTook: %lg \n",
@@ -3035,7 +3106,7 @@ inline int split_node_grav_impbh(
   const _v4sf boxSize   = __builtin_ia32_andps(boxSize1,   (_v4sf)mask);
 
 
-  const _v4sf dr   = __abs(boxCenter - nodeCOM) - boxSize;
+  const _v4sf dr   = __pabs(boxCenter - nodeCOM) - boxSize;
   const _v4sf ds   = dr + __abs(dr);
   const _v4sf dsq  = ds*ds;
   const _v4sf t1   = __builtin_ia32_haddps(dsq, dsq);
@@ -3148,9 +3219,9 @@ inline int split_node_grav_impbh_box4simd1( // takes 4 tree nodes and returns 4-
 
   const _v4sf zero = {0.0, 0.0, 0.0, 0.0};
 
-  _v4sf dx = __abs(bcx - ncx) - bsx;
-  _v4sf dy = __abs(bcy - ncy) - bsy;
-  _v4sf dz = __abs(bcz - ncz) - bsz;
+  _v4sf dx = __pabs(bcx - ncx) - bsx;
+  _v4sf dy = __pabs(bcy - ncy) - bsy;
+  _v4sf dz = __pabs(bcz - ncz) - bsz;
 
   dx = __builtin_ia32_maxps(dx, zero);
   dy = __builtin_ia32_maxps(dy, zero);
@@ -3810,6 +3881,13 @@ int getLEToptQuickFullTree(
   return  1 + nExportPtcl + 5*nExportCell;
 }
 
+//Explicit instantiation, the host benchmarks call it through parallelHost.h
+template int getLEToptQuickFullTree<v4sf>(
+    std::vector<v4sf> &, GETLETBUFFERS &, const int, const int,
+    const real4 *, const real4 *, const real4 *, const int, const int,
+    const real4 *, const int, const real4 *, const real4 *, const int, const int,
+    const int, const int, const int, unsigned long long &, double &);
+
 
 
 
@@ -4407,9 +4485,9 @@ int octree::recursiveTopLevelCheck(uint4 checkNode, real4* treeBoxSizes, real4*
       //         DistanceCheck++;
       //         DistanceCheckPP++;
       //Compute the distance between the group and the cell
-      float3 dr = make_float3(fabs((float)grpcntr.x - nodeCOM.x) - (float)grpsize.x,
-          fabs((float)grpcntr.y - nodeCOM.y) - (float)grpsize.y,
-          fabs((float)grpcntr.z - nodeCOM.z) - (float)grpsize.z);
+      float3 dr = make_float3(__pabs1((float)grpcntr.x - nodeCOM.x) - (float)grpsize.x,
+          __pabs1((float)grpcntr.y - nodeCOM.y) - (float)grpsize.y,
+          __pabs1((float)grpcntr.z - nodeCOM.z) - (float)grpsize.z);
 
       dr.x += fabs(dr.x); dr.x *= 0.5f;
       dr.y += fabs(dr.y); dr.y *= 0.5f;
@@ -4420,6 +4498,10 @@ int octree::recursiveTopLevelCheck(uint4 checkNode, real4* treeBoxSizes, real4*
 
       if (ds2     <= fabs(nodeCOM.w))           split = true;
       if (fabs(ds2 - fabs(nodeCOM.w)) < 10e-04) split = true; //Limited precision can result in round of errors. Use this as extra safe guard
+#ifdef TREEPM
+      const float rmax = letTreePMCut + sqrt(fabs(nodeCOM.w));
+      if (ds2 > rmax*rmax) split = false;
+#endif
 
       //         LOGF(stderr,"Node: %d grp: %d  split: %d || %f %f\n", nodeID, grp, split, ds2, nodeCOM.w);
     }
@@ -4559,6 +4641,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
                                        int             nTopLevelTrees)
 {
 #ifdef USE_MPI
+  TRACE_SCOPE("essential_tree_exchangeV2");
 
 
   mpiSync(); //todo delete
@@ -4627,7 +4710,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
   for(int i=0; i < MAXLEVELS; i++)  nLevelQuick[i] = 0;
 
 
-  omp_set_num_threads(16);
+  omp_set_num_threads(std::min(letThreads, LET_MAX_THREADS));
 
   letObject *computedLETs = new letObject[nProcs-1];
 
@@ -4648,19 +4731,23 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
   assert(nProcs <= NPROCMAX);
 
 
-  const static int MAX_THREAD = 64;
-  assert(MAX_THREAD >= omp_get_num_threads());
+  //The team of the parallel region below indexes these buffers by thread id
+  const static int MAX_THREAD = LET_MAX_THREADS;
+  assert(MAX_THREAD >= omp_get_max_threads());
   static __attribute__(( aligned(64) )) GETLETBUFFERS getLETBuffers[MAX_THREAD];
 
 
   static std::vector<v4sf> quickCheckData[NPROCMAX];
 
 #ifdef doGETLETQUICK
+  long long quickCheckBytes = 0;
   for (int i = 0; i < nProcs; i++)
   {
     quickCheckData[i].reserve(1+NCELLMAX*NLEAF*5*2);
     quickCheckData[i].clear();
+    quickCheckBytes += quickCheckData[i].capacity()*sizeof(v4sf);
   }
+  my_dev::base_mem::setHostMemUsage("LET quickCheckData", quickCheckBytes);
 #endif
 
   std::map<int, int> communicationStatus;
@@ -4695,6 +4782,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
   {
     int tid      = omp_get_thread_num();
     int nthreads = omp_get_num_threads();
+    TraceScope threadScope(tid == 1 ? "LET communication" : (tid == 0 ? "LET construction and GPU launch" : "LET construction"));
 
     if(tid != 1) //Thread 0, does LET creation and GPU control, Thread == 1 does MPI communication, all others do LET creation
     {
@@ -4714,6 +4802,10 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
       getLETBuffers[tid].nextGroupLevelVec.reserve(allocSize);
       getLETBuffers[tid].groupSplitFlag.reserve(allocSize);
 
+      //All construction threads reserve the same amount
+      if(tid == 0)
+        my_dev::base_mem::setHostMemUsage("LET thread buffers", getLETBuffers[tid].capacityBytes()*(nthreads-1));
+
       double tStatsAllocLoop = get_time();
 
       while(true) //Continue until everything is computed
@@ -4835,6 +4927,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
 
             //Build the tree we possibly have to send to the remote process
             double bla3;
+            PerfScope perfBuild(PERF_LET_BUILD);
             const int sizeTree=  getLEToptQuickFullTree(
                                             quickCheckData[ibox],
                                             getLETBuffers[tid],
@@ -4854,9 +4947,11 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
                                             tree.n_nodes,
                                             procId, ibox,
                                             nflops, bla3);
+            perfBuild.stop();
 
             //Test if the boundary tree send by the remote tree is sufficient for us
             double tBoundaryCheck;
+            PerfScope perfCheck(PERF_LET_CHECK);
             const int resultTree = getLEToptQuickTreevsTree(
                                               getLETBuffers[tid],
                                               &grpCenter[1+nbody+nnode],          //cntr
@@ -4870,6 +4965,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
                                               procId,
                                               ibox,
                                               tBoundaryCheck);
+            perfCheck.stop();
 
               if(resultTree == 0)
               {
@@ -4905,6 +5001,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
             double bla3;
             assert(startGrp == 0);
             const int nGroup = endGrp;
+            PerfScope perfBuild(PERF_LET_BUILD);
             const int sizeTree = getLETquick(
                                               getLETBuffers[tid],
                                               quickCheckData[ibox],
@@ -4924,6 +5021,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
                                               grpCenter,
                                               nGroup,
                                               tree.n_nodes, ibox, bla3);
+            perfBuild.stop();
 
             quickCheckSendSizes[ibox].y = 0; //Dont use boundary
             //double bla2 = get_time();
@@ -5147,7 +5245,10 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
       //Send the sizes
       LOGF(stderr, "Going to do the alltoall size communication! Iter: %d Since begin: %lg \n", iter, get_time()-tStart);
       double t100 = get_time();
-      MPI_Alltoall(quickCheckSendSizes, 2, MPI_INT, quickCheckRecvSizes, 2, MPI_INT, MPI_COMM_WORLD);
+      {
+        TRACE_SCOPE("MPI_Alltoall LET sizes");
+        MPI_Alltoall(quickCheckSendSizes, 2, MPI_INT, quickCheckRecvSizes, 2, MPI_INT, MPI_COMM_WORLD);
+      }
       LOGF(stderr, "Completed_alltoall size communication! Iter: %d Took: %lg ( %lg )\n", iter, get_time()-t100, get_time()-t0);
 
       //If quickCheckRecvSizes[].y == 1 then the remote process used the boundary.
@@ -5196,6 +5297,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
 
       double tmem = get_time();
       recvAllToAllBuffer =  new real4[recvCountItems];
+      my_dev::base_mem::setHostMemUsage("LET alltoall receive", recvCountItems*sizeof(real4));
       LOGF(stderr, "Completed_alltoall mem alloc! Iter: %d Took: %lg \n", iter, get_time()-tmem);
 
       //Convert the values to bytes to get correct offsets and sizes
@@ -5203,6 +5305,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
       {
         quickCheckSendSizes[i].x  *= sizeof(real4);
         quickCheckSendOffset[i]   *= sizeof(real4);
+        letBytesSent              += quickCheckSendSizes[i].x;
 
         if(quickCheckSendSizes[i].x > 0) nQuickCheckRealSends++;
       }
@@ -5239,13 +5342,17 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
                     MPI_COMM_WORLD);
 
 #else
-      MPI_Alltoallv(&topLevelTrees[0],       quickCheckSendSizes, quickCheckSendOffset, MPI_BYTE,
-                    &recvAllToAllBuffer[0],  quickCheckRecvSizes, quickCheckRecvOffset, MPI_BYTE,
-                    MPI_COMM_WORLD);
+      {
+        TRACE_SCOPE("MPI_Alltoallv LET data");
+        MPI_Alltoallv(&topLevelTrees[0],       quickCheckSendSizes, quickCheckSendOffset, MPI_BYTE,
+                      &recvAllToAllBuffer[0],  quickCheckRecvSizes, quickCheckRecvOffset, MPI_BYTE,
+                      MPI_COMM_WORLD);
+      }
 #endif
 
       LOGF(stderr, "[%d] Completed_alltoall 1D data communication! Iter: %d Took: %lg ( %lg )\tSize: %ld MB \n",
           procId, iter, get_time()-t110,  get_time()-t0, (recvCountItems*sizeof(real4))/(1024*1024));
+      letBytesRecv += recvCountItems*sizeof(real4);
 #else
       {
 
@@ -5383,9 +5490,11 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
           for(int i=nSendOut; i < tempComputed; i++)
           {
             //fprintf(stderr,"[%d] Sending out data to: %d \n", procId, computedLETs[i].destination);
+            Trace::instant("MPI_Isend LET");
             MPI_Isend(&(computedLETs[i].buffer)[0],computedLETs[i].size,
                 MPI_BYTE, computedLETs[i].destination, 999,
                 MPI_COMM_WORLD, &(computedLETs[i].req));
+            letBytesSent += computedLETs[i].size;
           }
           nSendOut = tempComputed;
         }
@@ -5408,7 +5517,11 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
             double tY = get_time();
             real4 *recvDataBuffer = new real4[count / sizeof(real4)];
             double tZ = get_time();
-            MPI_Recv(&recvDataBuffer[0], count, MPI_BYTE, probeStatus.MPI_SOURCE, probeStatus.MPI_TAG, MPI_COMM_WORLD,&recvStatus);
+            {
+              TRACE_SCOPE("MPI_Recv LET");
+              MPI_Recv(&recvDataBuffer[0], count, MPI_BYTE, probeStatus.MPI_SOURCE, probeStatus.MPI_TAG, MPI_COMM_WORLD,&recvStatus);
+            }
+            letBytesRecv += count;
 
             LOGF(stderr, "Receive complete from: %d  || recvTree: %d since start: %lg ( %lg ) alloc: %lg Recv: %lg Size: %d\n",
                 recvStatus.MPI_SOURCE, 0, get_time()-tStart,get_time()-t0,tZ-tY, get_time()-tZ, count);
@@ -5511,6 +5624,7 @@ tAlltoAll: %lg tGetLETSend: %lg tTotal: %lg mbSize-a2a: %f nA2AQsend: %d nA2AQre
    devContext.writeLogEvent(buff5); //TODO DELETE
 
   if(recvAllToAllBuffer) delete[] recvAllToAllBuffer;
+  my_dev::base_mem::setHostMemUsage("LET alltoall receive", 0);
   delete[] treeBuffersSource;
   delete[] computedLETs;
   delete[] treeBuffers;
@@ -5527,6 +5641,8 @@ void octree::mergeAndLaunchLETStructures(
     int &topNodeOnTheFlyCount,
     int &recvTree, bool &mergeOwntree, int &procTrees, double &tStart)
 {
+  TRACE_SCOPE("mergeAndLaunchLETStructures");
+  PERF_SCOPE(PERF_LET_MERGE);
   //Now we have to merge the separate tree-structures into one big-tree
 
   int PROCS  = recvTree-procTrees;
@@ -6186,7 +6302,7 @@ inline int split_node_grav_impbh_sse(
   const _v4sf boxSize   = __builtin_ia32_andps(boxSize1,   (_v4sf)mask);
 
 
-  const _v4sf dr   = __abs(boxCenter - nodeCOM) - boxSize;
+  const _v4sf dr   = __pabs(boxCenter - nodeCOM) - boxSize;
   const _v4sf ds   = dr + __abs(dr);
   const _v4sf dsq  = ds*ds;
   const _v4sf t1   = __builtin_ia32_haddps(dsq, dsq);
@@ -6586,6 +6702,7 @@ int balanceLoad(int *nParticlesOriginal, int *nParticlesNew, float *load,
 void octree::gpu_collect_hashes(int nHashes, uint4 *hashes, uint4 *boundaries, float lastExecTime, float lastExecTime2)
 {
 #ifdef USE_MPI
+  TRACE_SCOPE("gpu_collect_hashes");
   double t0 = get_time();
 
   hashInfo hInfo;
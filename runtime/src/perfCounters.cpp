@@ -0,0 +1,203 @@
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <unistd.h>
+#ifdef __linux__
+  #include <sys/syscall.h>
+  #include <linux/perf_event.h>
+#endif
+#include "log.h"
+#include "perfCounters.h"
+
+struct PerfThreadState
+{
+  int fd[PERF_NCOUNTERS];       //fd[0] is the group leader, -1 if unavailable
+  int thread;
+
+  //calls followed by the counters, since the last collect and for the whole run
+  std::atomic<long long> step [PERF_NPHASES][PERF_NCOUNTERS+1];
+  std::atomic<long long> total[PERF_NPHASES][PERF_NCOUNTERS+1];
+};
+
+bool PerfCounters::isEnabled = false;
+
+static std::mutex                      perfMutex;
+static std::vector<PerfThreadState*>   perfThreads;
+static std::atomic<bool>               perfWarned(false);
+static int                             perfProcId = 0;
+static thread_local PerfThreadState   *perfLocal  = NULL;
+
+static const char *perfPhaseNames[PERF_NPHASES] =
+{
+  "LET build", "LET check", "LET merge", "group tree", "sample sort", "statistics"
+};
+
+#ifdef __linux__
+static int perfOpen(const unsigned long long config, const int groupFd)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type           = PERF_TYPE_HARDWARE;
+  attr.size           = sizeof(attr);
+  attr.config         = config;
+  attr.exclude_kernel = 1;      //Allowed with the default perf_event_paranoid level
+  attr.exclude_hv     = 1;
+  attr.read_format    = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  //This thread only, on any CPU
+  return syscall(__NR_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+#endif
+
+static void perfOpenGroup(PerfThreadState *state)
+{
+  for(int i=0; i < PERF_NCOUNTERS; i++) state->fd[i] = -1;
+
+#ifdef __linux__
+  const unsigned long long config[PERF_NCOUNTERS] = {PERF_COUNT_HW_CPU_CYCLES,    PERF_COUNT_HW_INSTRUCTIONS,
+                                                     PERF_COUNT_HW_CACHE_MISSES,  PERF_COUNT_HW_BRANCH_MISSES};
+  for(int i=0; i < PERF_NCOUNTERS; i++)
+  {
+    state->fd[i] = perfOpen(config[i], i == 0 ? -1 : state->fd[0]);
+    if(state->fd[i] >= 0) continue;
+
+    const int err = errno;
+    for(int j=0; j < i; j++)
+    {
+      close(state->fd[j]);
+      state->fd[j] = -1;
+    }
+    if(!perfWarned.exchange(true))
+      LOGF(stderr, "Can not open hardware counters (%s), check /proc/sys/kernel/perf_event_paranoid\n",
+           strerror(err));
+    return;
+  }
+#else
+  if(!perfWarned.exchange(true))
+    LOGF(stderr, "Hardware counters require perf_event_open (Linux)\n");
+#endif
+}
+
+//The state of the calling thread, registered and opened on first use
+static PerfThreadState *perfState()
+{
+  if(perfLocal == NULL)
+  {
+    PerfThreadState *state = new PerfThreadState;
+    for(int i=0; i < PERF_NPHASES; i++)
+      for(int j=0; j <= PERF_NCOUNTERS; j++)
+      {
+        state->step [i][j] = 0;
+        state->total[i][j] = 0;
+      }
+    perfOpenGroup(state);
+
+    std::lock_guard<std::mutex> lock(perfMutex);
+    state->thread = perfThreads.size();
+    perfThreads.push_back(state);
+    perfLocal = state;
+  }
+  return perfLocal;
+}
+
+void PerfCounters::init(const bool enable, const int procId)
+{
+  perfProcId = procId;
+  isEnabled  = enable;
+  if(isEnabled) perfState();    //The main thread is thread 0
+}
+
+bool PerfCounters::read(long long values[PERF_NCOUNTERS])
+{
+#ifdef __linux__
+  const PerfThreadState *state = perfState();
+  if(state->fd[0] < 0) return false;
+
+  unsigned long long buff[3 + PERF_NCOUNTERS];    //nr, time enabled, time running, values
+  if(::read(state->fd[0], buff, sizeof(buff)) != (ssize_t)sizeof(buff)) return false;
+
+  //Scale up if the counters were multiplexed with other events
+  const double scale = (buff[2] > 0 && buff[2] < buff[1]) ? (double)buff[1] / buff[2] : 1.0;
+  for(int i=0; i < PERF_NCOUNTERS; i++)
+    values[i] = (long long)(buff[3+i]*scale);
+  return true;
+#else
+  return false;
+#endif
+}
+
+void PerfCounters::add(const int phase, const long long begin[PERF_NCOUNTERS], const long long end[PERF_NCOUNTERS])
+{
+  PerfThreadState *state = perfState();
+  state->step [phase][0].fetch_add(1, std::memory_order_relaxed);
+  state->total[phase][0].fetch_add(1, std::memory_order_relaxed);
+  for(int i=0; i < PERF_NCOUNTERS; i++)
+  {
+    state->step [phase][i+1].fetch_add(end[i] - begin[i], std::memory_order_relaxed);
+    state->total[phase][i+1].fetch_add(end[i] - begin[i], std::memory_order_relaxed);
+  }
+}
+
+void PerfCounters::collect(PerfPhaseCounts counts[PERF_NPHASES])
+{
+  memset(counts, 0, PERF_NPHASES*sizeof(PerfPhaseCounts));
+  if(!isEnabled) return;
+
+  std::lock_guard<std::mutex> lock(perfMutex);
+  for(size_t t=0; t < perfThreads.size(); t++)
+  {
+    for(int i=0; i < PERF_NPHASES; i++)
+    {
+      counts[i].calls += perfThreads[t]->step[i][0].exchange(0, std::memory_order_relaxed);
+      for(int j=0; j < PERF_NCOUNTERS; j++)
+        counts[i].counts[j] += perfThreads[t]->step[i][j+1].exchange(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+void PerfCounters::report()
+{
+  if(!isEnabled || perfProcId != 0) return;
+
+  std::lock_guard<std::mutex> lock(perfMutex);
+  LOGF(stderr, "Hardware counters of process 0, %d threads\n", (int)perfThreads.size());
+  LOGF(stderr, "%-12s %10s %12s %8s %10s %10s %16s\n",
+       "phase", "calls", "Gcycles", "IPC", "LLC MPKI", "br MPKI", "IPC threads");
+
+  for(int i=0; i < PERF_NPHASES; i++)
+  {
+    long long sum[PERF_NCOUNTERS+1] = {0};
+    double    ipcMin = 1e30, ipcMax = 0;
+    for(size_t t=0; t < perfThreads.size(); t++)
+    {
+      long long c[PERF_NCOUNTERS+1];
+      for(int j=0; j <= PERF_NCOUNTERS; j++)
+      {
+        c[j]    = perfThreads[t]->total[i][j].load(std::memory_order_relaxed);
+        sum[j] += c[j];
+      }
+      if(c[1+PERF_CYCLES] <= 0) continue;
+      const double ipc = (double)c[1+PERF_INSTRUCTIONS] / c[1+PERF_CYCLES];
+      ipcMin = std::min(ipcMin, ipc);
+      ipcMax = std::max(ipcMax, ipc);
+    }
+    if(sum[0] == 0) continue;
+
+    const double cycles = sum[1+PERF_CYCLES];
+    const double instr  = sum[1+PERF_INSTRUCTIONS];
+    LOGF(stderr, "%-12s %10lld %12.4f %8.3f %10.3f %10.3f %7.3f - %6.3f\n",
+         perfPhaseNames[i], sum[0], cycles*1e-9,
+         cycles > 0 ? instr / cycles : 0,
+         instr  > 0 ? 1000.0*sum[1+PERF_LLC_MISSES]    / instr : 0,
+         instr  > 0 ? 1000.0*sum[1+PERF_BRANCH_MISSES] / instr : 0,
+         ipcMax > 0 ? ipcMin : 0, ipcMax);
+  }
+}
+
+const char *PerfCounters::phaseName(const int phase)
+{
+  return perfPhaseNames[phase];
+}
@@ -0,0 +1,862 @@
+#ifdef USE_MPI
+  #include <mpi.h>
+#endif
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cfloat>
+#include <cassert>
+#include <algorithm>
+#include "log.h"
+#include "postProcessModules.h"
+#include "density.h"
+#include "haloFinder.h"
+
+#define G_CONST   6.672e-8
+#define M_SUN     1.989e33
+#define PARSEC    3.08567802e18
+#define ONE_YEAR  3.1558149984e7
+
+#define VELOCITY_KMS_CGS     (1.e+5)            // [km/s] -> [cm/s]
+#define PC_CGS               (3.08568025e+18)   // [cm]
+#define KPC_CGS              (PC_CGS*1.e+3)     // [cm]
+#define MSUN_CGS             (1.98892e+33)      // [g]
+#define GRAVITY_CONSTANT_CGS 6.6725985e-8       // [dyne m^2/kg^2] = [cm^3/g/s^2]
+
+#define MIN_D 1.0
+
+#define SQ(x)           ((x)*(x))
+#define CUBE(x)         ((x)*(x)*(x))
+
+#define STATISTICS_BLOCK 256    //Particles per block, the cell indices of a block are computed in SIMD
+
+void SlotHistograms::begin(const int nSlots, const size_t size)
+{
+  slots.resize(nSlots);
+  for(int i=0; i < nSlots; i++) slots[i].resize(size);
+  used.assign(nSlots, 0);
+}
+
+double *SlotHistograms::get(const int slot)
+{
+  std::vector<double> &hist = slots[slot];
+  if(!used[slot]) std::fill(hist.begin(), hist.end(), 0.0);
+  used[slot] = 1;
+  return &hist[0];
+}
+
+void SlotHistograms::merge()
+{
+  std::vector<int> list;
+  for(size_t i=0; i < slots.size(); i++)
+    if(used[i]) list.push_back(i);
+  if(list.empty())
+  {
+    get(0);
+    merged = 0;
+    return;
+  }
+
+  //Pairwise in log2(slots) rounds
+  const int nList = list.size();
+  for(int stride=1; stride < nList; stride *= 2)
+  {
+    for(int i=0; i + stride < nList; i += 2*stride)
+    {
+      double       *own   = &slots[list[i]][0];
+      const double *other = &slots[list[i+stride]][0];
+      const size_t  size  = slots[list[i]].size();
+      #pragma omp simd
+      for(size_t j=0; j < size; j++) own[j] += other[j];
+    }
+  }
+  merged = list[0];
+}
+
+//Monotonic in atan2(y, x) over (-pi, pi], ranges from -2 to 2
+static inline float pseudoAngle(const float x, const float y)
+{
+  const float p = 1.0f - x/(fabsf(x) + fabsf(y) + 1e-30f);
+  return y < 0 ? -p : p;
+}
+
+
+DENSITY::DENSITY(const StatisticsGrid &grid, double _xscale, double _mscale, double _xmax,
+                 const char *_baseFilename) :
+                 nMesh(grid.nMesh), nMeshR(grid.nMeshR), nMeshPhi(grid.nMeshPhi),
+                 xscale(_xscale), mscale(_mscale), xmax(_xmax), Rmin(0.0), Rmax(20.0),
+                 baseFilename(_baseFilename), time(0)
+{
+  histSize = 2*nMesh*nMesh + 2*nMeshPhi*nMeshR + 1;
+
+  //Pseudo angles of the azimuthal cell edges, from -180 to 180 degrees. The
+  //derivative of the pseudo angle is at least 1/2 so table cells of 1/nMeshPhi
+  //are narrower than the azimuthal cells
+  phiEdges.resize(nMeshPhi+1);
+  for(int i=0; i < nMeshPhi; i++)
+  {
+    const double phi = -M_PI + i*2*M_PI/nMeshPhi;
+    phiEdges[i] = pseudoAngle(cos(phi), sin(phi));
+  }
+  phiEdges[0]        = -2.0f;
+  phiEdges[nMeshPhi] = FLT_MAX;
+
+  phiLookup.resize(4*nMeshPhi);
+  for(int c=0, i=0; c < 4*nMeshPhi; c++)
+  {
+    const float p = -2.0f + (float)c/nMeshPhi;
+    while(i < nMeshPhi-1 && phiEdges[i+1] <= p) i++;
+    phiLookup[c] = i;
+  }
+}
+
+void DENSITY::begin(const int nSlots, const double _time)
+{
+  time = _time;
+  hist.begin(nSlots, histSize);
+}
+
+void DENSITY::consume(const ParticleBatch &batch, const int slot)
+{
+  const float4 *positions = batch.pos;
+  const int    *IDs       = batch.ids;
+  double       *out       = hist.get(slot);
+
+  const float xmin   = -xmax;
+  const float invDx  = nMesh/(2*xmax);
+  const float invDR  = nMeshR/(Rmax - Rmin);
+  const float scale  = xscale;
+  const float mScale = mscale;
+  const float rMin   = Rmin;
+
+  const int frontOffset = nMesh*nMesh;
+  const int countOffset = 2*nMesh*nMesh;
+  const int massOffset  = countOffset + nMeshPhi*nMeshR;
+  const int reject      = histSize-1;
+  const int nLookup     = 4*nMeshPhi;
+  const float *edges    = &phiEdges[0];
+  const int   *lookup   = &phiLookup[0];
+
+  const int mesh = nMesh, meshR = nMeshR, meshPhi = nMeshPhi;
+
+  for(int begin=0; begin < batch.n; begin += STATISTICS_BLOCK)
+  {
+    int   top[STATISTICS_BLOCK], front[STATISTICS_BLOCK], rphi[STATISTICS_BLOCK];
+    float mass[STATISTICS_BLOCK];
+    const int m = std::min(STATISTICS_BLOCK, batch.n - begin);
+
+    #pragma omp simd
+    for(int k=0; k < m; k++)
+    {
+      const float4 p    = positions[begin+k];
+      const bool   star = IDs[begin+k] < DMSTARTID;
+
+      //Top and front view, the truncation is the floor for the accepted cells
+      const float fx = (p.x*scale - xmin)*invDx;
+      const float fy = (p.y*scale - xmin)*invDx;
+      const float fz = (p.z*scale - xmin)*invDx;
+      const bool  inX = fx >= 0 && fx < mesh;
+      top  [k] = (star && inX && fy >= 0 && fy < mesh) ? (int)fx*mesh + (int)fy               : reject;
+      front[k] = (star && inX && fz >= 0 && fz < mesh) ? frontOffset + (int)fx*mesh + (int)fz : reject;
+      mass [k] = p.w*mScale;
+
+      //R-Phi cell
+      const float fr = (sqrtf(p.x*p.x + p.y*p.y) - rMin)*invDR;
+      const float pa = pseudoAngle(p.x, p.y);
+      const int   c  = std::min(std::max((int)((pa + 2.0f)*meshPhi), 0), nLookup-1);
+      int i = lookup[c];
+      i    += pa >= edges[i+1];
+      i    -= pa <  edges[i];
+      rphi[k] = (star && fr >= 0 && fr < meshR) ? i*meshR + (int)fr : -1;
+    }
+
+    //Only the stars are accumulated, rejects on one cell would form a dependency chain
+    int use[STATISTICS_BLOCK], nUse = 0;
+    for(int k=0; k < m; k++)
+    {
+      use[nUse] = k;
+      nUse     += IDs[begin+k] < DMSTARTID;
+    }
+
+    for(int u=0; u < nUse; u++)
+    {
+      const int k = use[u];
+      out[top  [k]] += mass[k];
+      out[front[k]] += mass[k];
+      if(rphi[k] >= 0)
+      {
+        out[countOffset + rphi[k]] += 1;
+        out[massOffset  + rphi[k]] += positions[begin+k].w;
+      }
+    }
+  }
+}
+
+void DENSITY::merge()
+{
+  hist.merge();
+}
+
+void DENSITY::reduceAndEmit(const int procId)
+{
+  const std::vector<double> &local = hist.sum();
+  std::vector<double> sum(local.size());
+#ifdef USE_MPI
+  MPI_Reduce((void*)&local[0], &sum[0], local.size(), MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+#else
+  sum = local;
+#endif
+  if(procId != 0) return;
+
+  const double dx     = 2*xmax/nMesh;
+  const double dR     = (Rmax - Rmin)/nMeshR;
+  const double tmp    = 1.e3*dx*xscale;
+  const double dscale = 1./(tmp*tmp);
+  const double x      = xscale*1e3*PARSEC;
+  const double tscale = sqrt(x*x*x/(G_CONST*mscale*M_SUN))*1e-6/ONE_YEAR;
+
+  //Log of the surface density, empty cells get the background
+  const float bg = log10(MIN_D);
+  std::vector<float> maps(2*nMesh*nMesh), rphi(nMeshPhi*nMeshR);
+  for(int i=0; i < 2*nMesh*nMesh; i++)
+    maps[i] = sum[i] > 0 ? log10(sum[i]*dscale) : bg;
+
+  //R-Phi relative to the mean of the ring
+  const double *mass = &sum[2*nMesh*nMesh + nMeshPhi*nMeshR];
+  for(int j=0; j < nMeshR; j++)
+  {
+    const double R    = Rmin + (j+0.5)*dR;
+    double       SigR = 0;
+    for(int i=0; i < nMeshPhi; i++) SigR += mass[i*nMeshR+j];
+    SigR /= 2*M_PI*R*dR;
+
+    const double ds = 2*M_PI*R*dR/nMeshPhi;
+    for(int i=0; i < nMeshPhi; i++)
+      rphi[i*nMeshR+j] = SigR > 0 ? mass[i*nMeshR+j]/ds/SigR : 0;
+  }
+
+  char fileName[256];
+  sprintf(fileName,"%s-TopFront-%f.bin", baseFilename.c_str(), time);
+  FILE *dump = fopen(fileName, "wb");
+  if(!dump)
+  {
+    LOGF(stderr, "Failed to open output file for density: %s \n", fileName);
+    return;
+  }
+
+  const int    header[4] = {STATISTICS_VERSION, nMesh, nMeshR, nMeshPhi};
+  const double tSim      = tscale*time;
+  fwrite("BDEN", 1, 4, dump);
+  fwrite(header,   sizeof(int),    4,           dump);
+  fwrite(&tSim,    sizeof(double), 1,           dump);
+  fwrite(&maps[0], sizeof(float),  maps.size(), dump);
+  fwrite(&rphi[0], sizeof(float),  rphi.size(), dump);
+  fclose(dump);
+}
+
+
+DISKSTATS::DISKSTATS(const StatisticsGrid &grid, double _xscale, double _mscale, const char *_baseFilename) :
+                     nBins(grid.nDiskBins), xscale(_xscale), mscale(_mscale),
+                     RrotMin(0.0), RrotEnd(30.0), baseFilename(_baseFilename), tsim(0)
+{
+}
+
+void DISKSTATS::begin(const int nSlots, const double time)
+{
+  tsim = time;
+  hist.begin(nSlots, NITEMS*3*nBins);
+}
+
+void DISKSTATS::consume(const ParticleBatch &batch, const int slot)
+{
+  const float4 *positions  = batch.pos;
+  const float4 *velocities = batch.vel;
+  const int    *IDs        = batch.ids;
+  double       *out        = hist.get(slot);
+
+  const int   stride = 3*nBins;
+  const int   bins   = nBins;
+  const float rMin   = RrotMin, rEnd = RrotEnd;
+  const float invDR  = nBins/(RrotEnd - RrotMin);
+
+  for(int begin=0; begin < batch.n; begin += STATISTICS_BLOCK)
+  {
+    int   all[STATISTICS_BLOCK], part[STATISTICS_BLOCK];
+    float val[NITEMS][STATISTICS_BLOCK];
+    const int m = std::min(STATISTICS_BLOCK, batch.n - begin);
+
+    #pragma omp simd
+    for(int k=0; k < m; k++)
+    {
+      const float4 p  = positions [begin+k];
+      const float4 v  = velocities[begin+k];
+      const int    id = IDs[begin+k];
+
+      const float R    = sqrtf(p.x*p.x + p.y*p.y);
+      const float invR = R > 0 ? 1.0f/R : 0.0f;
+      const float vr   = ( v.x*p.x + v.y*p.y)*invR;
+      const float va   = (-v.x*p.y + v.y*p.x)*invR;
+      const bool  use  = id >= 0 && id < DMSTARTID && R > rMin && R < rEnd;
+      const int   i    = std::min((int)((std::min(R, rEnd) - rMin)*invDR), bins-1);
+
+      //Disk+bulge, then the bulge or disk part
+      all [k] = use ? i                                        : -1;
+      part[k] = use ? (id >= BULGESTARTID ? bins : 2*bins) + i : -1;
+
+      val[NS  ][k] = 1;
+      val[SIGS][k] = p.w;
+      val[VRS ][k] = vr;
+      val[VAS ][k] = va;
+      val[VZS ][k] = v.z;
+      val[DRS ][k] = vr*vr;
+      val[DAS ][k] = va*va;
+      val[DZS ][k] = v.z*v.z;
+      val[ZRMS][k] = p.z*p.z;
+    }
+
+    int use[STATISTICS_BLOCK], nUse = 0;
+    for(int k=0; k < m; k++)
+    {
+      use[nUse] = k;
+      nUse     += all[k] >= 0;
+    }
+
+    for(int item=0; item < NITEMS; item++)
+    {
+      double *row = out + item*stride;
+      for(int u=0; u < nUse; u++)
+      {
+        const int k = use[u];
+        row[all [k]] += val[item][k];
+        row[part[k]] += val[item][k];
+      }
+    }
+  }
+}
+
+void DISKSTATS::merge()
+{
+  hist.merge();
+}
+
+void DISKSTATS::reduceAndEmit(const int procId)
+{
+  const std::vector<double> &local = hist.sum();
+  std::vector<double> sum(local.size());
+#ifdef USE_MPI
+  MPI_Reduce((void*)&local[0], &sum[0], local.size(), MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+#else
+  sum = local;
+#endif
+  if(procId != 0) return;
+
+  const double GravConst    = 1.0;
+  const double UnitLength   = xscale*KPC_CGS;                   //[kpc]->[cm]
+  const double UnitMass     = mscale*MSUN_CGS;
+  const double SDUnit       = 2.3e+9/1.e6;
+  const double UnitTime     = sqrt(CUBE(UnitLength)/(GRAVITY_CONSTANT_CGS*UnitMass));  //[s]
+  const double UnitVelocity = UnitLength/UnitTime;              //[cm/s]
+  const double VelUnit      = UnitVelocity/VELOCITY_KMS_CGS;
+  const double treal        = 1e-9*tsim*UnitTime/ONE_YEAR;
+  const double dR           = (RrotEnd - RrotMin)/nBins;
+
+  const int stride = 3*nBins;
+  std::vector<float> columns(nBins*DISKSTATS_NCOLUMNS);
+  std::vector<double> Mass(nBins), Omgs(nBins), kapps(nBins), Gam(nBins);
+
+  for(int j=0; j < 3; j++)
+  {
+    double *res[NITEMS];
+    for(int item=0; item < NITEMS; item++) res[item] = &sum[item*stride + j*nBins];
+
+    //Averages and dispersions, the enclosed mass uses the mass per bin
+    for(int i=0; i < nBins; i++)
+    {
+      const double R  = RrotMin + (i+0.5)*dR;
+      const double ns = res[NS][i];
+      Mass[i] = (i > 0 ? Mass[i-1] : 0) + res[SIGS][i];
+      Omgs[i] = 0;
+      if(ns == 0) continue;
+
+      res[SIGS][i] /= 2.0*M_PI*R*dR;
+      res[VRS] [i] /= ns;
+      res[VAS] [i] /= ns;
+      res[VZS] [i] /= ns;
+      res[DRS] [i]  = sqrt(std::max(res[DRS][i]/ns - SQ(res[VRS][i]), 0.0));
+      res[DAS] [i]  = sqrt(std::max(res[DAS][i]/ns - SQ(res[VAS][i]), 0.0));
+      res[DZS] [i]  = sqrt(std::max(res[DZS][i]/ns - SQ(res[VZS][i]), 0.0));
+      res[ZRMS][i]  = sqrt(res[ZRMS][i]/ns);
+      Omgs[i]       = res[VAS][i]/R;
+    }
+
+    //Epicyclic frequency and shear
+    for(int i=1; i < nBins-1; i++)
+    {
+      const double R = RrotMin + (i+0.5)*dR;
+      kapps[i] = sqrt(std::max(0.5*R*((SQ(Omgs[i+1])-SQ(Omgs[i-1]))/dR) + 4.0*SQ(Omgs[i]), 0.0));
+      Gam[i]   = -(R/Omgs[i])*0.5*(Omgs[i+1]-Omgs[i-1])/dR;
+    }
+    kapps[0]       = 2.0*Omgs[0];
+    kapps[nBins-1] = kapps[nBins-2];
+    Gam[0]         = Gam[1];
+    Gam[nBins-1]   = Gam[nBins-2];
+
+    //Columns 0-14 disk+bulge, 15-21 bulge, 22-28 disk
+    const int first = j == 0 ? 0 : (j == 1 ? 15 : 22);
+    for(int i=0; i < nBins; i++)
+    {
+      const double R    = RrotMin + (i+0.5)*dR;
+      const double Sig  = res[SIGS][i];
+      const double kapp = kapps[i];
+      float *row = &columns[i*DISKSTATS_NCOLUMNS + first];
+      row[0] = R;
+      row[1] = res[VAS][i]*VelUnit;
+      row[2] = res[DRS][i]*VelUnit;
+      row[3] = res[DAS][i]*VelUnit;
+      row[4] = res[DZS][i]*VelUnit;
+      if(j == 0)
+      {
+        row[5]  = Omgs[i]/UnitTime;
+        row[6]  = kapp*VelUnit;
+        row[7]  = res[DRS][i]*kapp/(3.36*GravConst*Sig);
+        row[8]  = Gam[i];
+        row[9]  = SQ(kapp)*R/(2.0*M_PI*GravConst*Sig)/4.0;
+        row[10] = Sig*SDUnit;
+        row[11] = Mass[i]*2.33e9;
+        row[12] = kapp*kapp/(GravConst*Sig);
+        row[13] = res[ZRMS][i];
+        row[14] = res[NS][i];
+      }
+      else
+      {
+        row[5] = Sig*SDUnit;
+        row[6] = Mass[i]*2.33e9;
+      }
+    }
+  }//for j
+
+  char fileName[512];
+  sprintf(fileName,"%s-%f.bin", baseFilename.c_str(), tsim);
+  FILE *out = fopen(fileName, "wb");
+  if(!out)
+  {
+    LOGF(stderr,"Failed to open output file for disk-stats: %s \n", fileName);
+    return;
+  }
+
+  const int header[3] = {STATISTICS_VERSION, nBins, DISKSTATS_NCOLUMNS};
+  fwrite("BDSK", 1, 4, out);
+  fwrite(header,      sizeof(int),    3,              out);
+  fwrite(&treal,      sizeof(double), 1,              out);
+  fwrite(&columns[0], sizeof(float),  columns.size(), out);
+  fclose(out);
+}
+
+
+
+SPHDENSITY::SPHDENSITY(const int _Nngb, const int _nThreads, const char *_baseFilename) :
+  Nngb(_Nngb), nThreads(_nThreads), baseFilename(_baseFilename), time(0), tCompute(0),
+  density(new Density(_Nngb, _nThreads)) {}
+
+SPHDENSITY::~SPHDENSITY()
+{
+  delete density;
+}
+
+void SPHDENSITY::begin(const int nSlots, const double _time)
+{
+  time = _time;
+  slotPos.resize(nSlots);
+  slotIds.resize(nSlots);
+  for(int i=0; i < nSlots; i++)
+  {
+    slotPos[i].clear();
+    slotIds[i].clear();
+  }
+}
+
+void SPHDENSITY::consume(const ParticleBatch &batch, const int slot)
+{
+  std::vector<float4> &p  = slotPos[slot];
+  std::vector<int>    &id = slotIds[slot];
+  for(int i=0; i < batch.n; i++)
+  {
+    if(batch.ids[i] >= DMSTARTID) continue;
+    p .push_back(batch.pos[i]);
+    id.push_back(batch.ids[i]);
+  }
+}
+
+void SPHDENSITY::merge()
+{
+  pos.clear();
+  ids.clear();
+  for(size_t i=0; i < slotPos.size(); i++)
+  {
+    pos.insert(pos.end(), slotPos[i].begin(), slotPos[i].end());
+    ids.insert(ids.end(), slotIds[i].begin(), slotIds[i].end());
+  }
+
+  //Without a guess h starts from the size of the tree cells
+  const int n = pos.size();
+  h  .assign(n, 0.0f);
+  rho.resize(n);
+  density->compute(n, n > 0 ? &pos[0].x : NULL, n > 0 ? &h[0] : NULL, n > 0 ? &rho[0] : NULL);
+  tCompute = density->getBuildTime() + density->getSolveTime();
+}
+
+void SPHDENSITY::reduceAndEmit(const int procId)
+{
+  const int n = pos.size();
+  if(procId == 0)
+    LOGF(stderr, "SPH density at t= %f : %d particles in %g sec, %d iterations, %d unconverged\n",
+         time, n, tCompute, density->iterations(), density->unconverged());
+
+#ifdef USE_MPI
+  int nProcs;
+  MPI_Comm_size(MPI_COMM_WORLD, &nProcs);
+  if(nProcs > 1)
+    density->correctBoundaries(MPI_COMM_WORLD, n > 0 ? &h[0] : NULL, n > 0 ? &rho[0] : NULL);
+#endif
+
+
+  char fileName[256];
+  sprintf(fileName,"%s-%f-%d.bin", baseFilename.c_str(), time, procId);
+  FILE *dump = fopen(fileName, "wb");
+  if(!dump)
+  {
+    LOGF(stderr, "Failed to open output file for sphdensity: %s \n", fileName);
+    return;
+  }
+
+  const int header[3] = {STATISTICS_VERSION, n, Nngb};
+  fwrite("BSPH", 1, 4, dump);
+  fwrite(header, sizeof(int),    3, dump);
+  fwrite(&time,  sizeof(double), 1, dump);
+  if(n > 0)
+  {
+    fwrite(&ids[0], sizeof(int),   n, dump);
+    fwrite(&h[0],   sizeof(float), n, dump);
+    fwrite(&rho[0], sizeof(float), n, dump);
+  }
+  fclose(dump);
+}
+
+
+FOF::FOF(const float _linkLength, const int _minMembers, const int _kNN, const int _nThreads,
+         const char *_baseFilename) :
+  linkLength(_linkLength), minMembers(std::max(_minMembers, 1)), kNN(std::max(_kNN, 0)),
+  nThreads(_nThreads), baseFilename(_baseFilename), time(0), tLocal(0), nStaged(0),
+  pos(NULL), vel(NULL), ids(NULL), tree(NULL), finder(new HaloFinder(_nThreads)) {}
+
+FOF::~FOF()
+{
+  delete finder;
+}
+
+void FOF::begin(const int nSlots, const double _time)
+{
+  time    = _time;
+  nStaged = 0;
+  tree    = NULL;
+}
+
+void FOF::consume(const ParticleBatch &batch, const int slot)
+{
+  if(batch.first == 0)
+  {
+    pos  = batch.pos;
+    vel  = batch.vel;
+    ids  = batch.ids;
+    tree = batch.tree;
+  }
+  nStaged += batch.n;
+}
+
+void FOF::merge()
+{
+  const double t0 = wtime();
+  const int    n  = tree ? (int)nStaged : 0;
+  label.resize(n);
+  rk   .assign(n, 0.0f);
+
+  //Also without particles, the merge across the processes uses the finder
+  const AnalysisTree none = {0, 0, NULL, NULL, NULL};
+  finder->setParticles(n, pos, n > 0 ? *tree : none);
+  if(n == 0) return;
+
+  finder->link(linkLength);
+  finder->labels(0, &label[0]);
+  if(kNN > 0) finder->nearest(kNN, &rk[0]);
+  tLocal = wtime() - t0;
+}
+
+void FOF::add(Moments &g, const int i) const
+{
+  const float4 p = pos[i], v = vel[i];
+  g.n   += 1;
+  g.m   += p.w;
+  g.mx  += p.w*p.x;  g.my  += p.w*p.y;  g.mz  += p.w*p.z;
+  g.mvx += p.w*v.x;  g.mvy += p.w*v.y;  g.mvz += p.w*v.z;
+  g.mr2 += p.w*((double)p.x*p.x + (double)p.y*p.y + (double)p.z*p.z);
+  g.mv2 += p.w*((double)v.x*v.x + (double)v.y*v.y + (double)v.z*v.z);
+  if(rk[i] < g.rkMin)
+  {
+    g.rkMin = rk[i];
+    g.xc = p.x;  g.yc = p.y;  g.zc = p.z;
+  }
+}
+
+void FOF::add(Moments &g, const Moments &h)
+{
+  g.n   += h.n;    g.m   += h.m;
+  g.mx  += h.mx;   g.my  += h.my;   g.mz  += h.mz;
+  g.mvx += h.mvx;  g.mvy += h.mvy;  g.mvz += h.mvz;
+  g.mr2 += h.mr2;  g.mv2 += h.mv2;
+  if(h.rkMin < g.rkMin)
+  {
+    g.rkMin = h.rkMin;
+    g.xc = h.xc;  g.yc = h.yc;  g.zc = h.zc;
+  }
+}
+
+#ifdef USE_MPI
+//Sends the items of send (grouped by destination, count per process in
+//sendCount) and returns the received ones with their count per source
+template<typename T>
+static void exchangeItems(const std::vector<T> &send, const std::vector<int> &sendCount,
+                          std::vector<T> &recv, std::vector<int> &recvCount, const int nProcs)
+{
+  std::vector<int> sendBytes(nProcs), sendOffset(nProcs+1, 0);
+  std::vector<int> recvBytes(nProcs), recvOffset(nProcs+1, 0);
+  for(int p=0; p < nProcs; p++)
+  {
+    sendBytes [p]   = sendCount[p]*sizeof(T);
+    sendOffset[p+1] = sendOffset[p] + sendBytes[p];
+  }
+  MPI_Alltoall(&sendBytes[0], 1, MPI_INT, &recvBytes[0], 1, MPI_INT, MPI_COMM_WORLD);
+  for(int p=0; p < nProcs; p++) recvOffset[p+1] = recvOffset[p] + recvBytes[p];
+
+  recv.resize(recvOffset[nProcs]/sizeof(T));
+  MPI_Alltoallv(send.empty() ? NULL : (void*)&send[0], &sendBytes[0], &sendOffset[0], MPI_BYTE,
+                recv.empty() ? NULL : (void*)&recv[0], &recvBytes[0], &recvOffset[0], MPI_BYTE, MPI_COMM_WORLD);
+  recvCount.resize(nProcs);
+  for(int p=0; p < nProcs; p++) recvCount[p] = recvBytes[p]/sizeof(T);
+}
+#endif
+
+void FOF::reduceAndEmit(const int procId)
+{
+  const double t0     = wtime();
+  const int    n      = label.size();
+  int          nProcs = 1;
+
+  //Global index of the first particle of every process
+  std::vector<long long> offsets(2, 0);
+  offsets[1] = n;
+#ifdef USE_MPI
+  MPI_Comm_size(MPI_COMM_WORLD, &nProcs);
+  if(nProcs > 1)
+  {
+    std::vector<int> counts(nProcs);
+    MPI_Allgather((void*)&n, 1, MPI_INT, &counts[0], 1, MPI_INT, MPI_COMM_WORLD);
+    offsets.assign(nProcs+1, 0);
+    for(int p=0; p < nProcs; p++) offsets[p+1] = offsets[p] + counts[p];
+    for(int i=0; i < n; i++) label[i] += offsets[procId];
+    finder->mergeAcrossProcesses(MPI_COMM_WORLD, linkLength, n > 0 ? &label[0] : NULL);
+    if(kNN > 0) finder->nearestAcrossProcesses(MPI_COMM_WORLD, kNN, n > 0 ? &rk[0] : NULL);
+  }
+#endif
+  const long long offset = offsets[procId];
+
+  //Members per group: groups are summed at their owner, the process that holds
+  //their smallest index. size[i] counts the group with label offset+i
+  std::vector<int> size(n, 0);
+  std::vector<long long> foreign;        //Labels owned by another process
+  for(int i=0; i < n; i++)
+  {
+    const long long l = label[i] - offset;
+    if(l >= 0 && l < n) size[l]++;
+    else                foreign.push_back(label[i]);
+  }
+  std::sort(foreign.begin(), foreign.end());
+
+  //Distinct foreign labels, grouped by owner with their local count
+  std::vector<long long> sendLabels;
+  std::vector<int>       sendSizes, sendCount(nProcs, 0);
+  for(size_t k=0; k < foreign.size(); )
+  {
+    size_t e = k;
+    while(e < foreign.size() && foreign[e] == foreign[k]) e++;
+    sendLabels.push_back(foreign[k]);
+    sendSizes .push_back(e - k);
+    sendCount[std::upper_bound(offsets.begin(), offsets.end(), foreign[k]) - offsets.begin() - 1]++;
+    k = e;
+  }
+
+#ifdef USE_MPI
+  std::vector<long long> recvLabels;
+  std::vector<int>       recvSizes, recvCount;
+  if(nProcs > 1)
+  {
+    exchangeItems(sendLabels, sendCount, recvLabels, recvCount, nProcs);
+    exchangeItems(sendSizes,  sendCount, recvSizes,  recvCount, nProcs);
+    for(size_t k=0; k < recvLabels.size(); k++) size[recvLabels[k] - offset] += recvSizes[k];
+    for(size_t k=0; k < recvLabels.size(); k++) recvSizes[k] = size[recvLabels[k] - offset];
+
+    //The totals go back to the processes that sent the labels
+    std::vector<int> totals, totalCount;
+    exchangeItems(recvSizes, recvCount, totals, totalCount, nProcs);
+    sendSizes = totals;
+  }
+#endif
+
+  //Moments of the groups that are large enough, size[] becomes the group index
+  std::vector<Moments> groups;
+  Moments empty;
+  memset(&empty, 0, sizeof(empty));
+  empty.rkMin = FLT_MAX;
+  for(int l=0; l < n; l++)
+  {
+    if(size[l] < minMembers) { size[l] = -1; continue; }
+    size[l]     = groups.size();
+    empty.label = offset + l;
+    groups.push_back(empty);
+  }
+  std::vector<Moments> foreignGroups;
+  std::vector<int>     foreignCount(nProcs, 0);
+  for(size_t k=0; k < sendLabels.size(); k++)
+  {
+    if(sendSizes[k] < minMembers) { sendSizes[k] = -1; continue; }
+    sendSizes[k] = foreignGroups.size();
+    empty.label  = sendLabels[k];
+    foreignGroups.push_back(empty);
+    foreignCount[std::upper_bound(offsets.begin(), offsets.end(), sendLabels[k]) - offsets.begin() - 1]++;
+  }
+
+  for(int i=0; i < n; i++)
+  {
+    const long long l = label[i] - offset;
+    int g;
+    if(l >= 0 && l < n)
+    {
+      g = size[l];
+      if(g >= 0) add(groups[g], i);
+    }
+    else
+    {
+      const int k = std::lower_bound(sendLabels.begin(), sendLabels.end(), label[i]) - sendLabels.begin();
+      g = sendSizes[k];
+      if(g >= 0) add(foreignGroups[g], i);
+    }
+    if(g < 0) label[i] = -1;
+  }
+
+#ifdef USE_MPI
+  if(nProcs > 1)
+  {
+    std::vector<Moments> recvGroups;
+    std::vector<int>     recvCount;
+    exchangeItems(foreignGroups, foreignCount, recvGroups, recvCount, nProcs);
+    for(size_t k=0; k < recvGroups.size(); k++)
+      add(groups[size[recvGroups[k].label - offset]], recvGroups[k]);
+  }
+#endif
+
+  //Catalogue rows of the groups we own
+  std::vector<long long> groupLabels(groups.size());
+  std::vector<float>     rows(groups.size()*FOF_NCOLUMNS);
+  for(size_t g=0; g < groups.size(); g++)
+  {
+    const Moments &s = groups[g];
+    const double   m = s.m > 0 ? s.m : 1;
+    const double   x = s.mx/m,  y = s.my/m,  z = s.mz/m;
+    const double  vx = s.mvx/m, vy = s.mvy/m, vz = s.mvz/m;
+    float *row = &rows[g*FOF_NCOLUMNS];
+    row[0]  = s.n;
+    row[1]  = s.m;
+    row[2]  = x;   row[3] = y;   row[4] = z;
+    row[5]  = vx;  row[6] = vy;  row[7] = vz;
+    row[8]  = sqrt(std::max(s.mv2/m - (vx*vx + vy*vy + vz*vz), 0.0)/3);
+    row[9]  = sqrt(std::max(s.mr2/m - (x*x + y*y + z*z), 0.0));
+    row[10] = kNN > 0 ? s.xc : x;
+    row[11] = kNN > 0 ? s.yc : y;
+    row[12] = kNN > 0 ? s.zc : z;
+    row[13] = kNN > 0 ? s.rkMin : 0;
+    groupLabels[g] = s.label;
+  }
+
+  //Groups of every process at process 0
+  int nGroups = groups.size();
+#ifdef USE_MPI
+  if(nProcs > 1)
+  {
+    std::vector<int> groupCount(nProcs), groupOffset(nProcs+1, 0);
+    MPI_Gather(&nGroups, 1, MPI_INT, &groupCount[0], 1, MPI_INT, 0, MPI_COMM_WORLD);
+    for(int p=0; p < nProcs; p++) groupOffset[p+1] = groupOffset[p] + groupCount[p];
+    std::vector<long long> allLabels(procId == 0 ? groupOffset[nProcs] : 0);
+    MPI_Gatherv(groupLabels.empty() ? NULL : &groupLabels[0], nGroups, MPI_LONG_LONG,
+                allLabels.empty() ? NULL : &allLabels[0], &groupCount[0], &groupOffset[0],
+                MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+    for(int p=0; p <= nProcs; p++)
+    {
+      if(p < nProcs) groupCount[p] *= FOF_NCOLUMNS;
+      groupOffset[p] *= FOF_NCOLUMNS;
+    }
+    std::vector<float> allRows(procId == 0 ? groupOffset[nProcs] : 0);
+    MPI_Gatherv(rows.empty() ? NULL : &rows[0], nGroups*FOF_NCOLUMNS, MPI_FLOAT,
+                allRows.empty() ? NULL : &allRows[0], &groupCount[0], &groupOffset[0],
+                MPI_FLOAT, 0, MPI_COMM_WORLD);
+    groupLabels.swap(allLabels);
+    rows.swap(allRows);
+    nGroups = groupLabels.size();
+  }
+#endif
+
+  char fileName[256];
+  sprintf(fileName,"%s-%f-%d.bin", baseFilename.c_str(), time, procId);
+  FILE *dump = fopen(fileName, "wb");
+  if(!dump)
+  {
+    LOGF(stderr, "Failed to open output file for fof: %s \n", fileName);
+  }
+  else
+  {
+    const int    header[4] = {STATISTICS_VERSION, n, minMembers, kNN};
+    const double link      = linkLength;
+    fwrite("BFOF", 1, 4, dump);
+    fwrite(header, sizeof(int),    4, dump);
+    fwrite(&time,  sizeof(double), 1, dump);
+    fwrite(&link,  sizeof(double), 1, dump);
+    if(n > 0)
+    {
+      fwrite(ids,       sizeof(int),       n, dump);
+      fwrite(&label[0], sizeof(long long), n, dump);
+      if(kNN > 0) fwrite(&rk[0], sizeof(float), n, dump);
+    }
+    fclose(dump);
+  }
+
+  if(procId != 0) return;
+
+  LOGF(stderr, "FOF at t= %f : %d groups, local linking %g sec, merge and catalogue %g sec\n",
+       time, nGroups, tLocal, wtime() - t0);
+
+  sprintf(fileName,"%s-%f.bin", baseFilename.c_str(), time);
+  dump = fopen(fileName, "wb");
+  if(!dump)
+  {
+    LOGF(stderr, "Failed to open output file for fof: %s \n", fileName);
+    return;
+  }
+  const int header[3] = {STATISTICS_VERSION, nGroups, FOF_NCOLUMNS};
+  fwrite("BFGC", 1, 4, dump);
+  fwrite(header, sizeof(int),    3, dump);
+  fwrite(&time,  sizeof(double), 1, dump);
+  if(nGroups > 0)
+  {
+    fwrite(&groupLabels[0], sizeof(long long), nGroups,   dump);
+    fwrite(&rows[0],        sizeof(float),     rows.size(), dump);
+  }
+  fclose(dump);
+}
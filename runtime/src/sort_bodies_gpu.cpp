@@ -128,6 +128,17 @@ void octree::sort_bodies(tree_structure &tree, bool doDomainUpdate) {
   float domain_fac  = tree.domain_fac;
   
   tree.corner.w = domain_fac;  
+
+#ifdef PERIODIC
+  //The keys have to match the ones of the domain decomposition, which uses
+  //the periodic box and not the bounding box of the particles
+  if(periodicBoxSize > 0)
+  {
+    setPeriodicCorner(tree.corner);
+    tree.domain_fac = domain_fac = tree.corner.w;
+    idomain_fac     = 1.0f/domain_fac;
+  }
+#endif
   
   LOG("Corner: %f %f %f idomain fac: %f domain_fac: %f\n", 
          tree.corner.x, tree.corner.y, tree.corner.z, idomain_fac, domain_fac);
@@ -197,6 +208,8 @@ void octree::sort_bodies(tree_structure &tree, bool doDomainUpdate) {
   else
   {
     oneRunFull = 1;
+    //The DOUBLE_ACCUMULATION low words are not reordered, this first sort
+    //comes before the first predict and they are all still zero
     //Call the reorder data functions
     //First generate some memory buffers
     //generalBuffer is always at least 3xfloat4*N
@@ -0,0 +1,225 @@
+#ifdef USE_MPI
+  #include <mpi.h>
+#endif
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include "log.h"
+#include "telemetry.h"
+
+Telemetry::Telemetry(const std::string &fileName, const int _procId, const int _nProcs,
+                     const int capacity)
+  : procId(_procId), nProcs(_nProcs), ring(capacity), head(0), tail(0),
+    stop(false), dropped(0), history(TELEMETRY_HISTORY), historyCount(0)
+{
+  out    = NULL;
+  binary = false;
+  if(fileName.empty()) return;     //Only the in memory history
+
+  binary = fileName.size() > 4 && fileName.compare(fileName.size()-4, 4, ".bin") == 0;
+
+  //One file per process, the same way the per process snapshots are named
+  std::string name = fileName;
+  if(nProcs > 1)
+  {
+    char buff[16];
+    sprintf(buff, "-%d", procId);
+    name += buff;
+  }
+
+  out = fopen(name.c_str(), binary ? "wb" : "w");
+  if(!out)
+  {
+    LOGF(stderr, "Can not open telemetry file: %s\n", name.c_str());
+#ifdef USE_MPI
+    MPI_Abort(MPI_COMM_WORLD, 1);
+#else
+    exit(1);
+#endif
+  }
+
+  if(binary)
+  {
+    const int header[3] = {TELEMETRY_VERSION, (int)sizeof(TelemetryRecord), TELEMETRY_NREGIONS};
+    fwrite("BTEL", 1, 4, out);
+    fwrite(header, sizeof(int), 3, out);
+  }
+
+  writer = std::thread(&Telemetry::writerLoop, this);
+}
+
+Telemetry::~Telemetry()
+{
+  if(out == NULL) return;
+  stop = true;
+  writer.join();
+  fclose(out);
+  if(dropped > 0)
+    LOGF(stderr, "Telemetry dropped %lld records, the writer could not keep up\n", dropped);
+}
+
+void Telemetry::record(const TelemetryRecord &rec)
+{
+  push(rec);
+  if(nProcs > 1) aggregate(rec);
+}
+
+//Producer side of the ring, the slot is published by the store to head
+void Telemetry::push(const TelemetryRecord &rec)
+{
+  {
+    std::lock_guard<std::mutex> lock(historyMutex);
+    history[historyCount % TELEMETRY_HISTORY] = rec;
+    historyCount++;
+  }
+
+  if(out == NULL) return;
+  const size_t h = head.load(std::memory_order_relaxed);
+  if(h - tail.load(std::memory_order_acquire) >= ring.size())
+  {
+    dropped++;
+    return;
+  }
+  ring[h % ring.size()] = rec;
+  head.store(h+1, std::memory_order_release);
+}
+
+//Combines the records of all processes on process 0. Times are the maximum
+//over the processes, counts are summed
+void Telemetry::aggregate(const TelemetryRecord &rec)
+{
+#ifdef USE_MPI
+  const int nTimes = 8 + TELEMETRY_NREGIONS;
+  double times[nTimes], maxTimes[nTimes];
+  times[0] = rec.stepTime;     times[1] = rec.gravTime;
+  times[2] = rec.buildTime;    times[3] = rec.domainTime;
+  times[4] = rec.waitTime;     times[5] = rec.letCommTime;
+  times[6] = rec.gpuGravLocal; times[7] = rec.gpuGravLET;
+  memcpy(&times[8], rec.regionTime, TELEMETRY_NREGIONS*sizeof(double));
+
+  long long counts[7] = {rec.n, rec.nActive, rec.nDirect, rec.nApprox,
+                         rec.letBytesSent, rec.letBytesRecv, rec.memHighWater};
+  long long sumCounts[7];
+  double    sumStep;
+
+  MPI_Reduce(times,          maxTimes,  nTimes, MPI_DOUBLE,    MPI_MAX, 0, MPI_COMM_WORLD);
+  MPI_Reduce(counts,         sumCounts, 7,      MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(&rec.stepTime,  &sumStep,  1,      MPI_DOUBLE,    MPI_SUM, 0, MPI_COMM_WORLD);
+
+  const int nPerf = PERF_NPHASES*(PERF_NCOUNTERS+1);
+  PerfPhaseCounts sumPerf[PERF_NPHASES];
+  if(PerfCounters::enabled())
+    MPI_Reduce((void*)rec.perf, sumPerf, nPerf, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+
+  if(procId != 0) return;
+
+  TelemetryRecord all = rec;
+  all.rank         = -1;
+  all.stepTime     = maxTimes[0];  all.gravTime     = maxTimes[1];
+  all.buildTime    = maxTimes[2];  all.domainTime   = maxTimes[3];
+  all.waitTime     = maxTimes[4];  all.letCommTime  = maxTimes[5];
+  all.gpuGravLocal = maxTimes[6];  all.gpuGravLET   = maxTimes[7];
+  memcpy(all.regionTime, &maxTimes[8], TELEMETRY_NREGIONS*sizeof(double));
+  all.n            = (int)sumCounts[0];
+  all.nActive      = (int)sumCounts[1];
+  all.nDirect      = sumCounts[2];
+  all.nApprox      = sumCounts[3];
+  all.letBytesSent = sumCounts[4];
+  all.letBytesRecv = sumCounts[5];
+  all.memHighWater = sumCounts[6];
+  all.imbalance    = (sumStep > 0) ? maxTimes[0]/(sumStep/nProcs) : 1;
+  if(PerfCounters::enabled())
+    memcpy(all.perf, sumPerf, sizeof(sumPerf));
+  push(all);
+#endif
+}
+
+void Telemetry::recent(std::vector<TelemetryRecord> &records, const int rank, const int count) const
+{
+  records.clear();
+  std::lock_guard<std::mutex> lock(historyMutex);
+  const size_t n = std::min(historyCount, (size_t)TELEMETRY_HISTORY);
+  for(size_t i=historyCount-n; i < historyCount; i++)
+  {
+    const TelemetryRecord &rec = history[i % TELEMETRY_HISTORY];
+    if(rec.rank == rank) records.push_back(rec);
+  }
+  if((int)records.size() > count)
+    records.erase(records.begin(), records.end()-count);
+}
+
+void Telemetry::writerLoop()
+{
+  while(1)
+  {
+    const bool   finish = stop.load();
+    const size_t h      = head.load(std::memory_order_acquire);
+    size_t       t      = tail.load(std::memory_order_relaxed);
+
+    if(t == h)
+    {
+      if(finish) break;
+      usleep(10000);
+      continue;
+    }
+
+    for(; t != h; t++)
+    {
+      write(ring[t % ring.size()]);
+      tail.store(t+1, std::memory_order_release);
+    }
+    fflush(out);
+  }
+}
+
+void Telemetry::write(const TelemetryRecord &rec)
+{
+  if(binary)
+  {
+    fwrite(&rec, sizeof(TelemetryRecord), 1, out);
+    return;
+  }
+
+  fprintf(out, "{\"iter\":%d,\"rank\":%d,\"n\":%d,\"nActive\":%d,\"t\":%.9g,"
+               "\"step\":%.6g,\"grav\":%.6g,\"build\":%.6g,\"domain\":%.6g,\"wait\":%.6g,\"letComm\":%.6g,"
+               "\"gpuGravLocal\":%.6g,\"gpuGravLET\":%.6g,"
+               "\"direct\":%lld,\"approx\":%lld,\"letBytesSent\":%lld,\"letBytesRecv\":%lld,"
+               "\"memHighWater\":%lld,\"dE\":%.6g",
+               rec.iter, rec.rank, rec.n, rec.nActive, rec.tSim,
+               rec.stepTime, rec.gravTime, rec.buildTime, rec.domainTime, rec.waitTime, rec.letCommTime,
+               rec.gpuGravLocal, rec.gpuGravLET,
+               rec.nDirect, rec.nApprox, rec.letBytesSent, rec.letBytesRecv, rec.memHighWater,
+               rec.energyError);
+  if(rec.rank < 0)
+    fprintf(out, ",\"imbalance\":%.6g", rec.imbalance);
+
+  fprintf(out, ",\"regions\":[");
+  for(int i=0; i < TELEMETRY_NREGIONS; i++)
+    fprintf(out, "%s%.6g", i ? "," : "", rec.regionTime[i]);
+  fprintf(out, "]");
+
+  //IPC and misses per thousand instructions of the host phases that ran this step
+  if(PerfCounters::enabled())
+  {
+    fprintf(out, ",\"perf\":{");
+    bool first = true;
+    for(int i=0; i < PERF_NPHASES; i++)
+    {
+      const PerfPhaseCounts &p = rec.perf[i];
+      if(p.calls == 0) continue;
+
+      const double cycles = p.counts[PERF_CYCLES];
+      const double instr  = p.counts[PERF_INSTRUCTIONS];
+      fprintf(out, "%s\"%s\":{\"calls\":%lld,\"cycles\":%lld,\"instructions\":%lld,"
+                   "\"ipc\":%.4g,\"llcMPKI\":%.4g,\"branchMPKI\":%.4g}",
+                   first ? "" : ",", PerfCounters::phaseName(i), p.calls,
+                   p.counts[PERF_CYCLES], p.counts[PERF_INSTRUCTIONS],
+                   cycles > 0 ? instr / cycles : 0,
+                   instr  > 0 ? 1000.0*p.counts[PERF_LLC_MISSES]    / instr : 0,
+                   instr  > 0 ? 1000.0*p.counts[PERF_BRANCH_MISSES] / instr : 0);
+      first = false;
+    }
+    fprintf(out, "}");
+  }
+  fprintf(out, "}\n");
+}
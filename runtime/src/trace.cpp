@@ -0,0 +1,200 @@
+#ifdef USE_MPI
+  #include <mpi.h>
+#endif
+#include <cstdio>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include "log.h"
+#include "trace.h"
+
+#define TRACE_GPU_TRACK 1000    //Track IDs of the GPU streams start here
+
+struct TraceEvent
+{
+  const char *name;
+  double      begin, end;       //end < 0 for an instant event
+};
+
+struct TraceThreadBuffer
+{
+  int                     track;
+  std::vector<TraceEvent> events;
+};
+
+struct TraceGPUEvent
+{
+  std::string name;             //Copied, the timing region text is not persistent
+  int         track;
+  double      begin, end;
+};
+
+bool Trace::isEnabled = false;
+
+static std::mutex                                traceMutex;
+static std::vector<TraceThreadBuffer*>           traceThreads;
+static std::vector<TraceGPUEvent>                traceGPUEvents;
+static std::map<const void*, std::pair<int, std::string> > traceStreams;
+static std::string                               traceFileName;
+static int                                       traceProcId = 0, traceNProcs = 1;
+static double                                    traceOriginMs = 0;
+static thread_local TraceThreadBuffer           *traceLocal = NULL;
+
+static double traceSteadyMs()
+{
+  return std::chrono::duration<double, std::milli>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//The buffer of the calling thread, registered on first use
+static TraceThreadBuffer *traceBuffer()
+{
+  if(traceLocal == NULL)
+  {
+    std::lock_guard<std::mutex> lock(traceMutex);
+    traceLocal        = new TraceThreadBuffer;
+    traceLocal->track = traceThreads.size();
+    traceLocal->events.reserve(4096);
+    traceThreads.push_back(traceLocal);
+  }
+  return traceLocal;
+}
+
+//Track of a stream, streams that were not named get a number
+static int traceStreamTrack(const void *stream)
+{
+  std::map<const void*, std::pair<int, std::string> >::iterator it = traceStreams.find(stream);
+  if(it != traceStreams.end()) return it->second.first;
+
+  char buff[64];
+  sprintf(buff, "GPU stream %d", (int)traceStreams.size());
+  const int track = TRACE_GPU_TRACK + traceStreams.size();
+  traceStreams[stream] = std::make_pair(track, std::string(stream ? buff : "GPU default stream"));
+  return track;
+}
+
+void Trace::init(const std::string &fileName, const int procId, const int nProcs)
+{
+  if(fileName.empty()) return;
+
+  traceFileName = fileName;
+  traceProcId   = procId;
+  traceNProcs   = nProcs;
+
+#ifdef USE_MPI
+  if(nProcs > 1) MPI_Barrier(MPI_COMM_WORLD);
+#endif
+  traceOriginMs = traceSteadyMs();
+  isEnabled     = true;
+  traceBuffer();              //The main thread is track 0
+}
+
+double Trace::now()
+{
+  return (traceSteadyMs() - traceOriginMs)*1000.0;
+}
+
+void Trace::complete(const char *name, const double begin, const double end)
+{
+  TraceEvent e = {name, begin, end};
+  traceBuffer()->events.push_back(e);
+}
+
+void Trace::instant(const char *name)
+{
+  if(!isEnabled) return;
+  TraceEvent e = {name, now(), -1};
+  traceBuffer()->events.push_back(e);
+}
+
+void Trace::gpuRegion(const char *name, const void *stream, const double startMs, const double endMs)
+{
+  if(!isEnabled) return;
+  std::lock_guard<std::mutex> lock(traceMutex);
+  TraceGPUEvent e;
+  e.name  = name;
+  e.track = traceStreamTrack(stream);
+  e.begin = (startMs - traceOriginMs)*1000.0;
+  e.end   = (endMs   - traceOriginMs)*1000.0;
+  traceGPUEvents.push_back(e);
+}
+
+void Trace::nameStream(const void *stream, const char *name)
+{
+  if(!isEnabled) return;
+  std::lock_guard<std::mutex> lock(traceMutex);
+  traceStreamTrack(stream);
+  traceStreams[stream].second = name;
+}
+
+void Trace::write()
+{
+  if(!isEnabled) return;
+
+  //Second synchronisation point, used to correct the clock drift between processes
+#ifdef USE_MPI
+  if(traceNProcs > 1) MPI_Barrier(MPI_COMM_WORLD);
+#endif
+  const double syncEnd = now();
+
+  std::string name = traceFileName;
+  if(traceNProcs > 1)
+  {
+    char buff[16];
+    sprintf(buff, "-%d", traceProcId);
+    name += buff;
+  }
+
+  FILE *out = fopen(name.c_str(), "w");
+  if(!out)
+  {
+    LOGF(stderr, "Can not open trace file: %s\n", name.c_str());
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(traceMutex);
+
+  const int pid = traceProcId;
+  fprintf(out, "{\"otherData\":{\"rank\":%d,\"nProcs\":%d,\"syncEndUs\":%.3f},\n", pid, traceNProcs, syncEnd);
+  fprintf(out, "\"traceEvents\":[\n");
+  fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"rank %d\"}}", pid, pid);
+
+  for(size_t i=0; i < traceThreads.size(); i++)
+    fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"host thread %d%s\"}}",
+                 pid, traceThreads[i]->track, traceThreads[i]->track, i == 0 ? " (main)" : "");
+
+  std::map<const void*, std::pair<int, std::string> >::const_iterator it;
+  for(it = traceStreams.begin(); it != traceStreams.end(); it++)
+    fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                 pid, it->second.first, it->second.second.c_str());
+
+  for(size_t i=0; i < traceThreads.size(); i++)
+  {
+    const TraceThreadBuffer *buf = traceThreads[i];
+    for(size_t j=0; j < buf->events.size(); j++)
+    {
+      const TraceEvent &e = buf->events[j];
+      if(e.end < 0)
+        fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f}",
+                     e.name, pid, buf->track, e.begin);
+      else
+        fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                     e.name, pid, buf->track, e.begin, e.end - e.begin);
+    }
+  }
+
+  for(size_t i=0; i < traceGPUEvents.size(); i++)
+  {
+    const TraceGPUEvent &e = traceGPUEvents[i];
+    fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                 e.name.c_str(), pid, e.track, e.begin, e.end - e.begin);
+  }
+
+  fprintf(out, "\n]}\n");
+  fclose(out);
+
+  for(size_t i=0; i < traceThreads.size(); i++)
+    traceThreads[i]->events.clear();
+  traceGPUEvents.clear();
+}
@@ -0,0 +1,515 @@
+#include "octree.h"
+#include "devFunctionDefinitions.h"
+
+#ifdef TREEPM
+
+#include "treepm.h"
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
+PMSolver::PMSolver(const int nGrid, const double boxSize, const double rSplit,
+                   const int _procId, const int _nProcs)
+  : N(nGrid), L(boxSize), rs(rSplit*boxSize/nGrid), procId(_procId), nProcs(_nProcs)
+{
+  static bool fftwInitialized = false;
+  if(!fftwInitialized)
+  {
+    fftwf_init_threads();
+#ifdef USE_MPI
+    fftwf_mpi_init();
+#endif
+    fftwInitialized = true;
+  }
+#ifdef _OPENMP
+  fftwf_plan_with_nthreads(omp_get_max_threads());
+#endif
+
+  ptrdiff_t allocLocal;
+#ifdef USE_MPI
+  MPI_Comm_dup(MPI_COMM_WORLD, &comm);
+  allocLocal = fftwf_mpi_local_size_3d(N, N, N/2+1, comm, &localN0, &local0Start);
+#else
+  localN0     = N;
+  local0Start = 0;
+  allocLocal  = (ptrdiff_t)N*N*(N/2+1);
+#endif
+
+  slabReal = fftwf_alloc_real(2*allocLocal);
+  slabK    = fftwf_alloc_complex(allocLocal);
+  slabWork = fftwf_alloc_complex(allocLocal);
+
+#ifdef USE_MPI
+  planForward  = fftwf_mpi_plan_dft_r2c_3d(N, N, N, slabReal, slabK,    comm, FFTW_ESTIMATE);
+  planBackward = fftwf_mpi_plan_dft_c2r_3d(N, N, N, slabWork, slabReal, comm, FFTW_ESTIMATE);
+#else
+  planForward  = fftwf_plan_dft_r2c_3d(N, N, N, slabReal, slabK,    FFTW_ESTIMATE);
+  planBackward = fftwf_plan_dft_c2r_3d(N, N, N, slabWork, slabReal, FFTW_ESTIMATE);
+#endif
+
+  //Owner of every x-plane. FFTW can leave processes without planes, those
+  //never receive particles
+  std::vector<int> starts(nProcs), counts(nProcs);
+  int myStart = local0Start, myCount = localN0;
+#ifdef USE_MPI
+  MPI_Allgather(&myStart, 1, MPI_INT, &starts[0], 1, MPI_INT, comm);
+  MPI_Allgather(&myCount, 1, MPI_INT, &counts[0], 1, MPI_INT, comm);
+#else
+  starts[0] = myStart;
+  counts[0] = myCount;
+#endif
+  planeOwner.resize(N);
+  for(int p=0; p < nProcs; p++)
+    for(int i=starts[p]; i < starts[p] + counts[p]; i++)
+      planeOwner[i] = p;
+
+  prevOwner = planeOwner[(local0Start + N - 1) % N];
+  nextOwner = planeOwner[(local0Start + localN0) % N];
+
+  mesh.resize((size_t)(localN0+1)*N*N);
+  sendCounts.resize(nProcs);
+  sendDispls.resize(nProcs);
+  recvCounts.resize(nProcs);
+  recvDispls.resize(nProcs);
+}
+
+PMSolver::~PMSolver()
+{
+  fftwf_destroy_plan(planForward);
+  fftwf_destroy_plan(planBackward);
+  fftwf_free(slabReal);
+  fftwf_free(slabK);
+  fftwf_free(slabWork);
+#ifdef USE_MPI
+  MPI_Comm_free(&comm);
+#endif
+}
+
+//Mesh plane left of (or at) x, mesh point i sits at -L/2 + i*h
+int PMSolver::ownerPlane(const float x) const
+{
+  double u = (x + 0.5*L)*N/L;
+  u -= N*floor(u/N);
+  int i = (int)u;
+  if(i >= N) i -= N;
+  return i;
+}
+
+//Sends the particles and tracers to the owners of their planes. sendSlot
+//remembers where each one went so returnAcc can put the results back
+void PMSolver::exchangeParticles(const real4 *pos, const int n, const real4 *tracerPos, const int nTracer)
+{
+  const int nTotal = n + nTracer;
+  std::vector<int> dest(nTotal);
+  std::fill(sendCounts.begin(), sendCounts.end(), 0);
+  for(int p=0; p < nTotal; p++)
+  {
+    const float x = (p < n) ? pos[p].x : tracerPos[p-n].x;
+    dest[p]       = planeOwner[ownerPlane(x)];
+    sendCounts[dest[p]]++;
+  }
+  sendDispls[0] = 0;
+  for(int i=1; i < nProcs; i++)
+    sendDispls[i] = sendDispls[i-1] + sendCounts[i-1];
+
+  sendPos.resize(nTotal);
+  sendSlot.resize(nTotal);
+  std::vector<int> fill(sendDispls);
+  for(int p=0; p < nTotal; p++)
+  {
+    const int slot = fill[dest[p]]++;
+    sendSlot[p]    = slot;
+    if(p < n)
+      sendPos[slot] = pos[p];
+    else
+    {
+      sendPos[slot]   = tracerPos[p-n];
+      sendPos[slot].w = 0;
+    }
+  }
+
+#ifdef USE_MPI
+  MPI_Alltoall(&sendCounts[0], 1, MPI_INT, &recvCounts[0], 1, MPI_INT, comm);
+  recvDispls[0] = 0;
+  for(int i=1; i < nProcs; i++)
+    recvDispls[i] = recvDispls[i-1] + recvCounts[i-1];
+  recvPos.resize(recvDispls[nProcs-1] + recvCounts[nProcs-1]);
+
+  //Counts in floats, four per particle
+  std::vector<int> sc(nProcs), sd(nProcs), rc(nProcs), rd(nProcs);
+  for(int i=0; i < nProcs; i++)
+  {
+    sc[i] = 4*sendCounts[i]; sd[i] = 4*sendDispls[i];
+    rc[i] = 4*recvCounts[i]; rd[i] = 4*recvDispls[i];
+  }
+  MPI_Alltoallv(sendPos.empty() ? NULL : &sendPos[0], &sc[0], &sd[0], MPI_FLOAT,
+                recvPos.empty() ? NULL : &recvPos[0], &rc[0], &rd[0], MPI_FLOAT, comm);
+#else
+  recvCounts[0] = sendCounts[0];
+  recvDispls[0] = 0;
+  recvPos       = sendPos;
+#endif
+  recvAcc.resize(recvPos.size());
+}
+
+//Sends the interpolated accelerations back along the reverse route
+void PMSolver::returnAcc(real4 *acc, const int n, real4 *tracerAcc, const int nTracer)
+{
+  sendAcc.resize(sendPos.size());
+#ifdef USE_MPI
+  std::vector<int> sc(nProcs), sd(nProcs), rc(nProcs), rd(nProcs);
+  for(int i=0; i < nProcs; i++)
+  {
+    sc[i] = 4*sendCounts[i]; sd[i] = 4*sendDispls[i];
+    rc[i] = 4*recvCounts[i]; rd[i] = 4*recvDispls[i];
+  }
+  MPI_Alltoallv(recvAcc.empty() ? NULL : &recvAcc[0], &rc[0], &rd[0], MPI_FLOAT,
+                sendAcc.empty() ? NULL : &sendAcc[0], &sc[0], &sd[0], MPI_FLOAT, comm);
+#else
+  sendAcc = recvAcc;
+#endif
+
+  for(int p=0; p < n; p++)       acc[p]       = sendAcc[sendSlot[p]];
+  for(int p=0; p < nTracer; p++) tracerAcc[p] = sendAcc[sendSlot[n+p]];
+}
+
+//Cloud in cell assignment of the received masses to the slab. The plane
+//right of the slab is the ghost plane, it belongs to nextOwner
+void PMSolver::assignMass()
+{
+  const double invH = N/L;
+  std::fill(mesh.begin(), mesh.end(), 0.0f);
+
+  #pragma omp parallel for
+  for(int p=0; p < (int)recvPos.size(); p++)
+  {
+    if(recvPos[p].w == 0) continue;
+
+    int    i[3];
+    double d[3];
+    const double x[3] = {recvPos[p].x, recvPos[p].y, recvPos[p].z};
+    for(int c=0; c < 3; c++)
+    {
+      double u = (x[c] + 0.5*L)*invH;
+      u   -= N*floor(u/N);
+      i[c] = (int)u;
+      d[c] = u - i[c];
+      if(i[c] >= N) { i[c] -= N; }
+    }
+    i[0] -= local0Start;
+
+    for(int c=0; c < 8; c++)
+    {
+      const int a = (c >> 2) & 1, b = (c >> 1) & 1, e = c & 1;
+      const float w = recvPos[p].w*(a ? d[0] : 1-d[0])*(b ? d[1] : 1-d[1])*(e ? d[2] : 1-d[2]);
+      const size_t idx = ((size_t)(i[0]+a)*N + (i[1]+b) % N)*N + (i[2]+e) % N;
+      #pragma omp atomic
+      mesh[idx] += w;
+    }
+  }
+}
+
+//Adds the ghost plane of the left neighbour to the first plane of the slab
+//and sends our own ghost plane to the right
+void PMSolver::addGhostPlane()
+{
+  if(localN0 == 0) return;
+
+  const size_t plane = (size_t)N*N;
+  std::vector<float> ghost(plane);
+#ifdef USE_MPI
+  MPI_Sendrecv(&mesh[localN0*plane], plane, MPI_FLOAT, nextOwner, 0,
+               &ghost[0],            plane, MPI_FLOAT, prevOwner, 0, comm, MPI_STATUS_IGNORE);
+#else
+  std::copy(mesh.begin() + localN0*plane, mesh.end(), ghost.begin());
+#endif
+  #pragma omp parallel for
+  for(int i=0; i < (int)plane; i++)
+    mesh[i] += ghost[i];
+}
+
+//Copies the first plane of the right neighbour in the ghost plane, needed
+//by the interpolation of particles in the last plane of the slab
+void PMSolver::fillGhostPlane()
+{
+  if(localN0 == 0) return;
+
+  const size_t plane = (size_t)N*N;
+#ifdef USE_MPI
+  MPI_Sendrecv(&mesh[0],              plane, MPI_FLOAT, prevOwner, 1,
+               &mesh[localN0*plane],  plane, MPI_FLOAT, nextOwner, 1, comm, MPI_STATUS_IGNORE);
+#else
+  std::copy(mesh.begin(), mesh.begin() + plane, mesh.begin() + localN0*plane);
+#endif
+}
+
+//Puts the slab in the padded FFTW layout
+void PMSolver::meshToSlab()
+{
+  const int rowPad = 2*(N/2+1);
+  #pragma omp parallel for
+  for(int r=0; r < localN0*N; r++)
+    for(int k=0; k < N; k++)
+      slabReal[(size_t)r*rowPad + k] = mesh[(size_t)r*N + k];
+}
+
+//And back, the ghost plane is filled by fillGhostPlane
+void PMSolver::slabToMesh()
+{
+  const int rowPad = 2*(N/2+1);
+  #pragma omp parallel for
+  for(int r=0; r < localN0*N; r++)
+    for(int k=0; k < N; k++)
+      mesh[(size_t)r*N + k] = slabReal[(size_t)r*rowPad + k];
+}
+
+//Turns the transformed mass into the transformed long range potential.
+//FFTW transforms are unnormalized, the 1/L^3 makes the inverse transform
+//the potential of the masses
+void PMSolver::applyGreens()
+{
+  const double kf   = 2.0*M_PI/L;
+  const double norm = 1.0/(L*L*L);
+
+  #pragma omp parallel for
+  for(int i=0; i < localN0; i++)
+  {
+    const int    ix = local0Start + i;
+    const int    sx = (ix <= N/2) ? ix : ix - N;
+    const double wx = (sx == 0) ? 1.0 : sin(M_PI*sx/N)/(M_PI*sx/N);
+    for(int j=0; j < N; j++)
+    {
+      const int    sy = (j <= N/2) ? j : j - N;
+      const double wy = (sy == 0) ? 1.0 : sin(M_PI*sy/N)/(M_PI*sy/N);
+      for(int k=0; k <= N/2; k++)
+      {
+        const double wz  = (k == 0) ? 1.0 : sin(M_PI*k/N)/(M_PI*k/N);
+        const size_t idx = ((size_t)i*N + j)*(N/2+1) + k;
+
+        const double k2  = kf*kf*((double)sx*sx + (double)sy*sy + (double)k*k);
+        double green = 0;
+        if(k2 > 0)
+        {
+          //CIC window of the assignment and the interpolation
+          const double w  = wx*wx*wy*wy*wz*wz;
+          green = -4.0*M_PI/k2*exp(-k2*rs*rs)/(w*w)*norm;
+        }
+        slabK[idx][0] *= green;
+        slabK[idx][1] *= green;
+      }
+    }
+  }
+}
+
+//CIC interpolation of the slab into component (0..2 acceleration, 3
+//potential) of the received particles
+void PMSolver::interpolate(const int component)
+{
+  const double invH = N/L;
+
+  #pragma omp parallel for
+  for(int p=0; p < (int)recvPos.size(); p++)
+  {
+    int    i[3];
+    double d[3];
+    const double x[3] = {recvPos[p].x, recvPos[p].y, recvPos[p].z};
+    for(int c=0; c < 3; c++)
+    {
+      double u = (x[c] + 0.5*L)*invH;
+      u   -= N*floor(u/N);
+      i[c] = (int)u;
+      d[c] = u - i[c];
+      if(i[c] >= N) { i[c] -= N; }
+    }
+    i[0] -= local0Start;
+
+    double val = 0;
+    for(int c=0; c < 8; c++)
+    {
+      const int a = (c >> 2) & 1, b = (c >> 1) & 1, e = c & 1;
+      const double w = (a ? d[0] : 1-d[0])*(b ? d[1] : 1-d[1])*(e ? d[2] : 1-d[2]);
+      val += w*mesh[((size_t)(i[0]+a)*N + (i[1]+b) % N)*N + (i[2]+e) % N];
+    }
+
+    switch(component)
+    {
+      case 0: recvAcc[p].x = val; break;
+      case 1: recvAcc[p].y = val; break;
+      case 2: recvAcc[p].z = val; break;
+      case 3: recvAcc[p].w = val; break;
+    }
+  }
+}
+
+void PMSolver::compute(const real4 *pos,       const int n,       real4 *acc,
+                       const real4 *tracerPos, const int nTracer, real4 *tracerAcc)
+{
+  exchangeParticles(pos, n, tracerPos, nTracer);
+  assignMass();
+  addGhostPlane();
+  meshToSlab();
+  fftwf_execute(planForward);
+  applyGreens();
+
+  const double kf = 2.0*M_PI/L;
+  for(int comp=0; comp < 4; comp++)
+  {
+    //The acceleration is -grad(phi), which is -i k phi in k-space. The
+    //Nyquist plane has no well defined derivative and is left out
+    #pragma omp parallel for
+    for(int i=0; i < localN0; i++)
+    {
+      const int sx = ((local0Start + i) <= N/2) ? (local0Start + i) : (local0Start + i) - N;
+      for(int j=0; j < N; j++)
+      {
+        const int sy = (j <= N/2) ? j : j - N;
+        for(int k=0; k <= N/2; k++)
+        {
+          const size_t idx = ((size_t)i*N + j)*(N/2+1) + k;
+          if(comp == 3)
+          {
+            slabWork[idx][0] = slabK[idx][0];
+            slabWork[idx][1] = slabK[idx][1];
+            continue;
+          }
+          const int    s  = (comp == 0) ? sx : ((comp == 1) ? sy : k);
+          const double kc = (2*abs(s) == N) ? 0.0 : kf*s;
+          slabWork[idx][0] =  kc*slabK[idx][1];
+          slabWork[idx][1] = -kc*slabK[idx][0];
+        }
+      }
+    }
+
+    fftwf_execute(planBackward);
+    slabToMesh();
+    fillGhostPlane();
+    interpolate(comp);
+  }
+
+  returnAcc(acc, n, tracerAcc, nTracer);
+}
+
+
+//Set up of the mesh part, called from load_kernels once the periodic box is known
+void octree::initTreePM()
+{
+  if(pmGrid <= 0) return;
+
+  if(periodicBoxSize <= 0)
+  {
+    LOGF(stderr, "--pmgrid requires a periodic box (--periodic), mesh disabled\n");
+    pmGrid = 0;
+    return;
+  }
+
+  pmSolver = new PMSolver(pmGrid, periodicBoxSize, pmSplit, procId, nProcs);
+
+  if(pmSolver->getRcut() >= 0.5*periodicBoxSize)
+  {
+    LOGF(stderr, "TreePM cutoff %f does not fit in half the box, increase --pmgrid or reduce --rsplit\n",
+         pmSolver->getRcut());
+#ifdef USE_MPI
+    MPI_Abort(MPI_COMM_WORLD, 1);
+#else
+    exit(1);
+#endif
+  }
+
+  gpu_setTreePMSplit(pmSolver->getRs(), pmSolver->getRcut());
+
+  //The mesh runs on its own host thread next to the tree walk and makeLET.
+  //With more than one process that needs MPI_THREAD_MULTIPLE, otherwise it
+  //runs on the main thread after makeLET
+  pmThreaded = true;
+#ifdef USE_MPI
+  int provided;
+  MPI_Query_thread(&provided);
+  int threaded = (nProcs == 1 || provided == MPI_THREAD_MULTIPLE);
+  MPI_Allreduce(MPI_IN_PLACE, &threaded, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+  pmThreaded = threaded;
+#endif
+
+  if(procId == 0)
+    LOGF(stderr, "TreePM mesh: %d^3\trs: %f\trcut: %f\tthreaded: %d\n",
+         pmGrid, pmSolver->getRs(), pmSolver->getRcut(), (int)pmThreaded);
+}
+
+//Long range force of the current predicted positions. Called after the
+//host copy of bodies_Ppos (and of the predicted dust) is made, starts the
+//mesh on pmThread so it runs on the host cores while the GPU computes the
+//short range part. pm_addForces joins it
+void octree::pm_gravity(tree_structure &tree)
+{
+  pmAcc.resize(tree.n);
+  pmDustAcc.clear();
+#ifdef USE_DUST
+  if(tree.n_dust > 0)
+  {
+    tree.dust_pos.d2h(tree.n_dust);
+    pmDustAcc.resize(tree.n_dust);
+  }
+#endif
+
+  if(pmThreaded)
+    pmThread = std::thread(&octree::pm_compute, this, &tree);
+}
+
+void octree::pm_compute(tree_structure *tree)
+{
+  double t0 = get_time();
+#ifdef USE_DUST
+  const real4 *dustPos = pmDustAcc.empty() ? NULL : &tree->dust_pos[0];
+#else
+  const real4 *dustPos = NULL;
+#endif
+  pmSolver->compute(pmAcc.empty() ? NULL : &tree->bodies_Ppos[0], (int)pmAcc.size(),
+                    pmAcc.empty() ? NULL : &pmAcc[0],
+                    dustPos, (int)pmDustAcc.size(), pmDustAcc.empty() ? NULL : &pmDustAcc[0]);
+  pmTime = get_time() - t0;
+}
+
+//Without a mesh thread this is where the mesh runs, after makeLET
+void octree::pm_wait()
+{
+  if(pmThreaded)
+    pmThread.join();
+  else
+    pm_compute(&localTree);
+  LOG("PM time: %lg \n", pmTime);
+}
+
+//Adds the mesh force to the tree force once the walk has finished. The dust
+//only gets it where approximate_dust just wrote a new acceleration
+void octree::pm_addForces(tree_structure &tree)
+{
+  pm_wait();
+
+#ifdef USE_DUST
+  if(!pmDustAcc.empty())
+  {
+    tree.dust_acc1.d2h(tree.n_dust);
+    tree.active_dust_list.d2h(tree.n_dust);
+    for(int i=0; i < tree.n_dust; i++)
+    {
+      if(tree.active_dust_list[i] != 1) continue;
+      tree.dust_acc1[i].x += pmDustAcc[i].x;
+      tree.dust_acc1[i].y += pmDustAcc[i].y;
+      tree.dust_acc1[i].z += pmDustAcc[i].z;
+      tree.dust_acc1[i].w += pmDustAcc[i].w;
+    }
+    tree.dust_acc1.h2d(tree.n_dust);
+  }
+#endif
+
+  tree.bodies_acc1.d2h();
+  for(int i=0; i < tree.n; i++)
+  {
+    tree.bodies_acc1[i].x += pmAcc[i].x;
+    tree.bodies_acc1[i].y += pmAcc[i].y;
+    tree.bodies_acc1[i].z += pmAcc[i].z;
+    tree.bodies_acc1[i].w += pmAcc[i].w;
+  }
+  tree.bodies_acc1.h2d();
+}
+
+#endif
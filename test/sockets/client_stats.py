@@ -0,0 +1,30 @@
+import json
+import socket
+import sys
+import time
+
+# Polls the stats endpoint of a running simulation (bonsai2 --stats-port 50010)
+# usage: python client_stats.py [host] [port] [interval in seconds]
+
+HOST = sys.argv[1] if len(sys.argv) > 1 else 'localhost'
+PORT = int(sys.argv[2]) if len(sys.argv) > 2 else 50010
+INTERVAL = float(sys.argv[3]) if len(sys.argv) > 3 else 5.0
+BUFFERSIZE = 65536
+
+s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+s.connect((HOST, PORT))
+
+while 1:
+    s.send(json.dumps({'task': 'stats'}).encode())
+    stats = json.loads(s.recv(BUFFERSIZE).decode())
+
+    if stats['steps'] > 0:
+        last = stats['last']
+        phases = stats['phases']
+        print("iter %d  t= %g  %.3f steps/s  %.4g particle-steps/s  imbalance %.3f  "
+              "grav %.3f build %.3f domain %.3f wait %.3f  mem %.1f MB  dE %.3g" %
+              (last['iter'], last['time'], stats['step_rate'], stats['particle_steps_per_second'],
+               stats['imbalance'], phases['grav'], phases['build'], phases['domain'], phases['wait'],
+               last['memory'] / 1048576.0, last['energy_error']))
+    sys.stdout.flush()
+    time.sleep(INTERVAL)
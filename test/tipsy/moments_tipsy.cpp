@@ -0,0 +1,119 @@
+#include <cmath>
+#include <iostream>
+#include "tipsy_stream.h"
+
+// Mass weighted first and second moments of the positions, relative to an
+// origin near the particles
+struct moments
+{
+    explicit moments(double const* origin) : com(origin)
+    {
+        for (int k = 0; k < DIM * DIM; ++k) second[k] = 0.0;
+    }
+
+    template <class Particle>
+    void operator()(Particle const& p)
+    {
+        com(p);
+        double x[DIM];
+        for (int k = 0; k < DIM; ++k) x[k] = p.pos[k] - com.origin[k];
+        for (int i = 0; i < DIM; ++i)
+            for (int j = 0; j < DIM; ++j) second[i * DIM + j] += p.mass * x[i] * x[j];
+    }
+
+    moments& operator+=(moments const& other)
+    {
+        com += other.com;
+        for (int k = 0; k < DIM * DIM; ++k) second[k] += other.second[k];
+        return *this;
+    }
+
+    center_of_mass com;
+    double second[DIM * DIM];
+};
+
+// Eigenvalues and eigenvectors (columns of v) of the symmetric matrix a with
+// Jacobi rotations
+static void eigen_symmetric(double a[DIM][DIM], double d[DIM], double v[DIM][DIM])
+{
+    for (int i = 0; i < DIM; ++i)
+        for (int j = 0; j < DIM; ++j) v[i][j] = i == j ? 1.0 : 0.0;
+
+    for (int sweep = 0; sweep < 50; ++sweep)
+    {
+        double off = 0.0;
+        for (int p = 0; p < DIM; ++p)
+            for (int q = p + 1; q < DIM; ++q) off += a[p][q] * a[p][q];
+        if (off < 1e-30) break;
+
+        for (int p = 0; p < DIM; ++p)
+            for (int q = p + 1; q < DIM; ++q)
+            {
+                if (a[p][q] == 0.0) continue;
+                double theta = 0.5 * (a[q][q] - a[p][p]) / a[p][q];
+                double t = (theta >= 0 ? 1.0 : -1.0) / (std::fabs(theta) + std::sqrt(theta * theta + 1.0));
+                double c = 1.0 / std::sqrt(t * t + 1.0);
+                double s = t * c;
+                for (int k = 0; k < DIM; ++k) {
+                    double akp = a[k][p], akq = a[k][q];
+                    a[k][p] = c * akp - s * akq;
+                    a[k][q] = s * akp + c * akq;
+                }
+                for (int k = 0; k < DIM; ++k) {
+                    double apk = a[p][k], aqk = a[q][k];
+                    a[p][k] = c * apk - s * aqk;
+                    a[q][k] = s * apk + c * aqk;
+                }
+                for (int k = 0; k < DIM; ++k) {
+                    double vkp = v[k][p], vkq = v[k][q];
+                    v[k][p] = c * vkp - s * vkq;
+                    v[k][q] = s * vkp + c * vkq;
+                }
+            }
+    }
+    for (int i = 0; i < DIM; ++i) d[i] = a[i][i];
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2) {
+        std::cout << "Usage: " << argv[0] << " <file>" << std::endl;
+        std::cout << "Prints the centre of mass, the mean velocity and the moment of inertia" << std::endl;
+        std::cout << "tensor about the centre of mass with its principal axes" << std::endl;
+        return 1;
+    }
+
+    try {
+        tipsy_reader reader(argv[1]);
+        std::vector<double> origin = tipsy_first_position(reader);
+        moments m = tipsy_reduce(reader, moments(&origin[0]));
+
+        center_of_mass const& com = m.com;
+        std::cout << "nbodies = " << com.n << " mass = " << com.mass << std::endl;
+        std::cout << "center = " << com.position(0) << " " << com.position(1) << " " << com.position(2) << std::endl;
+        std::cout << "velocity = " << com.velocity(0) << " " << com.velocity(1) << " " << com.velocity(2) << std::endl;
+
+        // Second moments about the centre of mass, then I = tr(S) 1 - S
+        double c[DIM], s[DIM][DIM], inertia[DIM][DIM];
+        for (int k = 0; k < DIM; ++k) c[k] = com.mass > 0 ? com.mpos[k] / com.mass : 0.0;
+        for (int i = 0; i < DIM; ++i)
+            for (int j = 0; j < DIM; ++j) s[i][j] = m.second[i * DIM + j] - com.mass * c[i] * c[j];
+        double trace = s[0][0] + s[1][1] + s[2][2];
+        for (int i = 0; i < DIM; ++i)
+            for (int j = 0; j < DIM; ++j) inertia[i][j] = (i == j ? trace : 0.0) - s[i][j];
+
+        std::cout << "inertia =" << std::endl;
+        for (int i = 0; i < DIM; ++i)
+            std::cout << "  " << inertia[i][0] << " " << inertia[i][1] << " " << inertia[i][2] << std::endl;
+
+        double eigenvalues[DIM], axes[DIM][DIM];
+        eigen_symmetric(inertia, eigenvalues, axes);
+        for (int k = 0; k < DIM; ++k)
+            std::cout << "principal moment " << eigenvalues[k] << " axis "
+                      << axes[0][k] << " " << axes[1][k] << " " << axes[2][k] << std::endl;
+    }
+    catch (std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,106 @@
+#include <cmath>
+#include <iostream>
+#include <string>
+#include "tipsy_stream.h"
+
+// Spherical shells of width rmax/nbins around a centre
+struct radial_profile
+{
+    enum { N_DARK, M_DARK, N_STAR, M_STAR, M_VR, M_VR2, NCOLUMNS };
+
+    radial_profile(int nbins, double rmax, double const* center, double const* velocity)
+     : nbins(nbins), rmax(rmax), bins(nbins * NCOLUMNS, 0.0)
+    {
+        for (int k = 0; k < DIM; ++k) {
+            this->center[k] = center[k];
+            this->velocity[k] = velocity[k];
+        }
+    }
+
+    void operator()(dark_particle const& d) { add(d, N_DARK); }
+    void operator()(star_particle const& s) { add(s, N_STAR); }
+
+    template <class Particle>
+    void add(Particle const& p, int column)
+    {
+        double x[DIM], v[DIM], r2 = 0.0;
+        for (int k = 0; k < DIM; ++k) {
+            x[k] = p.pos[k] - center[k];
+            v[k] = p.vel[k] - velocity[k];
+            r2 += x[k] * x[k];
+        }
+        double r = std::sqrt(r2);
+        int bin = static_cast<int>(r / rmax * nbins);
+        if (bin >= nbins) return;
+
+        double vr = r > 0 ? (x[0] * v[0] + x[1] * v[1] + x[2] * v[2]) / r : 0.0;
+        double* b = &bins[bin * NCOLUMNS];
+        b[column] += 1;
+        b[column + 1] += p.mass;
+        b[M_VR] += p.mass * vr;
+        b[M_VR2] += p.mass * vr * vr;
+    }
+
+    radial_profile& operator+=(radial_profile const& other)
+    {
+        for (size_t i = 0; i < bins.size(); ++i) bins[i] += other.bins[i];
+        return *this;
+    }
+
+    int nbins;
+    double rmax;
+    double center[DIM], velocity[DIM];
+    std::vector<double> bins;
+};
+
+int main(int argc, char** argv)
+{
+    if (argc != 3 && argc != 4 && argc != 7) {
+        std::cout << "Usage: " << argv[0] << " <file> <rmax> [nbins, default 100] [x y z]" << std::endl;
+        std::cout << "Radial profiles around the centre of mass or (x,y,z), in the units of the file:" << std::endl;
+        std::cout << "r n_dark m_dark rho_dark n_star m_star rho_star vr sigma_r vcirc (G = 1)" << std::endl;
+        return 1;
+    }
+
+    try {
+        double rmax = std::stod(argv[2]);
+        int nbins = argc >= 4 ? std::stoi(argv[3]) : 100;
+        if (rmax <= 0 || nbins < 1) throw std::runtime_error("rmax and nbins must be positive");
+
+        tipsy_reader reader(argv[1]);
+        std::vector<double> origin = tipsy_first_position(reader);
+        center_of_mass com = tipsy_reduce(reader, center_of_mass(&origin[0]));
+
+        double center[DIM], velocity[DIM];
+        for (int k = 0; k < DIM; ++k) {
+            center[k] = argc == 7 ? std::stod(argv[4 + k]) : com.position(k);
+            velocity[k] = com.velocity(k);
+        }
+
+        radial_profile profile = tipsy_reduce(reader, radial_profile(nbins, rmax, center, velocity));
+
+        double const dr = rmax / nbins;
+        double enclosed = 0.0;
+        for (int i = 0; i < nbins; ++i)
+        {
+            double const* b = &profile.bins[i * radial_profile::NCOLUMNS];
+            double r0 = i * dr, r1 = (i + 1) * dr;
+            double volume = 4.0 / 3.0 * M_PI * (r1 * r1 * r1 - r0 * r0 * r0);
+            double mass = b[radial_profile::M_DARK] + b[radial_profile::M_STAR];
+            double vr = mass > 0 ? b[radial_profile::M_VR] / mass : 0.0;
+            double sigma = mass > 0 ? std::sqrt(std::max(b[radial_profile::M_VR2] / mass - vr * vr, 0.0)) : 0.0;
+            enclosed += mass;
+
+            std::cout << 0.5 * (r0 + r1) << " "
+                      << b[radial_profile::N_DARK] << " " << b[radial_profile::M_DARK] << " "
+                      << b[radial_profile::M_DARK] / volume << " "
+                      << b[radial_profile::N_STAR] << " " << b[radial_profile::M_STAR] << " "
+                      << b[radial_profile::M_STAR] / volume << " "
+                      << vr << " " << sigma << " " << std::sqrt(enclosed / r1) << std::endl;
+        }
+    }
+    catch (std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
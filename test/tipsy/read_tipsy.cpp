@@ -1,66 +1,126 @@
-#include "tipsy.h"
-#include <fstream>
+#include "tipsy_stream.h"
+#include <cfloat>
+#include <climits>
+#include <cstring>
 #include <iostream>
-#include <set>
 
-int main(int argc, char** argv)
+// Count, mass, ID range and bounding box of one species
+struct species_summary
 {
-    std::ifstream is(argv[1], std::ios::binary);
-
-    head h;
-    is.read((char*) &h, sizeof(h));
+    species_summary()
+     : n(0), mass(0.0), phi_min(INT_MAX), phi_max(INT_MIN)
+    {
+        for (int k = 0; k < DIM; ++k) {
+            min[k] = FLT_MAX;
+            max[k] = -FLT_MAX;
+        }
+    }
 
-    std::cout << "time = " << h.time << std::endl;    
-    std::cout << "nbodies = " << h.nbodies << std::endl;    
-    std::cout << "ndim = " << h.ndim << std::endl;    
-    std::cout << "nsph = " << h.nsph << std::endl;    
-    std::cout << "ndark = " << h.ndark << std::endl;    
-    std::cout << "nstar= " << h.nstar << std::endl;    
+    template <class Particle>
+    void add(Particle const& p)
+    {
+        n += 1;
+        mass += p.mass;
+        phi_min = std::min(phi_min, p.phi);
+        phi_max = std::max(phi_max, p.phi);
+        for (int k = 0; k < DIM; ++k) {
+            min[k] = std::min(min[k], p.pos[k]);
+            max[k] = std::max(max[k], p.pos[k]);
+        }
+    }
 
-    // dark particles
-    std::set<int> dark_phis;
+    species_summary& operator+=(species_summary const& other)
+    {
+        n += other.n;
+        mass += other.mass;
+        phi_min = std::min(phi_min, other.phi_min);
+        phi_max = std::max(phi_max, other.phi_max);
+        for (int k = 0; k < DIM; ++k) {
+            min[k] = std::min(min[k], other.min[k]);
+            max[k] = std::max(max[k], other.max[k]);
+        }
+        return *this;
+    }
 
-    for (int i = 0; i != h.ndark; ++i)
+    void print(std::ostream& os, const char* name) const
     {
-        dark_particle d;
-        is.read((char*) &d, sizeof(d));
-        std::cout << d.mass << " "
-                  << d.pos[0] << " "
-                  << d.pos[1] << " "
-                  << d.pos[2] << " "
-                  << d.vel[0] << " "
-                  << d.vel[1] << " "
-                  << d.vel[2] << " "
-                  << d.eps << " "
-                  << d.phi << std::endl;
-        dark_phis.insert(d.phi);
+        os << name << ": n = " << n << " mass = " << mass;
+        if (n == 0) {
+            os << std::endl;
+            return;
+        }
+        os << " phi = [" << phi_min << ", " << phi_max << "]"
+           << " box = [" << min[0] << ", " << max[0] << "] x ["
+                         << min[1] << ", " << max[1] << "] x ["
+                         << min[2] << ", " << max[2] << "]" << std::endl;
     }
 
-    std::cout << "dark_phis.size() = " << dark_phis.size() << std::endl;
-    //for (auto p : dark_phis) std::cout << p << std::endl;
+    long n;
+    double mass;
+    int phi_min, phi_max;
+    float min[DIM], max[DIM];
+};
 
-    // star particles
-    std::set<int> star_phis;
+struct summary
+{
+    void operator()(dark_particle const& d) { dark.add(d); }
+    void operator()(star_particle const& s) { star.add(s); }
 
-    for (int i = 0; i != h.nstar; ++i)
+    summary& operator+=(summary const& other)
     {
-        star_particle s;
-        is.read((char*) &s, sizeof(s));
-        std::cout << s.mass << " "
-                  << s.pos[0] << " "
-                  << s.pos[1] << " "
-                  << s.pos[2] << " "
-                  << s.vel[0] << " "
-                  << s.vel[1] << " "
-                  << s.vel[2] << " "
-                  << s.metals << " "
-                  << s.tform << " "
-                  << s.eps << " "
-                  << s.phi << std::endl;
-        star_phis.insert(s.phi);
+        dark += other.dark;
+        star += other.star;
+        return *this;
     }
 
-    std::cout << "star_phis.size() = " << star_phis.size() << std::endl;
-    //for (auto s : star_phis) std::cout << s << std::endl;
-}
+    species_summary dark, star;
+};
 
+int main(int argc, char** argv)
+{
+    if (argc < 2 || argc > 3 || (argc == 3 && strcmp(argv[2], "--print") != 0)) {
+        std::cout << "Usage: " << argv[0] << " <file> [--print]" << std::endl;
+        return 1;
+    }
+
+    try {
+        tipsy_reader reader(argv[1]);
+        head const& h = reader.header();
+
+        std::cout << "time = " << h.time << std::endl;
+        std::cout << "nbodies = " << h.nbodies << std::endl;
+        std::cout << "ndim = " << h.ndim << std::endl;
+        std::cout << "nsph = " << h.nsph << std::endl;
+        std::cout << "ndark = " << h.ndark << std::endl;
+        std::cout << "nstar= " << h.nstar << std::endl;
+
+        if (argc == 3) {
+            // One line per particle, in file order
+            reader.for_each_chunk<dark_particle>([](dark_particle const* d, size_t n, size_t)
+            {
+                for (size_t i = 0; i != n; ++i)
+                    std::cout << d[i].mass << " "
+                              << d[i].pos[0] << " " << d[i].pos[1] << " " << d[i].pos[2] << " "
+                              << d[i].vel[0] << " " << d[i].vel[1] << " " << d[i].vel[2] << " "
+                              << d[i].eps << " " << d[i].phi << "\n";
+            });
+            reader.for_each_chunk<star_particle>([](star_particle const* s, size_t n, size_t)
+            {
+                for (size_t i = 0; i != n; ++i)
+                    std::cout << s[i].mass << " "
+                              << s[i].pos[0] << " " << s[i].pos[1] << " " << s[i].pos[2] << " "
+                              << s[i].vel[0] << " " << s[i].vel[1] << " " << s[i].vel[2] << " "
+                              << s[i].metals << " " << s[i].tform << " "
+                              << s[i].eps << " " << s[i].phi << "\n";
+            });
+        }
+
+        summary sum = tipsy_reduce(reader, summary());
+        sum.dark.print(std::cout, "dark");
+        sum.star.print(std::cout, "star");
+    }
+    catch (std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
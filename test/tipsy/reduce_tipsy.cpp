@@ -1,7 +1,23 @@
-#include <fstream>
 #include <iostream>
-#include <vector>
-#include "tipsy.h"
+#include <string>
+#include "tipsy_stream.h"
+
+// Keeps every reduce_factor-th particle of each species, with its mass scaled
+// by reduce_factor
+struct every_nth
+{
+    explicit every_nth(int reduce_factor) : reduce_factor(reduce_factor) {}
+
+    template <class Particle>
+    int operator()(Particle& p, size_t index) const
+    {
+        if (index % reduce_factor != 0) return -1;
+        p.mass *= reduce_factor;
+        return 0;
+    }
+
+    int reduce_factor;
+};
 
 int main(int argc, char** argv)
 {
@@ -11,36 +27,23 @@ int main(int argc, char** argv)
         return 1;
     }
 
-    std::ifstream is(argv[1], std::ios::binary);
-    std::ofstream os(argv[2], std::ios::binary);
-    int reduce_factor = std::stoi(argv[3]);
+    try {
+        int reduce_factor = std::stoi(argv[3]);
+        if (reduce_factor < 1) throw std::runtime_error("The reduce factor must be positive");
 
-    head h_in;
-    is.read((char*) &h_in, sizeof(head));
+        tipsy_reader reader(argv[1]);
+        tipsy_writer writer(argv[2], reader.header().time);
+        std::vector<tipsy_writer*> outs(1, &writer);
 
-    head h_out(h_in);
-    h_out.nbodies = static_cast<int>(h_out.nbodies / reduce_factor) + (h_out.nbodies % reduce_factor == 0 ? 0 : 1);
-    h_out.ndark = static_cast<int>(h_out.ndark / reduce_factor) + (h_out.ndark % reduce_factor == 0 ? 0 : 1);
-    h_out.nstar = static_cast<int>(h_out.nstar / reduce_factor) + (h_out.nstar % reduce_factor == 0 ? 0 : 1);
-    os.write((char*) &h_out, sizeof(head));
+        tipsy_filter<dark_particle>(reader, every_nth(reduce_factor), outs);
+        tipsy_filter<star_particle>(reader, every_nth(reduce_factor), outs);
+        writer.close();
 
-    dark_particle d;
-    for (int i = 0; i != h_in.ndark; ++i)
-    {
-        is.read((char*) &d, sizeof(dark_particle));
-        if (i % reduce_factor == 0) {
-            d.mass *= reduce_factor;
-            os.write((char*) &d, sizeof(dark_particle));
-        }
+        std::cout << "nbodies = " << writer.header().nbodies << " ndark = " << writer.header().ndark
+                  << " nstar = " << writer.header().nstar << std::endl;
     }
-
-    star_particle s;
-    for (int i = 0; i != h_in.nstar; ++i)
-    {
-        is.read((char*) &s, sizeof(star_particle));
-        if (i % reduce_factor == 0) {
-        	s.mass *= reduce_factor;
-            os.write((char*) &s, sizeof(star_particle));
-        }
+    catch (std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
     }
 }
@@ -1,135 +1,64 @@
-#include <fstream>
 #include <iostream>
-#include <Eigen/Eigenvalues>
-#include "tipsy.h"
+#include <string>
+#include "tipsy_stream.h"
 
-int main(int argc, char** argv)
+// Particles above the centre of mass along axis go to the first file
+struct above
 {
-    if (argc != 2) {
-        std::cout << "Usage: " << argv[0] << " <file>" << std::endl;    
-        exit(1);
-    }
-
-    std::ifstream is(argv[1], std::ios::binary);
-
-    head h;
-    is.read((char*) &h, sizeof(h));
-    int after_header = is.tellg();
-
-    std::cout << "time = " << h.time << std::endl;
-    std::cout << "nbodies = " << h.nbodies << std::endl;
-    std::cout << "ndim = " << h.ndim << std::endl;
-    std::cout << "nsph = " << h.nsph << std::endl;
-    std::cout << "ndark = " << h.ndark << std::endl;
-    std::cout << "nstar = " << h.nstar << std::endl;
-
-    double x,y,z;
-    Eigen::Vector3d S;
-    S.setZero();
-
-//    Eigen::Matrix3d I;
-//    I.setZero();
-
-    dark_particle d;
-    for (int i = 0; i < h.ndark; ++i)
-    {
-        is.read((char*) &d, sizeof(d));
-
-        x = d.pos[0];
-        y = d.pos[1];
-        z = d.pos[2];
-
-//        I(0,0) += y*y + z*z;
-//        I(0,1) += -x*y;
-//        I(0,2) += -x*z;
-//        I(1,0) += -y*x;
-//        I(1,1) += x*x + z*z;
-//        I(1,2) += -y*z;
-//        I(2,0) += -z*x;
-//        I(2,1) += -z*y;
-//        I(2,2) += x*x + y*y;
-
-        S(0) += x;
-        S(1) += y;
-        S(2) += z;
-    }
+    above(int axis, double center) : axis(axis), center(center) {}
 
-    star_particle s;
-    for (int i = 0; i < h.nstar; ++i)
+    template <class Particle>
+    int operator()(Particle& p, size_t) const
     {
-        is.read((char*) &s, sizeof(s));
-
-        x = s.pos[0];
-        y = s.pos[1];
-        z = s.pos[2];
-
-//        I(0,0) += y*y + z*z;
-//        I(0,1) += -x*y;
-//        I(0,2) += -x*z;
-//        I(1,0) += -y*x;
-//        I(1,1) += x*x + z*z;
-//        I(1,2) += -y*z;
-//        I(2,0) += -z*x;
-//        I(2,1) += -z*y;
-//        I(2,2) += x*x + y*y;
-
-        S(0) += x;
-        S(1) += y;
-        S(2) += z;
+        return p.pos[axis] > center ? 0 : 1;
     }
 
-    is.seekg(after_header);
-
-//    Eigen::EigenSolver<Eigen::Matrix3d> eigen_solver(I);
-//    std::cout << eigen_solver.eigenvalues() << std::endl;
-//    std::cout << eigen_solver.eigenvectors().col(0) << std::endl;
-//    std::cout << eigen_solver.eigenvectors().col(1) << std::endl;
-//    std::cout << eigen_solver.eigenvectors().col(2) << std::endl;
+    int axis;
+    double center;
+};
 
-    S /= h.nbodies;
-    std::cout << "center = " << S[0] << std::endl;
-
-    head h1, h2;
-
-    for (int i = 0; i < h.ndark; ++i)
-    {
-        is.read((char*) &d, sizeof(d));
-        if (d.pos[0] > S(0)) ++h1.ndark;
-        else ++h2.ndark;
+int main(int argc, char** argv)
+{
+    if (argc < 2 || argc > 3) {
+        std::cout << "Usage: " << argv[0] << " <file> [axis (0,1,2), default 0]" << std::endl;
+        std::cout << "Writes the particles above and below the centre of mass to 1.tipsy and 2.tipsy" << std::endl;
+        exit(1);
     }
 
-    for (int i = 0; i < h.nstar; ++i)
-    {
-        is.read((char*) &s, sizeof(s));
-        if (s.pos[0] > S(0)) ++h1.nstar;
-        else ++h2.nstar;
+    try {
+        int axis = argc == 3 ? std::stoi(argv[2]) : 0;
+        if (axis < 0 || axis >= DIM) throw std::runtime_error("The axis must be 0, 1 or 2");
+
+        tipsy_reader reader(argv[1]);
+        head const& h = reader.header();
+
+        std::cout << "time = " << h.time << std::endl;
+        std::cout << "nbodies = " << h.nbodies << std::endl;
+        std::cout << "ndim = " << h.ndim << std::endl;
+        std::cout << "nsph = " << h.nsph << std::endl;
+        std::cout << "ndark = " << h.ndark << std::endl;
+        std::cout << "nstar = " << h.nstar << std::endl;
+
+        std::vector<double> origin = tipsy_first_position(reader);
+        center_of_mass com = tipsy_reduce(reader, center_of_mass(&origin[0]));
+        std::cout << "center = " << com.position(axis) << std::endl;
+
+        tipsy_writer os1("1.tipsy", h.time);
+        tipsy_writer os2("2.tipsy", h.time);
+        std::vector<tipsy_writer*> outs;
+        outs.push_back(&os1);
+        outs.push_back(&os2);
+
+        tipsy_filter<dark_particle>(reader, above(axis, com.position(axis)), outs);
+        tipsy_filter<star_particle>(reader, above(axis, com.position(axis)), outs);
+        os1.close();
+        os2.close();
+
+        std::cout << "h1.nbodies = " << os1.header().nbodies << std::endl;
+        std::cout << "h2.nbodies = " << os2.header().nbodies << std::endl;
     }
-
-    h1.nbodies = h1.ndark + h1.nstar;
-    h2.nbodies = h2.ndark + h2.nstar;
-
-    std::cout << "h1.nbodies = " << h1.nbodies << std::endl;
-    std::cout << "h2.nbodies = " << h2.nbodies << std::endl;
-
-    std::ofstream os1("1.tipsy", std::ios::binary);
-    std::ofstream os2("2.tipsy", std::ios::binary);
-
-    os1.write((char*) &h1, sizeof(h1));
-    os2.write((char*) &h2, sizeof(h2));
-
-    is.seekg(after_header);
-
-    for (int i = 0; i < h.ndark; ++i)
-    {
-        is.read((char*) &d, sizeof(d));
-        if (d.pos[0] > S(0)) os1.write((char*) &d, sizeof(d));
-        else os2.write((char*) &d, sizeof(d));
-    }
-
-    for (int i = 0; i < h.nstar; ++i)
-    {
-        is.read((char*) &s, sizeof(s));
-        if (s.pos[0] > S(0)) os1.write((char*) &s, sizeof(s));
-        else os2.write((char*) &s, sizeof(s));
+    catch (std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
     }
 }
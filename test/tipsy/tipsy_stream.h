@@ -0,0 +1,336 @@
+#ifndef TIPSY_STREAM_H
+#define TIPSY_STREAM_H
+
+// Streaming access to tipsy files of any size with bounded memory.
+//
+// The particles are mapped chunk by chunk (chunk_bytes, 256 MB by default)
+// and each chunk is unmapped after use, so the resident memory stays at about
+// two chunks. The next chunk is requested from the kernel while the current
+// one is processed. Only dark and star particles (the files Bonsai writes)
+// are supported.
+//
+//   tipsy_reader reader("snapshot.tipsy");
+//   center_of_mass com = tipsy_reduce(reader, center_of_mass());
+//
+// tipsy_reduce runs an accumulator over both species on all OpenMP threads:
+// every thread works on a copy of the given (empty) accumulator, the copies
+// are summed with +=. An accumulator has a templated operator() taking a
+// dark_particle or a star_particle.
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <omp.h>
+#include "tipsy.h"
+
+class tipsy_reader
+{
+public:
+
+    explicit tipsy_reader(std::string const& filename, size_t chunk_bytes = 256 << 20)
+     : filename(filename), chunk_bytes(chunk_bytes), page(sysconf(_SC_PAGESIZE))
+    {
+        fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Can not open " + filename);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || pread(fd, &h, sizeof(h), 0) != sizeof(h)) {
+            close(fd);
+            throw std::runtime_error("Can not read the header of " + filename);
+        }
+        if (h.nsph != 0) {
+            close(fd);
+            throw std::runtime_error(filename + ": gas particles are not supported");
+        }
+        size_t expected = sizeof(head) + h.ndark * sizeof(dark_particle) + h.nstar * sizeof(star_particle);
+        if (static_cast<size_t>(st.st_size) != expected) {
+            close(fd);
+            throw std::runtime_error(filename + ": file size does not match the header");
+        }
+    }
+
+    ~tipsy_reader() { close(fd); }
+
+    head const& header() const { return h; }
+
+    template <class Particle>
+    size_t count() const;
+
+    // A single particle, without mapping
+    template <class Particle>
+    Particle particle(size_t i) const
+    {
+        Particle p;
+        if (pread(fd, &p, sizeof(p), offset<Particle>() + i * sizeof(p)) != sizeof(p))
+            throw std::runtime_error("Can not read " + filename);
+        return p;
+    }
+
+    // Calls kernel(particles, n, first) for consecutive chunks of the particles
+    // of one species, first is the index of particles[0] within the species
+    template <class Particle, class Kernel>
+    void for_each_chunk(Kernel kernel) const
+    {
+        size_t const n = count<Particle>();
+        size_t const per_chunk = std::max(chunk_bytes / sizeof(Particle), size_t(1));
+        size_t const begin = offset<Particle>();
+
+        chunk next = map(begin, std::min(n, per_chunk) * sizeof(Particle));
+        for (size_t first = 0; first < n; first += per_chunk)
+        {
+            chunk current = next;
+            size_t const n_chunk = std::min(n - first, per_chunk);
+            if (first + per_chunk < n) {
+                size_t const n_next = std::min(n - first - per_chunk, per_chunk);
+                next = map(begin + (first + per_chunk) * sizeof(Particle), n_next * sizeof(Particle));
+            }
+            kernel(reinterpret_cast<Particle const*>(current.data), n_chunk, first);
+            unmap(current);
+        }
+    }
+
+private:
+
+    struct chunk
+    {
+        char const* data;
+        void* base;
+        size_t length;
+    };
+
+    // Maps [offset, offset + bytes) and asks the kernel to read it ahead
+    chunk map(size_t offset, size_t bytes) const
+    {
+        chunk c = {NULL, NULL, 0};
+        if (bytes == 0) return c;
+        size_t const aligned = offset / page * page;
+        c.length = bytes + offset - aligned;
+        c.base = mmap(NULL, c.length, PROT_READ, MAP_PRIVATE, fd, aligned);
+        if (c.base == MAP_FAILED) throw std::runtime_error("Can not map " + filename);
+        madvise(c.base, c.length, MADV_SEQUENTIAL);
+        madvise(c.base, c.length, MADV_WILLNEED);
+        c.data = static_cast<char const*>(c.base) + offset - aligned;
+        return c;
+    }
+
+    static void unmap(chunk const& c)
+    {
+        if (c.base) munmap(c.base, c.length);
+    }
+
+    template <class Particle>
+    size_t offset() const;
+
+    std::string filename;
+    size_t chunk_bytes;
+    size_t page;
+    int fd;
+    head h;
+};
+
+template <>
+inline size_t tipsy_reader::count<dark_particle>() const { return h.ndark; }
+
+template <>
+inline size_t tipsy_reader::count<star_particle>() const { return h.nstar; }
+
+// The species are stored dark first
+template <>
+inline size_t tipsy_reader::offset<dark_particle>() const { return sizeof(head); }
+
+template <>
+inline size_t tipsy_reader::offset<star_particle>() const
+{
+    return sizeof(head) + h.ndark * sizeof(dark_particle);
+}
+
+// Writes dark particles before star particles, the particle counts of the
+// header are set on close
+class tipsy_writer
+{
+public:
+
+    tipsy_writer(std::string const& filename, double time)
+     : filename(filename), h(time, 0, DIM), buffer(16 << 20)
+    {
+        file = fopen(filename.c_str(), "wb");
+        if (!file) throw std::runtime_error("Can not create " + filename);
+        setvbuf(file, &buffer[0], _IOFBF, buffer.size());
+        fwrite(&h, sizeof(h), 1, file);
+    }
+
+    ~tipsy_writer()
+    {
+        try { close(); }
+        catch (std::exception const&) {}
+    }
+
+    void write(dark_particle const* d, size_t n)
+    {
+        if (h.nstar != 0) throw std::runtime_error(filename + ": dark particles after star particles");
+        h.ndark += n;
+        put(d, n);
+    }
+
+    void write(star_particle const* s, size_t n)
+    {
+        h.nstar += n;
+        put(s, n);
+    }
+
+    head const& header() const { return h; }
+
+    void close()
+    {
+        if (!file) return;
+        h.nbodies = h.ndark + h.nstar;
+        fseek(file, 0, SEEK_SET);
+        fwrite(&h, sizeof(h), 1, file);
+        bool const failed = ferror(file);
+        fclose(file);
+        file = NULL;
+        if (failed) throw std::runtime_error("Writing " + filename + " failed");
+    }
+
+private:
+
+    template <class Particle>
+    void put(Particle const* p, size_t n)
+    {
+        if (n && fwrite(p, sizeof(Particle), n, file) != n)
+            throw std::runtime_error("Writing " + filename + " failed");
+    }
+
+    std::string filename;
+    head h;
+    std::vector<char> buffer;
+    FILE* file;
+};
+
+template <class Accumulator, class Particle>
+void tipsy_reduce_species(tipsy_reader const& reader, Accumulator const& empty, Accumulator& sum)
+{
+    reader.for_each_chunk<Particle>([&](Particle const* p, size_t n, size_t)
+    {
+        #pragma omp parallel
+        {
+            Accumulator local(empty);
+            #pragma omp for schedule(static)
+            for (long i = 0; i < static_cast<long>(n); ++i) local(p[i]);
+            #pragma omp critical
+            sum += local;
+        }
+    });
+}
+
+template <class Accumulator>
+Accumulator tipsy_reduce(tipsy_reader const& reader, Accumulator const& empty)
+{
+    Accumulator sum(empty);
+    tipsy_reduce_species<Accumulator, dark_particle>(reader, empty, sum);
+    tipsy_reduce_species<Accumulator, star_particle>(reader, empty, sum);
+    return sum;
+}
+
+// Splits the particles of one species over the writers in outs, in file
+// order: select(p, index) may modify p and returns the index of its writer,
+// or -1 to drop it. The selection runs on all threads, the writes on the
+// calling thread
+template <class Particle, class Select>
+void tipsy_filter(tipsy_reader const& reader, Select select, std::vector<tipsy_writer*> const& outs)
+{
+    int const nthreads = omp_get_max_threads();
+    std::vector<std::vector<Particle> > selected(nthreads * outs.size());
+    reader.for_each_chunk<Particle>([&](Particle const* p, size_t n, size_t first)
+    {
+        for (size_t k = 0; k < selected.size(); ++k) selected[k].clear();
+
+        #pragma omp parallel num_threads(nthreads)
+        {
+            // Contiguous slices keep the file order
+            int const nt = omp_get_num_threads();
+            int const thread = omp_get_thread_num();
+            size_t const begin = n * thread / nt;
+            size_t const end = n * (thread + 1) / nt;
+            for (size_t i = begin; i < end; ++i) {
+                Particle q = p[i];
+                int const out = select(q, first + i);
+                if (out >= 0) selected[thread * outs.size() + out].push_back(q);
+            }
+        }
+
+        for (int t = 0; t < nthreads; ++t)
+            for (size_t o = 0; o < outs.size(); ++o) {
+                std::vector<Particle> const& s = selected[t * outs.size() + o];
+                if (!s.empty()) outs[o]->write(&s[0], s.size());
+            }
+    });
+}
+
+// Mass, centre of mass and mean velocity. The sums are taken relative to
+// origin, a point near the particles, to keep the precision for files far
+// from the coordinate origin
+struct center_of_mass
+{
+    explicit center_of_mass(double const* origin = NULL)
+     : n(0), mass(0)
+    {
+        for (int k = 0; k < DIM; ++k) {
+            this->origin[k] = origin ? origin[k] : 0.0;
+            mpos[k] = mvel[k] = 0.0;
+        }
+    }
+
+    template <class Particle>
+    void operator()(Particle const& p)
+    {
+        n += 1;
+        mass += p.mass;
+        for (int k = 0; k < DIM; ++k) {
+            mpos[k] += p.mass * (p.pos[k] - origin[k]);
+            mvel[k] += p.mass * p.vel[k];
+        }
+    }
+
+    center_of_mass& operator+=(center_of_mass const& other)
+    {
+        n += other.n;
+        mass += other.mass;
+        for (int k = 0; k < DIM; ++k) {
+            mpos[k] += other.mpos[k];
+            mvel[k] += other.mvel[k];
+        }
+        return *this;
+    }
+
+    double position(int k) const { return mass > 0 ? origin[k] + mpos[k] / mass : origin[k]; }
+    double velocity(int k) const { return mass > 0 ? mvel[k] / mass : 0.0; }
+
+    double origin[DIM];
+    long n;
+    double mass;
+    double mpos[DIM];
+    double mvel[DIM];
+};
+
+// Position of the first particle in the file, an origin for center_of_mass
+inline std::vector<double> tipsy_first_position(tipsy_reader const& reader)
+{
+    std::vector<double> first(DIM, 0.0);
+    if (reader.header().ndark > 0) {
+        dark_particle d = reader.particle<dark_particle>(0);
+        first.assign(d.pos, d.pos + DIM);
+    } else if (reader.header().nstar > 0) {
+        star_particle s = reader.particle<star_particle>(0);
+        first.assign(s.pos, s.pos + DIM);
+    }
+    return first;
+}
+
+#endif // TIPSY_STREAM_H